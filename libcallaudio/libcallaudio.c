@@ -8,6 +8,15 @@
 #include "libcallaudio.h"
 #include "callaudiod.h"
 #include "callaudio-dbus.h"
+#include "cad-state-page.h"
+
+#include <gio/gunixfdlist.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /**
  * SECTION:libcallaudio
@@ -35,39 +44,1064 @@
  * ]|
  */
 
+/*
+ * libcallaudio can be used from several threads:
+ * - _lock protects the proxy, the init count and the listeners list
+ * - the routing state is packed into a single integer, one byte per field,
+ *   which is swapped atomically when callaudiod publishes changes; getters
+ *   can therefore read a consistent snapshot without taking any lock or
+ *   touching the proxy; there is no other copy of the state, so listeners
+ *   get the previous state from that same integer
+ * - when callaudiod provides a state page, getters read it directly instead;
+ *   _page is only changed with _lock held, and unmapped once no reader is
+ *   left (readers only increment/decrement _page_readers around accesses)
+ * - _init_running is set while call_audio_init() creates the proxy with
+ *   _lock released, other initializations wait for _init_cond meanwhile
+ * - the event loop integration state (_epoll_fd, _poll_fds, ...) is only
+ *   used by call_audio_get_fd() and call_audio_dispatch(), which must be
+ *   called from a single thread
+ */
+static GMutex                  _lock;
 static CallAudioDbusCallAudio *_proxy;
-static gboolean               _initted;
+static guint                   _init_count;
+static gint                    _initted;
+static gint                    _packed_state;
+static GArray                 *_listeners;
+static guint                   _last_listener_id;
+static gint                    _timeout = -1;
+static guint64                 _generation;
+static gboolean                _have_state_signal;
+static CadStatePage           *_page;
+static gint                    _page_readers;
+static gboolean                _init_pending;
+static gboolean                _init_running;
+static GCond                   _init_cond;
+static GQueue                  _init_waiters = G_QUEUE_INIT;
+static GQueue                  _pending_calls = G_QUEUE_INIT;
+static GMainContext           *_context;
+static gint                    _epoll_fd = -1;
+static GArray                 *_poll_fds;
+static GArray                 *_watched_fds;
+static gint                    _max_priority;
+static gboolean                _prepared;
 
 typedef struct _CallAudioAsyncData {
     CallAudioCallback cb;
     gpointer user_data;
 } CallAudioAsyncData;
 
+typedef void (*CallAudioFailFunc)(gpointer data, const GError *error);
+
+/*
+ * A method call issued while call_audio_init_async() is in progress, sent
+ * once the proxy is ready or failed with @fail if initialization fails.
+ */
+typedef struct _CallAudioPendingCall {
+    CallAudioDbusCallAudio *proxy;
+    const gchar *method;
+    GVariant *parameters;
+    gint timeout_msec;
+    GCancellable *cancellable;
+    GAsyncReadyCallback done;
+    gpointer done_data;
+    CallAudioFailFunc fail;
+} CallAudioPendingCall;
+
+/*
+ * A GIO-style method call, started from the library's main context
+ */
+typedef struct _CallAudioMethodCall {
+    const gchar *method;
+    GVariant *parameters;
+    gint timeout_msec;
+    GCancellable *cancellable;
+    GAsyncReadyCallback callback;
+    gpointer user_data;
+    gpointer source_tag;
+} CallAudioMethodCall;
+
+typedef struct _CallAudioCommitStart {
+    GArray *ops;
+    GCancellable *cancellable;
+    GAsyncReadyCallback callback;
+    gpointer user_data;
+} CallAudioCommitStart;
+
+typedef struct _CallAudioInvoke {
+    GMainContext *context;
+    GSourceFunc func;
+    gpointer data;
+} CallAudioInvoke;
+
+typedef struct _CallAudioProxyRequest {
+    GMutex lock;
+    GCond cond;
+    gboolean done;
+    CallAudioDbusCallAudio *proxy;
+    GError *error;
+} CallAudioProxyRequest;
+
+typedef struct _CallAudioTransactionOp {
+    const gchar *method;
+    const gchar *format;
+    guint value;
+    gboolean barrier;
+} CallAudioTransactionOp;
+
+struct _CallAudioTransaction {
+    GArray *ops;
+};
+
+/*
+ * Steps may complete from different threads if the transaction is committed
+ * while the library is being initialized: @pending is only updated
+ * atomically, and @lock protects @error and @error_index.
+ */
+typedef struct _CallAudioCommitData {
+    GArray *ops;
+    guint next;
+    gint pending;
+    GMutex lock;
+    guint error_index;
+    GError *error;
+} CallAudioCommitData;
+
+typedef struct _CallAudioCommitStep {
+    GTask *task;
+    const gchar *method;
+    guint index;
+} CallAudioCommitStep;
+
+typedef struct _CallAudioListener {
+    guint id;
+    CallAudioStateCallback cb;
+    gpointer user_data;
+} CallAudioListener;
+
+static gint pack_state(const CallAudioState *state)
+{
+    guint32 packed = (state->mode & 0xff) |
+                     ((state->speaker_state & 0xff) << 8) |
+                     ((state->mic_state & 0xff) << 16) |
+                     ((guint32)(state->bt_audio_state & 0xff) << 24);
+
+    return (gint)packed;
+}
+
+static void unpack_state(gint value, CallAudioState *state)
+{
+    guint32 packed = (guint32)value;
+
+    state->mode = packed & 0xff;
+    state->speaker_state = (packed >> 8) & 0xff;
+    state->mic_state = (packed >> 16) & 0xff;
+    state->bt_audio_state = (packed >> 24) & 0xff;
+}
+
+/*
+ * Get a reference to the proxy, so it stays valid even if another thread
+ * calls call_audio_deinit() in the meantime.
+ */
+static CallAudioDbusCallAudio *get_proxy(void)
+{
+    CallAudioDbusCallAudio *proxy = NULL;
+
+    g_mutex_lock(&_lock);
+    if (_proxy)
+        proxy = g_object_ref(_proxy);
+    g_mutex_unlock(&_lock);
+
+    return proxy;
+}
+
+static guint get_cached_property(GDBusProxy *proxy, const gchar *name, guint fallback)
+{
+    g_autoptr(GVariant) value = NULL;
+
+    value = g_dbus_proxy_get_cached_property(proxy, name);
+    if (!value)
+        return fallback;
+
+    return g_variant_get_uint32(value);
+}
+
+static void read_state(GDBusProxy *proxy, CallAudioState *state)
+{
+    state->mode = get_cached_property(proxy, "AudioMode",
+                                      CALL_AUDIO_MODE_UNKNOWN);
+    state->speaker_state = get_cached_property(proxy, "SpeakerState",
+                                               CALL_AUDIO_SPEAKER_UNKNOWN);
+    state->mic_state = get_cached_property(proxy, "MicState",
+                                           CALL_AUDIO_MIC_UNKNOWN);
+    state->bt_audio_state = get_cached_property(proxy, "BtAudioState",
+                                                CALL_AUDIO_BT_UNKNOWN);
+}
+
+/*
+ * Returns the current routing state, or %FALSE if the library isn't
+ * initialized.
+ */
+static gboolean get_state(CallAudioState *state, guint64 *generation)
+{
+    CadStatePage *page;
+    CadStatePageData data;
+
+    if (!g_atomic_int_get(&_initted))
+        return FALSE;
+
+    g_atomic_int_inc(&_page_readers);
+    page = g_atomic_pointer_get(&_page);
+    if (page)
+        cad_state_page_read(page, &data);
+    g_atomic_int_add(&_page_readers, -1);
+
+    if (page) {
+        state->mode = data.audio_mode;
+        state->speaker_state = data.speaker_state;
+        state->mic_state = data.mic_state;
+        state->bt_audio_state = data.bt_audio_state;
+        if (generation)
+            *generation = data.generation;
+    } else {
+        unpack_state(g_atomic_int_get(&_packed_state), state);
+        if (generation)
+            *generation = __atomic_load_n(&_generation, __ATOMIC_ACQUIRE);
+    }
+
+    return TRUE;
+}
+
+/*
+ * Must be called with _lock held
+ */
+static void unmap_state_page(void)
+{
+    CadStatePage *page = g_atomic_pointer_get(&_page);
+
+    if (!page)
+        return;
+
+    g_atomic_pointer_set(&_page, NULL);
+    while (g_atomic_int_get(&_page_readers) > 0)
+        g_thread_yield();
+
+    munmap(page, sizeof(CadStatePage));
+}
+
+static void get_state_page_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    g_autoptr(GUnixFDList) fd_list = NULL;
+    g_autoptr(GVariant) ret = NULL;
+    g_autoptr(GError) error = NULL;
+    CadStatePage *page;
+    gint32 handle;
+    gint fd;
+
+    ret = g_dbus_proxy_call_with_unix_fd_list_finish(G_DBUS_PROXY(object),
+                                                      &fd_list, result, &error);
+    if (!ret) {
+        g_debug("State page not available: %s", error->message);
+        return;
+    }
+
+    g_variant_get(ret, "(h)", &handle);
+    fd = g_unix_fd_list_get(fd_list, handle, &error);
+    if (fd < 0) {
+        g_warning("Unable to get state page: %s", error->message);
+        return;
+    }
+
+    page = mmap(NULL, sizeof(CadStatePage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        g_warning("Unable to map state page: %s", g_strerror(errno));
+        return;
+    }
+
+    if (page->magic != CAD_STATE_PAGE_MAGIC ||
+        page->version != CAD_STATE_PAGE_VERSION) {
+        g_warning("Unsupported state page version %u", page->version);
+        munmap(page, sizeof(CadStatePage));
+        return;
+    }
+
+    g_mutex_lock(&_lock);
+    /* Discard the page if we were deinitialized in the meantime */
+    if (_proxy == (CallAudioDbusCallAudio *)object) {
+        unmap_state_page();
+        g_atomic_pointer_set(&_page, page);
+        page = NULL;
+    }
+    g_mutex_unlock(&_lock);
+
+    if (page)
+        munmap(page, sizeof(CadStatePage));
+}
+
+static void request_state_page(GDBusProxy *proxy)
+{
+    g_dbus_proxy_call_with_unix_fd_list(proxy, "GetStatePage", NULL,
+                                        G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL,
+                                        get_state_page_done, NULL);
+}
+
+/*
+ * The state page belongs to a given instance of callaudiod: drop it when the
+ * daemon goes away, and request the new one when it gets restarted.
+ */
+static void name_owner_changed_cb(GObject *object, GParamSpec *pspec, gpointer data)
+{
+    g_autofree gchar *owner = g_dbus_proxy_get_name_owner(G_DBUS_PROXY(object));
+
+    g_mutex_lock(&_lock);
+    unmap_state_page();
+    g_mutex_unlock(&_lock);
+
+    if (owner)
+        request_state_page(G_DBUS_PROXY(object));
+}
+
+/*
+ * Must be called with _lock held
+ */
+static gboolean has_listener(guint id)
+{
+    guint i;
+
+    for (i = 0; _listeners && i < _listeners->len; i++) {
+        if (g_array_index(_listeners, CallAudioListener, i).id == id)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Store a new routing state and notify listeners if it changed
+ */
+static void update_state(const CallAudioState *new_state, guint64 generation)
+{
+    g_autoptr(GArray) listeners = NULL;
+    CallAudioState old_state;
+    gboolean registered;
+    guint i;
+
+    unpack_state(g_atomic_int_get(&_packed_state), &old_state);
+    __atomic_store_n(&_generation, generation, __ATOMIC_RELEASE);
+    if (memcmp(&old_state, new_state, sizeof(CallAudioState)) == 0)
+        return;
+
+    g_atomic_int_set(&_packed_state, pack_state(new_state));
+
+    /*
+     * Work on a copy so listeners can safely add or remove listeners from
+     * their callback.
+     */
+    g_mutex_lock(&_lock);
+    if (_listeners && _listeners->len > 0) {
+        listeners = g_array_sized_new(FALSE, FALSE, sizeof(CallAudioListener),
+                                      _listeners->len);
+        g_array_append_vals(listeners, _listeners->data, _listeners->len);
+    }
+    g_mutex_unlock(&_lock);
+
+    if (!listeners)
+        return;
+
+    for (i = 0; i < listeners->len; i++) {
+        CallAudioListener *listener = &g_array_index(listeners, CallAudioListener, i);
+
+        /* Skip listeners removed by a previous callback */
+        g_mutex_lock(&_lock);
+        registered = has_listener(listener->id);
+        g_mutex_unlock(&_lock);
+
+        if (registered)
+            listener->cb(&old_state, new_state, listener->user_data);
+    }
+}
+
+/*
+ * callaudiod publishes all the changes made by a single operation in one
+ * StateChanged signal, along with its generation number: once we know it
+ * does, ignore individual property changes so listeners never see
+ * intermediate states.
+ */
+static void state_changed_cb(CallAudioDbusCallAudio *proxy,
+                             GVariant               *state,
+                             gpointer                data)
+{
+    CallAudioState new_state;
+    guint64 generation = __atomic_load_n(&_generation, __ATOMIC_RELAXED);
+
+    _have_state_signal = TRUE;
+
+    unpack_state(g_atomic_int_get(&_packed_state), &new_state);
+
+    g_variant_lookup(state, "AudioMode", "u", &new_state.mode);
+    g_variant_lookup(state, "SpeakerState", "u", &new_state.speaker_state);
+    g_variant_lookup(state, "MicState", "u", &new_state.mic_state);
+    g_variant_lookup(state, "BtAudioState", "u", &new_state.bt_audio_state);
+    g_variant_lookup(state, "Generation", "t", &generation);
+
+    update_state(&new_state, generation);
+}
+
+static void properties_changed_cb(GDBusProxy *proxy,
+                                  GVariant   *changed,
+                                  GStrv       invalidated,
+                                  gpointer    data)
+{
+    CallAudioState old_state, new_state;
+
+    if (_have_state_signal)
+        return;
+
+    read_state(proxy, &new_state);
+    unpack_state(g_atomic_int_get(&_packed_state), &old_state);
+    if (memcmp(&new_state, &old_state, sizeof(CallAudioState)) == 0)
+        return;
+
+    update_state(&new_state, __atomic_load_n(&_generation, __ATOMIC_RELAXED) + 1);
+}
+
+G_DEFINE_QUARK(call-audio-error-quark, call_audio_error)
+
+/*
+ * Get the main context passed to call_audio_init_with_context(), if any.
+ * Must be called without _lock held.
+ */
+static GMainContext *get_context(void)
+{
+    GMainContext *context;
+
+    g_mutex_lock(&_lock);
+    context = _context ? g_main_context_ref(_context) : NULL;
+    g_mutex_unlock(&_lock);
+
+    return context;
+}
+
+static gboolean invoke_cb(gpointer data)
+{
+    CallAudioInvoke *invoke = data;
+
+    g_main_context_push_thread_default(invoke->context);
+    invoke->func(invoke->data);
+    g_main_context_pop_thread_default(invoke->context);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void invoke_free(gpointer data)
+{
+    CallAudioInvoke *invoke = data;
+
+    g_main_context_unref(invoke->context);
+    g_free(invoke);
+}
+
+/*
+ * Call @func with @context as the thread-default main context, so the D-Bus
+ * replies and GTask callbacks it sets up are dispatched there.
+ *
+ * A main context can only be made the thread-default one by a thread which
+ * owns it: if another thread is iterating @context, @func is called from
+ * that thread instead, the next time it dispatches @context. If @context is
+ * %NULL, @func is called right away in the caller's context.
+ */
+static void invoke_in_context(GMainContext *context, GSourceFunc func, gpointer data)
+{
+    CallAudioInvoke *invoke;
+    GSource *source;
+
+    if (!context) {
+        func(data);
+        return;
+    }
+
+    invoke = g_new0(CallAudioInvoke, 1);
+    invoke->context = g_main_context_ref(context);
+    invoke->func = func;
+    invoke->data = data;
+
+    if (g_main_context_acquire(context)) {
+        invoke_cb(invoke);
+        g_main_context_release(context);
+        invoke_free(invoke);
+        return;
+    }
+
+    source = g_idle_source_new();
+    g_source_set_priority(source, G_PRIORITY_DEFAULT);
+    g_source_set_callback(source, invoke_cb, invoke, invoke_free);
+    g_source_attach(source, context);
+    g_source_unref(source);
+}
+
+/*
+ * Must be called with _lock held
+ */
+static void setup_proxy(CallAudioDbusCallAudio *proxy)
+{
+    CallAudioState state;
+
+    g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(proxy), _timeout);
+
+    read_state(G_DBUS_PROXY(proxy), &state);
+    g_atomic_int_set(&_packed_state, pack_state(&state));
+    g_signal_connect(proxy, "g-properties-changed",
+                     G_CALLBACK(properties_changed_cb), NULL);
+    g_signal_connect(proxy, "state-changed",
+                     G_CALLBACK(state_changed_cb), NULL);
+    g_signal_connect(proxy, "notify::g-name-owner",
+                     G_CALLBACK(name_owner_changed_cb), NULL);
+    request_state_page(G_DBUS_PROXY(proxy));
+
+    _proxy = proxy;
+    g_atomic_int_set(&_initted, TRUE);
+}
+
+static void pending_call_free(CallAudioPendingCall *call)
+{
+    g_clear_object(&call->proxy);
+    g_variant_unref(call->parameters);
+    g_clear_object(&call->cancellable);
+    g_free(call);
+}
+
+static gboolean start_call_cb(gpointer data)
+{
+    CallAudioPendingCall *call = data;
+
+    g_dbus_proxy_call(G_DBUS_PROXY(call->proxy), call->method,
+                      call->parameters, G_DBUS_CALL_FLAGS_NONE,
+                      call->timeout_msec, call->cancellable,
+                      call->done, call->done_data);
+    pending_call_free(call);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Send a method call to callaudiod, or queue it if the library is still
+ * being initialized asynchronously.
+ *
+ * Returns: %FALSE if the library isn't initialized, in which case nothing is
+ * sent and @done won't be called.
+ */
+static gboolean send_call(const gchar         *method,
+                          GVariant            *parameters,
+                          gint                 timeout_msec,
+                          GCancellable        *cancellable,
+                          GAsyncReadyCallback  done,
+                          gpointer             done_data,
+                          CallAudioFailFunc    fail)
+{
+    CallAudioDbusCallAudio *proxy = NULL;
+    CallAudioPendingCall *call;
+    GMainContext *context;
+
+    g_mutex_lock(&_lock);
+
+    if (_proxy) {
+        proxy = g_object_ref(_proxy);
+    } else if (_init_pending) {
+        call = g_new0(CallAudioPendingCall, 1);
+        call->method = method;
+        call->parameters = g_variant_ref_sink(parameters);
+        call->timeout_msec = timeout_msec;
+        call->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+        call->done = done;
+        call->done_data = done_data;
+        call->fail = fail;
+        g_queue_push_tail(&_pending_calls, call);
+
+        g_mutex_unlock(&_lock);
+        return TRUE;
+    }
+
+    g_mutex_unlock(&_lock);
+
+    if (!proxy) {
+        g_variant_unref(g_variant_ref_sink(parameters));
+        return FALSE;
+    }
+
+    call = g_new0(CallAudioPendingCall, 1);
+    call->proxy = proxy;
+    call->method = method;
+    call->parameters = g_variant_ref_sink(parameters);
+    call->timeout_msec = timeout_msec;
+    call->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+    call->done = done;
+    call->done_data = done_data;
+    call->fail = fail;
+
+    context = get_context();
+    invoke_in_context(context, start_call_cb, call);
+    g_clear_pointer(&context, g_main_context_unref);
+
+    return TRUE;
+}
+
+static void async_data_fail(gpointer data, const GError *error)
+{
+    CallAudioAsyncData *async_data = data;
+
+    if (async_data->cb)
+        async_data->cb(FALSE, (GError *)error, async_data->user_data);
+    g_free(async_data);
+}
+
+static void task_fail(gpointer data, const GError *error)
+{
+    GTask *task = data;
+
+    g_task_return_error(task, g_error_copy(error));
+    g_object_unref(task);
+}
+
+static gboolean create_proxy_cb(gpointer data)
+{
+    CallAudioProxyRequest *request = data;
+    CallAudioDbusCallAudio *proxy;
+    GError *error = NULL;
+
+    proxy = call_audio_dbus_call_audio_proxy_new_for_bus_sync(
+                                    CALLAUDIO_DBUS_TYPE,
+                                    G_DBUS_PROXY_FLAGS_NONE,
+                                    CALLAUDIO_DBUS_NAME,
+                                    CALLAUDIO_DBUS_PATH, NULL, &error);
+
+    g_mutex_lock(&request->lock);
+    request->proxy = proxy;
+    request->error = error;
+    request->done = TRUE;
+    g_cond_signal(&request->cond);
+    g_mutex_unlock(&request->lock);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Create the proxy in @context, so its signals are emitted there, and wait
+ * for it to be ready.
+ */
+static CallAudioDbusCallAudio *create_proxy(GMainContext *context, GError **error)
+{
+    CallAudioProxyRequest request = { 0 };
+
+    g_mutex_init(&request.lock);
+    g_cond_init(&request.cond);
+
+    invoke_in_context(context, create_proxy_cb, &request);
+
+    g_mutex_lock(&request.lock);
+    while (!request.done)
+        g_cond_wait(&request.cond, &request.lock);
+    g_mutex_unlock(&request.lock);
+
+    g_mutex_clear(&request.lock);
+    g_cond_clear(&request.cond);
+
+    if (request.error)
+        g_propagate_error(error, request.error);
+
+    return request.proxy;
+}
+
+/*
+ * Must be called with _lock held
+ */
+static void wait_init_running(void)
+{
+    while (_init_running)
+        g_cond_wait(&_init_cond, &_lock);
+}
+
+static gboolean init_sync(GMainContext *context, GError **error)
+{
+    CallAudioDbusCallAudio *proxy;
+
+    g_mutex_lock(&_lock);
+
+    wait_init_running();
+
+    /*
+     * We can't wait for call_audio_init_async() to complete here, as it may
+     * have to be dispatched by the calling thread.
+     */
+    if (_init_pending) {
+        g_mutex_unlock(&_lock);
+        g_set_error(error, CALL_AUDIO_ERROR, CALL_AUDIO_ERROR_NOT_INITIALIZED,
+                    "libcallaudio is being initialized asynchronously");
+        return FALSE;
+    }
+
+    if (_init_count > 0) {
+        _init_count++;
+        g_mutex_unlock(&_lock);
+        return TRUE;
+    }
+
+    /*
+     * Don't hold _lock while creating the proxy: this may have to wait for
+     * another thread to dispatch @context, which could need the lock.
+     */
+    _init_running = TRUE;
+    if (context)
+        _context = g_main_context_ref(context);
+    g_mutex_unlock(&_lock);
+
+    proxy = create_proxy(context, error);
+
+    g_mutex_lock(&_lock);
+    _init_running = FALSE;
+    if (proxy) {
+        _init_count = 1;
+        setup_proxy(proxy);
+    } else if (context) {
+        g_clear_pointer(&_context, g_main_context_unref);
+    }
+    g_cond_broadcast(&_init_cond);
+    g_mutex_unlock(&_lock);
+
+    return proxy != NULL;
+}
+
 /**
  * call_audio_init:
  * @error: Error information
  *
  * Initialize libcallaudio. This must be called before any other functions.
  *
+ * libcallaudio is thread-safe and reference-counted: each successful call
+ * must be balanced by a call to call_audio_deinit(). State change
+ * notifications are delivered in the thread-default main context of the
+ * first caller.
+ *
  * Returns: %TRUE if successful, or %FALSE on error.
  */
 gboolean call_audio_init(GError **error)
 {
-    if (_initted)
-        return TRUE;
+    return init_sync(NULL, error);
+}
 
-    _proxy = call_audio_dbus_call_audio_proxy_new_for_bus_sync(
-                                    CALLAUDIO_DBUS_TYPE,
-                                    G_DBUS_PROXY_FLAGS_NONE,
-                                    CALLAUDIO_DBUS_NAME,
-                                    CALLAUDIO_DBUS_PATH, NULL, error);
-    if (!_proxy)
-        return FALSE;
+/**
+ * call_audio_init_with_context:
+ * @context: (nullable): The main context to dispatch events in, or %NULL
+ * @error: Error information
+ *
+ * Initialize libcallaudio like call_audio_init(), but dispatch all
+ * asynchronous callbacks and state change notifications in @context instead
+ * of the caller's thread-default main context.
+ *
+ * If @context is %NULL, libcallaudio uses a private main context, which can
+ * be driven from any event loop using call_audio_get_fd() and
+ * call_audio_dispatch(), without running a GLib main loop.
+ *
+ * @context may be iterated by any thread: requests made from other threads
+ * are then started from the thread running @context, and this function
+ * blocks until that thread has dispatched the initialization.
+ *
+ * The context is only taken into account by the call which actually
+ * initializes the library.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_init_with_context(GMainContext *context, GError **error)
+{
+    g_autoptr(GMainContext) private_context = NULL;
 
-    g_object_add_weak_pointer(G_OBJECT(_proxy), (gpointer *)&_proxy);
+    if (!context)
+        context = private_context = g_main_context_new();
 
-    _initted = TRUE;
-    return TRUE;
+    return init_sync(context, error);
+}
+
+static guint32 poll_events_to_epoll(gushort events)
+{
+    guint32 ret = 0;
+
+    if (events & G_IO_IN)
+        ret |= EPOLLIN;
+    if (events & G_IO_OUT)
+        ret |= EPOLLOUT;
+    if (events & G_IO_PRI)
+        ret |= EPOLLPRI;
+
+    return ret;
+}
+
+/*
+ * Prepare the next main context iteration, and update the epoll set to
+ * match the file descriptors GLib needs to watch.
+ *
+ * Returns: the maximum time to wait before calling call_audio_dispatch()
+ */
+static gint prepare_poll(GMainContext *context)
+{
+    GPollFD *fds;
+    gint timeout = -1;
+    gint n_fds;
+    guint i, j;
+
+    if (!_poll_fds) {
+        _poll_fds = g_array_new(FALSE, TRUE, sizeof(GPollFD));
+        _watched_fds = g_array_new(FALSE, FALSE, sizeof(gint));
+    }
+
+    g_main_context_prepare(context, &_max_priority);
+
+    while (TRUE) {
+        guint allocated = _poll_fds->len;
+
+        g_array_set_size(_poll_fds, allocated);
+        n_fds = g_main_context_query(context, _max_priority, &timeout,
+                                     (GPollFD *)_poll_fds->data, allocated);
+        if ((guint)n_fds <= allocated)
+            break;
+        g_array_set_size(_poll_fds, n_fds);
+    }
+    g_array_set_size(_poll_fds, n_fds);
+    fds = (GPollFD *)_poll_fds->data;
+
+    for (i = 0; i < _watched_fds->len; i++)
+        epoll_ctl(_epoll_fd, EPOLL_CTL_DEL,
+                  g_array_index(_watched_fds, gint, i), NULL);
+    g_array_set_size(_watched_fds, 0);
+
+    for (i = 0; i < (guint)n_fds; i++) {
+        struct epoll_event event = { 0 };
+        gboolean seen = FALSE;
+
+        for (j = 0; j < i && !seen; j++)
+            seen = (fds[j].fd == fds[i].fd);
+        if (seen)
+            continue;
+
+        /* The same fd can be watched by several sources */
+        event.data.fd = fds[i].fd;
+        for (j = i; j < (guint)n_fds; j++) {
+            if (fds[j].fd == fds[i].fd)
+                event.events |= poll_events_to_epoll(fds[j].events);
+        }
+
+        if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fds[i].fd, &event) < 0) {
+            g_warning("Unable to watch fd %d: %s", fds[i].fd, g_strerror(errno));
+            continue;
+        }
+        g_array_append_val(_watched_fds, fds[i].fd);
+    }
+
+    _prepared = TRUE;
+
+    return timeout;
+}
+
+/**
+ * call_audio_get_fd:
+ *
+ * Get a file descriptor which becomes readable whenever libcallaudio has
+ * events to process. This allows integrating the library into a non-GLib
+ * event loop: add the file descriptor to the loop, and call
+ * call_audio_dispatch() when it is readable or when the timeout returned by
+ * the previous call_audio_dispatch() call has expired.
+ *
+ * This requires the library to have been initialized using
+ * call_audio_init_with_context(). The file descriptor is owned by
+ * libcallaudio and closed by call_audio_deinit().
+ *
+ * Returns: A pollable file descriptor, or -1 on error.
+ */
+gint call_audio_get_fd(void)
+{
+    GMainContext *context;
+
+    g_mutex_lock(&_lock);
+    context = _context ? g_main_context_ref(_context) : NULL;
+    if (context && _epoll_fd < 0) {
+        _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (_epoll_fd < 0)
+            g_warning("Unable to create epoll fd: %s", g_strerror(errno));
+    }
+    g_mutex_unlock(&_lock);
+
+    if (!context)
+        return -1;
+
+    if (_epoll_fd >= 0 && !_prepared && g_main_context_acquire(context)) {
+        prepare_poll(context);
+        g_main_context_release(context);
+    }
+
+    g_main_context_unref(context);
+
+    return _epoll_fd;
+}
+
+/**
+ * call_audio_dispatch:
+ *
+ * Process pending libcallaudio events, invoking the relevant callbacks. This
+ * never blocks.
+ *
+ * Returns: The maximum time in milliseconds after which this function must be
+ * called again even if the file descriptor returned by call_audio_get_fd()
+ * didn't become readable, or -1 for no timeout.
+ */
+gint call_audio_dispatch(void)
+{
+    GMainContext *context;
+    gint timeout;
+
+    g_mutex_lock(&_lock);
+    context = _context ? g_main_context_ref(_context) : NULL;
+    g_mutex_unlock(&_lock);
+
+    if (!context || _epoll_fd < 0 || !g_main_context_acquire(context)) {
+        if (context)
+            g_main_context_unref(context);
+        return -1;
+    }
+
+    if (!_prepared)
+        prepare_poll(context);
+
+    g_poll((GPollFD *)_poll_fds->data, _poll_fds->len, 0);
+    if (g_main_context_check(context, _max_priority,
+                             (GPollFD *)_poll_fds->data, _poll_fds->len))
+        g_main_context_dispatch(context);
+
+    timeout = prepare_poll(context);
+
+    g_main_context_release(context);
+    g_main_context_unref(context);
+
+    return timeout;
+}
+
+static void init_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    g_autoptr(GError) error = NULL;
+    CallAudioDbusCallAudio *proxy;
+    CallAudioPendingCall *call;
+    CallAudioAsyncData *waiter;
+    GQueue calls, waiters;
+
+    proxy = call_audio_dbus_call_audio_proxy_new_for_bus_finish(result, &error);
+
+    g_mutex_lock(&_lock);
+
+    _init_pending = FALSE;
+    if (proxy && _init_count == 0) {
+        /* call_audio_deinit() was called in the meantime */
+        g_clear_object(&proxy);
+        g_set_error(&error, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                    "libcallaudio was deinitialized");
+    }
+
+    if (proxy) {
+        setup_proxy(proxy);
+        g_object_ref(proxy);
+    } else {
+        _init_count = 0;
+    }
+
+    calls = _pending_calls;
+    g_queue_init(&_pending_calls);
+    waiters = _init_waiters;
+    g_queue_init(&_init_waiters);
+
+    g_mutex_unlock(&_lock);
+
+    while ((call = g_queue_pop_head(&calls))) {
+        if (proxy) {
+            g_dbus_proxy_call(G_DBUS_PROXY(proxy), call->method,
+                              call->parameters, G_DBUS_CALL_FLAGS_NONE,
+                              call->timeout_msec, call->cancellable,
+                              call->done, call->done_data);
+        } else {
+            call->fail(call->done_data, error);
+        }
+
+        pending_call_free(call);
+    }
+
+    while ((waiter = g_queue_pop_head(&waiters))) {
+        if (waiter->cb)
+            waiter->cb(proxy != NULL, error, waiter->user_data);
+        g_free(waiter);
+    }
+
+    g_clear_object(&proxy);
+}
+
+/**
+ * call_audio_init_async:
+ * @flags: Flags controlling the initialization
+ * @cb: Function to be called when initialization completes
+ * @data: User data to be passed to the callback function after completion. This
+ *        data is owned by the caller, which is responsible for freeing it.
+ *
+ * Initialize libcallaudio without blocking. Asynchronous operations requested
+ * before the initialization completes are queued, and sent to callaudiod
+ * as soon as it is ready; their completion callbacks are then invoked from
+ * the main context which was the thread-default one when this function was
+ * called. Synchronous operations and getters fail until then, and so does
+ * call_audio_init().
+ *
+ * As with call_audio_init(), each call must be balanced by a call to
+ * call_audio_deinit(), even if initialization fails.
+ */
+void call_audio_init_async(CallAudioInitFlags flags,
+                           CallAudioCallback  cb,
+                           gpointer           data)
+{
+    GDBusProxyFlags proxy_flags = G_DBUS_PROXY_FLAGS_NONE;
+    CallAudioAsyncData *waiter;
+
+    g_mutex_lock(&_lock);
+
+    wait_init_running();
+
+    if (_init_count > 0 && !_init_pending) {
+        _init_count++;
+        g_mutex_unlock(&_lock);
+        if (cb)
+            cb(TRUE, NULL, data);
+        return;
+    }
+
+    waiter = g_new0(CallAudioAsyncData, 1);
+    waiter->cb = cb;
+    waiter->user_data = data;
+    g_queue_push_tail(&_init_waiters, waiter);
+    _init_count++;
+
+    if (_init_pending) {
+        g_mutex_unlock(&_lock);
+        return;
+    }
+
+    _init_pending = TRUE;
+    g_mutex_unlock(&_lock);
+
+    if (flags & CALL_AUDIO_INIT_FLAGS_NO_AUTO_START)
+        proxy_flags |= G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START;
+    if (flags & CALL_AUDIO_INIT_FLAGS_LAZY_PROPERTIES)
+        proxy_flags |= G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES;
+
+    /*
+     * No main context can have been passed to call_audio_init_with_context()
+     * at this point, the caller's thread-default one is used.
+     */
+    call_audio_dbus_call_audio_proxy_new_for_bus(CALLAUDIO_DBUS_TYPE,
+                                                 proxy_flags,
+                                                 CALLAUDIO_DBUS_NAME,
+                                                 CALLAUDIO_DBUS_PATH, NULL,
+                                                 init_done, NULL);
 }
 
 /**
@@ -80,19 +1114,163 @@ gboolean call_audio_init(GError **error)
  */
 gboolean call_audio_is_inited(void)
 {
-    return _initted;
+    return g_atomic_int_get(&_initted);
 }
 
 /**
  * call_audio_deinit:
  *
  * Uninitialize the library when no longer used. Usually called
- * on program shutdown.
+ * on program shutdown. Resources are only freed once every call to
+ * call_audio_init() has been balanced.
  */
 void call_audio_deinit(void)
 {
-    _initted = FALSE;
-    g_clear_object(&_proxy);
+    CallAudioDbusCallAudio *proxy = NULL;
+
+    g_mutex_lock(&_lock);
+
+    if (_init_count == 0 || --_init_count > 0) {
+        g_mutex_unlock(&_lock);
+        return;
+    }
+
+    g_atomic_int_set(&_initted, FALSE);
+    proxy = g_steal_pointer(&_proxy);
+    g_clear_pointer(&_listeners, g_array_unref);
+    _have_state_signal = FALSE;
+    unmap_state_page();
+
+    if (_epoll_fd >= 0) {
+        close(_epoll_fd);
+        _epoll_fd = -1;
+    }
+    g_clear_pointer(&_poll_fds, g_array_unref);
+    g_clear_pointer(&_watched_fds, g_array_unref);
+    _prepared = FALSE;
+    g_clear_pointer(&_context, g_main_context_unref);
+
+    g_mutex_unlock(&_lock);
+
+    if (proxy) {
+        g_signal_handlers_disconnect_by_func(proxy, properties_changed_cb, NULL);
+        g_signal_handlers_disconnect_by_func(proxy, state_changed_cb, NULL);
+        g_signal_handlers_disconnect_by_func(proxy, name_owner_changed_cb, NULL);
+        g_object_unref(proxy);
+    }
+}
+
+/**
+ * call_audio_set_timeout:
+ * @timeout_msec: Timeout in milliseconds, -1 to use the default D-Bus timeout
+ *   or %G_MAXINT for no timeout
+ *
+ * Set the maximum time synchronous functions and the legacy asynchronous
+ * functions wait for callaudiod to reply. This can be called before or after
+ * call_audio_init().
+ */
+void call_audio_set_timeout(gint timeout_msec)
+{
+    g_mutex_lock(&_lock);
+    _timeout = timeout_msec;
+    if (_proxy)
+        g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(_proxy), _timeout);
+    g_mutex_unlock(&_lock);
+}
+
+static void call_method_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    g_autoptr(GTask) task = data;
+    g_autoptr(GVariant) ret = NULL;
+    GError *error = NULL;
+    gboolean success = FALSE;
+
+    ret = g_dbus_proxy_call_finish(G_DBUS_PROXY(object), result, &error);
+    if (!ret) {
+        if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+            g_task_return_new_error(task, CALL_AUDIO_ERROR,
+                                    CALL_AUDIO_ERROR_TIMED_OUT,
+                                    "%s timed out", g_task_get_name(task));
+            g_error_free(error);
+        } else {
+            g_task_return_error(task, error);
+        }
+        return;
+    }
+
+    g_variant_get(ret, "(b)", &success);
+    g_debug("%s: D-bus call returned success=%d", g_task_get_name(task), success);
+
+    if (!success) {
+        g_task_return_new_error(task, CALL_AUDIO_ERROR, CALL_AUDIO_ERROR_FAILED,
+                                "%s failed", g_task_get_name(task));
+        return;
+    }
+
+    g_task_return_boolean(task, TRUE);
+}
+
+static gboolean start_method_cb(gpointer data)
+{
+    CallAudioMethodCall *call = data;
+    GTask *task = g_task_new(NULL, call->cancellable, call->callback, call->user_data);
+
+    g_task_set_source_tag(task, call->source_tag);
+    g_task_set_name(task, call->method);
+
+    if (!send_call(call->method, call->parameters, call->timeout_msec,
+                   call->cancellable, call_method_done, task, task_fail)) {
+        g_task_return_new_error(task, CALL_AUDIO_ERROR,
+                                CALL_AUDIO_ERROR_NOT_INITIALIZED,
+                                "libcallaudio is not initialized");
+        g_object_unref(task);
+    }
+
+    g_clear_object(&call->cancellable);
+    g_free(call);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Common implementation of the GIO-style asynchronous functions: all
+ * callaudiod methods take a single argument and return a boolean.
+ * The task is created in the library's main context, so @callback is
+ * invoked there.
+ */
+static void call_method_full(const gchar         *method,
+                             GVariant            *parameters,
+                             gint                 timeout_msec,
+                             GCancellable        *cancellable,
+                             GAsyncReadyCallback  callback,
+                             gpointer             user_data,
+                             gpointer             source_tag)
+{
+    CallAudioMethodCall *call = g_new0(CallAudioMethodCall, 1);
+    GMainContext *context;
+
+    call->method = method;
+    call->parameters = parameters;
+    call->timeout_msec = timeout_msec;
+    call->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+    call->callback = callback;
+    call->user_data = user_data;
+    call->source_tag = source_tag;
+
+    context = get_context();
+    invoke_in_context(context, start_method_cb, call);
+    g_clear_pointer(&context, g_main_context_unref);
+}
+
+static gboolean call_method_finish(GAsyncResult  *result,
+                                   gpointer       source_tag,
+                                   GError       **error)
+{
+    g_return_val_if_fail(g_task_is_valid(result, NULL), FALSE);
+    g_return_val_if_fail(g_task_get_source_tag(G_TASK(result)) == source_tag,
+                         FALSE);
+
+    return g_task_propagate_boolean(G_TASK(result), error);
 }
 
 static void select_mode_done(GObject *object, GAsyncResult *result, gpointer data)
@@ -133,14 +1311,14 @@ gboolean call_audio_select_mode_async(CallAudioMode     mode,
 {
     CallAudioAsyncData *async_data = g_new0(CallAudioAsyncData, 1);
 
-    if (!_initted || !async_data)
-        return FALSE;
-
     async_data->cb = cb;
     async_data->user_data = data;
 
-    call_audio_dbus_call_audio_call_select_mode(_proxy, mode, NULL,
-                                                select_mode_done, async_data);
+    if (!send_call("SelectMode", g_variant_new("(u)", mode), -1, NULL,
+                   select_mode_done, async_data, async_data_fail)) {
+        g_free(async_data);
+        return FALSE;
+    }
 
     return TRUE;
 }
@@ -157,14 +1335,16 @@ gboolean call_audio_select_mode_async(CallAudioMode     mode,
  */
 gboolean call_audio_select_mode(CallAudioMode mode, GError **error)
 {
+    CallAudioDbusCallAudio *proxy = get_proxy();
     gboolean success = FALSE;
     gboolean ret;
 
-    if (!_initted)
+    if (!proxy)
         return FALSE;
 
-    ret = call_audio_dbus_call_audio_call_select_mode_sync(_proxy, mode, &success,
-                                                           NULL, error);
+    ret = call_audio_dbus_call_audio_call_select_mode_sync(proxy, mode, &success,
+                                                          NULL, error);
+    g_object_unref(proxy);
     if (error && *error)
         g_critical("Couldn't set mode %u: %s", mode, (*error)->message);
 
@@ -173,6 +1353,43 @@ gboolean call_audio_select_mode(CallAudioMode mode, GError **error)
     return (ret && success);
 }
 
+/**
+ * call_audio_select_mode_full:
+ * @mode: Audio mode to select
+ * @timeout_msec: Timeout in milliseconds, -1 to use the default timeout
+ * @cancellable: (nullable): A #GCancellable or %NULL
+ * @callback: Function to be called when operation completes
+ * @user_data: User data to be passed to @callback
+ *
+ * Select the audio mode to use. When the operation completes, @callback is
+ * called from the thread-default main context of the caller, and should call
+ * call_audio_select_mode_finish() to get the result.
+ */
+void call_audio_select_mode_full(CallAudioMode       mode,
+                                 gint                timeout_msec,
+                                 GCancellable       *cancellable,
+                                 GAsyncReadyCallback callback,
+                                 gpointer            user_data)
+{
+    call_method_full("SelectMode", g_variant_new("(u)", mode), timeout_msec,
+                     cancellable, callback, user_data,
+                     call_audio_select_mode_full);
+}
+
+/**
+ * call_audio_select_mode_finish:
+ * @result: The #GAsyncResult passed to the callback
+ * @error: The error that will be set if the audio mode could not be selected.
+ *
+ * Finish an operation started with call_audio_select_mode_full().
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_select_mode_finish(GAsyncResult *result, GError **error)
+{
+    return call_method_finish(result, call_audio_select_mode_full, error);
+}
+
 /**
  * call_audio_get_audio_mode:
  *
@@ -180,10 +1397,12 @@ gboolean call_audio_select_mode(CallAudioMode mode, GError **error)
  */
 CallAudioMode call_audio_get_audio_mode(void)
 {
-    if (!_initted)
+    CallAudioState state;
+
+    if (!get_state(&state, NULL))
         return CALL_AUDIO_MODE_UNKNOWN;
 
-    return call_audio_dbus_call_audio_get_audio_mode(_proxy);
+    return state.mode;
 }
 
 static void enable_speaker_done(GObject *object, GAsyncResult *result, gpointer data)
@@ -224,18 +1443,54 @@ gboolean call_audio_enable_speaker_async(gboolean          enable,
 {
     CallAudioAsyncData *async_data = g_new0(CallAudioAsyncData, 1);
 
-    if (!_initted || !async_data)
-        return FALSE;
-
     async_data->cb = cb;
     async_data->user_data = data;
 
-    call_audio_dbus_call_audio_call_enable_speaker(_proxy, enable, NULL,
-                                                   enable_speaker_done, async_data);
+    if (!send_call("EnableSpeaker", g_variant_new("(b)", enable), -1, NULL,
+                   enable_speaker_done, async_data, async_data_fail)) {
+        g_free(async_data);
+        return FALSE;
+    }
 
     return TRUE;
 }
 
+/**
+ * call_audio_enable_speaker_full:
+ * @enable: Desired speaker state
+ * @timeout_msec: Timeout in milliseconds, -1 to use the default timeout
+ * @cancellable: (nullable): A #GCancellable or %NULL
+ * @callback: Function to be called when operation completes
+ * @user_data: User data to be passed to @callback
+ *
+ * Enable or disable speaker output. When the operation completes, @callback
+ * should call call_audio_enable_speaker_finish() to get the result.
+ */
+void call_audio_enable_speaker_full(gboolean            enable,
+                                    gint                timeout_msec,
+                                    GCancellable       *cancellable,
+                                    GAsyncReadyCallback callback,
+                                    gpointer            user_data)
+{
+    call_method_full("EnableSpeaker", g_variant_new("(b)", enable),
+                     timeout_msec, cancellable, callback, user_data,
+                     call_audio_enable_speaker_full);
+}
+
+/**
+ * call_audio_enable_speaker_finish:
+ * @result: The #GAsyncResult passed to the callback
+ * @error: The error that will be set if the speaker state could not be changed.
+ *
+ * Finish an operation started with call_audio_enable_speaker_full().
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_enable_speaker_finish(GAsyncResult *result, GError **error)
+{
+    return call_method_finish(result, call_audio_enable_speaker_full, error);
+}
+
 /**
  * call_audio_get_speaker_state:
  *
@@ -244,10 +1499,12 @@ gboolean call_audio_enable_speaker_async(gboolean          enable,
  */
 CallAudioSpeakerState call_audio_get_speaker_state(void)
 {
-    if (!_initted)
+    CallAudioState state;
+
+    if (!get_state(&state, NULL))
         return CALL_AUDIO_SPEAKER_UNKNOWN;
 
-    return call_audio_dbus_call_audio_get_speaker_state(_proxy);
+    return state.speaker_state;
 }
 
 /**
@@ -262,14 +1519,16 @@ CallAudioSpeakerState call_audio_get_speaker_state(void)
  */
 gboolean call_audio_enable_speaker(gboolean enable, GError **error)
 {
+    CallAudioDbusCallAudio *proxy = get_proxy();
     gboolean success = FALSE;
     gboolean ret;
 
-    if (!_initted)
+    if (!proxy)
         return FALSE;
 
-    ret = call_audio_dbus_call_audio_call_enable_speaker_sync(_proxy, enable, &success,
-                                                              NULL, error);
+    ret = call_audio_dbus_call_audio_call_enable_speaker_sync(proxy, enable, &success,
+                                                             NULL, error);
+    g_object_unref(proxy);
     if (error && *error)
         g_critical("Couldn't enable speaker: %s", (*error)->message);
 
@@ -315,14 +1574,14 @@ gboolean call_audio_mute_mic_async(gboolean          mute,
 {
     CallAudioAsyncData *async_data = g_new0(CallAudioAsyncData, 1);
 
-    if (!_initted || !async_data)
-        return FALSE;
-
     async_data->cb = cb;
     async_data->user_data = data;
 
-    call_audio_dbus_call_audio_call_mute_mic(_proxy, mute, NULL,
-                                             mute_mic_done, async_data);
+    if (!send_call("MuteMic", g_variant_new("(b)", mute), -1, NULL,
+                   mute_mic_done, async_data, async_data_fail)) {
+        g_free(async_data);
+        return FALSE;
+    }
 
     return TRUE;
 }
@@ -339,14 +1598,16 @@ gboolean call_audio_mute_mic_async(gboolean          mute,
  */
 gboolean call_audio_mute_mic(gboolean mute, GError **error)
 {
+    CallAudioDbusCallAudio *proxy = get_proxy();
     gboolean success = FALSE;
     gboolean ret;
 
-    if (!_initted)
+    if (!proxy)
         return FALSE;
 
-    ret = call_audio_dbus_call_audio_call_mute_mic_sync(_proxy, mute, &success,
-                                                        NULL, error);
+    ret = call_audio_dbus_call_audio_call_mute_mic_sync(proxy, mute, &success,
+                                                       NULL, error);
+    g_object_unref(proxy);
     if (error && *error)
         g_critical("Couldn't mute mic: %s", (*error)->message);
 
@@ -355,6 +1616,43 @@ gboolean call_audio_mute_mic(gboolean mute, GError **error)
     return (ret && success);
 }
 
+/**
+ * call_audio_mute_mic_full:
+ * @mute: %TRUE to mute the microphone, or %FALSE to unmute it
+ * @timeout_msec: Timeout in milliseconds, -1 to use the default timeout
+ * @cancellable: (nullable): A #GCancellable or %NULL
+ * @callback: Function to be called when operation completes
+ * @user_data: User data to be passed to @callback
+ *
+ * Mute or unmute microphone. When the operation completes, @callback should
+ * call call_audio_mute_mic_finish() to get the result.
+ */
+void call_audio_mute_mic_full(gboolean            mute,
+                              gint                timeout_msec,
+                              GCancellable       *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data)
+{
+    call_method_full("MuteMic", g_variant_new("(b)", mute), timeout_msec,
+                     cancellable, callback, user_data,
+                     call_audio_mute_mic_full);
+}
+
+/**
+ * call_audio_mute_mic_finish:
+ * @result: The #GAsyncResult passed to the callback
+ * @error: The error that will be set if the microphone state could not be
+ *   changed.
+ *
+ * Finish an operation started with call_audio_mute_mic_full().
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_mute_mic_finish(GAsyncResult *result, GError **error)
+{
+    return call_method_finish(result, call_audio_mute_mic_full, error);
+}
+
 /**
  * call_audio_get_mic_state:
  *
@@ -363,10 +1661,12 @@ gboolean call_audio_mute_mic(gboolean mute, GError **error)
  */
 CallAudioMicState call_audio_get_mic_state(void)
 {
-    if (!_initted)
+    CallAudioState state;
+
+    if (!get_state(&state, NULL))
         return CALL_AUDIO_MIC_UNKNOWN;
 
-    return call_audio_dbus_call_audio_get_mic_state(_proxy);
+    return state.mic_state;
 }
 
 
@@ -407,14 +1707,14 @@ gboolean call_audio_bt_audio_async(gboolean          enable,
 {
     CallAudioAsyncData *async_data = g_new0(CallAudioAsyncData, 1);
 
-    if (!_initted || !async_data)
-        return FALSE;
-
     async_data->cb = cb;
     async_data->user_data = data;
 
-    call_audio_dbus_call_audio_call_bt_audio(_proxy, enable, NULL,
-                                             bt_audio_done, async_data);
+    if (!send_call("BtAudio", g_variant_new("(b)", enable), -1, NULL,
+                   bt_audio_done, async_data, async_data_fail)) {
+        g_free(async_data);
+        return FALSE;
+    }
 
     return TRUE;
 }
@@ -431,14 +1731,16 @@ gboolean call_audio_bt_audio_async(gboolean          enable,
  */
 gboolean call_audio_bt_audio(gboolean enable, GError **error)
 {
+    CallAudioDbusCallAudio *proxy = get_proxy();
     gboolean success = FALSE;
     gboolean ret;
 
-    if (!_initted)
+    if (!proxy)
         return FALSE;
 
-    ret = call_audio_dbus_call_audio_call_bt_audio_sync(_proxy, enable, &success,
-                                                        NULL, error);
+    ret = call_audio_dbus_call_audio_call_bt_audio_sync(proxy, enable, &success,
+                                                       NULL, error);
+    g_object_unref(proxy);
     if (error && *error)
         g_critical("Couldn't enable audio path: %s", (*error)->message);
 
@@ -447,6 +1749,43 @@ gboolean call_audio_bt_audio(gboolean enable, GError **error)
     return (ret && success);
 }
 
+/**
+ * call_audio_bt_audio_full:
+ * @enable: %TRUE to switch to bluetooth audio, or %FALSE to go back to default output
+ * @timeout_msec: Timeout in milliseconds, -1 to use the default timeout
+ * @cancellable: (nullable): A #GCancellable or %NULL
+ * @callback: Function to be called when operation completes
+ * @user_data: User data to be passed to @callback
+ *
+ * Enable or disable bluetooth audio in call. When the operation completes,
+ * @callback should call call_audio_bt_audio_finish() to get the result.
+ */
+void call_audio_bt_audio_full(gboolean            enable,
+                              gint                timeout_msec,
+                              GCancellable       *cancellable,
+                              GAsyncReadyCallback callback,
+                              gpointer            user_data)
+{
+    call_method_full("BtAudio", g_variant_new("(b)", enable), timeout_msec,
+                     cancellable, callback, user_data,
+                     call_audio_bt_audio_full);
+}
+
+/**
+ * call_audio_bt_audio_finish:
+ * @result: The #GAsyncResult passed to the callback
+ * @error: The error that will be set if the bluetooth audio state could not
+ *   be changed.
+ *
+ * Finish an operation started with call_audio_bt_audio_full().
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_bt_audio_finish(GAsyncResult *result, GError **error)
+{
+    return call_method_finish(result, call_audio_bt_audio_full, error);
+}
+
 /**
  * call_audio_get_bt_audio_state:
  *
@@ -458,8 +1797,549 @@ gboolean call_audio_bt_audio(gboolean enable, GError **error)
  */
 CallAudioBluetoothState call_audio_get_bt_audio_state(void)
 {
-    if (!_initted)
+    CallAudioState state;
+
+    if (!get_state(&state, NULL))
         return CALL_AUDIO_BT_UNAVAILABLE;
 
-    return call_audio_dbus_call_audio_get_bt_audio_state(_proxy);
+    return state.bt_audio_state;
+}
+
+static void prepare_call_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    CallAudioDbusCallAudio *proxy = CALL_AUDIO_DBUS_CALL_AUDIO(object);
+    CallAudioAsyncData *async_data = data;
+    GError *error = NULL;
+    gboolean success = FALSE;
+    gboolean ret;
+
+    g_return_if_fail(CALL_AUDIO_DBUS_IS_CALL_AUDIO(proxy));
+
+    ret = call_audio_dbus_call_audio_call_prepare_call_finish(proxy, &success,
+                                                              result, &error);
+    if (!ret || !success)
+        g_warning("PrepareCall failed: %s", error ? error->message : "unknown error");
+
+    g_debug("%s: D-bus call returned %d (success=%d)", __func__, ret, success);
+
+    if (async_data && async_data->cb)
+        async_data->cb(ret && success, error, async_data->user_data);
+    g_free(async_data);
+}
+
+/**
+ * call_audio_prepare_call_async:
+ * @prepare: %TRUE when an incoming call starts ringing, %FALSE if it wasn't
+ *   answered
+ * @cb: Function to be called when operation completes
+ * @data: User data to be passed to the callback function after completion. This
+ *        data is owned by the caller, which is responsible for freeing it.
+ *
+ * Let callaudiod get ready for an incoming call, so that selecting the call
+ * mode once the call is answered is faster. This doesn't change the current
+ * routing, so it can be called as soon as the phone starts ringing.
+ */
+gboolean call_audio_prepare_call_async(gboolean          prepare,
+                                       CallAudioCallback cb,
+                                       gpointer          data)
+{
+    CallAudioAsyncData *async_data = g_new0(CallAudioAsyncData, 1);
+
+    async_data->cb = cb;
+    async_data->user_data = data;
+
+    if (!send_call("PrepareCall", g_variant_new("(b)", prepare), -1, NULL,
+                   prepare_call_done, async_data, async_data_fail)) {
+        g_free(async_data);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * call_audio_prepare_call:
+ * @prepare: %TRUE when an incoming call starts ringing, %FALSE if it wasn't
+ *   answered
+ * @error: The error that will be set if the call could not be prepared.
+ *
+ * Let callaudiod get ready for an incoming call. This function is
+ * synchronous, and will return only once the operation has been executed.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_prepare_call(gboolean prepare, GError **error)
+{
+    CallAudioDbusCallAudio *proxy = get_proxy();
+    gboolean success = FALSE;
+    gboolean ret;
+
+    if (!proxy)
+        return FALSE;
+
+    ret = call_audio_dbus_call_audio_call_prepare_call_sync(proxy, prepare, &success,
+                                                           NULL, error);
+    g_object_unref(proxy);
+    if (error && *error)
+        g_critical("Couldn't prepare call: %s", (*error)->message);
+
+    g_debug("%s %s: success=%d", ret ? "succeeded" : "failed", __func__, success);
+
+    return (ret && success);
+}
+
+/**
+ * call_audio_prepare_call_full:
+ * @prepare: %TRUE when an incoming call starts ringing, %FALSE if it wasn't
+ *   answered
+ * @timeout_msec: Timeout in milliseconds, -1 to use the default timeout
+ * @cancellable: (nullable): A #GCancellable or %NULL
+ * @callback: Function to be called when operation completes
+ * @user_data: User data to be passed to @callback
+ *
+ * Let callaudiod get ready for an incoming call. When the operation
+ * completes, @callback should call call_audio_prepare_call_finish() to get
+ * the result.
+ */
+void call_audio_prepare_call_full(gboolean            prepare,
+                                  gint                timeout_msec,
+                                  GCancellable       *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer            user_data)
+{
+    call_method_full("PrepareCall", g_variant_new("(b)", prepare), timeout_msec,
+                     cancellable, callback, user_data,
+                     call_audio_prepare_call_full);
+}
+
+/**
+ * call_audio_prepare_call_finish:
+ * @result: The #GAsyncResult passed to the callback
+ * @error: The error that will be set if the call could not be prepared.
+ *
+ * Finish an operation started with call_audio_prepare_call_full().
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean call_audio_prepare_call_finish(GAsyncResult *result, GError **error)
+{
+    return call_method_finish(result, call_audio_prepare_call_full, error);
+}
+
+/**
+ * call_audio_add_state_listener:
+ * @cb: Function to be called when the routing state changes
+ * @data: User data to be passed to the callback function. This data is owned
+ *        by the caller, which is responsible for freeing it.
+ *
+ * Register a function to be notified of routing state changes. Changes
+ * published by callaudiod at the same time are coalesced, so @cb is called
+ * only once per batch with both the previous and the new state.
+ *
+ * Callbacks are invoked from the main context which was the thread-default
+ * one when call_audio_init() was called, or the one passed to
+ * call_audio_init_with_context().
+ *
+ * Returns: A listener ID to be passed to call_audio_remove_state_listener(),
+ * or 0 on error.
+ */
+guint call_audio_add_state_listener(CallAudioStateCallback cb, gpointer data)
+{
+    CallAudioListener listener;
+
+    if (!cb)
+        return 0;
+
+    g_mutex_lock(&_lock);
+
+    if (_init_count == 0) {
+        g_mutex_unlock(&_lock);
+        return 0;
+    }
+
+    if (!_listeners)
+        _listeners = g_array_new(FALSE, FALSE, sizeof(CallAudioListener));
+
+    listener.id = ++_last_listener_id;
+    listener.cb = cb;
+    listener.user_data = data;
+    g_array_append_val(_listeners, listener);
+
+    g_mutex_unlock(&_lock);
+
+    return listener.id;
+}
+
+/**
+ * call_audio_remove_state_listener:
+ * @id: Listener ID returned by call_audio_add_state_listener()
+ *
+ * Stop notifying a state listener.
+ *
+ * This should be called from the main context listeners are invoked from,
+ * including from a listener callback: the listener is then never called
+ * again once this returns. When called from another thread, it may still be
+ * called once by a notification being delivered at the same time, so its
+ * user data must remain valid until that context has been dispatched.
+ */
+void call_audio_remove_state_listener(guint id)
+{
+    guint i;
+
+    g_mutex_lock(&_lock);
+
+    for (i = 0; _listeners && i < _listeners->len; i++) {
+        if (g_array_index(_listeners, CallAudioListener, i).id == id) {
+            g_array_remove_index(_listeners, i);
+            break;
+        }
+    }
+
+    g_mutex_unlock(&_lock);
+}
+
+/**
+ * call_audio_get_state:
+ * @state: (out): Location to store the current routing state
+ * @generation: (out) (optional): Location to store the state generation
+ *   number, or %NULL
+ *
+ * Get the whole routing state at once. When callaudiod provides a state page,
+ * this reads it directly without any IPC. The generation number is
+ * incremented each time the state changes, so it can be used to cheaply
+ * check whether anything changed since the last call.
+ *
+ * Returns: %TRUE if successful, or %FALSE if the library isn't initialized.
+ */
+gboolean call_audio_get_state(CallAudioState *state, guint64 *generation)
+{
+    g_return_val_if_fail(state != NULL, FALSE);
+
+    return get_state(state, generation);
+}
+
+/**
+ * call_audio_transaction_new:
+ *
+ * Create a new, empty transaction. Operations added to the transaction are
+ * only sent to callaudiod when calling call_audio_transaction_commit_async().
+ *
+ * Returns: (transfer full): A new #CallAudioTransaction, to be freed with
+ * call_audio_transaction_free().
+ */
+CallAudioTransaction *call_audio_transaction_new(void)
+{
+    CallAudioTransaction *transaction = g_new0(CallAudioTransaction, 1);
+
+    transaction->ops = g_array_new(FALSE, FALSE, sizeof(CallAudioTransactionOp));
+
+    return transaction;
+}
+
+/**
+ * call_audio_transaction_free:
+ * @transaction: A #CallAudioTransaction
+ *
+ * Free a transaction. This can be done right after committing it, without
+ * waiting for the operations to complete.
+ */
+void call_audio_transaction_free(CallAudioTransaction *transaction)
+{
+    if (!transaction)
+        return;
+
+    g_array_unref(transaction->ops);
+    g_free(transaction);
+}
+
+/*
+ * Operations marked as @barrier change the whole route (card profile,
+ * Bluetooth loopbacks): callaudiod interleaves the underlying PulseAudio
+ * requests, so the following operations are only sent once they complete.
+ */
+static void transaction_add(CallAudioTransaction *transaction,
+                            const gchar          *method,
+                            const gchar          *format,
+                            guint                 value,
+                            gboolean              barrier)
+{
+    CallAudioTransactionOp op;
+
+    op.method = method;
+    op.format = format;
+    op.value = value;
+    op.barrier = barrier;
+    g_array_append_val(transaction->ops, op);
+}
+
+/**
+ * call_audio_transaction_select_mode:
+ * @transaction: A #CallAudioTransaction
+ * @mode: Audio mode to select
+ *
+ * Add an audio mode change to the transaction.
+ */
+void call_audio_transaction_select_mode(CallAudioTransaction *transaction,
+                                        CallAudioMode         mode)
+{
+    g_return_if_fail(transaction != NULL);
+
+    transaction_add(transaction, "SelectMode", "(u)", mode, TRUE);
+}
+
+/**
+ * call_audio_transaction_enable_speaker:
+ * @transaction: A #CallAudioTransaction
+ * @enable: Desired speaker state
+ *
+ * Add a speaker state change to the transaction.
+ */
+void call_audio_transaction_enable_speaker(CallAudioTransaction *transaction,
+                                           gboolean              enable)
+{
+    g_return_if_fail(transaction != NULL);
+
+    transaction_add(transaction, "EnableSpeaker", "(b)", !!enable, FALSE);
+}
+
+/**
+ * call_audio_transaction_mute_mic:
+ * @transaction: A #CallAudioTransaction
+ * @mute: %TRUE to mute the microphone, %FALSE to unmute it
+ *
+ * Add a microphone state change to the transaction.
+ */
+void call_audio_transaction_mute_mic(CallAudioTransaction *transaction,
+                                     gboolean              mute)
+{
+    g_return_if_fail(transaction != NULL);
+
+    transaction_add(transaction, "MuteMic", "(b)", !!mute, FALSE);
+}
+
+/**
+ * call_audio_transaction_bt_audio:
+ * @transaction: A #CallAudioTransaction
+ * @enable: Desired Bluetooth audio state
+ *
+ * Add a Bluetooth audio state change to the transaction.
+ */
+void call_audio_transaction_bt_audio(CallAudioTransaction *transaction,
+                                     gboolean              enable)
+{
+    g_return_if_fail(transaction != NULL);
+
+    transaction_add(transaction, "BtAudio", "(b)", !!enable, TRUE);
+}
+
+static void commit_data_free(gpointer data)
+{
+    CallAudioCommitData *commit = data;
+
+    g_array_unref(commit->ops);
+    g_mutex_clear(&commit->lock);
+    g_clear_error(&commit->error);
+    g_free(commit);
+}
+
+static void commit_send_batch(GTask *task);
+
+/*
+ * Drop one pending step. Once none is left, send the next batch of
+ * operations, or complete the transaction if they have all been sent.
+ * This consumes the reference to @task held by that step.
+ */
+static void commit_release(GTask *task)
+{
+    CallAudioCommitData *commit = g_task_get_task_data(task);
+
+    if (g_atomic_int_dec_and_test(&commit->pending)) {
+        if (commit->next < commit->ops->len)
+            commit_send_batch(task);
+        else if (commit->error)
+            g_task_return_error(task, g_steal_pointer(&commit->error));
+        else
+            g_task_return_boolean(task, TRUE);
+    }
+
+    g_object_unref(task);
+}
+
+/*
+ * Record the result of a single operation. Only the error of the earliest
+ * failing operation is kept.
+ */
+static void commit_step_complete(CallAudioCommitStep *step, GError *error)
+{
+    GTask *task = step->task;
+    CallAudioCommitData *commit = g_task_get_task_data(task);
+
+    if (error) {
+        g_mutex_lock(&commit->lock);
+        if (!commit->error || step->index < commit->error_index) {
+            g_clear_error(&commit->error);
+            commit->error = g_steal_pointer(&error);
+            commit->error_index = step->index;
+        }
+        g_mutex_unlock(&commit->lock);
+        g_clear_error(&error);
+    }
+
+    g_free(step);
+    commit_release(task);
+}
+
+static void commit_step_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    CallAudioCommitStep *step = data;
+    g_autoptr(GVariant) ret = NULL;
+    GError *error = NULL;
+    gboolean success = FALSE;
+
+    ret = g_dbus_proxy_call_finish(G_DBUS_PROXY(object), result, &error);
+    if (ret) {
+        g_variant_get(ret, "(b)", &success);
+        if (!success) {
+            error = g_error_new(CALL_AUDIO_ERROR, CALL_AUDIO_ERROR_FAILED,
+                                "%s failed", step->method);
+        }
+    } else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT)) {
+        g_clear_error(&error);
+        error = g_error_new(CALL_AUDIO_ERROR, CALL_AUDIO_ERROR_TIMED_OUT,
+                            "%s timed out", step->method);
+    }
+
+    commit_step_complete(step, error);
+}
+
+static void commit_step_fail(gpointer data, const GError *error)
+{
+    commit_step_complete(data, g_error_copy(error));
+}
+
+/*
+ * Send operations without waiting for their replies, up to and including the
+ * next barrier. An extra step is held until they have all been sent, so the
+ * next batch can't be started in the meantime.
+ */
+static void commit_send_batch(GTask *task)
+{
+    CallAudioCommitData *commit = g_task_get_task_data(task);
+    gboolean barrier = FALSE;
+
+    g_atomic_int_set(&commit->pending, 1);
+    g_object_ref(task);
+
+    while (commit->next < commit->ops->len && !barrier) {
+        CallAudioTransactionOp *op = &g_array_index(commit->ops,
+                                                    CallAudioTransactionOp,
+                                                    commit->next);
+        CallAudioCommitStep *step = g_new0(CallAudioCommitStep, 1);
+
+        step->task = g_object_ref(task);
+        step->method = op->method;
+        step->index = commit->next++;
+        barrier = op->barrier;
+        g_atomic_int_inc(&commit->pending);
+
+        if (!send_call(op->method, g_variant_new(op->format, op->value), -1,
+                       g_task_get_cancellable(task), commit_step_done, step,
+                       commit_step_fail)) {
+            commit_step_complete(step,
+                                 g_error_new(CALL_AUDIO_ERROR,
+                                             CALL_AUDIO_ERROR_NOT_INITIALIZED,
+                                             "libcallaudio is not initialized"));
+        }
+    }
+
+    commit_release(task);
+}
+
+static gboolean start_commit_cb(gpointer data)
+{
+    CallAudioCommitStart *start = data;
+    CallAudioCommitData *commit;
+    GTask *task;
+
+    task = g_task_new(NULL, start->cancellable, start->callback, start->user_data);
+    g_task_set_source_tag(task, call_audio_transaction_commit_async);
+
+    if (start->ops->len == 0) {
+        g_task_return_boolean(task, TRUE);
+    } else {
+        commit = g_new0(CallAudioCommitData, 1);
+        commit->ops = g_steal_pointer(&start->ops);
+        g_mutex_init(&commit->lock);
+        g_task_set_task_data(task, commit, commit_data_free);
+
+        commit_send_batch(task);
+    }
+
+    g_object_unref(task);
+    g_clear_pointer(&start->ops, g_array_unref);
+    g_clear_object(&start->cancellable);
+    g_free(start);
+
+    return G_SOURCE_REMOVE;
+}
+
+/**
+ * call_audio_transaction_commit_async:
+ * @transaction: A #CallAudioTransaction
+ * @cancellable: (nullable): A #GCancellable, or %NULL
+ * @callback: Function to be called when all operations have completed
+ * @user_data: User data to be passed to @callback
+ *
+ * Send the operations in the transaction to callaudiod, in the order they
+ * were added, without waiting for each reply before sending the next one.
+ *
+ * Only operations which don't conflict with each other are actually
+ * pipelined: callaudiod doesn't serialize requests, so an operation
+ * changing the whole route (call_audio_transaction_select_mode() and
+ * call_audio_transaction_bt_audio()) could otherwise override the effect of
+ * the following ones. Operations added after such a change are only sent
+ * once it has completed, which gives the same result as performing the
+ * operations one after the other.
+ *
+ * @callback is invoked once, after every operation has returned; use
+ * call_audio_transaction_commit_finish() to get the aggregated result. The
+ * transaction can be freed or committed again right away.
+ */
+void call_audio_transaction_commit_async(CallAudioTransaction *transaction,
+                                         GCancellable         *cancellable,
+                                         GAsyncReadyCallback   callback,
+                                         gpointer              user_data)
+{
+    CallAudioCommitStart *start;
+    GMainContext *context;
+
+    g_return_if_fail(transaction != NULL);
+
+    start = g_new0(CallAudioCommitStart, 1);
+    start->ops = g_array_sized_new(FALSE, FALSE, sizeof(CallAudioTransactionOp),
+                                   transaction->ops->len);
+    g_array_append_vals(start->ops, transaction->ops->data, transaction->ops->len);
+    start->cancellable = cancellable ? g_object_ref(cancellable) : NULL;
+    start->callback = callback;
+    start->user_data = user_data;
+
+    context = get_context();
+    invoke_in_context(context, start_commit_cb, start);
+    g_clear_pointer(&context, g_main_context_unref);
+}
+
+/**
+ * call_audio_transaction_commit_finish:
+ * @result: The #GAsyncResult passed to the callback
+ * @error: The error that will be set if any operation failed
+ *
+ * Complete a call to call_audio_transaction_commit_async(). All operations
+ * are sent even if one of them fails; @error then describes the first
+ * failing operation.
+ *
+ * Returns: %TRUE if all operations were successful, or %FALSE on error.
+ */
+gboolean call_audio_transaction_commit_finish(GAsyncResult *result, GError **error)
+{
+    return call_method_finish(result, call_audio_transaction_commit_async, error);
 }
@@ -9,7 +9,7 @@
 
 #include "libcallaudio-enums.h"
 
-#include <glib.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -17,6 +17,8 @@ G_BEGIN_DECLS
  * CallAudioMode:
  * @CALL_AUDIO_MODE_DEFAULT: Default mode (used for music, alarms, ringtones...)
  * @CALL_AUDIO_MODE_CALL: Voice call mode
+ * @CALL_AUDIO_MODE_VOIP: VoIP call mode: same routing as voice call mode, but
+ *   audio is handled by the application through the default (HiFi) profile
  * @CALL_AUDIO_MODE_UNKNOWN: Mode unknown
  *
  * Enum values to indicate the mode to be selected.
@@ -25,6 +27,7 @@ G_BEGIN_DECLS
 typedef enum {
   CALL_AUDIO_MODE_DEFAULT = 0,
   CALL_AUDIO_MODE_CALL,
+  CALL_AUDIO_MODE_VOIP,
   CALL_AUDIO_MODE_UNKNOWN = 255
 } CallAudioMode;
 
@@ -61,35 +64,174 @@ typedef enum {
   CALL_AUDIO_BT_UNKNOWN = 255
 } CallAudioBluetoothState;
 
+/**
+ * CALL_AUDIO_ERROR:
+ *
+ * Error domain for libcallaudio. Errors in this domain will be from the
+ * #CallAudioError enumeration.
+ */
+#define CALL_AUDIO_ERROR (call_audio_error_quark())
+
+/**
+ * CallAudioError:
+ * @CALL_AUDIO_ERROR_NOT_INITIALIZED: libcallaudio hasn't been initialized
+ * @CALL_AUDIO_ERROR_FAILED: callaudiod failed to perform the operation
+ * @CALL_AUDIO_ERROR_TIMED_OUT: callaudiod didn't reply in time
+ *
+ * Error codes returned by libcallaudio functions.
+ */
+
+typedef enum {
+  CALL_AUDIO_ERROR_NOT_INITIALIZED,
+  CALL_AUDIO_ERROR_FAILED,
+  CALL_AUDIO_ERROR_TIMED_OUT,
+} CallAudioError;
+
 typedef void (*CallAudioCallback)(gboolean success,
                                   GError *error,
                                   gpointer data);
 
+/**
+ * CallAudioInitFlags:
+ * @CALL_AUDIO_INIT_FLAGS_NONE: No flags set
+ * @CALL_AUDIO_INIT_FLAGS_NO_AUTO_START: Don't auto-start callaudiod if it isn't
+ *   running yet
+ * @CALL_AUDIO_INIT_FLAGS_LAZY_PROPERTIES: Don't fetch the current state while
+ *   initializing; it is then only known once callaudiod reports a change
+ *
+ * Flags used by call_audio_init_async().
+ */
+typedef enum {
+  CALL_AUDIO_INIT_FLAGS_NONE = 0,
+  CALL_AUDIO_INIT_FLAGS_NO_AUTO_START = 1 << 0,
+  CALL_AUDIO_INIT_FLAGS_LAZY_PROPERTIES = 1 << 1,
+} CallAudioInitFlags;
+
+/**
+ * CallAudioState:
+ * @mode: Selected audio mode
+ * @speaker_state: Speaker state
+ * @mic_state: Microphone state
+ * @bt_audio_state: Bluetooth audio state
+ *
+ * The routing state published by callaudiod.
+ */
+typedef struct {
+  CallAudioMode           mode;
+  CallAudioSpeakerState   speaker_state;
+  CallAudioMicState       mic_state;
+  CallAudioBluetoothState bt_audio_state;
+} CallAudioState;
+
+/**
+ * CallAudioTransaction:
+ *
+ * An opaque structure holding a set of operations to be sent to callaudiod
+ * together.
+ */
+typedef struct _CallAudioTransaction CallAudioTransaction;
+
+typedef void (*CallAudioStateCallback)(const CallAudioState *old_state,
+                                       const CallAudioState *new_state,
+                                       gpointer              data);
+
+GQuark   call_audio_error_quark(void);
+
 gboolean call_audio_init     (GError **error);
+void     call_audio_init_async(CallAudioInitFlags flags,
+                               CallAudioCallback  cb,
+                               gpointer           data);
+gboolean call_audio_init_with_context(GMainContext *context, GError **error);
 gboolean call_audio_is_inited(void);
 void     call_audio_deinit   (void);
+void     call_audio_set_timeout(gint timeout_msec);
+
+/* Integration with non-GLib event loops */
+gint     call_audio_get_fd   (void);
+gint     call_audio_dispatch (void);
 
 gboolean call_audio_select_mode      (CallAudioMode mode, GError **error);
 gboolean call_audio_select_mode_async(CallAudioMode     mode,
                                       CallAudioCallback cb,
                                       gpointer          data);
+void     call_audio_select_mode_full  (CallAudioMode       mode,
+                                      gint                timeout_msec,
+                                      GCancellable       *cancellable,
+                                      GAsyncReadyCallback callback,
+                                      gpointer            user_data);
+gboolean call_audio_select_mode_finish(GAsyncResult *result, GError **error);
 CallAudioMode call_audio_get_audio_mode(void);
 
 gboolean call_audio_enable_speaker      (gboolean enable, GError **error);
 gboolean call_audio_enable_speaker_async(gboolean          enable,
                                          CallAudioCallback cb,
                                          gpointer          data);
+void     call_audio_enable_speaker_full  (gboolean            enable,
+                                         gint                timeout_msec,
+                                         GCancellable       *cancellable,
+                                         GAsyncReadyCallback callback,
+                                         gpointer            user_data);
+gboolean call_audio_enable_speaker_finish(GAsyncResult *result, GError **error);
 CallAudioSpeakerState call_audio_get_speaker_state(void);
 
 gboolean call_audio_mute_mic      (gboolean mute, GError **error);
 gboolean call_audio_mute_mic_async(gboolean          enable,
                                    CallAudioCallback cb,
                                    gpointer          data);
+void     call_audio_mute_mic_full  (gboolean            mute,
+                                   gint                timeout_msec,
+                                   GCancellable       *cancellable,
+                                   GAsyncReadyCallback callback,
+                                   gpointer            user_data);
+gboolean call_audio_mute_mic_finish(GAsyncResult *result, GError **error);
 CallAudioMicState call_audio_get_mic_state(void);
 /* Bluetooth */
 gboolean call_audio_bt_audio    (gboolean mute, GError **error);
 gboolean call_audio_bt_audio_async(gboolean          enable,
                                    CallAudioCallback cb,
                                    gpointer          data);
+void     call_audio_bt_audio_full  (gboolean            enable,
+                                   gint                timeout_msec,
+                                   GCancellable       *cancellable,
+                                   GAsyncReadyCallback callback,
+                                   gpointer            user_data);
+gboolean call_audio_bt_audio_finish(GAsyncResult *result, GError **error);
 CallAudioBluetoothState call_audio_get_bt_audio_state(void);
+
+/* Incoming calls */
+gboolean call_audio_prepare_call      (gboolean prepare, GError **error);
+gboolean call_audio_prepare_call_async(gboolean          prepare,
+                                       CallAudioCallback cb,
+                                       gpointer          data);
+void     call_audio_prepare_call_full  (gboolean            prepare,
+                                       gint                timeout_msec,
+                                       GCancellable       *cancellable,
+                                       GAsyncReadyCallback callback,
+                                       gpointer            user_data);
+gboolean call_audio_prepare_call_finish(GAsyncResult *result, GError **error);
+
+gboolean call_audio_get_state(CallAudioState *state, guint64 *generation);
+
+/* State change notifications */
+guint call_audio_add_state_listener   (CallAudioStateCallback cb,
+                                       gpointer               data);
+void  call_audio_remove_state_listener(guint id);
+
+/* Transactions */
+CallAudioTransaction *call_audio_transaction_new(void);
+void     call_audio_transaction_free          (CallAudioTransaction *transaction);
+void     call_audio_transaction_select_mode   (CallAudioTransaction *transaction,
+                                               CallAudioMode         mode);
+void     call_audio_transaction_enable_speaker(CallAudioTransaction *transaction,
+                                               gboolean              enable);
+void     call_audio_transaction_mute_mic      (CallAudioTransaction *transaction,
+                                               gboolean              mute);
+void     call_audio_transaction_bt_audio      (CallAudioTransaction *transaction,
+                                               gboolean              enable);
+void     call_audio_transaction_commit_async  (CallAudioTransaction *transaction,
+                                               GCancellable         *cancellable,
+                                               GAsyncReadyCallback   callback,
+                                               gpointer              user_data);
+gboolean call_audio_transaction_commit_finish (GAsyncResult *result,
+                                               GError      **error);
 G_END_DECLS
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-backend"
+
+#include "cad-backend.h"
+#include "cad-pulse.h"
+#include "config.h"
+
+#if HAVE_PIPEWIRE
+#include "cad-pipewire.h"
+#endif
+
+/******************************************************************************
+ * Audio backend selection
+ *
+ * Routing goes through the PulseAudio backend by default, which also works
+ * with pipewire-pulse. When built with PipeWire support, the experimental
+ * native PipeWire backend can be selected at startup instead: it sets card
+ * profiles and routes directly through the PipeWire API. The extra features of the
+ * PulseAudio backend (suspending unused devices, echo cancellation, sidetone,
+ * metering and watchdog) are configured through cad_pulse_*() directly.
+ ******************************************************************************/
+
+#if HAVE_PIPEWIRE
+static gboolean use_pipewire;
+#endif
+
+/**
+ * cad_backend_init:
+ * @pipewire: whether to use the native PipeWire backend
+ *
+ * Create the selected backend, which connects to the sound server.
+ */
+void cad_backend_init(gboolean pipewire)
+{
+#if HAVE_PIPEWIRE
+    use_pipewire = pipewire;
+    if (use_pipewire) {
+        g_warning("The native PipeWire backend is experimental");
+        cad_pipewire_get_default();
+        return;
+    }
+#else
+    if (pipewire)
+        g_warning("Built without PipeWire support, using PulseAudio");
+#endif
+
+    cad_pulse_get_default();
+}
+
+gboolean cad_backend_is_pipewire(void)
+{
+#if HAVE_PIPEWIRE
+    return use_pipewire;
+#else
+    return FALSE;
+#endif
+}
+
+void cad_backend_select_mode(CallAudioMode mode, CadOperation *op)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire) {
+        cad_pipewire_select_mode(mode, op);
+        return;
+    }
+#endif
+    cad_pulse_select_mode(mode, op);
+}
+
+void cad_backend_enable_speaker(gboolean enable, CadOperation *op)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire) {
+        cad_pipewire_enable_speaker(enable, op);
+        return;
+    }
+#endif
+    cad_pulse_enable_speaker(enable, op);
+}
+
+void cad_backend_mute_mic(gboolean mute, CadOperation *op)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire) {
+        cad_pipewire_mute_mic(mute, op);
+        return;
+    }
+#endif
+    cad_pulse_mute_mic(mute, op);
+}
+
+void cad_backend_prepare_call(gboolean prepare, CadOperation *op)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire) {
+        cad_pipewire_prepare_call(prepare, op);
+        return;
+    }
+#endif
+    cad_pulse_prepare_call(prepare, op);
+}
+
+void cad_backend_enable_bt_audio(gboolean enable, CadOperation *op)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire) {
+        cad_pipewire_enable_bt_audio(enable, op);
+        return;
+    }
+#endif
+    cad_pulse_enable_bt_audio(enable, op);
+}
+
+gboolean cad_backend_find_bt_audio_capabilities(void)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire)
+        return cad_pipewire_find_bt_audio_capabilities();
+#endif
+    return cad_pulse_find_bt_audio_capabilities();
+}
+
+CallAudioMode cad_backend_get_audio_mode(void)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire)
+        return cad_pipewire_get_audio_mode();
+#endif
+    return cad_pulse_get_audio_mode();
+}
+
+CallAudioSpeakerState cad_backend_get_speaker_state(void)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire)
+        return cad_pipewire_get_speaker_state();
+#endif
+    return cad_pulse_get_speaker_state();
+}
+
+CallAudioMicState cad_backend_get_mic_state(void)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire)
+        return cad_pipewire_get_mic_state();
+#endif
+    return cad_pulse_get_mic_state();
+}
+
+CallAudioBluetoothState cad_backend_get_bt_audio_state(void)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire)
+        return cad_pipewire_get_bt_audio_state();
+#endif
+    return cad_pulse_get_bt_audio_state();
+}
+
+/*
+ * PipeWire adapts sample rates within its graph, the native backend doesn't
+ * track them
+ */
+gboolean cad_backend_is_resampling(void)
+{
+#if HAVE_PIPEWIRE
+    if (use_pipewire)
+        return FALSE;
+#endif
+    return cad_pulse_is_resampling();
+}
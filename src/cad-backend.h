@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+#include "cad-operation.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void cad_backend_init(gboolean pipewire);
+gboolean cad_backend_is_pipewire(void);
+
+void cad_backend_select_mode(CallAudioMode mode, CadOperation *op);
+void cad_backend_enable_speaker(gboolean enable, CadOperation *op);
+void cad_backend_mute_mic(gboolean mute, CadOperation *op);
+void cad_backend_prepare_call(gboolean prepare, CadOperation *op);
+void cad_backend_enable_bt_audio(gboolean enable, CadOperation *op);
+gboolean cad_backend_find_bt_audio_capabilities(void);
+
+CallAudioMode cad_backend_get_audio_mode(void);
+CallAudioSpeakerState cad_backend_get_speaker_state(void);
+CallAudioMicState cad_backend_get_mic_state(void);
+CallAudioBluetoothState cad_backend_get_bt_audio_state(void);
+gboolean cad_backend_is_resampling(void);
+
+G_END_DECLS
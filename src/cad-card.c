@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-card"
+
+#include "cad-card.h"
+
+#include <alsa/use-case.h>
+
+#include <string.h>
+
+#define CARD_BUS_PATH_PREFIX "platform-"
+#define CARD_FORM_FACTOR "internal"
+#define CARD_MODEM_CLASS "modem"
+#define CARD_MODEM_NAME "Modem"
+
+/******************************************************************************
+ * Card detection heuristics
+ *
+ * The following functions only work on the card's properties, port and
+ * profile names, so they can be shared by the audio backends and exercised
+ * without any sound server. Names are checked one at a time, so backends can
+ * walk their own port and profile lists without copying them.
+ ******************************************************************************/
+
+/**
+ * cad_card_is_internal:
+ * @bus_path: (nullable): the card's bus path property
+ * @form_factor: (nullable): the card's form factor property
+ * @card_name: (nullable): the ALSA card name
+ * @device_class: (nullable): the card's device class property
+ *
+ * Check whether the card is an internal, non-modem sound card. Missing
+ * properties don't disqualify a card.
+ *
+ * Returns: %TRUE if the card could be the phone's main sound card.
+ */
+gboolean cad_card_is_internal(const gchar *bus_path,
+                              const gchar *form_factor,
+                              const gchar *card_name,
+                              const gchar *device_class)
+{
+    if (bus_path && !g_str_has_prefix(bus_path, CARD_BUS_PATH_PREFIX))
+        return FALSE;
+    if (form_factor && strcmp(form_factor, CARD_FORM_FACTOR) != 0)
+        return FALSE;
+    if (card_name && strcmp(card_name, CARD_MODEM_NAME) == 0)
+        return FALSE;
+    if (device_class && strcmp(device_class, CARD_MODEM_CLASS) == 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+/**
+ * cad_card_port_is_speaker:
+ * @name: a port name
+ *
+ * Returns: %TRUE if @name is a speaker port.
+ */
+gboolean cad_card_port_is_speaker(const gchar *name)
+{
+    return strstr(name, SND_USE_CASE_DEV_SPEAKER) != NULL;
+}
+
+/**
+ * cad_card_port_is_earpiece:
+ * @name: a port name
+ *
+ * Returns: %TRUE if @name is an earpiece (or handset) port.
+ */
+gboolean cad_card_port_is_earpiece(const gchar *name)
+{
+    return strstr(name, SND_USE_CASE_DEV_EARPIECE) != NULL ||
+           strstr(name, SND_USE_CASE_DEV_HANDSET) != NULL;
+}
+
+/**
+ * cad_card_profile_is_voice:
+ * @name: a profile name
+ *
+ * Cards may have several matching profiles (e.g. "Voice Call" and
+ * "Voice Call BT"), callers use the first one for calls.
+ *
+ * Returns: %TRUE if @name is a voice call profile.
+ */
+gboolean cad_card_profile_is_voice(const gchar *name)
+{
+    return strstr(name, SND_USE_CASE_VERB_VOICECALL) != NULL;
+}
@@ -0,0 +1,21 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_card_is_internal(const gchar *bus_path,
+                              const gchar *form_factor,
+                              const gchar *card_name,
+                              const gchar *device_class);
+gboolean cad_card_port_is_speaker(const gchar *name);
+gboolean cad_card_port_is_earpiece(const gchar *name);
+gboolean cad_card_profile_is_voice(const gchar *name);
+
+G_END_DECLS
@@ -8,11 +8,14 @@
 
 #include "callaudiod.h"
 #include "cad-manager.h"
-#include "cad-pulse.h"
+#include "cad-backend.h"
+#include "cad-state-page.h"
+#include "cad-wakeups.h"
 
 #include "libcallaudio.h"
 #include "udev.h"
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <glib-unix.h>
 
 static void cad_manager_call_audio_iface_init(CallAudioDbusCallAudioIface *iface);
@@ -22,6 +25,32 @@ G_DEFINE_TYPE_WITH_CODE(CadManager, cad_manager,
                         G_IMPLEMENT_INTERFACE(CALL_AUDIO_DBUS_TYPE_CALL_AUDIO,
                                               cad_manager_call_audio_iface_init));
 
+enum {
+    SIGNAL_ACTIVITY,
+    SIGNAL_REPLIED,
+    N_SIGNALS
+};
+
+static guint signals[N_SIGNALS];
+
+/*
+ * Let interested parties (e.g. the exit-on-idle logic) know a client
+ * request has been received.
+ */
+static void notify_activity(CallAudioDbusCallAudio *object)
+{
+    g_signal_emit(object, signals[SIGNAL_ACTIVITY], 0);
+}
+
+/*
+ * Let interested parties (e.g. activation latency logging) know a reply has
+ * been sent to a client.
+ */
+static void notify_replied(CallAudioDbusCallAudio *object)
+{
+    g_signal_emit(object, signals[SIGNAL_REPLIED], 0);
+}
+
 static void complete_command_cb(CadOperation *op)
 {
     if (!op)
@@ -41,6 +70,9 @@ static void complete_command_cb(CadOperation *op)
         case CAD_OPERATION_SWITCH_BT_AUDIO:
             call_audio_dbus_call_audio_complete_bt_audio(op->object, op->invocation, op->success);
             break;
+        case CAD_OPERATION_PREPARE_CALL:
+            call_audio_dbus_call_audio_complete_prepare_call(op->object, op->invocation, op->success);
+            break;
         default:
             g_critical("unknown operation %d", op->type);
             break;
@@ -50,6 +82,8 @@ static void complete_command_cb(CadOperation *op)
                                               G_DBUS_ERROR_FAILED,
                                               "Operation failed");
     }
+
+    notify_replied(op->object);
 }
 
 static gboolean cad_manager_handle_select_mode(CallAudioDbusCallAudio *object,
@@ -58,9 +92,12 @@ static gboolean cad_manager_handle_select_mode(CallAudioDbusCallAudio *object,
 {
     CadOperation *op;
 
+    notify_activity(object);
+
     switch ((CallAudioMode)mode) {
     case CALL_AUDIO_MODE_DEFAULT:
     case CALL_AUDIO_MODE_CALL:
+    case CALL_AUDIO_MODE_VOIP:
         break;
     case CALL_AUDIO_MODE_UNKNOWN:
     default:
@@ -86,7 +123,7 @@ static gboolean cad_manager_handle_select_mode(CallAudioDbusCallAudio *object,
     op->callback = complete_command_cb;
 
     g_debug("Select mode: %u", mode);
-    cad_pulse_select_mode(mode, op);
+    cad_backend_select_mode(mode, op);
 
     return TRUE;
 }
@@ -94,7 +131,7 @@ static gboolean cad_manager_handle_select_mode(CallAudioDbusCallAudio *object,
 static CallAudioMode
 cad_manager_get_audio_mode(CallAudioDbusCallAudio *object)
 {
-    return cad_pulse_get_audio_mode();
+    return cad_backend_get_audio_mode();
 }
 
 static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object,
@@ -103,6 +140,8 @@ static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object
 {
     CadOperation *op;
 
+    notify_activity(object);
+
     op = g_new(CadOperation, 1);
     if (!op) {
         g_critical("Unable to allocate memory for speaker operation");
@@ -119,7 +158,7 @@ static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object
     op->callback = complete_command_cb;
 
     g_debug("Enable speaker: %d", enable);
-    cad_pulse_enable_speaker(enable, op);
+    cad_backend_enable_speaker(enable, op);
 
     return TRUE;
 }
@@ -127,7 +166,7 @@ static gboolean cad_manager_handle_enable_speaker(CallAudioDbusCallAudio *object
 static CallAudioSpeakerState
 cad_manager_get_speaker_state(CallAudioDbusCallAudio *object)
 {
-    return cad_pulse_get_speaker_state();
+    return cad_backend_get_speaker_state();
 }
 
 static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
@@ -136,6 +175,8 @@ static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
 {
     CadOperation *op;
 
+    notify_activity(object);
+
     op = g_new(CadOperation, 1);
     if (!op) {
         g_critical("Unable to allocate memory for mic operation");
@@ -152,7 +193,7 @@ static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
     op->callback = complete_command_cb;
 
     g_debug("Mute mic: %d", mute);
-    cad_pulse_mute_mic(mute, op);
+    cad_backend_mute_mic(mute, op);
 
     return TRUE;
 }
@@ -160,7 +201,7 @@ static gboolean cad_manager_handle_mute_mic(CallAudioDbusCallAudio *object,
 static CallAudioMicState
 cad_manager_get_mic_state(CallAudioDbusCallAudio *object)
 {
-    return cad_pulse_get_mic_state();
+    return cad_backend_get_mic_state();
 }
 
 
@@ -170,6 +211,8 @@ static gboolean cad_manager_handle_switch_bt_audio(CallAudioDbusCallAudio *objec
 {
     CadOperation *op;
 
+    notify_activity(object);
+
     op = g_new(CadOperation, 1);
     if (!op) {
         g_critical("Unable to allocate memory for speaker operation");
@@ -186,7 +229,7 @@ static gboolean cad_manager_handle_switch_bt_audio(CallAudioDbusCallAudio *objec
     op->callback = complete_command_cb;
 
     g_message("Enable BT audio: %d", enable);
-    cad_pulse_enable_bt_audio(enable, op);
+    cad_backend_enable_bt_audio(enable, op);
 
     return TRUE;
 }
@@ -194,7 +237,105 @@ static gboolean cad_manager_handle_switch_bt_audio(CallAudioDbusCallAudio *objec
 static CallAudioBluetoothState
 cad_manager_get_bt_audio_state(CallAudioDbusCallAudio *object)
 {
-    return cad_pulse_get_bt_audio_state();
+    return cad_backend_get_bt_audio_state();
+}
+
+static gboolean cad_manager_handle_prepare_call(CallAudioDbusCallAudio *object,
+                                                GDBusMethodInvocation *invocation,
+                                                gboolean prepare)
+{
+    CadOperation *op;
+
+    notify_activity(object);
+
+    op = g_new(CadOperation, 1);
+    if (!op) {
+        g_critical("Unable to allocate memory for prepare call operation");
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_NO_MEMORY,
+                                              "Failed to allocate operation");
+        return FALSE;
+    }
+
+    op->type = CAD_OPERATION_PREPARE_CALL;
+    op->value = GUINT_TO_POINTER(prepare);
+    op->object = object;
+    op->invocation = invocation;
+    op->callback = complete_command_cb;
+
+    g_debug("Prepare call: %d", prepare);
+    cad_backend_prepare_call(prepare, op);
+
+    return TRUE;
+}
+
+static gboolean cad_manager_handle_get_state_page(CallAudioDbusCallAudio *object,
+                                                  GDBusMethodInvocation *invocation)
+{
+    g_autoptr(GUnixFDList) fd_list = NULL;
+    g_autoptr(GError) error = NULL;
+    gint fd = cad_state_page_get_fd();
+
+    if (fd < 0) {
+        g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                              G_DBUS_ERROR_NOT_SUPPORTED,
+                                              "State page not available");
+        return TRUE;
+    }
+
+    fd_list = g_unix_fd_list_new();
+    if (g_unix_fd_list_append(fd_list, fd, &error) < 0) {
+        g_dbus_method_invocation_return_gerror(invocation, error);
+        return TRUE;
+    }
+
+    g_dbus_method_invocation_return_value_with_unix_fd_list(invocation,
+                                                            g_variant_new("(h)", 0),
+                                                            fd_list);
+    notify_replied(object);
+
+    return TRUE;
+}
+
+static GVariant *build_state(CadManager *self)
+{
+    GVariantBuilder builder;
+    guint audio_mode, speaker_state, mic_state, bt_audio_state;
+
+    g_object_get(self,
+                 "audio-mode", &audio_mode,
+                 "speaker-state", &speaker_state,
+                 "mic-state", &mic_state,
+                 "bt-audio-state", &bt_audio_state,
+                 NULL);
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "AudioMode", g_variant_new_uint32(audio_mode));
+    g_variant_builder_add(&builder, "{sv}", "SpeakerState", g_variant_new_uint32(speaker_state));
+    g_variant_builder_add(&builder, "{sv}", "MicState", g_variant_new_uint32(mic_state));
+    g_variant_builder_add(&builder, "{sv}", "BtAudioState", g_variant_new_uint32(bt_audio_state));
+    g_variant_builder_add(&builder, "{sv}", "Resampling", g_variant_new_boolean(cad_backend_is_resampling()));
+    g_variant_builder_add(&builder, "{sv}", "Generation", g_variant_new_uint64(self->generation));
+    g_variant_builder_add(&builder, "{sv}", "Timestamp", g_variant_new_int64(self->timestamp));
+    g_variant_builder_add(&builder, "{sv}", "IdleWakeups", g_variant_new_uint64(cad_wakeups_get_idle_count()));
+
+    return g_variant_builder_end(&builder);
+}
+
+static gboolean cad_manager_handle_get_state(CallAudioDbusCallAudio *object,
+                                             GDBusMethodInvocation *invocation)
+{
+    CadManager *self = CAD_MANAGER(object);
+
+    notify_activity(object);
+
+    /* Make sure we report the latest state along with its generation */
+    cad_manager_commit_state(self);
+    call_audio_dbus_call_audio_complete_get_state(object, invocation,
+                                                  build_state(self));
+    notify_replied(object);
+
+    return TRUE;
 }
 
 static void cad_manager_call_audio_iface_init(CallAudioDbusCallAudioIface *iface)
@@ -207,14 +348,153 @@ static void cad_manager_call_audio_iface_init(CallAudioDbusCallAudioIface *iface
     iface->get_mic_state = cad_manager_get_mic_state;
     iface->handle_bt_audio = cad_manager_handle_switch_bt_audio;
     iface->get_bt_audio_state = cad_manager_get_bt_audio_state;
+    iface->handle_get_state_page = cad_manager_handle_get_state_page;
+    iface->handle_get_state = cad_manager_handle_get_state;
+    iface->handle_prepare_call = cad_manager_handle_prepare_call;
 }
 
 static void cad_manager_class_init(CadManagerClass *klass)
 {
+    /**
+     * CadManager::activity:
+     * @manager: the #CadManager
+     *
+     * Emitted whenever a client request is received.
+     */
+    signals[SIGNAL_ACTIVITY] = g_signal_new("activity",
+                                            G_TYPE_FROM_CLASS(klass),
+                                            G_SIGNAL_RUN_LAST,
+                                            0, NULL, NULL, NULL,
+                                            G_TYPE_NONE, 0);
+
+    /**
+     * CadManager::replied:
+     * @manager: the #CadManager
+     *
+     * Emitted whenever a reply to a client request has been sent.
+     */
+    signals[SIGNAL_REPLIED] = g_signal_new("replied",
+                                           G_TYPE_FROM_CLASS(klass),
+                                           G_SIGNAL_RUN_LAST,
+                                           0, NULL, NULL, NULL,
+                                           G_TYPE_NONE, 0);
+}
+
+static void commit_state(CadManager *self)
+{
+    guint audio_mode, speaker_state, mic_state, bt_audio_state;
+
+    self->generation++;
+    self->timestamp = g_get_monotonic_time();
+
+    g_object_get(self,
+                 "audio-mode", &audio_mode,
+                 "speaker-state", &speaker_state,
+                 "mic-state", &mic_state,
+                 "bt-audio-state", &bt_audio_state,
+                 NULL);
+
+    cad_state_page_publish(self->generation, self->timestamp,
+                           audio_mode, speaker_state, mic_state, bt_audio_state);
+    call_audio_dbus_call_audio_emit_state_changed(CALL_AUDIO_DBUS_CALL_AUDIO(self),
+                                                  build_state(self));
+}
+
+static gboolean commit_state_cb(gpointer data)
+{
+    CadManager *self = data;
+
+    self->commit_id = 0;
+    commit_state(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Property changes are only published (state page, StateChanged signal) once
+ * the current operation is complete, or on the next main loop iteration for
+ * changes not triggered by a client request. This way clients never see
+ * intermediate states.
+ */
+static void state_changed_cb(GObject *object, GParamSpec *pspec, gpointer data)
+{
+    cad_manager_route_changed(CAD_MANAGER(object));
+}
+
+/**
+ * cad_manager_route_changed:
+ * @self: the #CadManager
+ *
+ * Schedule a state update for routing details which aren't exposed as
+ * properties, such as whether the route is resampling.
+ */
+void cad_manager_route_changed(CadManager *self)
+{
+    if (self->commit_hold > 0) {
+        self->commit_deferred = TRUE;
+        return;
+    }
+
+    if (self->commit_id == 0)
+        self->commit_id = g_idle_add(commit_state_cb, self);
+}
+
+/**
+ * cad_manager_hold_state:
+ * @self: the #CadManager
+ *
+ * Delay publishing state changes until cad_manager_release_state() is called,
+ * for requests made of several steps.
+ */
+void cad_manager_hold_state(CadManager *self)
+{
+    self->commit_hold++;
+}
+
+/**
+ * cad_manager_release_state:
+ * @self: the #CadManager
+ *
+ * Undo a previous cad_manager_hold_state() call. Changes made in the meantime
+ * are then scheduled for publication, or published by the next
+ * cad_manager_commit_state() call.
+ */
+void cad_manager_release_state(CadManager *self)
+{
+    g_return_if_fail(self->commit_hold > 0);
+
+    self->commit_hold--;
+    if (self->commit_hold == 0 && self->commit_deferred) {
+        self->commit_deferred = FALSE;
+        cad_manager_route_changed(self);
+    }
+}
+
+/**
+ * cad_manager_commit_state:
+ * @self: the #CadManager
+ *
+ * Publish pending property changes right away, as a single state update.
+ * This does nothing if no property changed since the last commit.
+ */
+void cad_manager_commit_state(CadManager *self)
+{
+    if (self->commit_id == 0)
+        return;
+
+    g_source_remove(self->commit_id);
+    self->commit_id = 0;
+    commit_state(self);
 }
 
 static void cad_manager_init(CadManager *self)
 {
+    g_autoptr(GError) error = NULL;
+
+    if (!cad_state_page_init(&error))
+        g_warning("%s", error->message);
+
+    g_signal_connect(self, "notify", G_CALLBACK(state_changed_cb), NULL);
 }
 
 CadManager *cad_manager_get_default(void)
@@ -238,7 +518,7 @@ gboolean scan_bt_devices(CadManager *manager)
 
     g_message("Bluetooth rescan triggered");
 
-    ret = cad_pulse_find_bt_audio_capabilities();
+    ret = cad_backend_find_bt_audio_capabilities();
     g_message("Find audio returned %i", ret);
     /*
      * We need to query here all pulseaudio cards
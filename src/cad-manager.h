@@ -18,12 +18,22 @@ G_BEGIN_DECLS
 typedef struct _CadManager {
     CallAudioDbusCallAudioSkeleton parent;
     GUdevClient *udev;
+    guint bt_scan_id;
+    guint commit_id;
+    guint commit_hold;
+    gboolean commit_deferred;
+    guint64 generation;
+    gint64 timestamp;
 } CadManager;
 
 G_DECLARE_FINAL_TYPE(CadManager, cad_manager, CAD, MANAGER,
                      CallAudioDbusCallAudioSkeleton);
 
 CadManager *cad_manager_get_default(void);
+void cad_manager_commit_state(CadManager *self);
+void cad_manager_route_changed(CadManager *self);
+void cad_manager_hold_state(CadManager *self);
+void cad_manager_release_state(CadManager *self);
 
 gboolean scan_bt_devices(CadManager *manager);
 G_END_DECLS
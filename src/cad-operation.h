@@ -14,6 +14,8 @@
  * @CAD_OPERATION_SELECT_MODE: Selecting an audio mode (default mode, voice call mode)
  * @CAD_OPERATION_ENABLE_SPEAKER: Enable or disable the loudspeaker
  * @CAD_OPERATION_MUTE_MIC: Mute or unmute the microphone
+ * @CAD_OPERATION_SWITCH_BT_AUDIO: Enable or disable bluetooth audio
+ * @CAD_OPERATION_PREPARE_CALL: Prepare for an incoming call, or cancel it
  *
  * Enum values to indicate the operation to be performed.
  */
@@ -22,6 +24,7 @@ typedef enum {
     CAD_OPERATION_ENABLE_SPEAKER,
     CAD_OPERATION_MUTE_MIC,
     CAD_OPERATION_SWITCH_BT_AUDIO,
+    CAD_OPERATION_PREPARE_CALL,
 } CadOperationType;
 
 typedef struct _CadOperation CadOperation;
@@ -0,0 +1,1643 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-pipewire"
+
+#include "cad-card.h"
+#include "cad-manager.h"
+#include "cad-pipewire.h"
+#include "cad-trace.h"
+#include "cad-ucm.h"
+
+#include <glib-unix.h>
+#include <pipewire/impl.h>
+#include <pipewire/pipewire.h>
+#include <spa/param/param.h>
+#include <spa/param/props.h>
+#include <spa/pod/builder.h>
+#include <spa/pod/parser.h>
+#include <alsa/use-case.h>
+
+#include <errno.h>
+#include <string.h>
+
+#define APPLICATION_NAME "CallAudio"
+#define APPLICATION_ID   "org.mobian-project.CallAudio"
+
+#define PW_AUDIO_DEVICE_CLASS "Audio/Device"
+#define PW_AUDIO_SINK_CLASS "Audio/Sink"
+#define PW_AUDIO_SOURCE_CLASS "Audio/Source"
+#define PW_BT_API "bluez5"
+#define PW_BT_PREFERRED_PROFILE "headset-head-unit"
+#define PW_MAIN_CARD_BT_PROFILE "Voice Call BT"
+#define PW_LOOPBACK_MODULE "libpipewire-module-loopback"
+#define PW_RECONNECT_MAX_DELAY 64
+#define PW_MAX_ROUTE_PROFILES 64
+
+/*
+ * A profile of a device, as reported by the EnumProfile param
+ */
+typedef struct _CadPipewireProfile {
+    gint32 index;
+    gchar *name;
+    gint32 priority;
+    guint32 available;
+} CadPipewireProfile;
+
+/*
+ * A route (port) of a device, as reported by the EnumRoute param
+ */
+typedef struct _CadPipewireRoute {
+    gint32 index;
+    guint32 direction;
+    gchar *name;
+    gint32 priority;
+    guint32 available;
+    /* Indexes of the profiles this route can be used with */
+    GArray *profiles;
+} CadPipewireRoute;
+
+/*
+ * The route currently used for one direction, as reported by the Route param
+ */
+typedef struct _CadPipewireActiveRoute {
+    gint32 index;
+    gint32 device;
+    gchar *name;
+    gboolean mute;
+} CadPipewireActiveRoute;
+
+typedef struct _CadPipewire CadPipewire;
+
+typedef struct _CadPipewireDevice {
+    CadPipewire *pipewire;
+    guint32 id;
+    gchar *name;
+    gboolean is_bluetooth;
+
+    struct pw_device *proxy;
+    struct spa_hook listener;
+
+    GPtrArray *profiles;
+    GPtrArray *routes;
+    gint32 active_profile;
+    CadPipewireActiveRoute output;
+    CadPipewireActiveRoute input;
+} CadPipewireDevice;
+
+typedef struct _CadPipewireNode {
+    guint32 id;
+    guint32 device_id;
+    gchar *name;
+    gboolean is_sink;
+} CadPipewireNode;
+
+struct _CadPipewire
+{
+    GObject parent_instance;
+
+    GObject *manager;
+
+    struct pw_loop *loop;
+    guint loop_source_id;
+    struct pw_context *context;
+    struct pw_core *core;
+    struct spa_hook core_listener;
+    struct pw_registry *registry;
+    struct spa_hook registry_listener;
+    int init_seq;
+    guint reconnect_id;
+    guint reconnect_delay;
+
+    /* Devices and nodes we track, indexed by global id */
+    GHashTable *devices;
+    GHashTable *nodes;
+    CadPipewireDevice *card;
+    CadPipewireDevice *bt_card;
+
+    /* Operations waiting for the server to process our requests */
+    GList *pending;
+
+    /* Loopbacks between the bluetooth headset and the internal card */
+    struct pw_impl_module *bt_loopbacks[2];
+    struct spa_hook bt_loopback_listeners[2];
+
+    CallAudioMode audio_mode;
+    CallAudioSpeakerState speaker_state;
+    CallAudioMicState mic_state;
+    CallAudioBluetoothState bt_audio;
+};
+
+G_DEFINE_TYPE(CadPipewire, cad_pipewire, G_TYPE_OBJECT);
+
+typedef struct _CadPipewireOperation CadPipewireOperation;
+
+/*
+ * Next step of an operation, run once the server has processed the requests
+ * sent by the previous one
+ */
+typedef void (*CadPipewireStep)(CadPipewireOperation *operation);
+
+struct _CadPipewireOperation {
+    CadPipewire *pipewire;
+    CadOperation *op;
+    guint value;
+    gint64 start;
+    int seq;
+    CadPipewireStep next;
+};
+
+static CadPipewire *default_pipewire;
+
+static gboolean pipewire_connect(CadPipewire *self);
+static void pipewire_cleanup(CadPipewire *self);
+
+/******************************************************************************
+ * Published state
+ ******************************************************************************/
+
+static void set_audio_mode(CadPipewire *self, CallAudioMode mode)
+{
+    if (self->audio_mode == mode)
+        return;
+
+    self->audio_mode = mode;
+    g_object_set(self->manager, "audio-mode", mode, NULL);
+}
+
+static void set_speaker_state(CadPipewire *self, CallAudioSpeakerState state)
+{
+    if (self->speaker_state == state)
+        return;
+
+    self->speaker_state = state;
+    g_object_set(self->manager, "speaker-state", state, NULL);
+}
+
+static void set_mic_state(CadPipewire *self, CallAudioMicState state)
+{
+    if (self->mic_state == state)
+        return;
+
+    self->mic_state = state;
+    g_object_set(self->manager, "mic-state", state, NULL);
+}
+
+static void set_bt_audio_state(CadPipewire *self, CallAudioBluetoothState state)
+{
+    if (self->bt_audio == state)
+        return;
+
+    self->bt_audio = state;
+    g_object_set(self->manager, "bt-audio-state", state, NULL);
+}
+
+/******************************************************************************
+ * Device profiles and routes
+ *
+ * The following functions keep track of the devices' profiles and routes,
+ * which PipeWire sends us whenever they change as we subscribe to the
+ * corresponding params. There's no need to query the server before switching
+ * profiles or routes: our copy is always up to date.
+ ******************************************************************************/
+
+static void profile_free(gpointer data)
+{
+    CadPipewireProfile *profile = data;
+
+    g_free(profile->name);
+    g_free(profile);
+}
+
+static void route_free(gpointer data)
+{
+    CadPipewireRoute *route = data;
+
+    g_free(route->name);
+    g_array_unref(route->profiles);
+    g_free(route);
+}
+
+static void active_route_init(CadPipewireActiveRoute *route)
+{
+    route->index = -1;
+    route->device = -1;
+    route->name = NULL;
+    route->mute = FALSE;
+}
+
+static CadPipewireProfile *find_profile(CadPipewireDevice *dev, gint32 index)
+{
+    guint i;
+
+    for (i = 0; i < dev->profiles->len; i++) {
+        CadPipewireProfile *profile = g_ptr_array_index(dev->profiles, i);
+
+        if (profile->index == index)
+            return profile;
+    }
+
+    return NULL;
+}
+
+static CadPipewireProfile *find_profile_by_name(CadPipewireDevice *dev,
+                                                const gchar *name,
+                                                gboolean prefix)
+{
+    guint i;
+
+    for (i = 0; i < dev->profiles->len; i++) {
+        CadPipewireProfile *profile = g_ptr_array_index(dev->profiles, i);
+
+        if (prefix ? g_str_has_prefix(profile->name, name) :
+                     strcmp(profile->name, name) == 0)
+            return profile;
+    }
+
+    return NULL;
+}
+
+static CadPipewireRoute *find_route(CadPipewireDevice *dev, gint32 index)
+{
+    guint i;
+
+    for (i = 0; i < dev->routes->len; i++) {
+        CadPipewireRoute *route = g_ptr_array_index(dev->routes, i);
+
+        if (route->index == index)
+            return route;
+    }
+
+    return NULL;
+}
+
+static gboolean device_has_voice_profile(CadPipewireDevice *dev)
+{
+    guint i;
+
+    for (i = 0; i < dev->profiles->len; i++) {
+        CadPipewireProfile *profile = g_ptr_array_index(dev->profiles, i);
+
+        if (cad_card_profile_is_voice(profile->name))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean device_has_call_ports(CadPipewireDevice *dev)
+{
+    gboolean has_speaker = FALSE;
+    gboolean has_earpiece = FALSE;
+    guint i;
+
+    for (i = 0; i < dev->routes->len; i++) {
+        CadPipewireRoute *route = g_ptr_array_index(dev->routes, i);
+
+        if (cad_card_port_is_speaker(route->name))
+            has_speaker = TRUE;
+        else if (cad_card_port_is_earpiece(route->name))
+            has_earpiece = TRUE;
+    }
+
+    return has_speaker && has_earpiece;
+}
+
+static gboolean route_has_profile(CadPipewireRoute *route, gint32 profile)
+{
+    guint i;
+
+    /* Routes which don't list their profiles can be used with any of them */
+    if (route->profiles->len == 0)
+        return TRUE;
+
+    for (i = 0; i < route->profiles->len; i++) {
+        if (g_array_index(route->profiles, gint32, i) == profile)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Voice call modes use any output but the speaker, unless explicitly requested
+ */
+static gboolean mode_excludes_speaker(CallAudioMode mode)
+{
+    return mode == CALL_AUDIO_MODE_CALL || mode == CALL_AUDIO_MODE_VOIP;
+}
+
+static gboolean route_is_speaker(const gchar *name)
+{
+    return name && strstr(name, SND_USE_CASE_DEV_SPEAKER) != NULL;
+}
+
+/*
+ * Returns the highest priority output route usable with the active profile,
+ * excluding the speaker if requested, or the speaker itself if @speaker is
+ * set.
+ */
+static CadPipewireRoute *get_output_route(CadPipewireDevice *dev,
+                                          gboolean speaker,
+                                          gboolean exclude_speaker)
+{
+    CadPipewireRoute *available_route = NULL;
+    guint i;
+
+    for (i = 0; i < dev->routes->len; i++) {
+        CadPipewireRoute *route = g_ptr_array_index(dev->routes, i);
+
+        if (route->direction != SPA_DIRECTION_OUTPUT ||
+            route->available == SPA_PARAM_AVAILABILITY_no ||
+            !route_has_profile(route, dev->active_profile))
+            continue;
+
+        if ((speaker && !route_is_speaker(route->name)) ||
+            (exclude_speaker && route_is_speaker(route->name)))
+            continue;
+
+        if (!available_route || route->priority > available_route->priority)
+            available_route = route;
+    }
+
+    if (available_route)
+        g_debug("found available output '%s'", available_route->name);
+    else
+        g_warning("no available output found!");
+
+    return available_route;
+}
+
+static void set_profile(CadPipewireDevice *dev, CadPipewireProfile *profile)
+{
+    guint8 buffer[256];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+    g_debug("switching device '%s' to profile '%s'", dev->name, profile->name);
+    pw_device_set_param(dev->proxy, SPA_PARAM_Profile, 0,
+                        spa_pod_builder_add_object(&b,
+                            SPA_TYPE_OBJECT_ParamProfile, SPA_PARAM_Profile,
+                            SPA_PARAM_PROFILE_index, SPA_POD_Int(profile->index)));
+}
+
+/*
+ * Select route @index for the card device used by @active, and optionally
+ * change its mute state
+ */
+static void set_route(CadPipewireDevice *dev, CadPipewireActiveRoute *active,
+                      gint32 index, gboolean set_mute, gboolean mute)
+{
+    guint8 buffer[1024];
+    struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+    struct spa_pod_frame f[2];
+    struct spa_pod *param;
+
+    spa_pod_builder_push_object(&b, &f[0], SPA_TYPE_OBJECT_ParamRoute, SPA_PARAM_Route);
+    spa_pod_builder_add(&b,
+                        SPA_PARAM_ROUTE_index, SPA_POD_Int(index),
+                        SPA_PARAM_ROUTE_device, SPA_POD_Int(active->device),
+                        0);
+    if (set_mute) {
+        spa_pod_builder_prop(&b, SPA_PARAM_ROUTE_props, 0);
+        spa_pod_builder_push_object(&b, &f[1], SPA_TYPE_OBJECT_Props, SPA_PARAM_Route);
+        spa_pod_builder_add(&b, SPA_PROP_mute, SPA_POD_Bool(mute), 0);
+        spa_pod_builder_pop(&b, &f[1]);
+    }
+    param = spa_pod_builder_pop(&b, &f[0]);
+
+    pw_device_set_param(dev->proxy, SPA_PARAM_Route, 0, param);
+}
+
+/*
+ * The audio mode can only be derived from the card state when it has a voice
+ * profile; the default and VoIP modes share the same profile, so the current
+ * one is kept unless the voice profile was left.
+ */
+static void update_audio_mode(CadPipewire *self)
+{
+    CadPipewireDevice *card = self->card;
+    CadPipewireProfile *profile;
+
+    if (!device_has_voice_profile(card))
+        return;
+
+    profile = find_profile(card, card->active_profile);
+    if (!profile)
+        return;
+
+    if (strcmp(profile->name, SND_USE_CASE_VERB_VOICECALL) == 0)
+        set_audio_mode(self, CALL_AUDIO_MODE_CALL);
+    else if (self->audio_mode == CALL_AUDIO_MODE_CALL ||
+             self->audio_mode == CALL_AUDIO_MODE_UNKNOWN)
+        set_audio_mode(self, CALL_AUDIO_MODE_DEFAULT);
+}
+
+static void update_route_state(CadPipewire *self)
+{
+    CadPipewireDevice *card = self->card;
+
+    if (card->output.index >= 0) {
+        set_speaker_state(self, route_is_speaker(card->output.name) ?
+                          CALL_AUDIO_SPEAKER_ON : CALL_AUDIO_SPEAKER_OFF);
+    }
+
+    if (card->input.index >= 0)
+        set_mic_state(self, card->input.mute ? CALL_AUDIO_MIC_OFF : CALL_AUDIO_MIC_ON);
+}
+
+static void update_bt_state(CadPipewire *self)
+{
+    if (self->bt_audio == CALL_AUDIO_BT_ENABLED && self->bt_card)
+        return;
+
+    set_bt_audio_state(self, self->bt_card ? CALL_AUDIO_BT_AVAILABLE :
+                                             CALL_AUDIO_BT_UNAVAILABLE);
+}
+
+/*
+ * Check whether a device can be used as the main card or as the bluetooth
+ * headset, now that we know more about its profiles and routes
+ */
+static void check_device(CadPipewire *self, CadPipewireDevice *dev)
+{
+    if (dev->is_bluetooth) {
+        if (!self->bt_card &&
+            find_profile_by_name(dev, PW_BT_PREFERRED_PROFILE, TRUE)) {
+            g_message("Bluetooth headset '%s' found", dev->name);
+            self->bt_card = dev;
+            update_bt_state(self);
+        }
+        return;
+    }
+
+    if (self->card || !device_has_call_ports(dev))
+        return;
+
+    self->card = dev;
+    g_debug("CARD: id=%u name='%s'", dev->id, dev->name);
+    g_debug("CARD:   %s voice profile", device_has_voice_profile(dev) ? "has" : "doesn't have");
+
+    update_audio_mode(self);
+    update_route_state(self);
+}
+
+static void parse_enum_profile(CadPipewireDevice *dev, const struct spa_pod *param)
+{
+    CadPipewireProfile *profile;
+    const char *name;
+    gint32 index, priority = 0;
+    guint32 available = SPA_PARAM_AVAILABILITY_unknown;
+
+    if (spa_pod_parse_object(param, SPA_TYPE_OBJECT_ParamProfile, NULL,
+                             SPA_PARAM_PROFILE_index, SPA_POD_Int(&index),
+                             SPA_PARAM_PROFILE_name, SPA_POD_String(&name),
+                             SPA_PARAM_PROFILE_priority, SPA_POD_OPT_Int(&priority),
+                             SPA_PARAM_PROFILE_available, SPA_POD_OPT_Id(&available)) < 0) {
+        g_warning("invalid profile on device %u", dev->id);
+        return;
+    }
+
+    profile = find_profile(dev, index);
+    if (!profile) {
+        profile = g_new0(CadPipewireProfile, 1);
+        profile->index = index;
+        g_ptr_array_add(dev->profiles, profile);
+    }
+
+    g_free(profile->name);
+    profile->name = g_strdup(name);
+    profile->priority = priority;
+    profile->available = available;
+}
+
+static void parse_profile(CadPipewireDevice *dev, const struct spa_pod *param)
+{
+    gint32 index;
+
+    if (spa_pod_parse_object(param, SPA_TYPE_OBJECT_ParamProfile, NULL,
+                             SPA_PARAM_PROFILE_index, SPA_POD_Int(&index)) < 0) {
+        g_warning("invalid active profile on device %u", dev->id);
+        return;
+    }
+
+    dev->active_profile = index;
+}
+
+static void parse_enum_route(CadPipewireDevice *dev, const struct spa_pod *param)
+{
+    CadPipewireRoute *route;
+    const struct spa_pod *profiles = NULL;
+    const char *name;
+    gint32 index, priority = 0;
+    guint32 direction, available = SPA_PARAM_AVAILABILITY_unknown;
+    gint32 values[PW_MAX_ROUTE_PROFILES];
+    guint32 n_values = 0;
+
+    if (spa_pod_parse_object(param, SPA_TYPE_OBJECT_ParamRoute, NULL,
+                             SPA_PARAM_ROUTE_index, SPA_POD_Int(&index),
+                             SPA_PARAM_ROUTE_direction, SPA_POD_Id(&direction),
+                             SPA_PARAM_ROUTE_name, SPA_POD_String(&name),
+                             SPA_PARAM_ROUTE_priority, SPA_POD_OPT_Int(&priority),
+                             SPA_PARAM_ROUTE_available, SPA_POD_OPT_Id(&available),
+                             SPA_PARAM_ROUTE_profiles, SPA_POD_OPT_Pod(&profiles)) < 0) {
+        g_warning("invalid route on device %u", dev->id);
+        return;
+    }
+
+    if (profiles)
+        n_values = spa_pod_copy_array(profiles, SPA_TYPE_Int, values, G_N_ELEMENTS(values));
+
+    route = find_route(dev, index);
+    if (!route) {
+        route = g_new0(CadPipewireRoute, 1);
+        route->index = index;
+        route->profiles = g_array_new(FALSE, FALSE, sizeof(gint32));
+        g_ptr_array_add(dev->routes, route);
+    }
+
+    g_free(route->name);
+    route->name = g_strdup(name);
+    route->direction = direction;
+    route->priority = priority;
+    route->available = available;
+    g_array_set_size(route->profiles, 0);
+    g_array_append_vals(route->profiles, values, n_values);
+}
+
+static void parse_route(CadPipewireDevice *dev, const struct spa_pod *param)
+{
+    CadPipewireActiveRoute *active;
+    CadPipewireRoute *route;
+    const struct spa_pod *props = NULL;
+    const char *name = NULL;
+    gint32 index, device;
+    guint32 direction;
+    bool mute = false;
+
+    if (spa_pod_parse_object(param, SPA_TYPE_OBJECT_ParamRoute, NULL,
+                             SPA_PARAM_ROUTE_index, SPA_POD_Int(&index),
+                             SPA_PARAM_ROUTE_direction, SPA_POD_Id(&direction),
+                             SPA_PARAM_ROUTE_device, SPA_POD_Int(&device),
+                             SPA_PARAM_ROUTE_name, SPA_POD_OPT_String(&name),
+                             SPA_PARAM_ROUTE_props, SPA_POD_OPT_Pod(&props)) < 0) {
+        g_warning("invalid active route on device %u", dev->id);
+        return;
+    }
+
+    if (props) {
+        spa_pod_parse_object(props, SPA_TYPE_OBJECT_Props, NULL,
+                             SPA_PROP_mute, SPA_POD_OPT_Bool(&mute));
+    }
+
+    if (!name) {
+        route = find_route(dev, index);
+        name = route ? route->name : NULL;
+    }
+
+    active = direction == SPA_DIRECTION_OUTPUT ? &dev->output : &dev->input;
+    active->index = index;
+    active->device = device;
+    g_free(active->name);
+    active->name = g_strdup(name);
+    active->mute = mute;
+
+    g_debug("device '%s' %s route is '%s'%s", dev->name,
+            direction == SPA_DIRECTION_OUTPUT ? "output" : "input",
+            active->name, mute ? " (muted)" : "");
+}
+
+static void device_param(void *data, int seq, uint32_t id, uint32_t index,
+                         uint32_t next, const struct spa_pod *param)
+{
+    CadPipewireDevice *dev = data;
+    CadPipewire *self = dev->pipewire;
+
+    switch (id) {
+    case SPA_PARAM_EnumProfile:
+        parse_enum_profile(dev, param);
+        check_device(self, dev);
+        break;
+    case SPA_PARAM_Profile:
+        parse_profile(dev, param);
+        if (dev == self->card)
+            update_audio_mode(self);
+        break;
+    case SPA_PARAM_EnumRoute:
+        parse_enum_route(dev, param);
+        check_device(self, dev);
+        break;
+    case SPA_PARAM_Route:
+        parse_route(dev, param);
+        if (dev == self->card)
+            update_route_state(self);
+        break;
+    default:
+        break;
+    }
+}
+
+static const struct pw_device_events device_events = {
+    PW_VERSION_DEVICE_EVENTS,
+    .param = device_param,
+};
+
+static void device_free(gpointer data)
+{
+    CadPipewireDevice *dev = data;
+
+    spa_hook_remove(&dev->listener);
+    pw_proxy_destroy((struct pw_proxy *)dev->proxy);
+    g_ptr_array_unref(dev->profiles);
+    g_ptr_array_unref(dev->routes);
+    g_free(dev->output.name);
+    g_free(dev->input.name);
+    g_free(dev->name);
+    g_free(dev);
+}
+
+static void node_free(gpointer data)
+{
+    CadPipewireNode *node = data;
+
+    g_free(node->name);
+    g_free(node);
+}
+
+static CadPipewireNode *find_device_node(CadPipewire *self, CadPipewireDevice *dev,
+                                         gboolean is_sink)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, self->nodes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        CadPipewireNode *node = value;
+
+        if (node->device_id == dev->id && node->is_sink == is_sink)
+            return node;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+ * Registry
+ *
+ * Only audio devices which may be the internal card or a bluetooth headset
+ * are bound, along with the audio nodes so we know which sink and source
+ * belong to which device.
+ ******************************************************************************/
+
+static void add_device(CadPipewire *self, guint32 id, const struct spa_dict *props)
+{
+    static const uint32_t param_ids[] = {
+        SPA_PARAM_EnumProfile, SPA_PARAM_Profile,
+        SPA_PARAM_EnumRoute, SPA_PARAM_Route,
+    };
+    CadPipewireDevice *dev;
+    const char *card_name;
+    gboolean is_bluetooth;
+
+    is_bluetooth = g_strcmp0(spa_dict_lookup(props, PW_KEY_DEVICE_API), PW_BT_API) == 0;
+
+    card_name = spa_dict_lookup(props, "alsa.card_name");
+    if (!card_name)
+        card_name = spa_dict_lookup(props, "api.alsa.card.name");
+
+    if (!is_bluetooth &&
+        !cad_card_is_internal(spa_dict_lookup(props, PW_KEY_DEVICE_BUS_PATH),
+                              spa_dict_lookup(props, PW_KEY_DEVICE_FORM_FACTOR),
+                              card_name,
+                              spa_dict_lookup(props, PW_KEY_DEVICE_CLASS)))
+        return;
+
+    dev = g_new0(CadPipewireDevice, 1);
+    dev->pipewire = self;
+    dev->id = id;
+    dev->name = g_strdup(spa_dict_lookup(props, PW_KEY_DEVICE_NAME));
+    dev->is_bluetooth = is_bluetooth;
+    dev->profiles = g_ptr_array_new_with_free_func(profile_free);
+    dev->routes = g_ptr_array_new_with_free_func(route_free);
+    dev->active_profile = -1;
+    active_route_init(&dev->output);
+    active_route_init(&dev->input);
+
+    dev->proxy = pw_registry_bind(self->registry, id, PW_TYPE_INTERFACE_Device,
+                                  PW_VERSION_DEVICE, 0);
+    if (!dev->proxy) {
+        g_warning("Unable to bind device %u", id);
+        g_ptr_array_unref(dev->profiles);
+        g_ptr_array_unref(dev->routes);
+        g_free(dev->name);
+        g_free(dev);
+        return;
+    }
+
+    pw_device_add_listener(dev->proxy, &dev->listener, &device_events, dev);
+    pw_device_subscribe_params(dev->proxy, (uint32_t *)param_ids,
+                               G_N_ELEMENTS(param_ids));
+
+    g_hash_table_insert(self->devices, GUINT_TO_POINTER(id), dev);
+    g_debug("tracking %s device %u '%s'", is_bluetooth ? "bluetooth" : "internal",
+            id, dev->name);
+}
+
+static void add_node(CadPipewire *self, guint32 id, const struct spa_dict *props,
+                     gboolean is_sink)
+{
+    CadPipewireNode *node;
+    const char *device_id = spa_dict_lookup(props, PW_KEY_DEVICE_ID);
+
+    if (!device_id)
+        return;
+
+    node = g_new0(CadPipewireNode, 1);
+    node->id = id;
+    node->device_id = (guint32)g_ascii_strtoull(device_id, NULL, 10);
+    node->name = g_strdup(spa_dict_lookup(props, PW_KEY_NODE_NAME));
+    node->is_sink = is_sink;
+
+    g_hash_table_insert(self->nodes, GUINT_TO_POINTER(id), node);
+}
+
+static void registry_global(void *data, uint32_t id, uint32_t permissions,
+                            const char *type, uint32_t version,
+                            const struct spa_dict *props)
+{
+    CadPipewire *self = data;
+    const char *media_class;
+
+    if (!props)
+        return;
+
+    media_class = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
+    if (!media_class)
+        return;
+
+    if (strcmp(type, PW_TYPE_INTERFACE_Device) == 0 &&
+        strcmp(media_class, PW_AUDIO_DEVICE_CLASS) == 0) {
+        add_device(self, id, props);
+    } else if (strcmp(type, PW_TYPE_INTERFACE_Node) == 0) {
+        if (strcmp(media_class, PW_AUDIO_SINK_CLASS) == 0)
+            add_node(self, id, props, TRUE);
+        else if (strcmp(media_class, PW_AUDIO_SOURCE_CLASS) == 0)
+            add_node(self, id, props, FALSE);
+    }
+}
+
+static void destroy_bt_loopbacks(CadPipewire *self);
+
+static void registry_global_remove(void *data, uint32_t id)
+{
+    CadPipewire *self = data;
+    CadPipewireDevice *dev;
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_remove(self->nodes, GUINT_TO_POINTER(id));
+
+    dev = g_hash_table_lookup(self->devices, GUINT_TO_POINTER(id));
+    if (!dev)
+        return;
+
+    if (dev == self->card) {
+        g_message("Card '%s' removed", dev->name);
+        self->card = NULL;
+    } else if (dev == self->bt_card) {
+        g_message("Bluetooth headset '%s' removed", dev->name);
+        self->bt_card = NULL;
+        destroy_bt_loopbacks(self);
+        set_bt_audio_state(self, CALL_AUDIO_BT_UNAVAILABLE);
+    }
+
+    g_hash_table_remove(self->devices, GUINT_TO_POINTER(id));
+
+    /* Another device may take over */
+    g_hash_table_iter_init(&iter, self->devices);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        check_device(self, value);
+}
+
+static const struct pw_registry_events registry_events = {
+    PW_VERSION_REGISTRY_EVENTS,
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+/******************************************************************************
+ * Operations
+ ******************************************************************************/
+
+static void operation_complete(CadPipewireOperation *operation, gboolean success)
+{
+    CadPipewire *self = operation->pipewire;
+    CadOperation *cad_op = operation->op;
+
+    g_debug("operation %d completed in %.1f ms on PipeWire", cad_op->type,
+            (g_get_monotonic_time() - operation->start) / 1000.0);
+    cad_op->success = success;
+
+    if (cad_op->type == CAD_OPERATION_SELECT_MODE &&
+        operation->value == CALL_AUDIO_MODE_CALL && success) {
+        g_message("Call route set up in %.1f ms (PipeWire native)",
+                  (g_get_monotonic_time() - operation->start) / 1000.0);
+    }
+    cad_trace_operation(cad_op->type, operation->value, success);
+
+    if (success) {
+        switch (cad_op->type) {
+        case CAD_OPERATION_SELECT_MODE:
+            set_audio_mode(self, operation->value);
+            break;
+        case CAD_OPERATION_ENABLE_SPEAKER:
+            set_speaker_state(self, operation->value ? CALL_AUDIO_SPEAKER_ON :
+                                                       CALL_AUDIO_SPEAKER_OFF);
+            break;
+        case CAD_OPERATION_MUTE_MIC:
+            /*
+             * "Mute mic" operation's value is TRUE (1) for muting the mic,
+             * so ensure mic_state carries the right value.
+             */
+            set_mic_state(self, operation->value ? CALL_AUDIO_MIC_OFF :
+                                                   CALL_AUDIO_MIC_ON);
+            break;
+        case CAD_OPERATION_SWITCH_BT_AUDIO:
+            if (operation->value)
+                set_bt_audio_state(self, CALL_AUDIO_BT_ENABLED);
+            else
+                set_bt_audio_state(self, self->bt_card ? CALL_AUDIO_BT_AVAILABLE :
+                                                         CALL_AUDIO_BT_UNAVAILABLE);
+            break;
+        case CAD_OPERATION_PREPARE_CALL:
+        default:
+            break;
+        }
+    }
+
+    if (cad_op->type == CAD_OPERATION_SELECT_MODE)
+        cad_manager_release_state(CAD_MANAGER(self->manager));
+
+    /*
+     * Publish the resulting state before replying, so the client gets the
+     * StateChanged signal before the method returns. Internal operations
+     * have no callback, their changes get published along with the request
+     * which triggered them.
+     */
+    if (cad_op->callback) {
+        cad_manager_commit_state(CAD_MANAGER(self->manager));
+        cad_op->callback(cad_op);
+    }
+
+    g_free(cad_op);
+    g_free(operation);
+}
+
+/*
+ * Wait for the server to process the requests sent so far, then run @next,
+ * or complete the operation if it is NULL. Requests are processed in order,
+ * and the resulting param changes are sent to us before the sync reply.
+ */
+static void operation_sync(CadPipewireOperation *operation, CadPipewireStep next)
+{
+    CadPipewire *self = operation->pipewire;
+
+    operation->next = next;
+    operation->seq = pw_core_sync(self->core, PW_ID_CORE, 0);
+    self->pending = g_list_append(self->pending, operation);
+}
+
+/*
+ * Switch the card's output route according to the operation: any route but
+ * the speaker in voice call modes or when disabling the speaker, the speaker
+ * when enabling it, and the highest priority route otherwise.
+ */
+static void select_output_step(CadPipewireOperation *operation)
+{
+    CadPipewireDevice *card = operation->pipewire->card;
+    CadPipewireRoute *target;
+
+    if (!card || card->output.index < 0) {
+        g_warning("card has no usable output");
+        operation_complete(operation, FALSE);
+        return;
+    }
+
+    if (operation->op->type == CAD_OPERATION_SELECT_MODE)
+        target = get_output_route(card, FALSE, mode_excludes_speaker(operation->value));
+    else
+        target = get_output_route(card, operation->value, !operation->value);
+
+    if (!target) {
+        operation_complete(operation, FALSE);
+        return;
+    }
+
+    g_debug("active route is '%s', target route is '%s'", card->output.name, target->name);
+
+    if (target->index == card->output.index) {
+        g_debug("%s: nothing to be done", __func__);
+        operation_complete(operation, TRUE);
+        return;
+    }
+
+    set_route(card, &card->output, target->index, FALSE, FALSE);
+    operation_sync(operation, NULL);
+}
+
+/*
+ * When PipeWire isn't available (yet), route directly through ALSA UCM if
+ * it has been enabled. Returns TRUE if the operation has been handled.
+ */
+static gboolean try_ucm_fallback(CadPipewireOperation *operation)
+{
+    gboolean success;
+
+    if (operation->pipewire->card || !cad_ucm_is_available())
+        return FALSE;
+
+    switch (operation->op->type) {
+    case CAD_OPERATION_SELECT_MODE:
+        success = cad_ucm_select_mode(operation->value);
+        break;
+    case CAD_OPERATION_ENABLE_SPEAKER:
+        success = cad_ucm_enable_speaker(operation->value);
+        break;
+    case CAD_OPERATION_MUTE_MIC:
+        success = cad_ucm_mute_mic(operation->value);
+        break;
+    case CAD_OPERATION_SWITCH_BT_AUDIO:
+    case CAD_OPERATION_PREPARE_CALL:
+    default:
+        return FALSE;
+    }
+
+    g_debug("PipeWire not ready, operation %d handled through UCM",
+            operation->op->type);
+    operation_complete(operation, success);
+
+    return TRUE;
+}
+
+static CadPipewireOperation *operation_new(CadOperation *cad_op, guint value)
+{
+    CadPipewireOperation *operation = g_new0(CadPipewireOperation, 1);
+
+    operation->pipewire = cad_pipewire_get_default();
+    operation->start = g_get_monotonic_time();
+    operation->op = cad_op;
+    operation->value = value;
+
+    return operation;
+}
+
+static void operation_fail(CadPipewireOperation *operation)
+{
+    CadOperation *cad_op = operation->op;
+
+    cad_op->success = FALSE;
+    if (cad_op->callback)
+        cad_op->callback(cad_op);
+    g_free(cad_op);
+    g_free(operation);
+}
+
+/**
+ * cad_pipewire_select_mode:
+ * @mode: the #CallAudioMode to switch to
+ * @cad_op: the #CadOperation to complete
+ *
+ * Same as cad_pulse_select_mode(), through PipeWire.
+ */
+void cad_pipewire_select_mode(CallAudioMode mode, CadOperation *cad_op)
+{
+    CadPipewireOperation *operation;
+    CadPipewire *self;
+    CadPipewireProfile *target;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_SELECT_MODE);
+    operation = operation_new(cad_op, mode);
+    self = operation->pipewire;
+
+    /*
+     * Switching modes may involve internal operations (see below), make sure
+     * the state is only published once everything is done.
+     */
+    cad_manager_hold_state(CAD_MANAGER(self->manager));
+
+    if (mode != CALL_AUDIO_MODE_CALL) {
+        /*
+         * When ending a call, we want to make sure the mic doesn't stay muted
+         */
+        CadOperation *unmute_op = g_new0(CadOperation, 1);
+        unmute_op->type = CAD_OPERATION_MUTE_MIC;
+
+        cad_pipewire_mute_mic(FALSE, unmute_op);
+
+        /*
+         * If the card has a dedicated voice profile, disable speaker so it
+         * doesn't get automatically enabled for next call.
+         */
+        if (self->card && device_has_voice_profile(self->card)) {
+            CadOperation *disable_speaker_op = g_new0(CadOperation, 1);
+            disable_speaker_op->type = CAD_OPERATION_ENABLE_SPEAKER;
+
+            cad_pipewire_enable_speaker(FALSE, disable_speaker_op);
+        }
+    }
+
+    if (try_ucm_fallback(operation))
+        return;
+
+    if (!self->card) {
+        g_warning("PipeWire isn't ready");
+        cad_manager_release_state(CAD_MANAGER(self->manager));
+        cad_manager_commit_state(CAD_MANAGER(self->manager));
+        operation_fail(operation);
+        return;
+    }
+
+    if (device_has_voice_profile(self->card)) {
+        target = find_profile_by_name(self->card,
+                                      mode == CALL_AUDIO_MODE_CALL ?
+                                      SND_USE_CASE_VERB_VOICECALL : SND_USE_CASE_VERB_HIFI,
+                                      FALSE);
+        if (target && target->index != self->card->active_profile) {
+            set_profile(self->card, target);
+            /*
+             * Leaving the voice profile re-creates the card's devices with
+             * their default route, which is usually the speaker: in VoIP
+             * mode, switch to the earpiece (or headphones) once done.
+             */
+            operation_sync(operation, mode == CALL_AUDIO_MODE_VOIP ? select_output_step : NULL);
+            return;
+        }
+
+        if (mode == CALL_AUDIO_MODE_CALL) {
+            g_debug("%s: nothing to be done", __func__);
+            operation_complete(operation, TRUE);
+            return;
+        }
+    }
+
+    /*
+     * Either the card has no voice profile, or the default profile, shared
+     * by both the default and VoIP modes, is already active: only the output
+     * route needs switching.
+     */
+    select_output_step(operation);
+}
+
+/**
+ * cad_pipewire_enable_speaker:
+ * @enable: whether to output audio to the speaker
+ * @cad_op: the #CadOperation to complete
+ */
+void cad_pipewire_enable_speaker(gboolean enable, CadOperation *cad_op)
+{
+    CadPipewireOperation *operation;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_ENABLE_SPEAKER);
+    operation = operation_new(cad_op, (guint)enable);
+
+    if (try_ucm_fallback(operation))
+        return;
+
+    if (!operation->pipewire->card) {
+        g_warning("PipeWire isn't ready");
+        operation_fail(operation);
+        return;
+    }
+
+    select_output_step(operation);
+}
+
+/**
+ * cad_pipewire_mute_mic:
+ * @mute: whether to mute the microphone
+ * @cad_op: the #CadOperation to complete
+ *
+ * The mute state is a property of the card's input route.
+ */
+void cad_pipewire_mute_mic(gboolean mute, CadOperation *cad_op)
+{
+    CadPipewireOperation *operation;
+    CadPipewireDevice *card;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_MUTE_MIC);
+    operation = operation_new(cad_op, (guint)mute);
+
+    if (try_ucm_fallback(operation))
+        return;
+
+    card = operation->pipewire->card;
+    if (!card || card->input.index < 0) {
+        g_warning("card has no usable input");
+        operation_fail(operation);
+        return;
+    }
+
+    if (card->input.mute == !!mute) {
+        g_debug("%s: nothing to be done", __func__);
+        operation_complete(operation, TRUE);
+        return;
+    }
+
+    g_debug("%s mic...", mute ? "muting" : "unmuting");
+    set_route(card, &card->input, card->input.index, TRUE, mute);
+    operation_sync(operation, NULL);
+}
+
+/**
+ * cad_pipewire_prepare_call:
+ * @prepare: %TRUE when a call starts ringing, %FALSE if it wasn't answered
+ * @cad_op: the #CadOperation to complete
+ *
+ * The PipeWire backend keeps the card's profiles and routes up to date from
+ * param events, so selecting the call mode never needs to query the card:
+ * there's nothing to prepare.
+ */
+void cad_pipewire_prepare_call(gboolean prepare, CadOperation *cad_op)
+{
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_PREPARE_CALL);
+
+    operation_complete(operation_new(cad_op, (guint)prepare), TRUE);
+}
+
+/******************************************************************************
+ * Bluetooth audio
+ *
+ * As with PulseAudio, the headset is switched to its handsfree profile, the
+ * card to its bluetooth voice profile if it has one, and audio is looped
+ * between both. The loopbacks are hosted by callaudiod itself through
+ * PW_LOOPBACK_MODULE, and linked by the session manager.
+ ******************************************************************************/
+
+static void bt_loopback_destroyed(void *data)
+{
+    struct pw_impl_module **module = data;
+
+    *module = NULL;
+}
+
+static const struct pw_impl_module_events bt_loopback_events = {
+    PW_VERSION_IMPL_MODULE_EVENTS,
+    .destroy = bt_loopback_destroyed,
+};
+
+static void destroy_bt_loopbacks(CadPipewire *self)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(self->bt_loopbacks); i++) {
+        if (self->bt_loopbacks[i]) {
+            spa_hook_remove(&self->bt_loopback_listeners[i]);
+            pw_impl_module_destroy(self->bt_loopbacks[i]);
+            self->bt_loopbacks[i] = NULL;
+        }
+    }
+}
+
+static gboolean create_bt_loopback(CadPipewire *self, guint i,
+                                   CadPipewireNode *capture,
+                                   CadPipewireNode *playback)
+{
+    g_autofree gchar *args = NULL;
+
+    args = g_strdup_printf("{ capture.props = { target.object = \"%s\" } "
+                           "playback.props = { target.object = \"%s\" } }",
+                           capture->name, playback->name);
+    g_message("Loopback from '%s' to '%s'", capture->name, playback->name);
+
+    self->bt_loopbacks[i] = pw_context_load_module(self->context, PW_LOOPBACK_MODULE,
+                                                   args, NULL);
+    if (!self->bt_loopbacks[i]) {
+        g_warning("Unable to load %s: %s", PW_LOOPBACK_MODULE, g_strerror(errno));
+        return FALSE;
+    }
+
+    pw_impl_module_add_listener(self->bt_loopbacks[i], &self->bt_loopback_listeners[i],
+                                &bt_loopback_events, &self->bt_loopbacks[i]);
+
+    return TRUE;
+}
+
+/*
+ * The profiles have been switched, so the nodes for the new profiles exist
+ * by now: loop audio between the headset and the card.
+ */
+static void bt_loopback_step(CadPipewireOperation *operation)
+{
+    CadPipewire *self = operation->pipewire;
+    CadPipewireNode *bt_source, *bt_sink, *card_source, *card_sink;
+
+    if (!self->card || !self->bt_card) {
+        g_warning("Bluetooth headset or card went away");
+        operation_complete(operation, FALSE);
+        return;
+    }
+
+    bt_source = find_device_node(self, self->bt_card, FALSE);
+    bt_sink = find_device_node(self, self->bt_card, TRUE);
+    card_source = find_device_node(self, self->card, FALSE);
+    card_sink = find_device_node(self, self->card, TRUE);
+
+    if (!bt_source || !bt_sink || !card_source || !card_sink) {
+        g_warning("Bluetooth headset or card has no sink or source");
+        operation_complete(operation, FALSE);
+        return;
+    }
+
+    destroy_bt_loopbacks(self);
+    if (!create_bt_loopback(self, 0, bt_source, card_sink) ||
+        !create_bt_loopback(self, 1, card_source, bt_sink)) {
+        destroy_bt_loopbacks(self);
+        operation_complete(operation, FALSE);
+        return;
+    }
+
+    operation_complete(operation, TRUE);
+}
+
+/**
+ * cad_pipewire_enable_bt_audio:
+ * @enable: whether to route call audio to the bluetooth headset
+ * @cad_op: the #CadOperation to complete
+ */
+void cad_pipewire_enable_bt_audio(gboolean enable, CadOperation *cad_op)
+{
+    CadPipewireOperation *operation;
+    CadPipewireProfile *bt_profile, *card_profile;
+    CadPipewire *self;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_SWITCH_BT_AUDIO);
+    operation = operation_new(cad_op, (guint)enable);
+    self = operation->pipewire;
+
+    g_message("Requested Bluetooth switch, enable %u", enable);
+
+    if (!self->card) {
+        g_warning("PipeWire isn't ready");
+        operation_fail(operation);
+        return;
+    }
+
+    if (!enable) {
+        destroy_bt_loopbacks(self);
+        operation_complete(operation, TRUE);
+        return;
+    }
+
+    if (!self->bt_card) {
+        g_warning("No bluetooth headset connected");
+        operation_fail(operation);
+        return;
+    }
+
+    bt_profile = find_profile_by_name(self->bt_card, PW_BT_PREFERRED_PROFILE, TRUE);
+    if (bt_profile && bt_profile->index != self->bt_card->active_profile)
+        set_profile(self->bt_card, bt_profile);
+
+    card_profile = find_profile_by_name(self->card, PW_MAIN_CARD_BT_PROFILE, FALSE);
+    if (card_profile && card_profile->index != self->card->active_profile)
+        set_profile(self->card, card_profile);
+
+    operation_sync(operation, bt_loopback_step);
+}
+
+/**
+ * cad_pipewire_find_bt_audio_capabilities:
+ *
+ * Bluetooth headsets are tracked from registry events, this only refreshes
+ * the published state.
+ *
+ * Returns: %G_SOURCE_REMOVE, so it can be used as a #GSourceFunc
+ */
+gboolean cad_pipewire_find_bt_audio_capabilities(void)
+{
+    /* We may be called while the backend is being created */
+    if (default_pipewire)
+        update_bt_state(default_pipewire);
+
+    return G_SOURCE_REMOVE;
+}
+
+CallAudioMode cad_pipewire_get_audio_mode(void)
+{
+    CadPipewire *self = cad_pipewire_get_default();
+    return self->audio_mode;
+}
+
+CallAudioSpeakerState cad_pipewire_get_speaker_state(void)
+{
+    CadPipewire *self = cad_pipewire_get_default();
+    return self->speaker_state;
+}
+
+CallAudioMicState cad_pipewire_get_mic_state(void)
+{
+    CadPipewire *self = cad_pipewire_get_default();
+    return self->mic_state;
+}
+
+CallAudioBluetoothState cad_pipewire_get_bt_audio_state(void)
+{
+    CadPipewire *self = cad_pipewire_get_default();
+    return self->bt_audio;
+}
+
+/******************************************************************************
+ * Connection management
+ *
+ * The PipeWire loop is driven by the GLib main loop through its file
+ * descriptor. When the connection is lost, we reconnect with an exponential
+ * back off, as with PulseAudio.
+ ******************************************************************************/
+
+static gboolean loop_cb(gint fd, GIOCondition condition, gpointer data)
+{
+    CadPipewire *self = data;
+    int res;
+
+    res = pw_loop_iterate(self->loop, 0);
+    if (res < 0 && res != -EINTR)
+        g_warning("Error in PipeWire loop: %s", spa_strerror(res));
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void schedule_reconnect(CadPipewire *self)
+{
+    if (self->reconnect_id)
+        return;
+
+    /*
+     * Reconnect immediately the first time, then back off exponentially
+     * so we don't spin if PipeWire keeps failing.
+     */
+    if (self->reconnect_delay == 0) {
+        self->reconnect_id = g_idle_add(G_SOURCE_FUNC(pipewire_connect), self);
+        self->reconnect_delay = 1;
+    } else {
+        g_debug("reconnecting to PipeWire in %us", self->reconnect_delay);
+        self->reconnect_id = g_timeout_add_seconds(self->reconnect_delay,
+                                                   G_SOURCE_FUNC(pipewire_connect), self);
+        self->reconnect_delay = MIN(self->reconnect_delay * 2, PW_RECONNECT_MAX_DELAY);
+    }
+}
+
+static void core_done(void *data, uint32_t id, int seq)
+{
+    CadPipewire *self = data;
+    CadPipewireOperation *operation = NULL;
+    GList *l;
+
+    if (id != PW_ID_CORE)
+        return;
+
+    if (seq == self->init_seq) {
+        self->reconnect_delay = 0;
+        if (!self->card)
+            g_message("No suitable card found, waiting for new cards...");
+        g_debug("PipeWire is ready");
+        return;
+    }
+
+    for (l = self->pending; l; l = l->next) {
+        CadPipewireOperation *pending = l->data;
+
+        if (pending->seq == seq) {
+            operation = pending;
+            self->pending = g_list_delete_link(self->pending, l);
+            break;
+        }
+    }
+
+    if (!operation)
+        return;
+
+    if (operation->next) {
+        CadPipewireStep next = operation->next;
+
+        operation->next = NULL;
+        next(operation);
+    } else {
+        operation_complete(operation, TRUE);
+    }
+}
+
+/* The core can't be destroyed from its own callbacks */
+static gboolean disconnected_cb(gpointer data)
+{
+    CadPipewire *self = data;
+
+    self->reconnect_id = 0;
+    pipewire_cleanup(self);
+    schedule_reconnect(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void core_error(void *data, uint32_t id, int seq, int res, const char *message)
+{
+    CadPipewire *self = data;
+
+    g_warning("PipeWire error on object %u: %s (%s)", id, message, spa_strerror(res));
+
+    if (id == PW_ID_CORE && res == -EPIPE && !self->reconnect_id)
+        self->reconnect_id = g_idle_add(disconnected_cb, self);
+}
+
+static const struct pw_core_events core_events = {
+    PW_VERSION_CORE_EVENTS,
+    .done = core_done,
+    .error = core_error,
+};
+
+static void pipewire_cleanup(CadPipewire *self)
+{
+    GList *pending = g_steal_pointer(&self->pending);
+    GList *l;
+
+    /* Pending operations will never be completed by the server */
+    for (l = pending; l; l = l->next)
+        operation_complete(l->data, FALSE);
+    g_list_free(pending);
+
+    destroy_bt_loopbacks(self);
+    self->card = NULL;
+    self->bt_card = NULL;
+    g_hash_table_remove_all(self->devices);
+    g_hash_table_remove_all(self->nodes);
+
+    if (self->registry) {
+        spa_hook_remove(&self->registry_listener);
+        pw_proxy_destroy((struct pw_proxy *)self->registry);
+        self->registry = NULL;
+    }
+
+    if (self->core) {
+        spa_hook_remove(&self->core_listener);
+        pw_core_disconnect(self->core);
+        self->core = NULL;
+    }
+}
+
+static gboolean pipewire_connect(CadPipewire *self)
+{
+    self->reconnect_id = 0;
+
+    self->core = pw_context_connect(self->context, NULL, 0);
+    if (!self->core) {
+        g_warning("Unable to connect to PipeWire: %s", g_strerror(errno));
+        schedule_reconnect(self);
+        return G_SOURCE_REMOVE;
+    }
+
+    pw_core_add_listener(self->core, &self->core_listener, &core_events, self);
+
+    self->registry = pw_core_get_registry(self->core, PW_VERSION_REGISTRY, 0);
+    pw_registry_add_listener(self->registry, &self->registry_listener,
+                             &registry_events, self);
+
+    /* We're done initializing once all the globals have been announced */
+    self->init_seq = pw_core_sync(self->core, PW_ID_CORE, 0);
+
+    return G_SOURCE_REMOVE;
+}
+
+/******************************************************************************
+ * GObject base functions
+ ******************************************************************************/
+
+static void constructed(GObject *object)
+{
+    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
+    CadPipewire *self = CAD_PIPEWIRE(object);
+
+    pw_init(NULL, NULL);
+
+    self->loop = pw_loop_new(NULL);
+    if (!self->loop)
+        g_error("Error creating PipeWire loop");
+    pw_loop_enter(self->loop);
+    self->loop_source_id = g_unix_fd_add(pw_loop_get_fd(self->loop), G_IO_IN,
+                                         loop_cb, self);
+
+    self->context = pw_context_new(self->loop,
+                                   pw_properties_new(PW_KEY_APP_NAME, APPLICATION_NAME,
+                                                     PW_KEY_APP_ID, APPLICATION_ID,
+                                                     NULL),
+                                   0);
+    if (!self->context)
+        g_error("Error creating PipeWire context");
+
+    pipewire_connect(self);
+
+    parent_class->constructed(object);
+}
+
+static void dispose(GObject *object)
+{
+    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
+    CadPipewire *self = CAD_PIPEWIRE(object);
+
+    if (self->reconnect_id) {
+        g_source_remove(self->reconnect_id);
+        self->reconnect_id = 0;
+    }
+
+    if (self->devices)
+        pipewire_cleanup(self);
+    g_clear_pointer(&self->devices, g_hash_table_destroy);
+    g_clear_pointer(&self->nodes, g_hash_table_destroy);
+
+    g_clear_pointer(&self->context, pw_context_destroy);
+
+    if (self->loop_source_id) {
+        g_source_remove(self->loop_source_id);
+        self->loop_source_id = 0;
+    }
+
+    if (self->loop) {
+        pw_loop_leave(self->loop);
+        pw_loop_destroy(self->loop);
+        self->loop = NULL;
+        pw_deinit();
+    }
+
+    parent_class->dispose(object);
+}
+
+static void cad_pipewire_class_init(CadPipewireClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->constructed = constructed;
+    object_class->dispose = dispose;
+}
+
+static void cad_pipewire_init(CadPipewire *self)
+{
+    self->manager = G_OBJECT(cad_manager_get_default());
+    self->audio_mode = CALL_AUDIO_MODE_UNKNOWN;
+    self->speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
+    self->mic_state = CALL_AUDIO_MIC_UNKNOWN;
+    self->bt_audio = CALL_AUDIO_BT_UNKNOWN;
+
+    self->devices = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, device_free);
+    self->nodes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, node_free);
+}
+
+CadPipewire *cad_pipewire_get_default(void)
+{
+    if (default_pipewire == NULL) {
+        g_debug("initializing pipewire backend...");
+        default_pipewire = g_object_new(CAD_TYPE_PIPEWIRE, NULL);
+        g_object_add_weak_pointer(G_OBJECT(default_pipewire), (gpointer *)&default_pipewire);
+    }
+
+    return default_pipewire;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+#include "cad-operation.h"
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define CAD_TYPE_PIPEWIRE (cad_pipewire_get_type())
+
+G_DECLARE_FINAL_TYPE(CadPipewire, cad_pipewire, CAD, PIPEWIRE, GObject);
+
+CadPipewire *cad_pipewire_get_default(void);
+void cad_pipewire_select_mode(CallAudioMode mode, CadOperation *op);
+void cad_pipewire_enable_speaker(gboolean enable, CadOperation *op);
+void cad_pipewire_mute_mic(gboolean mute, CadOperation *op);
+void cad_pipewire_prepare_call(gboolean prepare, CadOperation *op);
+void cad_pipewire_enable_bt_audio(gboolean enable, CadOperation *op);
+gboolean cad_pipewire_find_bt_audio_capabilities(void);
+
+CallAudioMode cad_pipewire_get_audio_mode(void);
+CallAudioSpeakerState cad_pipewire_get_speaker_state(void);
+CallAudioMicState cad_pipewire_get_mic_state(void);
+CallAudioBluetoothState cad_pipewire_get_bt_audio_state(void);
+
+G_END_DECLS
@@ -8,8 +8,12 @@
 #include <pulse/def.h>
 #define G_LOG_DOMAIN "callaudiod-pulse"
 
+#include "cad-card.h"
 #include "cad-manager.h"
 #include "cad-pulse.h"
+#include "cad-snapshot.h"
+#include "cad-trace.h"
+#include "cad-ucm.h"
 
 #include <glib/gi18n.h>
 #include <glib-object.h>
@@ -24,15 +28,27 @@
 #define APPLICATION_ID   "org.mobian-project.CallAudio"
 
 #define SINK_CLASS "sound"
-#define CARD_BUS_PATH_PREFIX "platform-"
-#define CARD_FORM_FACTOR "internal"
-#define CARD_MODEM_CLASS "modem"
-#define CARD_MODEM_NAME "Modem"
 #define PA_BT_DRIVER "module-bluez5-device.c"
 #define PA_BT_PREFERRED_PROFILE "handsfree_head_unit"
 #define PA_BT_PREFERRED_PORT "Bluetooth"
 #define PA_MAIN_CARD_BT_PROFILE "Voice Call BT"
 
+#define PA_RECONNECT_MAX_DELAY 64
+#define PA_EC_MODULE "module-echo-cancel"
+#define PA_EC_SINK_NAME "callaudiod_ec_sink"
+#define PA_EC_SOURCE_NAME "callaudiod_ec_source"
+#define PA_SIDETONE_NAME "callaudiod-sidetone"
+#define SIDETONE_LATENCY_MSEC 10
+#define SIDETONE_MAX_LATENCY (20 * PA_USEC_PER_MSEC)
+#define SIDETONE_CHECK_DELAY 2
+#define METER_RATE 50          /* peaks per second computed by PulseAudio */
+#define WATCHDOG_METER_RATE 1  /* same, when levels are only used by the watchdog */
+#define METER_SIGNAL_RATE 10   /* Levels signals per second */
+#define METER_REOPEN_DELAY 1   /* seconds */
+#define WATCHDOG_INTERVAL 5
+#define WATCHDOG_SILENCE_TIMEOUT (10 * G_USEC_PER_SEC)
+#define CALL_PLAN_TIMEOUT 120
+
 struct _CadPulse
 {
     GObject parent_instance;
@@ -41,10 +57,15 @@ struct _CadPulse
 
     pa_glib_mainloop  *loop;
     pa_context        *ctx;
+    guint              reconnect_id;
+    guint              reconnect_delay;
+    gboolean           is_pipewire;
 
     int card_id;
     int sink_id;
     int source_id;
+    gchar *sink_name;
+    gchar *source_name;
     
     int bluetooth_source_port_id;
     int bluetooth_sink_port_id;
@@ -55,10 +76,21 @@ struct _CadPulse
     int internal_source_id;
 
     int external_established_loopback;
+    /* Indexes of the loopback modules we loaded for bluetooth calls */
+    guint32 bt_loopback_modules[2];
+    /* Sample rates on both sides of the bluetooth loopbacks */
+    guint32 external_sink_rate;
+    guint32 external_source_rate;
+    guint32 internal_sink_rate;
+    guint32 internal_source_rate;
+    gboolean resampling;
     gchar *external_card_name;
     gboolean external_card_connected;
 
     gboolean has_voice_profile;
+    /* Route plan computed by cad_pulse_prepare_call() */
+    gchar *planned_profile;
+    guint call_plan_timeout_id;
     gchar *speaker_port;
     gchar *earpiece_port;
 
@@ -69,6 +101,49 @@ struct _CadPulse
     CallAudioSpeakerState speaker_state;
     CallAudioMicState mic_state;
     CallAudioBluetoothState bt_audio;
+
+    /* Operations waiting for PulseAudio, failed if the connection is lost */
+    GList *operations;
+
+    /* Names of the devices we suspended while in call mode */
+    gboolean suspend_unused;
+    GHashTable *suspended_sinks;
+    GHashTable *suspended_sources;
+
+    /* Echo cancellation and noise suppression for speakerphone calls */
+    gboolean echo_cancel;
+    guint32 echo_cancel_module;
+    gboolean echo_cancel_pending;
+    gint64 echo_cancel_start;
+
+    /* Sidetone loopback, level in percent (0 when disabled) */
+    guint sidetone_level;
+    guint32 sidetone_module;
+    gboolean sidetone_pending;
+    guint sidetone_check_id;
+    pa_usec_t sidetone_latency;
+
+    /* Call levels metering */
+    gboolean meter;
+    pa_stream *mic_meter;
+    pa_stream *output_meter;
+    gfloat mic_peak;
+    gfloat output_peak;
+    guint meter_rate;
+    gboolean levels_idle;
+    guint meter_id;
+    guint meter_reopen_id;
+    gint64 mic_last_sound;
+    gint64 output_last_sound;
+
+    /* In-call route watchdog */
+    gboolean watchdog;
+    gboolean watchdog_reapply;
+    guint watchdog_id;
+    guint watchdog_loopbacks;
+    const gchar *watchdog_cause;
+    gchar *watchdog_details;
+    const gchar *watchdog_reported;
 };
 
 G_DEFINE_TYPE(CadPulse, cad_pulse, G_TYPE_OBJECT);
@@ -77,11 +152,22 @@ typedef struct _CadPulseOperation {
     CadPulse *pulse;
     CadOperation *op;
     guint value;
+    gint64 start;
+    /* Whether the operation uses a route plan from cad_pulse_prepare_call() */
+    gboolean prepared;
+    /* Whether the operation delays state publishing until it completes */
+    gboolean holds_state;
+    /* Whether a card or sink info reply matched our card or sink */
+    gboolean matched;
+    /* Whether a request completing the operation has been sent */
+    gboolean queued;
+    /* Active profile of the card, as found by a card info query */
+    gchar *profile;
 } CadPulseOperation;
 
 static void pulseaudio_cleanup(CadPulse *self);
 static gboolean pulseaudio_connect(CadPulse *self);
-static gboolean init_pulseaudio_objects(CadPulse *self);
+static void operation_complete_cb(pa_context *ctx, int success, void *data);
 
 /******************************************************************************
  * Source management
@@ -135,6 +221,8 @@ static void change_source_info(pa_context *ctx, const pa_source_info *info, int
         return;
     }
 
+    cad_trace_source_info(info);
+
     if (info->index != self->source_id)
         return;
 
@@ -177,6 +265,8 @@ static void process_new_source(CadPulse *self, const pa_source_info *info)
         return;
 
     self->source_id = info->index;
+    g_free(self->source_name);
+    self->source_name = g_strdup(info->name);
     if (self->source_ports)
         g_hash_table_destroy(self->source_ports);
     self->source_ports = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
@@ -208,6 +298,8 @@ static void init_source_info(pa_context *ctx, const pa_source_info *info, int eo
         return;
     }
 
+    cad_trace_source_info(info);
+
     process_new_source(self, info);
     if (self->source_id < 0 || self->source_id != info->index)
         return;
@@ -273,6 +365,14 @@ static const gchar *get_available_sink_port(const pa_sink_info *sink, const gcha
     return NULL;
 }
 
+/*
+ * Voice call modes use any output but the speaker, unless explicitly requested
+ */
+static gboolean mode_excludes_speaker(CallAudioMode mode)
+{
+    return mode == CALL_AUDIO_MODE_CALL || mode == CALL_AUDIO_MODE_VOIP;
+}
+
 static void change_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
 {
     CadPulse *self = data;
@@ -289,6 +389,8 @@ static void change_sink_info(pa_context *ctx, const pa_sink_info *info, int eol,
         return;
     }
 
+    cad_trace_sink_info(info);
+
     if (info->index != self->sink_id)
         return;
 
@@ -328,6 +430,8 @@ static void process_new_sink(CadPulse *self, const pa_sink_info *info)
     if (info->card != self->card_id || self->sink_id != -1)
         return;
     self->sink_id = info->index;
+    g_free(self->sink_name);
+    self->sink_name = g_strdup(info->name);
     g_message("Sink ID: %i", self->sink_id);
     if (self->sink_ports)
         g_hash_table_destroy(self->sink_ports);
@@ -383,6 +487,8 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
         return;
     }
 
+    cad_trace_sink_info(info);
+
     process_new_sink(self, info);
     if (self->sink_id < 0 || self->sink_id != info->index)
         return;
@@ -396,6 +502,7 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
 
         switch (self->audio_mode) {
         case CALL_AUDIO_MODE_CALL:
+        case CALL_AUDIO_MODE_VOIP:
             if (g_strcmp0(info->active_port->name, self->speaker_port) == 0) {
                 self->speaker_state = CALL_AUDIO_SPEAKER_ON;
                 g_object_set(self->manager, "speaker-state", self->speaker_state, NULL);
@@ -440,7 +547,15 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
         g_object_set(self->manager, "speaker-state", self->speaker_state, NULL);
     }
 
-    target_port = get_available_sink_port(info, NULL);
+    /*
+     * The sink may be re-created by a profile change during a call, keep
+     * routing audio away from the speaker in this case
+     */
+    if (mode_excludes_speaker(self->audio_mode) &&
+        self->speaker_state != CALL_AUDIO_SPEAKER_ON)
+        target_port = get_available_sink_port(info, self->speaker_port);
+    else
+        target_port = get_available_sink_port(info, NULL);
     if (target_port) {
         g_debug("  Using sink port '%s'", target_port);
         op = pa_context_set_sink_port_by_index(ctx, self->sink_id,
@@ -450,294 +565,1187 @@ static void init_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, v
     }
 }
 
+static gboolean pulse_is_ready(CadPulse *self)
+{
+    return self->ctx && pa_context_get_state(self->ctx) == PA_CONTEXT_READY;
+}
+
 /******************************************************************************
- * Card management
+ * Unused devices management
  *
- * The following functions take care of gathering information about the default
- * sound card
+ * When enabled, sinks and sources which aren't part of the call route are
+ * suspended while in call mode, so they don't keep timers and DSP processing
+ * running. The devices we suspended are saved, so we can resume them even
+ * after a daemon or PulseAudio restart.
  ******************************************************************************/
 
-static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+static gboolean is_call_device(CadPulse *self, const gchar *name, guint32 card,
+                               guint32 index, int route_id)
 {
-    CadPulse *self = data;
-    pa_operation *op;
-    const gchar *prop;
-    gboolean has_speaker = FALSE;
-    gboolean has_earpiece = FALSE;
-    guint i;
+    if (route_id >= 0 && index == (guint32)route_id)
+        return TRUE;
+    if (strcmp(name, PA_EC_SINK_NAME) == 0 || strcmp(name, PA_EC_SOURCE_NAME) == 0)
+        return TRUE;
+    if (card == PA_INVALID_INDEX)
+        return FALSE;
 
-    if (eol != 0) {
-        if (self->card_id < 0) {
-            g_critical("No suitable card found, retrying in 3s...");
-            g_timeout_add_seconds(3, G_SOURCE_FUNC(init_pulseaudio_objects), self);
-        }
-        return;
-    }
+    /*
+     * Profile switches re-create the internal card's devices, so we can't
+     * rely on their indexes. The bluetooth headset may be switched to at any
+     * time during the call, so leave it alone too.
+     */
+    if (self->card_id >= 0 && card == (guint32)self->card_id)
+        return TRUE;
 
-    if (!info) {
-        g_critical("PA returned no card info (eol=%d)", eol);
-        return;
+    return self->external_card_id >= 0 && card == (guint32)self->external_card_id;
+}
+
+static gboolean update_suspended_device(CadPulse *self, GHashTable *suspended,
+                                        const gchar *name, gboolean unused)
+{
+    if (self->suspend_unused && self->audio_mode == CALL_AUDIO_MODE_CALL && unused) {
+        if (g_hash_table_add(suspended, g_strdup(name)))
+            g_debug("suspending unused device '%s'", name);
+        /* Suspend again even if known, PulseAudio may have been restarted */
+        return TRUE;
     }
 
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_BUS_PATH);
-    if (prop && !g_str_has_prefix(prop, CARD_BUS_PATH_PREFIX))
-        return;
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_FORM_FACTOR);
-    if (prop && strcmp(prop, CARD_FORM_FACTOR) != 0)
-        return;
-    prop = pa_proplist_gets(info->proplist, "alsa.card_name");
-    if (prop && strcmp(prop, CARD_MODEM_NAME) == 0)
-        return;
-    prop = pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS);
-    if (prop && strcmp(prop, CARD_MODEM_CLASS) == 0)
-        return;
+    if (g_hash_table_remove(suspended, name))
+        g_debug("resuming device '%s'", name);
 
-    for (i = 0; i < info->n_ports; i++) {
-        pa_card_port_info *port = info->ports[i];
+    return FALSE;
+}
 
-        if (strstr(port->name, SND_USE_CASE_DEV_SPEAKER) != NULL) {
-            has_speaker = TRUE;
-        } else if (strstr(port->name, SND_USE_CASE_DEV_EARPIECE) != NULL ||
-                   strstr(port->name, SND_USE_CASE_DEV_HANDSET)  != NULL) {
-            has_earpiece = TRUE;
-        }
-    }
-    if (!has_speaker || !has_earpiece) {
-        g_message("Card '%s' lacks speaker and/or earpiece port, skipping...",
-                  info->name);
-        return;
-    }
+static void save_suspended(CadPulse *self)
+{
+    g_autoptr(GError) err = NULL;
 
-    self->card_id = info->index;
+    if (!cad_snapshot_save_suspended(self->suspended_sinks, self->suspended_sources, &err))
+        g_warning("Unable to save suspended devices: %s", err->message);
+}
 
-    g_debug("CARD: idx=%u name='%s'", info->index, info->name);
+static void update_suspended_sink(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    gboolean known;
+    gboolean suspend;
+    pa_operation *op;
 
-    for (i = 0; i < info->n_profiles; i++) {
-        pa_card_profile_info2 *profile = info->profiles2[i];
+    if (eol != 0) {
+        if (eol > 0)
+            save_suspended(self);
+        return;
+    }
 
-        if (strstr(profile->name, SND_USE_CASE_VERB_VOICECALL) != NULL) {
-            self->has_voice_profile = TRUE;
-            if (info->active_profile2 == profile)
-                self->audio_mode = CALL_AUDIO_MODE_CALL;
-            else
-                self->audio_mode = CALL_AUDIO_MODE_DEFAULT;
-            break;
-        }
+    if (!info) {
+        g_critical("PA returned no sink info (eol=%d)", eol);
+        return;
     }
 
-    // We were able determine the current mode, set the corresponding D-Bus property
-    if (self->audio_mode != CALL_AUDIO_MODE_UNKNOWN)
-        g_object_set(self->manager, "audio-mode", self->audio_mode, NULL);
+    cad_trace_sink_info(info);
 
-    g_debug("CARD:   %s voice profile", self->has_voice_profile ? "has" : "doesn't have");
+    known = g_hash_table_contains(self->suspended_sinks, info->name);
+    suspend = update_suspended_device(self, self->suspended_sinks, info->name,
+                                      !is_call_device(self, info->name, info->card,
+                                                      info->index, self->sink_id));
+    if (!suspend && !known)
+        return;
 
-    /* Found a suitable card, let's prepare the sink/source */
-    op = pa_context_get_sink_info_list(self->ctx, init_sink_info, self);
-    if (op)
-        pa_operation_unref(op);
-    op = pa_context_get_source_info_list(self->ctx, init_source_info, self);
+    op = pa_context_suspend_sink_by_index(ctx, info->index, suspend, NULL, NULL);
     if (op)
         pa_operation_unref(op);
 }
 
-/******************************************************************************
- * PulseAudio management
- *
- * The following functions configure the PulseAudio connection and monitor the
- * state of PulseAudio objects
- ******************************************************************************/
-
-static void init_module_info(pa_context *ctx, const pa_module_info *info, int eol, void *data)
+static void update_suspended_source(pa_context *ctx, const pa_source_info *info, int eol, void *data)
 {
+    CadPulse *self = data;
+    gboolean known;
+    gboolean suspend;
     pa_operation *op;
 
-    if (eol != 0)
+    if (eol != 0) {
+        if (eol > 0)
+            save_suspended(self);
         return;
+    }
 
     if (!info) {
-        g_critical("PA returned no module info (eol=%d)", eol);
+        g_critical("PA returned no source info (eol=%d)", eol);
         return;
     }
 
-    g_debug("MODULE: idx=%u name='%s'", info->index, info->name);
+    cad_trace_source_info(info);
 
-    if (strcmp(info->name, "module-switch-on-port-available") == 0) {
-        g_debug("MODULE: unloading '%s'", info->name);
-        op = pa_context_unload_module(ctx, info->index, NULL, NULL);
-        if (op)
-            pa_operation_unref(op);
-    }
+    /* Monitor sources follow the state of their sink */
+    if (info->monitor_of_sink != PA_INVALID_INDEX)
+        return;
+
+    known = g_hash_table_contains(self->suspended_sources, info->name);
+    suspend = update_suspended_device(self, self->suspended_sources, info->name,
+                                      !is_call_device(self, info->name, info->card,
+                                                      info->index, self->source_id));
+    if (!suspend && !known)
+        return;
+
+    op = pa_context_suspend_source_by_index(ctx, info->index, suspend, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
 }
 
-static gboolean init_pulseaudio_objects(CadPulse *self)
+/*
+ * Suspend unused devices when in call mode, resume the ones we suspended
+ * otherwise
+ */
+static void update_suspended(CadPulse *self)
 {
     pa_operation *op;
 
-    self->card_id = self->sink_id = self->source_id = -1;
-    self->external_card_id = self->external_sink_id = self->external_source_id = -1;
-    self->sink_ports = self->source_ports = NULL;
+    if (!self->suspend_unused && g_hash_table_size(self->suspended_sinks) == 0 &&
+        g_hash_table_size(self->suspended_sources) == 0)
+        return;
 
-    op = pa_context_get_card_info_list(self->ctx, init_card_info, self);
+    if (!pulse_is_ready(self))
+        return;
+
+    op = pa_context_get_sink_info_list(self->ctx, update_suspended_sink, self);
     if (op)
         pa_operation_unref(op);
-    op = pa_context_get_module_info_list(self->ctx, init_module_info, self);
+    op = pa_context_get_source_info_list(self->ctx, update_suspended_source, self);
     if (op)
         pa_operation_unref(op);
+}
 
-    return G_SOURCE_REMOVE;
+/******************************************************************************
+ * Sample rates management
+ *
+ * Bluetooth calls loop audio back between the headset, running at 8 or 16 kHz,
+ * and the internal card. The following functions keep track of the sample
+ * rates on both sides, so we know whether the loopbacks have to resample.
+ ******************************************************************************/
+
+static gboolean rates_differ(guint32 rate1, guint32 rate2)
+{
+    return rate1 > 0 && rate2 > 0 && rate1 != rate2;
 }
 
-static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint32_t idx, void *data)
+static void update_resampling(CadPulse *self)
 {
-    CadPulse *self = data;
-    pa_subscription_event_type_t kind = type & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
-    pa_operation *op = NULL;
+    gboolean resampling = FALSE;
 
-    switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
-    case PA_SUBSCRIPTION_EVENT_SINK:
-        if (idx == self->sink_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
-            g_debug("sink %u removed", idx);
-            self->sink_id = -1;
-            g_hash_table_destroy(self->sink_ports);
-            self->sink_ports = NULL;
-        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
-            g_debug("new sink %u", idx);
-            op = pa_context_get_sink_info_by_index(ctx, idx, init_sink_info, self);
-            if (op)
-                pa_operation_unref(op);
-        }
-        break;
-    case PA_SUBSCRIPTION_EVENT_SOURCE:
-        if (idx == self->source_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
-            g_debug("source %u removed", idx);
-            self->source_id = -1;
-            g_hash_table_destroy(self->source_ports);
-            self->source_ports = NULL;
-        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
-            g_debug("new source %u", idx);
-            op = pa_context_get_source_info_by_index(ctx, idx, init_source_info, self);
-            if (op)
-                pa_operation_unref(op);
-        }
-        break;
-    case PA_SUBSCRIPTION_EVENT_CARD:
-        if (idx == self->card_id && kind == PA_SUBSCRIPTION_EVENT_CHANGE) {
-            g_debug("card %u changed", idx);
-            if (self->sink_id != -1) {
-                op = pa_context_get_sink_info_by_index(ctx, self->sink_id,
-                                                       change_sink_info, self);
-                if (op)
-                    pa_operation_unref(op);
-            }
-            if (self->source_id != -1) {
-                op = pa_context_get_source_info_by_index(ctx, self->source_id,
-                                                         change_source_info, self);
-                if (op)
-                    pa_operation_unref(op);
-            }
-        }
-        break;
-    default:
-        break;
+    if (self->external_established_loopback) {
+        resampling = rates_differ(self->external_source_rate, self->internal_sink_rate) ||
+                     rates_differ(self->internal_source_rate, self->external_sink_rate);
     }
+
+    if (resampling == self->resampling)
+        return;
+
+    self->resampling = resampling;
+    g_message("Bluetooth call route %s resampling (headset %u/%u Hz, internal card %u/%u Hz)",
+              resampling ? "is" : "isn't", self->external_sink_rate,
+              self->external_source_rate, self->internal_sink_rate,
+              self->internal_source_rate);
+    cad_manager_route_changed(CAD_MANAGER(self->manager));
 }
 
-static void pulse_state_cb(pa_context *ctx, void *data)
+static void update_sink_rate(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
 {
     CadPulse *self = data;
-    pa_context_state_t state;
 
-    state = pa_context_get_state(ctx);
-    switch (state) {
-    case PA_CONTEXT_UNCONNECTED:
-    case PA_CONTEXT_CONNECTING:
-    case PA_CONTEXT_AUTHORIZING:
-    case PA_CONTEXT_SETTING_NAME:
-        g_debug("PA not ready");
-        break;
-    case PA_CONTEXT_FAILED:
-        g_critical("Error in PulseAudio context: %s", pa_strerror(pa_context_errno(ctx)));
-        pulseaudio_cleanup(self);
-        g_idle_add(G_SOURCE_FUNC(pulseaudio_connect), self);
-        break;
-    case PA_CONTEXT_TERMINATED:
-    case PA_CONTEXT_READY:
-        pa_context_set_subscribe_callback(ctx, changed_cb, self);
-        pa_context_subscribe(ctx,
-                             PA_SUBSCRIPTION_MASK_SINK  | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_CARD,
-                             NULL, self);
-        g_debug("PA is ready, initializing cards list");
-        init_pulseaudio_objects(self);
-        break;
-    default:
-        g_return_if_reached();
-    }
-}
+    if (eol != 0)
+        return;
 
-static void pulseaudio_cleanup(CadPulse *self)
-{
-    if (self->ctx) {
-        pa_context_disconnect(self->ctx);
-        pa_context_unref(self->ctx);
-        self->ctx = NULL;
+    if (!info) {
+        g_critical("PA returned no sink info (eol=%d)", eol);
+        return;
     }
+
+    cad_trace_sink_info(info);
+
+    if (info->index == (guint32)self->external_sink_id)
+        self->external_sink_rate = info->sample_spec.rate;
+    else if (info->index == (guint32)self->internal_sink_id)
+        self->internal_sink_rate = info->sample_spec.rate;
+
+    update_resampling(self);
 }
 
-static gboolean pulseaudio_connect(CadPulse *self)
+static void update_source_rate(pa_context *ctx, const pa_source_info *info, int eol, void *data)
 {
-    pa_proplist *props;
-    int err;
+    CadPulse *self = data;
+
+    if (eol != 0)
+        return;
 
-    /* Meta data */
-    props = pa_proplist_new();
-    g_assert(props != NULL);
+    if (!info) {
+        g_critical("PA returned no source info (eol=%d)", eol);
+        return;
+    }
 
-    err = pa_proplist_sets(props, PA_PROP_APPLICATION_NAME, APPLICATION_NAME);
-    err = pa_proplist_sets(props, PA_PROP_APPLICATION_ID, APPLICATION_ID);
+    cad_trace_source_info(info);
 
-    if (!self->loop)
-        self->loop = pa_glib_mainloop_new(NULL);
-    if (!self->loop)
-        g_error ("Error creating PulseAudio main loop");
+    if (info->index == (guint32)self->external_source_id)
+        self->external_source_rate = info->sample_spec.rate;
+    else if (info->index == (guint32)self->internal_source_id)
+        self->internal_source_rate = info->sample_spec.rate;
 
-    if (!self->ctx)
-        self->ctx = pa_context_new(pa_glib_mainloop_get_api(self->loop), APPLICATION_NAME);
-    if (!self->ctx)
-        g_error ("Error creating PulseAudio context");
+    update_resampling(self);
+}
 
-    pa_context_set_state_callback(self->ctx, (pa_context_notify_cb_t)pulse_state_cb, self);
-    err = pa_context_connect(self->ctx, NULL, PA_CONTEXT_NOFAIL, 0);
-    if (err < 0)
-        g_error ("Error connecting to PulseAudio context: %s", pa_strerror(err));
+/*
+ * Run the loopback at the headset's rate: capturing from or playing to the
+ * headset then never needs resampling, and PulseAudio can switch the internal
+ * card to the same rate if the hardware supports it (with avoid-resampling
+ * enabled).
+ */
+static gchar *get_loopback_args(int source, int sink, guint32 rate)
+{
+    if (rate > 0)
+        return g_strdup_printf("source=%i sink=%i rate=%u", source, sink, rate);
 
-    return G_SOURCE_REMOVE;
+    return g_strdup_printf("source=%i sink=%i", source, sink);
 }
 
 /******************************************************************************
- * GObject base functions
+ * Card management
+ *
+ * The following functions take care of gathering information about the default
+ * sound card
  ******************************************************************************/
 
-static void constructed(GObject *object)
+static gboolean card_is_internal(const pa_card_info *info)
 {
-    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
-    CadPulse *self = CAD_PULSE(object);
-
-    pulseaudio_connect(self);
-
-    parent_class->constructed(object);
+    return cad_card_is_internal(pa_proplist_gets(info->proplist, PA_PROP_DEVICE_BUS_PATH),
+                                pa_proplist_gets(info->proplist, PA_PROP_DEVICE_FORM_FACTOR),
+                                pa_proplist_gets(info->proplist, "alsa.card_name"),
+                                pa_proplist_gets(info->proplist, PA_PROP_DEVICE_CLASS));
 }
 
-
-static void dispose(GObject *object)
+static gboolean card_has_call_ports(const pa_card_info *info)
 {
-    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
+    gboolean has_speaker = FALSE;
+    gboolean has_earpiece = FALSE;
+    guint i;
+
+    for (i = 0; i < info->n_ports; i++) {
+        if (cad_card_port_is_speaker(info->ports[i]->name))
+            has_speaker = TRUE;
+        else if (cad_card_port_is_earpiece(info->ports[i]->name))
+            has_earpiece = TRUE;
+    }
+
+    return has_speaker && has_earpiece;
+}
+
+/*
+ * Returns the card's voice call profile, or NULL if it doesn't have one
+ */
+static pa_card_profile_info2 *card_get_voice_profile(const pa_card_info *info)
+{
+    guint i;
+
+    for (i = 0; i < info->n_profiles; i++) {
+        if (cad_card_profile_is_voice(info->profiles2[i]->name))
+            return info->profiles2[i];
+    }
+
+    return NULL;
+}
+
+static void init_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    pa_card_profile_info2 *voice_profile;
+    pa_operation *op;
+
+    if (eol != 0) {
+        /*
+         * Don't poll for new cards: changed_cb will query any card added
+         * later on, so we don't wake up periodically on devices where no
+         * suitable card will ever show up.
+         */
+        if (self->card_id < 0)
+            g_message("No suitable card found, waiting for new cards...");
+        return;
+    }
+
+    if (!info) {
+        g_critical("PA returned no card info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_card_info(info);
+
+    if (!card_is_internal(info))
+        return;
+
+    if (!card_has_call_ports(info)) {
+        g_message("Card '%s' lacks speaker and/or earpiece port, skipping...",
+                  info->name);
+        return;
+    }
+
+    self->card_id = info->index;
+
+    g_debug("CARD: idx=%u name='%s'", info->index, info->name);
+
+    voice_profile = card_get_voice_profile(info);
+    if (voice_profile) {
+        self->has_voice_profile = TRUE;
+        if (info->active_profile2 == voice_profile)
+            self->audio_mode = CALL_AUDIO_MODE_CALL;
+        else
+            self->audio_mode = CALL_AUDIO_MODE_DEFAULT;
+    }
+
+    // We were able determine the current mode, set the corresponding D-Bus property
+    if (self->audio_mode != CALL_AUDIO_MODE_UNKNOWN)
+        g_object_set(self->manager, "audio-mode", self->audio_mode, NULL);
+
+    g_debug("CARD:   %s voice profile", self->has_voice_profile ? "has" : "doesn't have");
+
+    /* Found a suitable card, let's prepare the sink/source */
+    op = pa_context_get_sink_info_list(self->ctx, init_sink_info, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_source_info_list(self->ctx, init_source_info, self);
+    if (op)
+        pa_operation_unref(op);
+
+    /*
+     * Requests are answered in order, so the mode and route are known by the
+     * time we check for devices to suspend or resume
+     */
+    update_suspended(self);
+}
+
+/******************************************************************************
+ * Levels metering
+ *
+ * When enabled, callaudiod monitors the levels of the call source and of the
+ * sink's monitor while in call mode, and publishes them through the Levels
+ * D-Bus signal, so clients don't have to open their own monitoring streams.
+ * Peak detection is performed by PulseAudio itself: at METER_RATE Hz with
+ * PA_STREAM_PEAK_DETECT, each sample we read is the peak of the previous
+ * period, so we only keep the highest one until the next signal.
+ * The watchdog only needs to know when sound was last heard: when levels
+ * aren't published, the streams run at WATCHDOG_METER_RATE Hz instead and
+ * no signal timer is needed.
+ * Streams die when the device they're connected to goes away (e.g. when the
+ * card profile changes), they're reopened after METER_REOPEN_DELAY seconds.
+ ******************************************************************************/
+
+static void meter_read_cb(pa_stream *stream, size_t nbytes, void *data)
+{
+    CadPulse *self = data;
+    gboolean is_mic = stream == self->mic_meter;
+    gfloat *peak = is_mic ? &self->mic_peak : &self->output_peak;
+    gboolean sound = FALSE;
+    const void *buffer;
+    size_t length;
+    size_t i;
+
+    while (pa_stream_readable_size(stream) > 0) {
+        if (pa_stream_peek(stream, &buffer, &length) < 0) {
+            g_warning("Unable to read levels: %s",
+                      pa_strerror(pa_context_errno(pa_stream_get_context(stream))));
+            return;
+        }
+        if (length == 0)
+            return;
+
+        /* buffer is NULL when there's a hole in the stream */
+        if (buffer) {
+            const gfloat *samples = buffer;
+
+            for (i = 0; i < length / sizeof(gfloat); i++) {
+                if (samples[i] > *peak)
+                    *peak = samples[i];
+                if (samples[i] > 0.0f)
+                    sound = TRUE;
+            }
+        }
+
+        pa_stream_drop(stream);
+    }
+
+    /* Used by the watchdog to detect dead air */
+    if (sound) {
+        if (is_mic)
+            self->mic_last_sound = g_get_monotonic_time();
+        else
+            self->output_last_sound = g_get_monotonic_time();
+    }
+}
+
+static void meter_state_cb(pa_stream *stream, void *data);
+
+static pa_stream *create_meter(CadPulse *self, const gchar *name, const gchar *device)
+{
+    pa_sample_spec spec = {
+        .format = PA_SAMPLE_FLOAT32NE,
+        .rate = self->meter_rate,
+        .channels = 1,
+    };
+    pa_buffer_attr attr = {
+        .maxlength = (uint32_t)-1,
+        .tlength = (uint32_t)-1,
+        .prebuf = (uint32_t)-1,
+        .minreq = (uint32_t)-1,
+        .fragsize = sizeof(gfloat),
+    };
+    pa_stream *stream;
+
+    stream = pa_stream_new(self->ctx, name, &spec, NULL);
+    if (!stream) {
+        g_warning("Unable to create '%s' stream: %s", name,
+                  pa_strerror(pa_context_errno(self->ctx)));
+        return NULL;
+    }
+
+    pa_stream_set_read_callback(stream, meter_read_cb, self);
+    pa_stream_set_state_callback(stream, meter_state_cb, self);
+    if (pa_stream_connect_record(stream, device, &attr,
+                                 PA_STREAM_PEAK_DETECT | PA_STREAM_ADJUST_LATENCY) < 0) {
+        g_warning("Unable to connect '%s' stream: %s", name,
+                  pa_strerror(pa_context_errno(self->ctx)));
+        pa_stream_unref(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+static void destroy_meter(pa_stream **stream)
+{
+    if (!*stream)
+        return;
+
+    pa_stream_set_read_callback(*stream, NULL, NULL);
+    pa_stream_set_state_callback(*stream, NULL, NULL);
+    pa_stream_disconnect(*stream);
+    g_clear_pointer(stream, pa_stream_unref);
+}
+
+/*
+ * Create the missing streams. Returns TRUE if both streams exist.
+ */
+static gboolean open_meters(CadPulse *self)
+{
+    if (!self->mic_meter)
+        self->mic_meter = create_meter(self, "Microphone level", NULL);
+    if (!self->output_meter)
+        self->output_meter = create_meter(self, "Output level", "@DEFAULT_MONITOR@");
+
+    return self->mic_meter && self->output_meter;
+}
+
+static gboolean meter_reopen_cb(gpointer data)
+{
+    CadPulse *self = data;
+
+    if (!open_meters(self))
+        return G_SOURCE_CONTINUE;
+
+    self->meter_reopen_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_meter_reopen(CadPulse *self)
+{
+    if (!self->meter_reopen_id)
+        self->meter_reopen_id = g_timeout_add_seconds(METER_REOPEN_DELAY,
+                                                      meter_reopen_cb, self);
+}
+
+/*
+ * Levels are only meaningful while the stream is connected, the watchdog
+ * relies on this to tell actual silence from a dead stream.
+ */
+static gboolean meter_is_alive(pa_stream *stream)
+{
+    return stream && pa_stream_get_state(stream) == PA_STREAM_READY;
+}
+
+static void meter_state_cb(pa_stream *stream, void *data)
+{
+    CadPulse *self = data;
+    pa_stream **meter;
+
+    /* This is also called while the stream is being connected */
+    if (stream == self->mic_meter)
+        meter = &self->mic_meter;
+    else if (stream == self->output_meter)
+        meter = &self->output_meter;
+    else
+        return;
+
+    switch (pa_stream_get_state(stream)) {
+    case PA_STREAM_UNCONNECTED:
+    case PA_STREAM_CREATING:
+        break;
+    case PA_STREAM_READY:
+        /* Don't count the time the stream was down as silence */
+        if (meter == &self->mic_meter)
+            self->mic_last_sound = g_get_monotonic_time();
+        else
+            self->output_last_sound = g_get_monotonic_time();
+        break;
+    case PA_STREAM_FAILED:
+    case PA_STREAM_TERMINATED:
+        g_debug("%s level stream closed, reopening it",
+                meter == &self->mic_meter ? "microphone" : "output");
+        /* libpulse holds a reference to the stream during the callback */
+        destroy_meter(meter);
+        schedule_meter_reopen(self);
+        break;
+    default:
+        g_return_if_reached();
+    }
+}
+
+static gboolean meter_cb(gpointer data)
+{
+    CadPulse *self = data;
+    gboolean idle = self->mic_peak == 0.0f && self->output_peak == 0.0f;
+
+    /* Only report silence once */
+    if (!idle || !self->levels_idle) {
+        call_audio_dbus_call_audio_emit_levels(CALL_AUDIO_DBUS_CALL_AUDIO(self->manager),
+                                               self->mic_peak, self->output_peak);
+    }
+
+    self->levels_idle = idle;
+    self->mic_peak = 0.0f;
+    self->output_peak = 0.0f;
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void stop_meter(CadPulse *self)
+{
+    if (self->meter_rate) {
+        g_debug("stopping levels metering");
+        self->meter_rate = 0;
+    }
+    if (self->meter_id) {
+        g_source_remove(self->meter_id);
+        self->meter_id = 0;
+    }
+    if (self->meter_reopen_id) {
+        g_source_remove(self->meter_reopen_id);
+        self->meter_reopen_id = 0;
+    }
+
+    destroy_meter(&self->mic_meter);
+    destroy_meter(&self->output_meter);
+}
+
+/*
+ * Start metering when entering call mode, stop when leaving it. Streams are
+ * connected to the default source and sink monitor, so they follow the call
+ * route (including the echo cancellation filter, if any). Levels are also
+ * used by the watchdog, even if they aren't published. Streams are reopened
+ * at the right rate when publishing is toggled during a call.
+ */
+static void update_meter(CadPulse *self)
+{
+    gboolean needed = (self->meter || self->watchdog) && pulse_is_ready(self) &&
+                      (self->audio_mode == CALL_AUDIO_MODE_CALL ||
+                       self->audio_mode == CALL_AUDIO_MODE_VOIP);
+    guint rate = self->meter ? METER_RATE : WATCHDOG_METER_RATE;
+
+    if (!needed) {
+        stop_meter(self);
+        return;
+    }
+
+    if (self->meter_rate == rate)
+        return;
+
+    stop_meter(self);
+    g_debug("starting levels metering at %u Hz", rate);
+    self->meter_rate = rate;
+    self->mic_peak = self->output_peak = 0.0f;
+    self->levels_idle = FALSE;
+    self->mic_last_sound = self->output_last_sound = g_get_monotonic_time();
+    if (!open_meters(self))
+        schedule_meter_reopen(self);
+    if (self->meter)
+        self->meter_id = g_timeout_add(1000 / METER_SIGNAL_RATE, meter_cb, self);
+}
+
+/**
+ * cad_pulse_set_meter:
+ * @enable: whether to publish call levels
+ */
+void cad_pulse_set_meter(gboolean enable)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    self->meter = enable;
+    update_meter(self);
+}
+
+/******************************************************************************
+ * Call watchdog
+ *
+ * When enabled, the call route is checked every WATCHDOG_INTERVAL seconds
+ * while in call mode: active sink port and source mute must match the
+ * published state, bluetooth loopbacks must be loaded, and the call source
+ * and sink must not stay digitally silent. Problems are reported through the
+ * Diagnostic D-Bus signal, and optionally fixed by reapplying the route. Each
+ * check is only a few introspection requests, so it can be left enabled.
+ ******************************************************************************/
+
+/* Only the first problem found during a check is reported */
+static void watchdog_found(CadPulse *self, const gchar *cause, gchar *details)
+{
+    if (self->watchdog_cause) {
+        g_free(details);
+        return;
+    }
+
+    self->watchdog_cause = cause;
+    self->watchdog_details = details;
+}
+
+static void watchdog_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    gboolean muted = self->mic_state == CALL_AUDIO_MIC_OFF;
+    pa_operation *op;
+
+    if (eol != 0)
+        return;
+
+    if (!info) {
+        g_critical("PA returned no source info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_source_info(info);
+
+    if (info->index != (guint32)self->source_id || self->mic_state == CALL_AUDIO_MIC_UNKNOWN ||
+        !!info->mute == muted)
+        return;
+
+    watchdog_found(self, "mic-mute-mismatch",
+                   g_strdup_printf("source '%s' is %s, expected %s", info->name,
+                                   info->mute ? "muted" : "unmuted",
+                                   muted ? "muted" : "unmuted"));
+
+    if (self->watchdog_reapply) {
+        op = pa_context_set_source_mute_by_index(ctx, info->index, muted, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+    }
+}
+
+static void watchdog_sink_info(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    gboolean speaker = self->speaker_state == CALL_AUDIO_SPEAKER_ON;
+    const gchar *target_port;
+    pa_operation *op;
+
+    if (eol != 0)
+        return;
+
+    if (!info) {
+        g_critical("PA returned no sink info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_sink_info(info);
+
+    if (info->index != (guint32)self->sink_id || !info->active_port || !self->speaker_port ||
+        self->speaker_state == CALL_AUDIO_SPEAKER_UNKNOWN ||
+        (strcmp(info->active_port->name, self->speaker_port) == 0) == speaker)
+        return;
+
+    watchdog_found(self, "wrong-port",
+                   g_strdup_printf("sink '%s' uses port '%s' with speaker %s", info->name,
+                                   info->active_port->name, speaker ? "on" : "off"));
+
+    if (self->watchdog_reapply) {
+        if (speaker)
+            target_port = self->speaker_port;
+        else
+            target_port = get_available_sink_port(info, self->speaker_port);
+        if (target_port) {
+            op = pa_context_set_sink_port_by_index(ctx, info->index, target_port, NULL, NULL);
+            if (op)
+                pa_operation_unref(op);
+        }
+    }
+}
+
+static void watchdog_check_silence(CadPulse *self)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (meter_is_alive(self->mic_meter) && self->mic_state == CALL_AUDIO_MIC_ON &&
+        now - self->mic_last_sound > WATCHDOG_SILENCE_TIMEOUT) {
+        watchdog_found(self, "mic-silent",
+                       g_strdup_printf("no sound captured for %" G_GINT64_FORMAT " s",
+                                       (now - self->mic_last_sound) / G_USEC_PER_SEC));
+    }
+
+    /* Modem audio routed by the hardware never goes through the sink */
+    if (meter_is_alive(self->output_meter) &&
+        (self->audio_mode == CALL_AUDIO_MODE_VOIP || self->external_established_loopback) &&
+        now - self->output_last_sound > WATCHDOG_SILENCE_TIMEOUT) {
+        watchdog_found(self, "output-silent",
+                       g_strdup_printf("no sound played for %" G_GINT64_FORMAT " s",
+                                       (now - self->output_last_sound) / G_USEC_PER_SEC));
+    }
+}
+
+static void watchdog_module_info(pa_context *ctx, const pa_module_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol < 0)
+        return;
+
+    if (eol == 0) {
+        if (info && info->index != PA_INVALID_INDEX &&
+            (info->index == self->bt_loopback_modules[0] ||
+             info->index == self->bt_loopback_modules[1]))
+            self->watchdog_loopbacks++;
+        return;
+    }
+
+    /* This is answered last, all other checks are done */
+    if (self->external_established_loopback &&
+        self->watchdog_loopbacks < G_N_ELEMENTS(self->bt_loopback_modules)) {
+        watchdog_found(self, "missing-loopback",
+                       g_strdup_printf("%u of the %u bluetooth loopbacks loaded",
+                                       self->watchdog_loopbacks,
+                                       (guint)G_N_ELEMENTS(self->bt_loopback_modules)));
+    }
+    watchdog_check_silence(self);
+
+    if (self->watchdog_cause && self->watchdog_cause != self->watchdog_reported) {
+        g_warning("Call watchdog: %s (%s)%s", self->watchdog_cause,
+                  self->watchdog_details,
+                  self->watchdog_reapply ? ", reapplying route" : "");
+        call_audio_dbus_call_audio_emit_diagnostic(CALL_AUDIO_DBUS_CALL_AUDIO(self->manager),
+                                                   self->watchdog_cause,
+                                                   self->watchdog_details);
+    }
+
+    self->watchdog_reported = self->watchdog_cause;
+    self->watchdog_cause = NULL;
+    g_clear_pointer(&self->watchdog_details, g_free);
+}
+
+static gboolean watchdog_cb(gpointer data)
+{
+    CadPulse *self = data;
+    pa_operation *op;
+
+    if (!pulse_is_ready(self))
+        return G_SOURCE_CONTINUE;
+
+    self->watchdog_loopbacks = 0;
+
+    if (self->source_id >= 0) {
+        op = pa_context_get_source_info_by_index(self->ctx, self->source_id,
+                                                 watchdog_source_info, self);
+        if (op)
+            pa_operation_unref(op);
+    }
+    if (self->sink_id >= 0) {
+        op = pa_context_get_sink_info_by_index(self->ctx, self->sink_id,
+                                               watchdog_sink_info, self);
+        if (op)
+            pa_operation_unref(op);
+    }
+    op = pa_context_get_module_info_list(self->ctx, watchdog_module_info, self);
+    if (op)
+        pa_operation_unref(op);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void update_watchdog(CadPulse *self)
+{
+    gboolean needed = self->watchdog &&
+                      (self->audio_mode == CALL_AUDIO_MODE_CALL ||
+                       self->audio_mode == CALL_AUDIO_MODE_VOIP);
+
+    if (needed && !self->watchdog_id) {
+        g_debug("starting call watchdog");
+        self->watchdog_reported = NULL;
+        self->watchdog_id = g_timeout_add_seconds(WATCHDOG_INTERVAL, watchdog_cb, self);
+    } else if (!needed && self->watchdog_id) {
+        g_debug("stopping call watchdog");
+        g_source_remove(self->watchdog_id);
+        self->watchdog_id = 0;
+    }
+}
+
+/**
+ * cad_pulse_set_watchdog:
+ * @enable: whether to check the call route during calls
+ * @reapply: whether to reapply the route when a problem is detected
+ */
+void cad_pulse_set_watchdog(gboolean enable, gboolean reapply)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    self->watchdog = enable;
+    self->watchdog_reapply = reapply;
+    update_watchdog(self);
+    update_meter(self);
+}
+
+/******************************************************************************
+ * PulseAudio management
+ *
+ * The following functions configure the PulseAudio connection and monitor the
+ * state of PulseAudio objects
+ ******************************************************************************/
+
+static void invalidate_call_plan(CadPulse *self)
+{
+    if (self->call_plan_timeout_id) {
+        g_source_remove(self->call_plan_timeout_id);
+        self->call_plan_timeout_id = 0;
+    }
+
+    if (self->planned_profile) {
+        g_debug("dropping call route plan");
+        g_clear_pointer(&self->planned_profile, g_free);
+    }
+}
+
+static void init_server_info(pa_context *ctx, const pa_server_info *info, void *data)
+{
+    CadPulse *self = data;
+
+    if (!info) {
+        g_critical("PA returned no server info");
+        return;
+    }
+
+    /*
+     * pipewire-pulse reports e.g. "PulseAudio (on PipeWire 0.3.65)"; in this
+     * case, routing policy is handled by the session manager, and the
+     * PulseAudio-specific modules we usually tweak aren't there
+     */
+    self->is_pipewire = strstr(info->server_name, "PipeWire") != NULL;
+    g_message("Connected to %s %s%s", info->server_name, info->server_version,
+              self->is_pipewire ? " (PipeWire compatibility layer)" : "");
+}
+
+static void init_module_info(pa_context *ctx, const pa_module_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    pa_operation *op;
+
+    if (eol != 0 || self->is_pipewire)
+        return;
+
+    if (!info) {
+        g_critical("PA returned no module info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_module_info(info);
+
+    g_debug("MODULE: idx=%u name='%s'", info->index, info->name);
+
+    if (strcmp(info->name, "module-switch-on-port-available") == 0) {
+        g_debug("MODULE: unloading '%s'", info->name);
+        op = pa_context_unload_module(ctx, info->index, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+    } else if (info->argument &&
+               ((strcmp(info->name, PA_EC_MODULE) == 0 &&
+                 strstr(info->argument, PA_EC_SOURCE_NAME) != NULL) ||
+                (strcmp(info->name, "module-loopback") == 0 &&
+                 strstr(info->argument, PA_SIDETONE_NAME) != NULL))) {
+        /* Left behind by a previous instance, it will be loaded again if needed */
+        g_debug("MODULE: unloading stale '%s'", info->name);
+        op = pa_context_unload_module(ctx, info->index, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+    }
+}
+
+static gboolean init_pulseaudio_objects(CadPulse *self)
+{
+    pa_operation *op;
+
+    self->card_id = self->sink_id = self->source_id = -1;
+    self->external_card_id = self->external_sink_id = self->external_source_id = -1;
+    self->echo_cancel_module = PA_INVALID_INDEX;
+    self->echo_cancel_pending = FALSE;
+    self->sidetone_module = PA_INVALID_INDEX;
+    self->sidetone_pending = FALSE;
+    self->bt_loopback_modules[0] = self->bt_loopback_modules[1] = PA_INVALID_INDEX;
+    g_clear_pointer(&self->sink_name, g_free);
+    g_clear_pointer(&self->source_name, g_free);
+    g_clear_pointer(&self->sink_ports, g_hash_table_destroy);
+    g_clear_pointer(&self->source_ports, g_hash_table_destroy);
+
+    /* Requests are answered in order, so we know the server type early */
+    op = pa_context_get_server_info(self->ctx, init_server_info, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_card_info_list(self->ctx, init_card_info, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_module_info_list(self->ctx, init_module_info, self);
+    if (op)
+        pa_operation_unref(op);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void changed_cb(pa_context *ctx, pa_subscription_event_type_t type, uint32_t idx, void *data)
+{
+    CadPulse *self = data;
+    pa_subscription_event_type_t kind = type & PA_SUBSCRIPTION_EVENT_TYPE_MASK;
+    pa_operation *op = NULL;
+
+    cad_trace_subscription(idx, type);
+
+    switch (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) {
+    case PA_SUBSCRIPTION_EVENT_SINK:
+        if (idx == self->sink_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            g_debug("sink %u removed", idx);
+            self->sink_id = -1;
+            g_clear_pointer(&self->sink_name, g_free);
+            g_clear_pointer(&self->sink_ports, g_hash_table_destroy);
+        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
+            g_debug("new sink %u", idx);
+            op = pa_context_get_sink_info_by_index(ctx, idx, init_sink_info, self);
+            if (op)
+                pa_operation_unref(op);
+        } else if (kind == PA_SUBSCRIPTION_EVENT_CHANGE && self->external_established_loopback &&
+                   ((int)idx == self->external_sink_id || (int)idx == self->internal_sink_id)) {
+            /* The sink may have switched to the loopback's rate */
+            op = pa_context_get_sink_info_by_index(ctx, idx, update_sink_rate, self);
+            if (op)
+                pa_operation_unref(op);
+        }
+        break;
+    case PA_SUBSCRIPTION_EVENT_SOURCE:
+        if (idx == self->source_id && kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            g_debug("source %u removed", idx);
+            self->source_id = -1;
+            g_clear_pointer(&self->source_name, g_free);
+            g_clear_pointer(&self->source_ports, g_hash_table_destroy);
+        } else if (kind == PA_SUBSCRIPTION_EVENT_NEW) {
+            g_debug("new source %u", idx);
+            op = pa_context_get_source_info_by_index(ctx, idx, init_source_info, self);
+            if (op)
+                pa_operation_unref(op);
+        } else if (kind == PA_SUBSCRIPTION_EVENT_CHANGE && self->external_established_loopback &&
+                   ((int)idx == self->external_source_id || (int)idx == self->internal_source_id)) {
+            op = pa_context_get_source_info_by_index(ctx, idx, update_source_rate, self);
+            if (op)
+                pa_operation_unref(op);
+        }
+        break;
+    case PA_SUBSCRIPTION_EVENT_CARD:
+        /* Any card change may make the prepared route plan outdated */
+        if (kind != PA_SUBSCRIPTION_EVENT_CHANGE || idx == self->card_id)
+            invalidate_call_plan(self);
+        if (kind == PA_SUBSCRIPTION_EVENT_NEW && self->card_id < 0) {
+            g_debug("new card %u, checking if it is suitable", idx);
+            op = pa_context_get_card_info_by_index(ctx, idx, init_card_info, self);
+            if (op)
+                pa_operation_unref(op);
+        }
+        if (kind == PA_SUBSCRIPTION_EVENT_NEW || kind == PA_SUBSCRIPTION_EVENT_REMOVE) {
+            /* Bluetooth devices show up as new cards, no need to poll them */
+            cad_pulse_find_bt_audio_capabilities();
+        } else if (idx == self->card_id && kind == PA_SUBSCRIPTION_EVENT_CHANGE) {
+            g_debug("card %u changed", idx);
+            if (self->sink_id != -1) {
+                op = pa_context_get_sink_info_by_index(ctx, self->sink_id,
+                                                       change_sink_info, self);
+                if (op)
+                    pa_operation_unref(op);
+            }
+            if (self->source_id != -1) {
+                op = pa_context_get_source_info_by_index(ctx, self->source_id,
+                                                         change_source_info, self);
+                if (op)
+                    pa_operation_unref(op);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void schedule_reconnect(CadPulse *self)
+{
+    if (self->reconnect_id)
+        return;
+
+    /*
+     * Reconnect immediately the first time, then back off exponentially
+     * so we don't spin if PulseAudio keeps failing.
+     */
+    if (self->reconnect_delay == 0) {
+        self->reconnect_id = g_idle_add(G_SOURCE_FUNC(pulseaudio_connect), self);
+        self->reconnect_delay = 1;
+    } else {
+        g_debug("reconnecting to PA in %us", self->reconnect_delay);
+        self->reconnect_id = g_timeout_add_seconds(self->reconnect_delay,
+                                                   G_SOURCE_FUNC(pulseaudio_connect), self);
+        self->reconnect_delay = MIN(self->reconnect_delay * 2, PA_RECONNECT_MAX_DELAY);
+    }
+}
+
+static void pulse_state_cb(pa_context *ctx, void *data)
+{
+    CadPulse *self = data;
+    pa_context_state_t state;
+    pa_operation *op;
+
+    state = pa_context_get_state(ctx);
+    switch (state) {
+    case PA_CONTEXT_UNCONNECTED:
+    case PA_CONTEXT_CONNECTING:
+    case PA_CONTEXT_AUTHORIZING:
+    case PA_CONTEXT_SETTING_NAME:
+        g_debug("PA not ready");
+        break;
+    case PA_CONTEXT_FAILED:
+        g_critical("Error in PulseAudio context: %s", pa_strerror(pa_context_errno(ctx)));
+        invalidate_call_plan(self);
+        pulseaudio_cleanup(self);
+        schedule_reconnect(self);
+        break;
+    case PA_CONTEXT_TERMINATED:
+    case PA_CONTEXT_READY:
+        self->reconnect_delay = 0;
+        pa_context_set_subscribe_callback(ctx, changed_cb, self);
+        op = pa_context_subscribe(ctx,
+                                  PA_SUBSCRIPTION_MASK_SINK  | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_CARD,
+                                  NULL, self);
+        if (op)
+            pa_operation_unref(op);
+        g_debug("PA is ready, initializing cards list");
+        init_pulseaudio_objects(self);
+        break;
+    default:
+        g_return_if_reached();
+    }
+}
+
+static void pulseaudio_cleanup(CadPulse *self)
+{
+    GList *operations;
+    GList *l;
+
+    stop_meter(self);
+
+    if (self->ctx) {
+        pa_context_disconnect(self->ctx);
+        pa_context_unref(self->ctx);
+        self->ctx = NULL;
+    }
+
+    /*
+     * Requests still pending were dropped along with the context, and their
+     * callbacks will never be called: fail the operations waiting for them,
+     * so they release the state and the clients get a reply.
+     */
+    operations = g_steal_pointer(&self->operations);
+    for (l = operations; l; l = l->next)
+        operation_complete_cb(NULL, 0, l->data);
+    g_list_free(operations);
+}
+
+static gboolean pulseaudio_connect(CadPulse *self)
+{
+    pa_proplist *props;
+    int err;
+
+    self->reconnect_id = 0;
+
+    if (!self->loop)
+        self->loop = pa_glib_mainloop_new(NULL);
+    if (!self->loop)
+        g_error ("Error creating PulseAudio main loop");
+
+    if (!self->ctx) {
+        /* Meta data, copied by the context */
+        props = pa_proplist_new();
+        g_assert(props != NULL);
+
+        pa_proplist_sets(props, PA_PROP_APPLICATION_NAME, APPLICATION_NAME);
+        pa_proplist_sets(props, PA_PROP_APPLICATION_ID, APPLICATION_ID);
+
+        self->ctx = pa_context_new_with_proplist(pa_glib_mainloop_get_api(self->loop),
+                                                 APPLICATION_NAME, props);
+        pa_proplist_free(props);
+    }
+    if (!self->ctx)
+        g_error ("Error creating PulseAudio context");
+
+    pa_context_set_state_callback(self->ctx, (pa_context_notify_cb_t)pulse_state_cb, self);
+    err = pa_context_connect(self->ctx, NULL, PA_CONTEXT_NOFAIL, 0);
+    if (err < 0)
+        g_error ("Error connecting to PulseAudio context: %s", pa_strerror(err));
+
+    return G_SOURCE_REMOVE;
+}
+
+/******************************************************************************
+ * GObject base functions
+ ******************************************************************************/
+
+static void constructed(GObject *object)
+{
+    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
     CadPulse *self = CAD_PULSE(object);
 
-    if (self->speaker_port)
-        g_free(self->speaker_port);
-    if (self->earpiece_port)
-        g_free(self->earpiece_port);
+    pulseaudio_connect(self);
+
+    parent_class->constructed(object);
+}
+
+
+static void dispose(GObject *object)
+{
+    GObjectClass *parent_class = g_type_class_peek(G_TYPE_OBJECT);
+    CadPulse *self = CAD_PULSE(object);
 
+    g_clear_pointer(&self->speaker_port, g_free);
+    g_clear_pointer(&self->earpiece_port, g_free);
+    g_clear_pointer(&self->external_card_name, g_free);
+    g_clear_pointer(&self->sink_ports, g_hash_table_destroy);
+    g_clear_pointer(&self->source_ports, g_hash_table_destroy);
+    g_clear_pointer(&self->suspended_sinks, g_hash_table_destroy);
+    g_clear_pointer(&self->suspended_sources, g_hash_table_destroy);
+    g_clear_pointer(&self->sink_name, g_free);
+    g_clear_pointer(&self->source_name, g_free);
+    if (self->sidetone_check_id) {
+        g_source_remove(self->sidetone_check_id);
+        self->sidetone_check_id = 0;
+    }
+    if (self->watchdog_id) {
+        g_source_remove(self->watchdog_id);
+        self->watchdog_id = 0;
+    }
+    g_clear_pointer(&self->watchdog_details, g_free);
+    invalidate_call_plan(self);
+
+    if (self->reconnect_id) {
+        g_source_remove(self->reconnect_id);
+        self->reconnect_id = 0;
+    }
     pulseaudio_cleanup(self);
 
     if (self->loop) {
@@ -762,6 +1770,14 @@ static void cad_pulse_init(CadPulse *self)
     self->audio_mode = CALL_AUDIO_MODE_UNKNOWN;
     self->speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
     self->mic_state = CALL_AUDIO_MIC_UNKNOWN;
+    self->echo_cancel_module = PA_INVALID_INDEX;
+    self->sidetone_module = PA_INVALID_INDEX;
+    self->bt_loopback_modules[0] = self->bt_loopback_modules[1] = PA_INVALID_INDEX;
+
+    self->suspended_sinks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    self->suspended_sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    /* Devices left suspended by a previous instance will be resumed */
+    cad_snapshot_restore_suspended(self->suspended_sinks, self->suspended_sources);
 }
 
 CadPulse *cad_pulse_get_default(void)
@@ -778,13 +1794,390 @@ CadPulse *cad_pulse_get_default(void)
     return pulse;
 }
 
+/**
+ * cad_pulse_set_suspend_unused:
+ * @enable: whether to suspend unused devices during calls
+ *
+ * When enabled, all sinks and sources which aren't part of the call route are
+ * suspended when entering call mode, and resumed when leaving it.
+ */
+void cad_pulse_set_suspend_unused(gboolean enable)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    self->suspend_unused = enable;
+    update_suspended(self);
+}
+
+/******************************************************************************
+ * Echo cancellation
+ *
+ * When enabled, an echo cancellation and noise suppression filter is inserted
+ * in front of the call sink and source while the speaker is used during VoIP
+ * calls. It isn't needed with the earpiece, so it is removed in this case.
+ * Modem calls are routed directly by the hardware and never go through the
+ * filter, and neither do bluetooth loopbacks, which use the devices' indexes,
+ * so there's no point in loading it in call mode.
+ ******************************************************************************/
+
+static gboolean echo_cancel_needed(CadPulse *self)
+{
+    return self->echo_cancel && self->speaker_state == CALL_AUDIO_SPEAKER_ON &&
+           self->audio_mode == CALL_AUDIO_MODE_VOIP &&
+           self->sink_name && self->source_name;
+}
+
+static void echo_cancel_source_info(pa_context *ctx, const pa_source_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol != 0)
+        return;
+
+    if (!info) {
+        g_critical("PA returned no source info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_source_info(info);
+
+    g_message("Echo cancellation enabled in %.1f ms, adding %.1f ms of capture latency",
+              (g_get_monotonic_time() - self->echo_cancel_start) / 1000.0,
+              info->configured_latency / 1000.0);
+}
+
+static void echo_cancel_loaded(pa_context *ctx, uint32_t idx, void *data)
+{
+    CadPulse *self = data;
+    pa_operation *op;
+
+    self->echo_cancel_pending = FALSE;
+
+    if (idx == PA_INVALID_INDEX) {
+        g_warning("Unable to load %s: %s", PA_EC_MODULE,
+                  pa_strerror(pa_context_errno(ctx)));
+        return;
+    }
+
+    /* The route may have changed while the module was loading */
+    if (!echo_cancel_needed(self)) {
+        op = pa_context_unload_module(ctx, idx, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        return;
+    }
+
+    self->echo_cancel_module = idx;
+
+    /* Make sure streams created by VoIP apps go through the filter */
+    op = pa_context_set_default_sink(ctx, PA_EC_SINK_NAME, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_set_default_source(ctx, PA_EC_SOURCE_NAME, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+
+    op = pa_context_get_source_info_by_name(ctx, PA_EC_SOURCE_NAME,
+                                            echo_cancel_source_info, self);
+    if (op)
+        pa_operation_unref(op);
+}
+
+/*
+ * Insert or remove the echo cancellation filter according to the current
+ * route
+ */
+static void update_echo_cancel(CadPulse *self)
+{
+    g_autofree gchar *args = NULL;
+    gboolean needed;
+    pa_operation *op;
+
+    if (!pulse_is_ready(self) || self->echo_cancel_pending)
+        return;
+
+    needed = echo_cancel_needed(self);
+
+    if (needed && self->echo_cancel_module == PA_INVALID_INDEX) {
+        args = g_strdup_printf("sink_master=%s source_master=%s "
+                               "sink_name=" PA_EC_SINK_NAME " source_name=" PA_EC_SOURCE_NAME " "
+                               "aec_method=webrtc aec_args=\"noise_suppression=1\" "
+                               "use_master_format=1",
+                               self->sink_name, self->source_name);
+        g_debug("loading %s %s", PA_EC_MODULE, args);
+        self->echo_cancel_start = g_get_monotonic_time();
+        op = pa_context_load_module(self->ctx, PA_EC_MODULE, args,
+                                    echo_cancel_loaded, self);
+        if (op) {
+            self->echo_cancel_pending = TRUE;
+            pa_operation_unref(op);
+        }
+    } else if (!needed && self->echo_cancel_module != PA_INVALID_INDEX) {
+        g_debug("unloading %s", PA_EC_MODULE);
+        op = pa_context_unload_module(self->ctx, self->echo_cancel_module, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        self->echo_cancel_module = PA_INVALID_INDEX;
+
+        if (self->sink_name) {
+            op = pa_context_set_default_sink(self->ctx, self->sink_name, NULL, NULL);
+            if (op)
+                pa_operation_unref(op);
+        }
+        if (self->source_name) {
+            op = pa_context_set_default_source(self->ctx, self->source_name, NULL, NULL);
+            if (op)
+                pa_operation_unref(op);
+        }
+    }
+}
+
+/**
+ * cad_pulse_set_echo_cancel:
+ * @enable: whether to use echo cancellation during VoIP speakerphone calls
+ */
+void cad_pulse_set_echo_cancel(gboolean enable)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    self->echo_cancel = enable;
+    update_echo_cancel(self);
+}
+
+/******************************************************************************
+ * Sidetone
+ *
+ * Our codecs don't have hardware sidetone, so when enabled, a low-latency
+ * loopback from the call source to the call sink lets users hear themselves
+ * on earpiece and wired headset calls. As it captures from the call source,
+ * muting the microphone mutes the sidetone right away.
+ ******************************************************************************/
+
+static gboolean sidetone_needed(CadPulse *self)
+{
+    return self->sidetone_level > 0 && self->speaker_state != CALL_AUDIO_SPEAKER_ON &&
+           (self->audio_mode == CALL_AUDIO_MODE_CALL ||
+            self->audio_mode == CALL_AUDIO_MODE_VOIP) &&
+           !self->external_established_loopback &&
+           self->sink_name && self->source_name;
+}
+
+static void sidetone_sink_input_info(pa_context *ctx, const pa_sink_input_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+    pa_cvolume volume;
+    pa_operation *op;
+
+    if (eol != 0)
+        return;
+
+    if (!info) {
+        g_critical("PA returned no sink input info (eol=%d)", eol);
+        return;
+    }
+
+    if (info->owner_module != self->sidetone_module)
+        return;
+
+    self->sidetone_latency += info->buffer_usec + info->sink_usec;
+
+    pa_cvolume_set(&volume, info->channel_map.channels,
+                   pa_sw_volume_from_linear(self->sidetone_level / 100.0));
+    if (pa_cvolume_equal(&volume, &info->volume))
+        return;
+
+    op = pa_context_set_sink_input_volume(ctx, info->index, &volume, NULL, NULL);
+    if (op)
+        pa_operation_unref(op);
+}
+
+static void sidetone_source_output_info(pa_context *ctx, const pa_source_output_info *info, int eol, void *data)
+{
+    CadPulse *self = data;
+
+    if (eol > 0) {
+        /* Sink inputs have been queried first, so we have the total latency */
+        if (self->sidetone_latency > SIDETONE_MAX_LATENCY)
+            g_warning("Sidetone latency is %.1f ms, users may hear an echo",
+                      self->sidetone_latency / 1000.0);
+        else
+            g_message("Sidetone latency is %.1f ms", self->sidetone_latency / 1000.0);
+        return;
+    }
+    if (eol < 0)
+        return;
+
+    if (!info) {
+        g_critical("PA returned no source output info (eol=%d)", eol);
+        return;
+    }
+
+    if (info->owner_module == self->sidetone_module)
+        self->sidetone_latency += info->buffer_usec + info->source_usec;
+}
+
+/*
+ * Check the actual mic-to-ear latency once the loopback has settled
+ */
+static gboolean sidetone_check_cb(gpointer data)
+{
+    CadPulse *self = data;
+    pa_operation *op;
+
+    self->sidetone_check_id = 0;
+
+    if (self->sidetone_module == PA_INVALID_INDEX || !pulse_is_ready(self))
+        return G_SOURCE_REMOVE;
+
+    self->sidetone_latency = 0;
+    op = pa_context_get_sink_input_info_list(self->ctx, sidetone_sink_input_info, self);
+    if (op)
+        pa_operation_unref(op);
+    op = pa_context_get_source_output_info_list(self->ctx, sidetone_source_output_info, self);
+    if (op)
+        pa_operation_unref(op);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void sidetone_loaded(pa_context *ctx, uint32_t idx, void *data)
+{
+    CadPulse *self = data;
+    pa_operation *op;
+
+    self->sidetone_pending = FALSE;
+
+    if (idx == PA_INVALID_INDEX) {
+        g_warning("Unable to load sidetone loopback: %s",
+                  pa_strerror(pa_context_errno(ctx)));
+        return;
+    }
+
+    /* The route may have changed while the module was loading */
+    if (!sidetone_needed(self)) {
+        op = pa_context_unload_module(ctx, idx, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        return;
+    }
+
+    self->sidetone_module = idx;
+
+    /* Apply the sidetone level */
+    op = pa_context_get_sink_input_info_list(ctx, sidetone_sink_input_info, self);
+    if (op)
+        pa_operation_unref(op);
+
+    if (self->sidetone_check_id)
+        g_source_remove(self->sidetone_check_id);
+    self->sidetone_check_id = g_timeout_add_seconds(SIDETONE_CHECK_DELAY,
+                                                    sidetone_check_cb, self);
+}
+
+/*
+ * Insert or remove the sidetone loopback according to the current route
+ */
+static void update_sidetone(CadPulse *self)
+{
+    g_autofree gchar *args = NULL;
+    gboolean needed;
+    pa_operation *op;
+
+    if (!pulse_is_ready(self) || self->sidetone_pending)
+        return;
+
+    needed = sidetone_needed(self);
+
+    if (needed && self->sidetone_module == PA_INVALID_INDEX) {
+        args = g_strdup_printf("source=%s sink=%s latency_msec=%u "
+                               "source_dont_move=true sink_dont_move=true "
+                               "sink_input_properties=media.name=" PA_SIDETONE_NAME " "
+                               "source_output_properties=media.name=" PA_SIDETONE_NAME,
+                               self->source_name, self->sink_name,
+                               SIDETONE_LATENCY_MSEC);
+        g_debug("loading sidetone loopback %s", args);
+        op = pa_context_load_module(self->ctx, "module-loopback", args,
+                                    sidetone_loaded, self);
+        if (op) {
+            self->sidetone_pending = TRUE;
+            pa_operation_unref(op);
+        }
+    } else if (!needed && self->sidetone_module != PA_INVALID_INDEX) {
+        g_debug("unloading sidetone loopback");
+        op = pa_context_unload_module(self->ctx, self->sidetone_module, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+        self->sidetone_module = PA_INVALID_INDEX;
+    }
+}
+
+/**
+ * cad_pulse_set_sidetone:
+ * @level: the sidetone level in percent, 0 to disable sidetone
+ */
+void cad_pulse_set_sidetone(guint level)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    self->sidetone_level = MIN(level, 100);
+    update_sidetone(self);
+}
+
 /******************************************************************************
  * Commands management
  *
  * The following functions handle external requests to switch mode, output port
- * or microphone status
+ * or microphone status. Operations are tracked until they complete: libpulse
+ * drops pending requests without calling back when the connection is lost, so
+ * pulseaudio_cleanup() fails them instead.
  ******************************************************************************/
 
+static CadPulseOperation *operation_new(CadOperation *cad_op, guint value)
+{
+    CadPulseOperation *operation = g_new0(CadPulseOperation, 1);
+    CadPulse *self = cad_pulse_get_default();
+
+    operation->pulse = self;
+    operation->start = g_get_monotonic_time();
+    operation->op = cad_op;
+    operation->value = value;
+    self->operations = g_list_append(self->operations, operation);
+    cad_trace_operation_started(cad_op->type, value);
+
+    return operation;
+}
+
+static void operation_free(CadPulseOperation *operation)
+{
+    CadPulse *self = operation->pulse;
+
+    self->operations = g_list_remove(self->operations, operation);
+    g_free(operation->profile);
+    g_free(operation);
+}
+
+/*
+ * Delay publishing state changes until the operation completes, whichever
+ * way it does
+ */
+static void operation_hold_state(CadPulseOperation *operation)
+{
+    if (operation->holds_state)
+        return;
+
+    operation->holds_state = TRUE;
+    cad_manager_hold_state(CAD_MANAGER(operation->pulse->manager));
+}
+
+static void operation_release_state(CadPulseOperation *operation)
+{
+    if (!operation->holds_state)
+        return;
+
+    operation->holds_state = FALSE;
+    cad_manager_release_state(CAD_MANAGER(operation->pulse->manager));
+}
+
 static void operation_complete_cb(pa_context *ctx, int success, void *data)
 {
     CadPulseOperation *operation = data;
@@ -793,9 +2186,18 @@ static void operation_complete_cb(pa_context *ctx, int success, void *data)
 
     if (operation) {
         if (operation->op) {
+            g_debug("operation %d completed in %.1f ms on %s", operation->op->type,
+                    (g_get_monotonic_time() - operation->start) / 1000.0,
+                    operation->pulse->is_pipewire ? "PipeWire" : "PulseAudio");
             operation->op->success = (gboolean)!!success;
-            if (operation->op->callback)
-                operation->op->callback(operation->op);
+            /* Answer-to-audio latency, to check what preparing calls saves */
+            if (operation->op->type == CAD_OPERATION_SELECT_MODE &&
+                operation->value == CALL_AUDIO_MODE_CALL && success) {
+                g_message("Call route set up in %.1f ms (%s)",
+                          (g_get_monotonic_time() - operation->start) / 1000.0,
+                          operation->prepared ? "prepared" : "not prepared");
+            }
+            cad_trace_operation(operation->op->type, operation->value, success);
 
             if (operation->op->success) {
                 guint new_value = GPOINTER_TO_UINT(operation->value);
@@ -806,12 +2208,19 @@ static void operation_complete_cb(pa_context *ctx, int success, void *data)
                         operation->pulse->audio_mode = new_value;
                         g_object_set(operation->pulse->manager, "audio-mode", new_value, NULL);
                     }
+                    update_suspended(operation->pulse);
+                    update_meter(operation->pulse);
+                    update_watchdog(operation->pulse);
+                    update_echo_cancel(operation->pulse);
+                    update_sidetone(operation->pulse);
                     break;
                 case CAD_OPERATION_ENABLE_SPEAKER:
                     if (operation->pulse->speaker_state != new_value) {
                         operation->pulse->speaker_state = new_value;
                         g_object_set(operation->pulse->manager, "speaker-state", new_value, NULL);
                     }
+                    update_echo_cancel(operation->pulse);
+                    update_sidetone(operation->pulse);
                     break;
                 case CAD_OPERATION_MUTE_MIC:
                     /*
@@ -836,63 +2245,32 @@ static void operation_complete_cb(pa_context *ctx, int success, void *data)
                     if (operation->pulse->bt_audio > 0 &&
                         operation->pulse->bt_audio != new_value) {
                         operation->pulse->bt_audio = new_value;
-                        g_object_set(operation->pulse->manager, "bt-audio-state", new_value, NULL);
-                    }
-                default:
-                    break;
-                }
-            }
-
-            free(operation->op);
-        }
-
-        free(operation);
-    }
-}
-
-static void set_card_profile(pa_context *ctx, const pa_card_info *info, int eol, void *data)
-{
-    CadPulseOperation *operation = data;
-    pa_card_profile_info2 *profile;
-    pa_operation *op = NULL;
-
-    if (eol != 0)
-        return;
-
-    if (!info) {
-        g_critical("PA returned no card info (eol=%d)", eol);
-        return;
-    }
-
-    if (info->index != operation->pulse->card_id)
-        return;
-
-    profile = info->active_profile2;
-
-    if (strcmp(profile->name, SND_USE_CASE_VERB_VOICECALL) == 0 && operation->value == 0) {
-        g_debug("switching to default profile");
-        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
-                                                  SND_USE_CASE_VERB_HIFI,
-                                                  operation_complete_cb, operation);
-    } else if (strcmp(profile->name, SND_USE_CASE_VERB_HIFI) == 0 && operation->value == 1) {
-        g_debug("switching to voice profile");
-        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
-                                                  SND_USE_CASE_VERB_VOICECALL,
-                                                  operation_complete_cb, operation);
-        if (operation->pulse->external_card_id != -1) {
-            if (op) {
-                pa_operation_unref(op);
+                        g_object_set(operation->pulse->manager, "bt-audio-state", new_value, NULL);
+                    }
+                    update_sidetone(operation->pulse);
+                    break;
+                default:
+                    break;
+                }
             }
-            op = pa_context_set_card_profile_by_index(ctx, operation->pulse->external_card_id,
-                                                  PA_BT_PREFERRED_PROFILE,
-                                                  NULL, NULL);
+
+            operation_release_state(operation);
+
+            /*
+             * Publish the resulting state before replying, so the client
+             * gets the StateChanged signal before the method returns.
+             * Internal operations have no callback, their changes get
+             * published along with the request which triggered them.
+             */
+            if (operation->op->callback) {
+                cad_manager_commit_state(CAD_MANAGER(operation->pulse->manager));
+                operation->op->callback(operation->op);
+            }
+
+            g_free(operation->op);
         }
-    }
-    if (op) {
-        pa_operation_unref(op);
-    } else {
-        g_debug("%s: nothing to be done", __func__);
-        operation_complete_cb(ctx, 1, operation);
+
+        operation_free(operation);
     }
 }
 
@@ -902,17 +2280,38 @@ static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol,
     pa_operation *op = NULL;
     const gchar *target_port;
 
-    if (eol != 0)
+    if (eol < 0) {
+        g_critical("PA returned an error while querying sink info");
+        operation_complete_cb(ctx, 0, operation);
         return;
+    }
+    if (eol > 0) {
+        /*
+         * The sink may have gone away since the request was made. Otherwise,
+         * if no port switch is needed, the operation is complete.
+         */
+        if (!operation->matched) {
+            g_warning("sink %d not found", operation->pulse->sink_id);
+            operation_complete_cb(ctx, 0, operation);
+        } else if (!operation->queued) {
+            g_debug("%s: nothing to be done", __func__);
+            operation_complete_cb(ctx, 1, operation);
+        }
+        return;
+    }
 
     if (!info) {
         g_critical("PA returned no sink info (eol=%d)", eol);
         return;
     }
 
+    cad_trace_sink_info(info);
+
     if (info->card != operation->pulse->card_id || info->index != operation->pulse->sink_id)
         return;
 
+    operation->matched = TRUE;
+
     if (operation->op && operation->op->type == CAD_OPERATION_SELECT_MODE) {
         /*
          * When switching to voice call mode, we want to switch to any port
@@ -921,10 +2320,20 @@ static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol,
          * When switching back to normal mode, the highest priority port is to
          * be selected anyway.
          */
-        if (operation->value == CALL_AUDIO_MODE_CALL)
+        if (mode_excludes_speaker(operation->value))
             target_port = get_available_sink_port(info, operation->pulse->speaker_port);
         else
             target_port = get_available_sink_port(info, NULL);
+
+        /*
+         * The device latency is negotiated by PulseAudio according to the
+         * streams' requirements, log it so we can check VoIP apps actually
+         * ask for low latency.
+         */
+        if (operation->value == CALL_AUDIO_MODE_VOIP) {
+            g_debug("sink '%s' latency: %.1f ms (configured %.1f ms)", info->name,
+                    info->latency / 1000.0, info->configured_latency / 1000.0);
+        }
     } else {
         /*
          * When forcing speaker output, we simply select the speaker port.
@@ -940,13 +2349,111 @@ static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol,
 
     g_debug("active port is '%s', target port is '%s'", info->active_port->name, target_port);
 
-    if (strcmp(info->active_port->name, target_port) != 0) {
+    if (target_port && strcmp(info->active_port->name, target_port) != 0) {
         g_debug("switching to target port '%s'", target_port);
         op = pa_context_set_sink_port_by_index(ctx, operation->pulse->sink_id,
                                                target_port,
                                                operation_complete_cb, operation);
     }
 
+    /* Requests are answered in order, the reply comes after the list end */
+    if (op) {
+        operation->queued = TRUE;
+        pa_operation_unref(op);
+    }
+}
+
+static void set_card_sink_port(pa_context *ctx, const pa_sink_info *info, int eol, void *data)
+{
+    CadPulseOperation *operation = data;
+    const gchar *target_port;
+    pa_operation *op;
+
+    if (eol < 0) {
+        g_critical("PA returned an error while querying sinks");
+        operation_complete_cb(ctx, 0, operation);
+        return;
+    }
+    if (eol > 0) {
+        operation_complete_cb(ctx, 1, operation);
+        return;
+    }
+
+    if (!info) {
+        g_critical("PA returned no sink info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_sink_info(info);
+
+    if (info->card != operation->pulse->card_id || !info->active_port)
+        return;
+
+    target_port = get_available_sink_port(info, operation->pulse->speaker_port);
+    if (target_port && strcmp(info->active_port->name, target_port) != 0) {
+        g_debug("switching sink '%s' to port '%s'", info->name, target_port);
+        op = pa_context_set_sink_port_by_index(ctx, info->index, target_port, NULL, NULL);
+        if (op)
+            pa_operation_unref(op);
+    }
+}
+
+/*
+ * Leaving the voice profile re-creates the card's sinks with their default
+ * port, which is usually the speaker: in VoIP mode, switch them to the
+ * earpiece (or headphones) before completing the operation. Requests are
+ * processed in order, so the port is set by the time the client gets the
+ * reply.
+ */
+static void card_profile_applied(pa_context *ctx, int success, void *data)
+{
+    CadPulseOperation *operation = data;
+    pa_operation *op = NULL;
+
+    if (success && operation->value == CALL_AUDIO_MODE_VOIP)
+        op = pa_context_get_sink_info_list(ctx, set_card_sink_port, operation);
+
+    if (op)
+        pa_operation_unref(op);
+    else
+        operation_complete_cb(ctx, success, operation);
+}
+
+/*
+ * Switch the card profile according to the requested mode, given the
+ * currently active profile
+ */
+static void apply_card_profile(pa_context *ctx, const gchar *profile, CadPulseOperation *operation)
+{
+    pa_operation *op = NULL;
+    gboolean voice_call = operation->value == CALL_AUDIO_MODE_CALL;
+
+    if (strcmp(profile, SND_USE_CASE_VERB_VOICECALL) == 0 && !voice_call) {
+        g_debug("switching to default profile");
+        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
+                                                  SND_USE_CASE_VERB_HIFI,
+                                                  card_profile_applied, operation);
+    } else if (strcmp(profile, SND_USE_CASE_VERB_HIFI) == 0 && voice_call) {
+        g_debug("switching to voice profile");
+        op = pa_context_set_card_profile_by_index(ctx, operation->pulse->card_id,
+                                                  SND_USE_CASE_VERB_VOICECALL,
+                                                  operation_complete_cb, operation);
+        if (operation->pulse->external_card_id != -1) {
+            if (op) {
+                pa_operation_unref(op);
+            }
+            op = pa_context_set_card_profile_by_index(ctx, operation->pulse->external_card_id,
+                                                  PA_BT_PREFERRED_PROFILE,
+                                                  NULL, NULL);
+        }
+    } else if (!voice_call && operation->pulse->sink_id >= 0) {
+        /*
+         * We're already using the default profile, which is shared by both
+         * the default and VoIP modes: only the output port needs switching.
+         */
+        op = pa_context_get_sink_info_by_index(ctx, operation->pulse->sink_id,
+                                               set_output_port, operation);
+    }
     if (op) {
         pa_operation_unref(op);
     } else {
@@ -955,6 +2462,74 @@ static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol,
     }
 }
 
+static void set_card_profile(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadPulseOperation *operation = data;
+
+    if (eol < 0) {
+        g_critical("PA returned an error while querying card info");
+        operation_complete_cb(ctx, 0, operation);
+        return;
+    }
+    if (eol > 0) {
+        /* The card may have gone away since the request was made */
+        if (!operation->profile) {
+            g_warning("card %d not found", operation->pulse->card_id);
+            operation_complete_cb(ctx, 0, operation);
+            return;
+        }
+        apply_card_profile(ctx, operation->profile, operation);
+        return;
+    }
+
+    if (!info) {
+        g_critical("PA returned no card info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_card_info(info);
+
+    if (info->index != operation->pulse->card_id || !info->active_profile2)
+        return;
+
+    g_free(operation->profile);
+    operation->profile = g_strdup(info->active_profile2->name);
+}
+
+/*
+ * When PulseAudio isn't available (yet), route directly through ALSA UCM if
+ * it has been enabled. Returns TRUE if the operation has been handled.
+ */
+static gboolean try_ucm_fallback(CadPulseOperation *operation)
+{
+    gboolean success;
+
+    if (pulse_is_ready(operation->pulse) || !cad_ucm_is_available())
+        return FALSE;
+
+    switch (operation->op->type) {
+    case CAD_OPERATION_SELECT_MODE:
+        success = cad_ucm_select_mode(operation->value);
+        break;
+    case CAD_OPERATION_ENABLE_SPEAKER:
+        success = cad_ucm_enable_speaker(operation->value);
+        break;
+    case CAD_OPERATION_MUTE_MIC:
+        success = cad_ucm_mute_mic(operation->value);
+        break;
+    case CAD_OPERATION_SWITCH_BT_AUDIO:
+    case CAD_OPERATION_PREPARE_CALL:
+    default:
+        return FALSE;
+    }
+
+    g_debug("PulseAudio not ready, operation %d handled through UCM",
+            operation->op->type);
+    operation_complete_cb(operation->pulse->ctx, success, operation);
+
+    return TRUE;
+}
+
 /**
  * cad_pulse_select_mode:
  * @mode:
@@ -963,22 +2538,36 @@ static void set_output_port(pa_context *ctx, const pa_sink_info *info, int eol,
  */
 void cad_pulse_select_mode(CallAudioMode mode, CadOperation *cad_op)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
+    CadPulseOperation *operation;
     pa_operation *op = NULL;
 
     if (!cad_op) {
         g_critical("%s: no callaudiod operation", __func__);
-        goto error;
+        return;
     }
 
     /*
      * Make sure cad_op is of the correct type!
      */
     g_assert(cad_op->type == CAD_OPERATION_SELECT_MODE);
-    operation->pulse = cad_pulse_get_default();
-    operation->op = cad_op;
-    operation->value = mode;
-    cad_pulse_find_bt_audio_capabilities();
+    operation = operation_new(cad_op, mode);
+    operation->prepared = mode == CALL_AUDIO_MODE_CALL &&
+                          operation->pulse->has_voice_profile &&
+                          operation->pulse->planned_profile;
+
+    /*
+     * The bluetooth inventory was refreshed when preparing the call, and
+     * any card change since then dropped the plan. Scanning again would
+     * queue a full cards list query in front of the profile switch.
+     */
+    if (pulse_is_ready(operation->pulse) && !operation->prepared)
+        cad_pulse_find_bt_audio_capabilities();
+
+    /*
+     * Switching modes may involve internal operations (see below), make sure
+     * the state is only published once everything is done.
+     */
+    operation_hold_state(operation);
 
     if (mode != CALL_AUDIO_MODE_CALL) {
         /*
@@ -1001,11 +2590,28 @@ void cad_pulse_select_mode(CallAudioMode mode, CadOperation *cad_op)
         }
     }
 
-    if (operation->pulse->has_voice_profile) {
+    if (try_ucm_fallback(operation))
+        return;
+
+    if (!pulse_is_ready(operation->pulse)) {
+        g_warning("PulseAudio isn't ready");
+        goto error;
+    }
+
+    if (operation->prepared) {
+        g_autofree gchar *profile = g_steal_pointer(&operation->pulse->planned_profile);
+
+        /* The call has been prepared, no need to query the card again */
+        g_debug("using prepared route plan");
+        invalidate_call_plan(operation->pulse);
+        apply_card_profile(operation->pulse->ctx, profile, operation);
+        return;
+    } else if (operation->pulse->has_voice_profile) {
       /*
        * The pinephone f.e. has a voice profile
        */
         g_debug("card has voice profile, using it");
+        invalidate_call_plan(operation->pulse);
         op = pa_context_get_card_info_by_index(operation->pulse->ctx,
                                                operation->pulse->card_id,
                                                set_card_profile, operation);
@@ -1021,89 +2627,91 @@ void cad_pulse_select_mode(CallAudioMode mode, CadOperation *cad_op)
                                                set_output_port, operation);
     }
 
-    if (op)
-        pa_operation_unref(op);
+    if (!op) {
+        g_warning("unable to query card state");
+        goto error;
+    }
+    pa_operation_unref(op);
 
     return;
 
 error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        if (cad_op->callback)
-            cad_op->callback(cad_op);
-    }
-    if (operation)
-        free(operation);
+    operation_release_state(operation);
+    cad_manager_commit_state(CAD_MANAGER(operation->pulse->manager));
+    cad_op->success = FALSE;
+    if (cad_op->callback)
+        cad_op->callback(cad_op);
+    g_free(cad_op);
+    operation_free(operation);
 }
 
 void cad_pulse_enable_speaker(gboolean enable, CadOperation *cad_op)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
+    CadPulseOperation *operation;
     pa_operation *op = NULL;
 
     if (!cad_op) {
         g_critical("%s: no callaudiod operation", __func__);
-        goto error;
+        return;
     }
 
     /*
      * Make sure cad_op is of the correct type!
      */
     g_assert(cad_op->type == CAD_OPERATION_ENABLE_SPEAKER);
+    operation = operation_new(cad_op, (guint)enable);
 
-    operation->pulse = cad_pulse_get_default();
+    if (try_ucm_fallback(operation))
+        return;
 
-    if (operation->pulse->sink_id < 0) {
+    if (operation->pulse->sink_id < 0 || !pulse_is_ready(operation->pulse)) {
         g_warning("card has no usable sink");
         goto error;
     }
 
-    operation->op = cad_op;
-    operation->value = (guint)enable;
-
     op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
                                            operation->pulse->sink_id,
                                            set_output_port, operation);
-    if (op)
-        pa_operation_unref(op);
+    if (!op) {
+        g_warning("unable to query sink state");
+        goto error;
+    }
+    pa_operation_unref(op);
 
     return;
 
 error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        if (cad_op->callback)
-            cad_op->callback(cad_op);
-    }
-    if (operation)
-        free(operation);
+    cad_op->success = FALSE;
+    if (cad_op->callback)
+        cad_op->callback(cad_op);
+    g_free(cad_op);
+    operation_free(operation);
 }
 
 void cad_pulse_mute_mic(gboolean mute, CadOperation *cad_op)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
+    CadPulseOperation *operation;
     pa_operation *op = NULL;
 
     if (!cad_op) {
         g_critical("%s: no callaudiod operation", __func__);
-        goto error;
+        return;
     }
 
     /*
      * Make sure cad_op is of the correct type!
      */
     g_assert(cad_op->type == CAD_OPERATION_MUTE_MIC);
+    operation = operation_new(cad_op, (guint)mute);
 
-    operation->pulse = cad_pulse_get_default();
+    if (try_ucm_fallback(operation))
+        return;
 
-    if (operation->pulse->source_id < 0) {
+    if (operation->pulse->source_id < 0 || !pulse_is_ready(operation->pulse)) {
         g_warning("card has no usable source");
         goto error;
     }
 
-    operation->op = cad_op;
-    operation->value = (guint)mute;
-
     if (operation->pulse->mic_state == CALL_AUDIO_MIC_OFF && !operation->value) {
         g_debug("mic is muted, unmuting...");
         op = pa_context_set_source_mute_by_index(operation->pulse->ctx,
@@ -1126,13 +2734,120 @@ void cad_pulse_mute_mic(gboolean mute, CadOperation *cad_op)
     return;
 
 error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        if (cad_op->callback)
-            cad_op->callback(cad_op);
+    cad_op->success = FALSE;
+    if (cad_op->callback)
+        cad_op->callback(cad_op);
+    g_free(cad_op);
+    operation_free(operation);
+}
+
+static gboolean call_plan_timeout_cb(gpointer data)
+{
+    CadPulse *self = data;
+
+    self->call_plan_timeout_id = 0;
+    g_debug("call wasn't answered in time");
+    invalidate_call_plan(self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void prepare_card_info(pa_context *ctx, const pa_card_info *info, int eol, void *data)
+{
+    CadPulseOperation *operation = data;
+    CadPulse *self = operation->pulse;
+
+    if (eol < 0) {
+        g_critical("PA returned an error while querying card info");
+        operation_complete_cb(ctx, 0, operation);
+        return;
+    }
+    if (eol > 0) {
+        /* The card may have gone away since the request was made */
+        if (!operation->profile) {
+            g_warning("card %d not found", self->card_id);
+            operation_complete_cb(ctx, 0, operation);
+            return;
+        }
+
+        invalidate_call_plan(self);
+        self->planned_profile = g_steal_pointer(&operation->profile);
+        self->call_plan_timeout_id = g_timeout_add_seconds(CALL_PLAN_TIMEOUT,
+                                                           call_plan_timeout_cb, self);
+        g_debug("call prepared, active profile is '%s'", self->planned_profile);
+
+        operation_complete_cb(ctx, 1, operation);
+        return;
+    }
+
+    if (!info) {
+        g_critical("PA returned no card info (eol=%d)", eol);
+        return;
+    }
+
+    cad_trace_card_info(info);
+
+    if (info->index != self->card_id || !info->active_profile2)
+        return;
+
+    g_free(operation->profile);
+    operation->profile = g_strdup(info->active_profile2->name);
+}
+
+/**
+ * cad_pulse_prepare_call:
+ * @prepare: %TRUE when a call starts ringing, %FALSE if it wasn't answered
+ * @cad_op: the #CadOperation to complete
+ *
+ * Get ready for an incoming call without changing the current routing, so
+ * the ringtone is unaffected: refresh the bluetooth devices list and record
+ * the card state, so that a following cad_pulse_select_mode() can switch
+ * profiles right away. The plan is dropped on any card change, when the call
+ * is cancelled, or after CALL_PLAN_TIMEOUT seconds.
+ */
+void cad_pulse_prepare_call(gboolean prepare, CadOperation *cad_op)
+{
+    CadPulseOperation *operation;
+    pa_operation *op = NULL;
+
+    if (!cad_op) {
+        g_critical("%s: no callaudiod operation", __func__);
+        return;
+    }
+
+    /*
+     * Make sure cad_op is of the correct type!
+     */
+    g_assert(cad_op->type == CAD_OPERATION_PREPARE_CALL);
+    operation = operation_new(cad_op, (guint)prepare);
+
+    if (prepare && pulse_is_ready(operation->pulse))
+        cad_pulse_find_bt_audio_capabilities();
+
+    if (!prepare || !operation->pulse->has_voice_profile ||
+        !pulse_is_ready(operation->pulse)) {
+        invalidate_call_plan(operation->pulse);
+        operation_complete_cb(operation->pulse->ctx, 1, operation);
+        return;
+    }
+
+    op = pa_context_get_card_info_by_index(operation->pulse->ctx,
+                                           operation->pulse->card_id,
+                                           prepare_card_info, operation);
+    if (!op) {
+        g_warning("unable to query card state");
+        goto error;
     }
-    if (operation)
-        free(operation);
+    pa_operation_unref(op);
+
+    return;
+
+error:
+    cad_op->success = FALSE;
+    if (cad_op->callback)
+        cad_op->callback(cad_op);
+    g_free(cad_op);
+    operation_free(operation);
 }
 
 CallAudioMode cad_pulse_get_audio_mode(void)
@@ -1159,8 +2874,34 @@ CallAudioBluetoothState cad_pulse_get_bt_audio_state(void)
     return self->bt_audio;
 }
 
+/**
+ * cad_pulse_is_resampling:
+ *
+ * Returns: %TRUE if the active bluetooth call route has to resample audio
+ * between the headset and the internal card.
+ */
+gboolean cad_pulse_is_resampling(void)
+{
+    CadPulse *self = cad_pulse_get_default();
+
+    return self->resampling;
+}
+
+static void bt_loopback_loaded(pa_context *ctx, uint32_t idx, void *data)
+{
+    guint32 *module = data;
+
+    if (idx == PA_INVALID_INDEX) {
+        g_warning("Unable to load bluetooth loopback: %s",
+                  pa_strerror(pa_context_errno(ctx)));
+    }
+
+    *module = idx;
+}
+
 static void unload_loopback_callback(pa_context *ctx, const pa_module_info *info, int eol, void *data)
 {
+    CadPulse *self = data;
     pa_operation *op = NULL;
 
     if (eol != 0)
@@ -1172,7 +2913,7 @@ static void unload_loopback_callback(pa_context *ctx, const pa_module_info *info
     }
     // This is horrible, but as stated... YOLO!!
 
-    if (strcmp(info->name, "module-loopback") == 0) {
+    if (strcmp(info->name, "module-loopback") == 0 && info->index != self->sidetone_module) {
         g_message("Unloading '%s'", info->name);
         op = pa_context_unload_module(ctx, info->index, NULL, NULL);
         if (op)
@@ -1191,6 +2932,8 @@ static void get_source_id_callback(pa_context *ctx, const pa_source_info *info,
         g_critical("PA returned no source info (eol=%d)", eol);
         return;
     }
+
+    cad_trace_source_info(info);
     g_message("Card #%i. Source ID: %i: %s", info->card, info->index, info->name);
 
     if (info->monitor_of_sink != PA_INVALID_INDEX) {
@@ -1201,10 +2944,13 @@ static void get_source_id_callback(pa_context *ctx, const pa_source_info *info,
     if (info->card == self->external_card_id) {
         g_message("Source belongs to our bluetooth device, *SAVE IT*");
         self->external_source_id = info->index;
+        self->external_source_rate = info->sample_spec.rate;
     } else if (info->card == self->card_id) {
         g_message("Source is from the internal card!");
         self->internal_source_id = info->index;
+        self->internal_source_rate = info->sample_spec.rate;
     }
+    update_resampling(self);
     return;
 }
 
@@ -1220,15 +2966,20 @@ static void get_sink_id_callback(pa_context *ctx, const pa_sink_info *info, int
         g_critical("PA returned no sink info (eol=%d)", eol);
         return;
     }
+
+    cad_trace_sink_info(info);
     g_message("Card #%i. Sink ID: %i: %s", info->card, info->index, info->name);
 
     if (info->card == self->external_card_id) {
         g_message("Sink belongs to our bluetooth device");
         self->external_sink_id = info->index;
+        self->external_sink_rate = info->sample_spec.rate;
     } else if (info->card == self->card_id) {
         g_message("Sink is from the internal card!");
         self->internal_sink_id = info->index;
+        self->internal_sink_rate = info->sample_spec.rate;
     }
+    update_resampling(self);
     return;
 }
 
@@ -1245,6 +2996,8 @@ static void get_card_info_callback(pa_context *c, const pa_card_info *info, int
         g_message("Is last card!");
         return;
     }
+
+    cad_trace_card_info(info);
     g_message("%u: %s using %s\n", info->index, info->name, info->driver);
     /* Check the driver used by PulseAudio, and try to match the available
        profiles. We could modify this to allow for USB-C headsets, but 
@@ -1252,7 +3005,8 @@ static void get_card_info_callback(pa_context *c, const pa_card_info *info, int
     if (strcmp(info->driver, PA_BT_DRIVER) == 0) {
         g_message("We got a bluetooth audio device!");
         self->external_card_id = info->index;
-        self->external_card_name =  g_strdup(info->name);
+        g_free(self->external_card_name);
+        self->external_card_name = g_strdup(info->name);
         // Find the sink and source ports
         op = pa_context_get_sink_info_list(c, get_sink_id_callback, self);
         if (op)
@@ -1277,26 +3031,30 @@ static void get_card_info_callback(pa_context *c, const pa_card_info *info, int
 /* Pieces shamelessly stolen from wys */
 void cad_pulse_enable_bt_audio(gboolean enable, CadOperation *cad_op)
 {
-    CadPulseOperation *operation = g_new(CadPulseOperation, 1);
+    CadPulseOperation *operation;
     pa_operation *op = NULL;
     gchar *loopback_bt_source_arg, *loopback_int_source_arg;
     g_message("***** %s ******", __func__);
     if (!cad_op) {
         g_critical("%s: no callaudiod operation", __func__);
-        goto error;
+        return;
     }
 
     /*
      * Make sure cad_op is of the correct type!
      */
     g_assert(cad_op->type == CAD_OPERATION_SWITCH_BT_AUDIO);
-
-    operation->pulse = cad_pulse_get_default();
+    operation = operation_new(cad_op, (guint)enable);
 
 /*    if (operation->pulse->sink_id < 0) {
         g_warning("Audio isn't even ready yet");
         goto error;
     }*/
+    if (!pulse_is_ready(operation->pulse)) {
+        g_warning("PulseAudio isn't ready");
+        goto error;
+    }
+
     if (enable && operation->pulse->external_card_id < 0) {
         g_warning("No bluetooth adapter connected");
         goto error;
@@ -1307,8 +3065,6 @@ void cad_pulse_enable_bt_audio(gboolean enable, CadOperation *cad_op)
             g_warning("Bluetooth adapter has no sink or source");
             goto error;
     }
-    operation->op = cad_op;
-    operation->value = (guint)enable;
     g_message("Requested Bluetooth switch, enable %u", enable);
     /* TODO: Check if we're actually in call */
 
@@ -1341,33 +3097,46 @@ void cad_pulse_enable_bt_audio(gboolean enable, CadOperation *cad_op)
 
     /* Need to do it twice */
     // It's peanut-butter-loopback time
-    loopback_bt_source_arg = g_strdup_printf("source=%i sink=%i", operation->pulse->external_source_id, operation->pulse->internal_sink_id); 
-    loopback_int_source_arg = g_strdup_printf("source=%i sink=%i", operation->pulse->internal_source_id, operation->pulse->external_sink_id); 
+    loopback_bt_source_arg = get_loopback_args(operation->pulse->external_source_id,
+                                               operation->pulse->internal_sink_id,
+                                               operation->pulse->external_source_rate);
+    loopback_int_source_arg = get_loopback_args(operation->pulse->internal_source_id,
+                                                operation->pulse->external_sink_id,
+                                                operation->pulse->external_sink_rate);
     g_message("From BT to alsa: %s", loopback_bt_source_arg);
     g_message("From Alsa to BT: %s", loopback_int_source_arg);
 
     op = pa_context_load_module (operation->pulse->ctx,
                             "module-loopback",
                             loopback_bt_source_arg,
-                            NULL,
-                            NULL);
+                            bt_loopback_loaded,
+                            &operation->pulse->bt_loopback_modules[0]);
     if (op)
         pa_operation_unref(op);
     // Last one we report... I totally shouldn't be doing this
     op = pa_context_load_module (operation->pulse->ctx,
                             "module-loopback",
                             loopback_int_source_arg,
-                            NULL,
-                            NULL);
+                            bt_loopback_loaded,
+                            &operation->pulse->bt_loopback_modules[1]);
     if (op)
         pa_operation_unref(op);
+
+    g_free(loopback_bt_source_arg);
+    g_free(loopback_int_source_arg);
+    operation->pulse->external_established_loopback = 1;
     } else {
+        operation->pulse->external_established_loopback = 0;
+        operation->pulse->bt_loopback_modules[0] = PA_INVALID_INDEX;
+        operation->pulse->bt_loopback_modules[1] = PA_INVALID_INDEX;
         //    op = pa_context_get_module_info_list(self->ctx, init_module_info, self);
 
-        op = pa_context_get_module_info_list(operation->pulse->ctx, unload_loopback_callback, NULL);
+        op = pa_context_get_module_info_list(operation->pulse->ctx, unload_loopback_callback,
+                                             operation->pulse);
         if (op)
             pa_operation_unref(op);
     }
+    update_resampling(operation->pulse);
 
     operation_complete_cb(operation->pulse->ctx, 1, operation);
 /*    op = pa_context_get_sink_info_by_index(operation->pulse->ctx,
@@ -1379,13 +3148,11 @@ void cad_pulse_enable_bt_audio(gboolean enable, CadOperation *cad_op)
     return;
 
 error:
-    if (cad_op) {
-        cad_op->success = FALSE;
-        if (cad_op->callback)
-            cad_op->callback(cad_op);
-    }
-    if (operation)
-        free(operation);
+    cad_op->success = FALSE;
+    if (cad_op->callback)
+        cad_op->callback(cad_op);
+    g_free(cad_op);
+    operation_free(operation);
 }
 
 /* TODO: We need to cleanup after ourselves too... */
@@ -1394,6 +3161,9 @@ gboolean cad_pulse_find_bt_audio_capabilities(void)
     CadPulse *self = cad_pulse_get_default();
     pa_operation *op;
 
+    if (!pulse_is_ready(self))
+        return G_SOURCE_REMOVE;
+
     g_message("Scan bluetooth devices with audio support as headset");
    // op = pa_context_get_card_info_list(self->ctx, search_alternative_cards, self);
     op = pa_context_get_card_info_list(self->ctx, get_card_info_callback, self);
@@ -22,11 +22,18 @@ CadPulse *cad_pulse_get_default(void);
 void cad_pulse_select_mode(CallAudioMode mode, CadOperation *op);
 void cad_pulse_enable_speaker(gboolean enable, CadOperation *op);
 void cad_pulse_mute_mic(gboolean mute, CadOperation *op);
+void cad_pulse_prepare_call(gboolean prepare, CadOperation *op);
+void cad_pulse_set_suspend_unused(gboolean enable);
+void cad_pulse_set_echo_cancel(gboolean enable);
+void cad_pulse_set_sidetone(guint level);
+void cad_pulse_set_meter(gboolean enable);
+void cad_pulse_set_watchdog(gboolean enable, gboolean reapply);
 
 CallAudioMode cad_pulse_get_audio_mode(void);
 CallAudioSpeakerState cad_pulse_get_speaker_state(void);
 CallAudioMicState cad_pulse_get_mic_state(void);
 CallAudioBluetoothState cad_pulse_get_bt_audio_state(void);
+gboolean cad_pulse_is_resampling(void);
 void cad_pulse_enable_bt_audio(gboolean enable, CadOperation *cad_op);
 gboolean cad_pulse_find_bt_audio_capabilities(void);
 G_END_DECLS
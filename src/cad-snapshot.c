@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-snapshot"
+
+#include "cad-snapshot.h"
+#include "config.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+
+#define SNAPSHOT_GROUP "State"
+#define SUSPENDED_GROUP "Suspended"
+
+/*
+ * The snapshot lives in the user's runtime directory, so it doesn't survive
+ * a reboot: it is only meant to restore the published state quickly when the
+ * daemon is re-activated after exiting on idle.
+ */
+static gchar *get_snapshot_path(const gchar *name)
+{
+    return g_build_filename(g_get_user_runtime_dir(), APP_DATA_NAME,
+                            name, NULL);
+}
+
+static gboolean save_keyfile(GKeyFile *keyfile, const gchar *path, GError **error)
+{
+    g_autofree gchar *dir = g_path_get_dirname(path);
+
+    if (g_mkdir_with_parents(dir, 0700) < 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                    "Unable to create '%s': %s", dir, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    return g_key_file_save_to_file(keyfile, path, error);
+}
+
+static const gchar * const snapshot_properties[] = {
+    "audio-mode",
+    "speaker-state",
+    "mic-state",
+    "bt-audio-state",
+};
+
+/**
+ * cad_snapshot_save:
+ * @manager: the #CadManager whose state should be saved
+ * @error: Error information
+ *
+ * Save the currently published routing state.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_snapshot_save(CadManager *manager, GError **error)
+{
+    g_autoptr(GKeyFile) keyfile = g_key_file_new();
+    g_autofree gchar *path = get_snapshot_path("state");
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(snapshot_properties); i++) {
+        guint value;
+
+        g_object_get(manager, snapshot_properties[i], &value, NULL);
+        g_key_file_set_uint64(keyfile, SNAPSHOT_GROUP,
+                              snapshot_properties[i], value);
+    }
+
+    if (!save_keyfile(keyfile, path, error))
+        return FALSE;
+
+    g_debug("state saved to '%s'", path);
+
+    return TRUE;
+}
+
+/*
+ * Check whether a saved value can be published before PulseAudio confirms
+ * it. The snapshot may have been written on SIGTERM in the middle of a call,
+ * and the call has most likely ended by the time the daemon is re-activated:
+ * announcing a call routing that doesn't exist would mislead clients, so any
+ * call-related value is left unknown until the actual state is known.
+ */
+static gboolean snapshot_is_safe(guint64 *values)
+{
+    switch (values[0]) {
+    case CALL_AUDIO_MODE_DEFAULT:
+        break;
+    case CALL_AUDIO_MODE_CALL:
+    case CALL_AUDIO_MODE_VOIP:
+    case CALL_AUDIO_MODE_UNKNOWN:
+        return FALSE;
+    default:
+        g_warning("Invalid audio mode %" G_GUINT64_FORMAT " in state snapshot",
+                  values[0]);
+        return FALSE;
+    }
+
+    if (values[1] > CALL_AUDIO_SPEAKER_ON || values[2] > CALL_AUDIO_MIC_ON)
+        return FALSE;
+
+    /* Bluetooth audio can only be enabled during a call */
+    if (values[3] > CALL_AUDIO_BT_AVAILABLE)
+        return FALSE;
+
+    return TRUE;
+}
+
+/**
+ * cad_snapshot_restore:
+ * @manager: the #CadManager to restore the state to
+ *
+ * Publish the last saved routing state, if any. This is meant to be called
+ * before PulseAudio introspection completes, which will then override the
+ * restored values with the actual state.
+ *
+ * Only a snapshot of an idle (default mode, no Bluetooth audio) state is
+ * restored; call-related state is always re-derived from PulseAudio.
+ *
+ * Returns: %TRUE if a snapshot was restored, %FALSE otherwise.
+ */
+gboolean cad_snapshot_restore(CadManager *manager)
+{
+    g_autoptr(GKeyFile) keyfile = g_key_file_new();
+    g_autoptr(GError) err = NULL;
+    g_autofree gchar *path = get_snapshot_path("state");
+    guint64 values[G_N_ELEMENTS(snapshot_properties)];
+    guint i;
+
+    if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, &err)) {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning("Unable to load state snapshot: %s", err->message);
+        return FALSE;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(snapshot_properties); i++) {
+        values[i] = g_key_file_get_uint64(keyfile, SNAPSHOT_GROUP,
+                                          snapshot_properties[i], &err);
+        if (err) {
+            g_warning("Invalid state snapshot: %s", err->message);
+            return FALSE;
+        }
+    }
+
+    if (!snapshot_is_safe(values)) {
+        g_debug("ignoring state snapshot taken outside of default mode");
+        return FALSE;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(snapshot_properties); i++)
+        g_object_set(manager, snapshot_properties[i], (guint)values[i], NULL);
+
+    g_debug("state restored from '%s'", path);
+
+    return TRUE;
+}
+
+static void save_names(GKeyFile *keyfile, const gchar *key, GHashTable *names)
+{
+    g_autofree const gchar **array = NULL;
+    guint length;
+
+    array = (const gchar **)g_hash_table_get_keys_as_array(names, &length);
+    g_key_file_set_string_list(keyfile, SUSPENDED_GROUP, key, array, length);
+}
+
+/**
+ * cad_snapshot_save_suspended:
+ * @sinks: names of the sinks suspended by callaudiod
+ * @sources: names of the sources suspended by callaudiod
+ * @error: Error information
+ *
+ * Save the list of devices suspended during a call, so they can be resumed
+ * even if callaudiod or PulseAudio is restarted in the meantime. Device names
+ * are used as they are stable across PulseAudio restarts, unlike indexes.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_snapshot_save_suspended(GHashTable *sinks, GHashTable *sources,
+                                     GError **error)
+{
+    g_autoptr(GKeyFile) keyfile = NULL;
+    g_autofree gchar *path = get_snapshot_path("suspended");
+
+    if (g_hash_table_size(sinks) == 0 && g_hash_table_size(sources) == 0) {
+        if (g_unlink(path) < 0 && errno != ENOENT) {
+            int saved_errno = errno;
+            g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+                        "Unable to remove '%s': %s", path, g_strerror(saved_errno));
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    keyfile = g_key_file_new();
+    save_names(keyfile, "sinks", sinks);
+    save_names(keyfile, "sources", sources);
+
+    return save_keyfile(keyfile, path, error);
+}
+
+static void restore_names(GKeyFile *keyfile, const gchar *key, GHashTable *names)
+{
+    g_auto(GStrv) array = g_key_file_get_string_list(keyfile, SUSPENDED_GROUP,
+                                                     key, NULL, NULL);
+    guint i;
+
+    for (i = 0; array && array[i]; i++)
+        g_hash_table_add(names, g_strdup(array[i]));
+}
+
+/**
+ * cad_snapshot_restore_suspended:
+ * @sinks: set the names of suspended sinks will be added to
+ * @sources: set the names of suspended sources will be added to
+ *
+ * Load the list of devices saved by cad_snapshot_save_suspended(), if any.
+ */
+void cad_snapshot_restore_suspended(GHashTable *sinks, GHashTable *sources)
+{
+    g_autoptr(GKeyFile) keyfile = g_key_file_new();
+    g_autoptr(GError) err = NULL;
+    g_autofree gchar *path = get_snapshot_path("suspended");
+
+    if (!g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, &err)) {
+        if (!g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning("Unable to load suspended devices: %s", err->message);
+        return;
+    }
+
+    restore_names(keyfile, "sinks", sinks);
+    restore_names(keyfile, "sources", sources);
+
+    g_debug("%u sinks and %u sources to be resumed", g_hash_table_size(sinks),
+            g_hash_table_size(sources));
+}
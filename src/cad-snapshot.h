@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "cad-manager.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_snapshot_save(CadManager *manager, GError **error);
+gboolean cad_snapshot_restore(CadManager *manager);
+
+gboolean cad_snapshot_save_suspended(GHashTable *sinks, GHashTable *sources,
+                                     GError **error);
+void cad_snapshot_restore_suspended(GHashTable *sinks, GHashTable *sources);
+
+G_END_DECLS
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define _GNU_SOURCE
+#define G_LOG_DOMAIN "callaudiod-state-page"
+
+#include "cad-state-page.h"
+#include "libcallaudio.h"
+
+#include <gio/gio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static CadStatePage *state_page;
+static gint state_page_fd = -1;
+static gsize state_page_size;
+
+/**
+ * cad_state_page_init:
+ * @error: Error information
+ *
+ * Create the sealed memfd holding the state page. Clients get a file
+ * descriptor to it through the GetStatePage D-Bus method and can map it
+ * read-only to query the routing state without any IPC.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_state_page_init(GError **error)
+{
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+    int saved_errno;
+    void *mem;
+
+    if (state_page)
+        return TRUE;
+
+    state_page_size = MAX(sizeof(CadStatePage), (gsize)sysconf(_SC_PAGESIZE));
+
+    state_page_fd = memfd_create("callaudiod-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (state_page_fd < 0)
+        goto error;
+
+    if (ftruncate(state_page_fd, state_page_size) < 0)
+        goto error;
+
+    mem = mmap(NULL, state_page_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+               state_page_fd, 0);
+    if (mem == MAP_FAILED)
+        goto error;
+
+    state_page = mem;
+    state_page->magic = CAD_STATE_PAGE_MAGIC;
+    state_page->version = CAD_STATE_PAGE_VERSION;
+    state_page->audio_mode = CALL_AUDIO_MODE_UNKNOWN;
+    state_page->speaker_state = CALL_AUDIO_SPEAKER_UNKNOWN;
+    state_page->mic_state = CALL_AUDIO_MIC_UNKNOWN;
+    state_page->bt_audio_state = CALL_AUDIO_BT_UNKNOWN;
+    state_page->timestamp = g_get_monotonic_time();
+
+#ifdef F_SEAL_FUTURE_WRITE
+    /* Our own mapping stays writable, but clients can't map it for writing */
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if (fcntl(state_page_fd, F_ADD_SEALS, seals) < 0)
+        g_warning("Unable to seal state page: %s", g_strerror(errno));
+
+    return TRUE;
+
+error:
+    saved_errno = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                "Unable to create state page: %s", g_strerror(saved_errno));
+    cad_state_page_destroy();
+    return FALSE;
+}
+
+void cad_state_page_destroy(void)
+{
+    if (state_page) {
+        munmap(state_page, state_page_size);
+        state_page = NULL;
+    }
+
+    if (state_page_fd >= 0) {
+        close(state_page_fd);
+        state_page_fd = -1;
+    }
+}
+
+/**
+ * cad_state_page_publish:
+ * @generation: the generation number of this state
+ * @timestamp: monotonic time of the change
+ * @audio_mode: the current #CallAudioMode
+ * @speaker_state: the current #CallAudioSpeakerState
+ * @mic_state: the current #CallAudioMicState
+ * @bt_audio_state: the current #CallAudioBluetoothState
+ *
+ * Update the state page. The generation number is the one also reported by
+ * the GetState method and StateChanged signal.
+ */
+void cad_state_page_publish(guint64 generation,
+                            gint64  timestamp,
+                            guint32 audio_mode,
+                            guint32 speaker_state,
+                            guint32 mic_state,
+                            guint32 bt_audio_state)
+{
+    guint32 seq;
+
+    if (!state_page)
+        return;
+
+    seq = state_page->sequence;
+    __atomic_store_n(&state_page->sequence, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    __atomic_store_n(&state_page->generation, generation, __ATOMIC_RELAXED);
+    __atomic_store_n(&state_page->timestamp, timestamp, __ATOMIC_RELAXED);
+    __atomic_store_n(&state_page->audio_mode, audio_mode, __ATOMIC_RELAXED);
+    __atomic_store_n(&state_page->speaker_state, speaker_state, __ATOMIC_RELAXED);
+    __atomic_store_n(&state_page->mic_state, mic_state, __ATOMIC_RELAXED);
+    __atomic_store_n(&state_page->bt_audio_state, bt_audio_state, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&state_page->sequence, seq + 2, __ATOMIC_RELEASE);
+}
+
+gint cad_state_page_get_fd(void)
+{
+    return state_page_fd;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define CAD_STATE_PAGE_MAGIC   0x43414453 /* "CADS" */
+#define CAD_STATE_PAGE_VERSION 1
+
+/*
+ * Layout of the shared memory page callaudiod publishes its routing state
+ * in. The page is only written by callaudiod and is protected by a seqlock:
+ * @sequence is odd while an update is in progress, readers must retry until
+ * they read the same even value before and after copying the other fields.
+ *
+ * This header is shared between callaudiod and libcallaudio, changing the
+ * layout requires bumping CAD_STATE_PAGE_VERSION.
+ */
+typedef struct _CadStatePage {
+    guint32 magic;
+    guint32 version;
+    guint32 sequence;
+    guint32 reserved;
+    guint64 generation;     /* incremented on every state change */
+    gint64  timestamp;      /* monotonic time of the last change, in µs */
+    guint32 audio_mode;
+    guint32 speaker_state;
+    guint32 mic_state;
+    guint32 bt_audio_state;
+} CadStatePage;
+
+typedef struct _CadStatePageData {
+    guint64 generation;
+    gint64  timestamp;
+    guint32 audio_mode;
+    guint32 speaker_state;
+    guint32 mic_state;
+    guint32 bt_audio_state;
+} CadStatePageData;
+
+static inline void cad_state_page_read(const CadStatePage *page,
+                                       CadStatePageData   *data)
+{
+    guint32 seq_begin, seq_end;
+
+    do {
+        seq_begin = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if (seq_begin & 1)
+            continue;
+
+        data->generation = __atomic_load_n(&page->generation, __ATOMIC_RELAXED);
+        data->timestamp = __atomic_load_n(&page->timestamp, __ATOMIC_RELAXED);
+        data->audio_mode = __atomic_load_n(&page->audio_mode, __ATOMIC_RELAXED);
+        data->speaker_state = __atomic_load_n(&page->speaker_state, __ATOMIC_RELAXED);
+        data->mic_state = __atomic_load_n(&page->mic_state, __ATOMIC_RELAXED);
+        data->bt_audio_state = __atomic_load_n(&page->bt_audio_state, __ATOMIC_RELAXED);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        seq_end = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+    } while ((seq_begin & 1) || seq_begin != seq_end);
+}
+
+/* Writer side, only used by callaudiod */
+gboolean cad_state_page_init(GError **error);
+void cad_state_page_destroy(void);
+void cad_state_page_publish(guint64 generation,
+                            gint64  timestamp,
+                            guint32 audio_mode,
+                            guint32 speaker_state,
+                            guint32 mic_state,
+                            guint32 bt_audio_state);
+gint cad_state_page_get_fd(void);
+
+G_END_DECLS
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-trace"
+
+#include "cad-trace.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+static FILE *trace_file;
+static gint64 trace_start;
+
+/**
+ * cad_trace_open:
+ * @path: file to write the trace to
+ * @error: Error information
+ *
+ * Start recording PulseAudio events and routing operations to @path. Any
+ * existing file is overwritten.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_trace_open(const gchar *path, GError **error)
+{
+    guint32 version = CAD_TRACE_VERSION;
+
+    if (trace_file)
+        cad_trace_close();
+
+    trace_file = g_fopen(path, "wb");
+    if (!trace_file) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno),
+                    "Unable to open trace file '%s': %s",
+                    path, g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    if (fwrite(CAD_TRACE_MAGIC, strlen(CAD_TRACE_MAGIC), 1, trace_file) != 1 ||
+        fwrite(&version, sizeof(version), 1, trace_file) != 1) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                    "Unable to write trace header to '%s'", path);
+        fclose(trace_file);
+        trace_file = NULL;
+        return FALSE;
+    }
+
+    trace_start = g_get_monotonic_time();
+    g_message("Recording PulseAudio events to '%s'", path);
+
+    return TRUE;
+}
+
+void cad_trace_close(void)
+{
+    if (!trace_file)
+        return;
+
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+/*
+ * Write a record, consuming @payload if it is floating. Records are flushed
+ * right away, so the trace is usable even if callaudiod crashes.
+ */
+static void trace_record(CadTraceEvent event, guint32 index, GVariant *payload)
+{
+    g_autoptr(GVariant) data = g_variant_ref_sink(payload);
+    CadTraceRecord record = { 0 };
+
+    if (!trace_file)
+        return;
+
+    record.timestamp = g_get_monotonic_time() - trace_start;
+    record.index = index;
+    record.event = event;
+    record.size = g_variant_get_size(data);
+
+    if (fwrite(&record, sizeof(record), 1, trace_file) != 1 ||
+        (record.size > 0 &&
+         fwrite(g_variant_get_data(data), record.size, 1, trace_file) != 1) ||
+        fflush(trace_file) != 0) {
+        g_warning("Unable to write trace record, stopping trace");
+        cad_trace_close();
+    }
+}
+
+static GVariant *proplist_to_variant(const pa_proplist *proplist)
+{
+    GVariantBuilder builder;
+    const char *key;
+    void *state = NULL;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{ss}"));
+    while (proplist && (key = pa_proplist_iterate(proplist, &state))) {
+        const char *value = pa_proplist_gets(proplist, key);
+
+        /* Binary properties aren't used by callaudiod */
+        if (value)
+            g_variant_builder_add(&builder, "{ss}", key, value);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+static GVariant *sink_ports_to_variant(pa_sink_port_info **ports, guint32 n_ports)
+{
+    GVariantBuilder builder;
+    guint32 i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(suu)"));
+    for (i = 0; i < n_ports; i++) {
+        g_variant_builder_add(&builder, "(suu)", ports[i]->name,
+                              ports[i]->priority, (guint32)ports[i]->available);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+static GVariant *source_ports_to_variant(pa_source_port_info **ports, guint32 n_ports)
+{
+    GVariantBuilder builder;
+    guint32 i;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(suu)"));
+    for (i = 0; i < n_ports; i++) {
+        g_variant_builder_add(&builder, "(suu)", ports[i]->name,
+                              ports[i]->priority, (guint32)ports[i]->available);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+void cad_trace_subscription(guint32 index, pa_subscription_event_type_t type)
+{
+    if (!trace_file)
+        return;
+
+    trace_record(CAD_TRACE_EVENT_SUBSCRIPTION, index,
+                 g_variant_new("(u)", (guint32)type));
+}
+
+void cad_trace_card_info(const pa_card_info *info)
+{
+    GVariantBuilder profiles, ports;
+    guint32 i;
+
+    if (!trace_file)
+        return;
+
+    g_variant_builder_init(&profiles, G_VARIANT_TYPE("a(su)"));
+    for (i = 0; i < info->n_profiles; i++) {
+        g_variant_builder_add(&profiles, "(su)", info->profiles2[i]->name,
+                              (guint32)info->profiles2[i]->available);
+    }
+
+    g_variant_builder_init(&ports, G_VARIANT_TYPE("a(su)"));
+    for (i = 0; i < info->n_ports; i++) {
+        g_variant_builder_add(&ports, "(su)", info->ports[i]->name,
+                              (guint32)info->ports[i]->available);
+    }
+
+    trace_record(CAD_TRACE_EVENT_CARD_INFO, info->index,
+                 g_variant_new("(sss@a{ss}a(su)a(su))",
+                               info->name ? info->name : "",
+                               info->driver ? info->driver : "",
+                               info->active_profile2 ? info->active_profile2->name : "",
+                               proplist_to_variant(info->proplist),
+                               &profiles, &ports));
+}
+
+void cad_trace_sink_info(const pa_sink_info *info)
+{
+    if (!trace_file)
+        return;
+
+    trace_record(CAD_TRACE_EVENT_SINK_INFO, info->index,
+                 g_variant_new("(sus@a(suu)uybtt@a{ss})",
+                               info->name ? info->name : "",
+                               info->card,
+                               info->active_port ? info->active_port->name : "",
+                               sink_ports_to_variant(info->ports, info->n_ports),
+                               info->sample_spec.rate,
+                               info->sample_spec.channels,
+                               (gboolean)!!info->mute,
+                               (guint64)info->latency,
+                               (guint64)info->configured_latency,
+                               proplist_to_variant(info->proplist)));
+}
+
+void cad_trace_source_info(const pa_source_info *info)
+{
+    if (!trace_file)
+        return;
+
+    trace_record(CAD_TRACE_EVENT_SOURCE_INFO, info->index,
+                 g_variant_new("(sus@a(suu)uybtt@a{ss}u)",
+                               info->name ? info->name : "",
+                               info->card,
+                               info->active_port ? info->active_port->name : "",
+                               source_ports_to_variant(info->ports, info->n_ports),
+                               info->sample_spec.rate,
+                               info->sample_spec.channels,
+                               (gboolean)!!info->mute,
+                               (guint64)info->latency,
+                               (guint64)info->configured_latency,
+                               proplist_to_variant(info->proplist),
+                               info->monitor_of_sink));
+}
+
+void cad_trace_module_info(const pa_module_info *info)
+{
+    if (!trace_file)
+        return;
+
+    trace_record(CAD_TRACE_EVENT_MODULE_INFO, info->index,
+                 g_variant_new("(ss)", info->name ? info->name : "",
+                               info->argument ? info->argument : ""));
+}
+
+void cad_trace_operation_started(guint type, guint value)
+{
+    if (!trace_file)
+        return;
+
+    trace_record(CAD_TRACE_EVENT_OPERATION_STARTED, type, g_variant_new("(u)", value));
+}
+
+void cad_trace_operation(guint type, guint value, gboolean success)
+{
+    if (!trace_file)
+        return;
+
+    trace_record(success ? CAD_TRACE_EVENT_OPERATION_SUCCEEDED :
+                           CAD_TRACE_EVENT_OPERATION_FAILED,
+                 type, g_variant_new("(u)", value));
+}
+
+static const gchar *get_payload_type(guint32 event)
+{
+    switch (event) {
+    case CAD_TRACE_EVENT_SUBSCRIPTION:
+    case CAD_TRACE_EVENT_OPERATION_SUCCEEDED:
+    case CAD_TRACE_EVENT_OPERATION_FAILED:
+    case CAD_TRACE_EVENT_OPERATION_STARTED:
+        return "(u)";
+    case CAD_TRACE_EVENT_CARD_INFO:
+        return "(sssa{ss}a(su)a(su))";
+    case CAD_TRACE_EVENT_SINK_INFO:
+        return "(susa(suu)uybtta{ss})";
+    case CAD_TRACE_EVENT_SOURCE_INFO:
+        return "(susa(suu)uybtta{ss}u)";
+    case CAD_TRACE_EVENT_MODULE_INFO:
+        return "(ss)";
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * cad_trace_read:
+ * @path: trace file to read
+ * @func: function called for each record
+ * @user_data: data to pass to @func
+ * @error: Error information
+ *
+ * Read back a trace recorded with cad_trace_open(), calling @func for each
+ * record in order. A trace cut short by a crash ends with a truncated
+ * record: @func is called for all the complete records before an error is
+ * returned.
+ *
+ * Returns: %TRUE if the whole trace was read, or %FALSE on error.
+ */
+gboolean cad_trace_read(const gchar *path, CadTraceFunc func,
+                        gpointer user_data, GError **error)
+{
+    g_autoptr(GMappedFile) file = NULL;
+    const gchar *data, *end;
+    guint32 version;
+    gsize header_size = strlen(CAD_TRACE_MAGIC) + sizeof(version);
+
+    file = g_mapped_file_new(path, FALSE, error);
+    if (!file)
+        return FALSE;
+
+    data = g_mapped_file_get_contents(file);
+    end = data + g_mapped_file_get_length(file);
+
+    if ((gsize)(end - data) < header_size ||
+        memcmp(data, CAD_TRACE_MAGIC, strlen(CAD_TRACE_MAGIC)) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "'%s' is not a trace file", path);
+        return FALSE;
+    }
+
+    memcpy(&version, data + strlen(CAD_TRACE_MAGIC), sizeof(version));
+    if (version != CAD_TRACE_VERSION) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                    "Unsupported trace version %u", version);
+        return FALSE;
+    }
+
+    data += header_size;
+    while (data < end) {
+        g_autoptr(GVariant) payload = NULL;
+        g_autoptr(GBytes) bytes = NULL;
+        CadTraceRecord record;
+        const gchar *type;
+
+        if ((gsize)(end - data) < sizeof(record)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                        "Truncated trace record header");
+            return FALSE;
+        }
+        memcpy(&record, data, sizeof(record));
+        data += sizeof(record);
+
+        if ((gsize)(end - data) < record.size) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                        "Truncated trace record payload");
+            return FALSE;
+        }
+
+        type = get_payload_type(record.event);
+        if (!type) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                        "Unknown trace event %u", record.event);
+            return FALSE;
+        }
+
+        /* Copy the payload, GVariant needs it to be properly aligned */
+        bytes = g_bytes_new(data, record.size);
+        payload = g_variant_ref_sink(g_variant_new_from_bytes(G_VARIANT_TYPE(type),
+                                                              bytes, FALSE));
+        data += record.size;
+
+        if (!func(&record, payload, user_data))
+            break;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+G_BEGIN_DECLS
+
+#define CAD_TRACE_MAGIC   "CADTRACE"
+#define CAD_TRACE_VERSION 3
+
+/**
+ * CadTraceEvent:
+ * @CAD_TRACE_EVENT_SUBSCRIPTION: PulseAudio subscription event, the payload
+ *   is `(u)`: the pa_subscription_event_type_t value
+ * @CAD_TRACE_EVENT_CARD_INFO: card introspection reply, the payload is
+ *   `(sssa{ss}a(su)a(su))`: name, driver, active profile, properties,
+ *   profiles and ports (name and availability)
+ * @CAD_TRACE_EVENT_SINK_INFO: sink introspection reply, the payload is
+ *   `(susa(suu)uybtta{ss})`: name, card, active port, ports (name, priority
+ *   and availability), sample rate, channels, mute state, latency,
+ *   configured latency and properties
+ * @CAD_TRACE_EVENT_SOURCE_INFO: source introspection reply, the payload is
+ *   the same as @CAD_TRACE_EVENT_SINK_INFO followed by the index of the sink
+ *   it monitors: `(susa(suu)uybtta{ss}u)`
+ * @CAD_TRACE_EVENT_MODULE_INFO: module introspection reply, the payload is
+ *   `(ss)`: name and arguments
+ * @CAD_TRACE_EVENT_OPERATION_SUCCEEDED: routing operation completed, the
+ *   record index holds the #CadOperationType and the payload is `(u)`: the
+ *   requested value
+ * @CAD_TRACE_EVENT_OPERATION_FAILED: routing operation failed, same layout
+ *   as @CAD_TRACE_EVENT_OPERATION_SUCCEEDED
+ * @CAD_TRACE_EVENT_OPERATION_STARTED: routing operation requested, same
+ *   layout as @CAD_TRACE_EVENT_OPERATION_SUCCEEDED
+ *
+ * Types of events stored in a trace file. Strings missing from the reply
+ * (e.g. a sink without active port) are recorded as empty strings.
+ */
+typedef enum {
+    CAD_TRACE_EVENT_SUBSCRIPTION = 0,
+    CAD_TRACE_EVENT_CARD_INFO,
+    CAD_TRACE_EVENT_SINK_INFO,
+    CAD_TRACE_EVENT_SOURCE_INFO,
+    CAD_TRACE_EVENT_MODULE_INFO,
+    CAD_TRACE_EVENT_OPERATION_SUCCEEDED,
+    CAD_TRACE_EVENT_OPERATION_FAILED,
+    CAD_TRACE_EVENT_OPERATION_STARTED,
+} CadTraceEvent;
+
+/*
+ * A trace file starts with CAD_TRACE_MAGIC (without the trailing NUL) and a
+ * guint32 version, followed by records in host byte order. Each record is
+ * made of this header, followed by @size bytes holding the payload, a
+ * serialized GVariant whose type depends on @event.
+ */
+typedef struct _CadTraceRecord {
+    guint64 timestamp; /* microseconds since the trace was opened */
+    guint32 index;
+    guint32 event;
+    guint32 size;
+    guint32 reserved;
+} CadTraceRecord;
+
+/**
+ * CadTraceFunc:
+ * @record: the record header
+ * @payload: the record payload, of the type documented in #CadTraceEvent
+ * @user_data: user data passed to cad_trace_read()
+ *
+ * Returns: %FALSE to stop reading the trace.
+ */
+typedef gboolean (*CadTraceFunc)(const CadTraceRecord *record,
+                                 GVariant             *payload,
+                                 gpointer              user_data);
+
+gboolean cad_trace_open(const gchar *path, GError **error);
+void cad_trace_close(void);
+
+void cad_trace_subscription(guint32 index, pa_subscription_event_type_t type);
+void cad_trace_card_info(const pa_card_info *info);
+void cad_trace_sink_info(const pa_sink_info *info);
+void cad_trace_source_info(const pa_source_info *info);
+void cad_trace_module_info(const pa_module_info *info);
+void cad_trace_operation_started(guint type, guint value);
+void cad_trace_operation(guint type, guint value, gboolean success);
+
+gboolean cad_trace_read(const gchar *path, CadTraceFunc func,
+                        gpointer user_data, GError **error);
+
+G_END_DECLS
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-ucm"
+
+#include "cad-ucm.h"
+
+#include <gio/gio.h>
+#include <alsa/asoundlib.h>
+#include <alsa/use-case.h>
+
+/*
+ * Direct ALSA UCM routing, used when no sound server is available (yet),
+ * e.g. for emergency calls during early boot or on minimal images. Verbs and
+ * devices are switched through the UCM manager, and the microphone is muted
+ * through the capture switch of the mixer element UCM associates with it.
+ */
+
+#define UCM_DEFAULT_CTL "default"
+#define UCM_DEFAULT_MIC_ELEM "Capture"
+
+static snd_use_case_mgr_t *ucm;
+static snd_mixer_t *mixer;
+static gchar *mixer_ctl;
+static gchar *mic_elem;
+
+static CallAudioMode current_mode = CALL_AUDIO_MODE_UNKNOWN;
+static gboolean speaker_enabled;
+
+static gchar *get_value(const gchar *identifier, const gchar *fallback)
+{
+    const char *value = NULL;
+    gchar *ret;
+
+    if (snd_use_case_get(ucm, identifier, &value) < 0 || !value)
+        return g_strdup(fallback);
+
+    ret = g_strdup(value);
+    free((void *)value);
+
+    return ret;
+}
+
+/*
+ * The control device of the card UCM was opened for. UCM values such as
+ * CaptureCTL are only defined once a verb is set, so this can't rely on them.
+ */
+static gchar *get_card_ctl(const gchar *card)
+{
+    g_autofree gchar *name = get_value("_cardname", NULL);
+    int index = -1;
+
+    if (name && g_str_has_prefix(name, "hw:"))
+        return g_steal_pointer(&name);
+
+    if (name)
+        index = snd_card_get_index(name);
+    if (index < 0)
+        index = snd_card_get_index(g_str_has_prefix(card, "hw:") ? card + 3 : card);
+    if (index < 0)
+        return g_strdup(UCM_DEFAULT_CTL);
+
+    return g_strdup_printf("hw:%d", index);
+}
+
+static gboolean open_mixer(const gchar *ctl, GError **error)
+{
+    snd_mixer_t *new_mixer = NULL;
+    int err;
+
+    err = snd_mixer_open(&new_mixer, 0);
+    if (err == 0)
+        err = snd_mixer_attach(new_mixer, ctl);
+    if (err == 0)
+        err = snd_mixer_selem_register(new_mixer, NULL, NULL);
+    if (err == 0)
+        err = snd_mixer_load(new_mixer);
+
+    /* Keep using the previous mixer if the new one can't be opened */
+    if (err < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(-err),
+                    "Unable to open mixer '%s': %s", ctl, snd_strerror(err));
+        g_clear_pointer(&new_mixer, snd_mixer_close);
+        return FALSE;
+    }
+
+    g_clear_pointer(&mixer, snd_mixer_close);
+    mixer = new_mixer;
+    g_free(mixer_ctl);
+    mixer_ctl = g_strdup(ctl);
+
+    return TRUE;
+}
+
+/*
+ * The microphone's mixer element, and possibly its control device, depend on
+ * the verb: look them up again each time it changes.
+ */
+static void update_mic_elem(void)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *ctl = get_value("CaptureCTL/" SND_USE_CASE_DEV_MIC, NULL);
+
+    if (!ctl)
+        ctl = get_value("CaptureCTL", NULL);
+    if (ctl && g_strcmp0(ctl, mixer_ctl) != 0 && !open_mixer(ctl, &error))
+        g_warning("%s", error->message);
+
+    g_free(mic_elem);
+    mic_elem = get_value("CaptureMixerElem/" SND_USE_CASE_DEV_MIC,
+                         UCM_DEFAULT_MIC_ELEM);
+}
+
+/**
+ * cad_ucm_init:
+ * @card: the ALSA card name or index, as understood by alsaucm
+ * @error: Error information
+ *
+ * Open the UCM configuration for @card. This doesn't change the current
+ * routing.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_ucm_init(const gchar *card, GError **error)
+{
+    g_autofree gchar *ctl = NULL;
+    int err;
+
+    err = snd_use_case_mgr_open(&ucm, card);
+    if (err < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(-err),
+                    "Unable to open UCM for card '%s': %s", card,
+                    snd_strerror(err));
+        ucm = NULL;
+        return FALSE;
+    }
+
+    ctl = get_card_ctl(card);
+    if (!open_mixer(ctl, error)) {
+        cad_ucm_destroy();
+        return FALSE;
+    }
+
+    /* Updated once a verb is set */
+    mic_elem = g_strdup(UCM_DEFAULT_MIC_ELEM);
+    g_message("UCM routing available for card '%s'", card);
+
+    return TRUE;
+}
+
+void cad_ucm_destroy(void)
+{
+    g_clear_pointer(&mixer, snd_mixer_close);
+    g_clear_pointer(&ucm, snd_use_case_mgr_close);
+    g_clear_pointer(&mixer_ctl, g_free);
+    g_clear_pointer(&mic_elem, g_free);
+    current_mode = CALL_AUDIO_MODE_UNKNOWN;
+}
+
+gboolean cad_ucm_is_available(void)
+{
+    return ucm != NULL;
+}
+
+static gboolean set_device(const gchar *device, gboolean enable)
+{
+    int err = snd_use_case_set(ucm, enable ? "_enadev" : "_disdev", device);
+
+    /* Disabling a device which isn't enabled isn't an error for us */
+    if (err < 0 && enable) {
+        g_warning("Unable to enable UCM device '%s': %s", device, snd_strerror(err));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean in_call(void)
+{
+    return current_mode == CALL_AUDIO_MODE_CALL || current_mode == CALL_AUDIO_MODE_VOIP;
+}
+
+static gboolean apply_output(void)
+{
+    const gchar *output = SND_USE_CASE_DEV_SPEAKER;
+    const gchar *other = SND_USE_CASE_DEV_EARPIECE;
+
+    if (in_call() && !speaker_enabled) {
+        output = SND_USE_CASE_DEV_EARPIECE;
+        other = SND_USE_CASE_DEV_SPEAKER;
+    }
+
+    set_device(other, FALSE);
+    return set_device(output, TRUE);
+}
+
+/**
+ * cad_ucm_select_mode:
+ * @mode: the #CallAudioMode to switch to
+ *
+ * Switch to the VoiceCall verb (or HiFi if the card doesn't provide it) in
+ * call mode, or to the HiFi verb otherwise, and route audio to the relevant
+ * devices. VoIP mode uses the HiFi verb with the call mode routing.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_ucm_select_mode(CallAudioMode mode)
+{
+    const gchar *verb = SND_USE_CASE_VERB_HIFI;
+    gint64 start = g_get_monotonic_time();
+    int err = -1;
+
+    g_return_val_if_fail(ucm != NULL, FALSE);
+
+    if (mode == CALL_AUDIO_MODE_CALL) {
+        err = snd_use_case_set(ucm, "_verb", SND_USE_CASE_VERB_VOICECALL);
+        if (err == 0)
+            verb = SND_USE_CASE_VERB_VOICECALL;
+        else
+            g_debug("No '%s' verb, falling back to '%s'",
+                    SND_USE_CASE_VERB_VOICECALL, SND_USE_CASE_VERB_HIFI);
+    }
+
+    if (err < 0) {
+        err = snd_use_case_set(ucm, "_verb", verb);
+        if (err < 0) {
+            g_warning("Unable to set UCM verb '%s': %s", verb, snd_strerror(err));
+            return FALSE;
+        }
+    }
+
+    update_mic_elem();
+
+    current_mode = mode;
+    if (!apply_output())
+        return FALSE;
+
+    if (in_call() && !set_device(SND_USE_CASE_DEV_MIC, TRUE))
+        return FALSE;
+
+    g_debug("UCM: switched to '%s' in %" G_GINT64_FORMAT " us", verb,
+            g_get_monotonic_time() - start);
+
+    return TRUE;
+}
+
+/**
+ * cad_ucm_enable_speaker:
+ * @enable: whether to route call audio to the speaker
+ *
+ * In call mode, switch between the earpiece and the speaker. In default mode,
+ * the speaker is always used, so this only records the setting for the next
+ * call.
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_ucm_enable_speaker(gboolean enable)
+{
+    gint64 start = g_get_monotonic_time();
+
+    g_return_val_if_fail(ucm != NULL, FALSE);
+
+    speaker_enabled = enable;
+    if (in_call() && !apply_output())
+        return FALSE;
+
+    g_debug("UCM: speaker %s in %" G_GINT64_FORMAT " us",
+            enable ? "enabled" : "disabled", g_get_monotonic_time() - start);
+
+    return TRUE;
+}
+
+/**
+ * cad_ucm_mute_mic:
+ * @mute: whether to mute the microphone
+ *
+ * Returns: %TRUE if successful, or %FALSE on error.
+ */
+gboolean cad_ucm_mute_mic(gboolean mute)
+{
+    snd_mixer_selem_id_t *sid;
+    snd_mixer_elem_t *elem;
+    gint64 start = g_get_monotonic_time();
+    int err;
+
+    g_return_val_if_fail(mixer != NULL, FALSE);
+
+    snd_mixer_selem_id_alloca(&sid);
+    snd_mixer_selem_id_set_name(sid, mic_elem);
+    elem = snd_mixer_find_selem(mixer, sid);
+    if (!elem || !snd_mixer_selem_has_capture_switch(elem)) {
+        g_warning("No capture switch for mixer element '%s'", mic_elem);
+        return FALSE;
+    }
+
+    err = snd_mixer_selem_set_capture_switch_all(elem, !mute);
+    if (err < 0) {
+        g_warning("Unable to %s '%s': %s", mute ? "mute" : "unmute", mic_elem,
+                  snd_strerror(err));
+        return FALSE;
+    }
+
+    g_debug("UCM: mic %s in %" G_GINT64_FORMAT " us",
+            mute ? "muted" : "unmuted", g_get_monotonic_time() - start);
+
+    return TRUE;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean cad_ucm_init(const gchar *card, GError **error);
+void cad_ucm_destroy(void);
+gboolean cad_ucm_is_available(void);
+
+gboolean cad_ucm_select_mode(CallAudioMode mode);
+gboolean cad_ucm_enable_speaker(gboolean enable);
+gboolean cad_ucm_mute_mic(gboolean mute);
+
+G_END_DECLS
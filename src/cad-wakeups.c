@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "callaudiod-wakeups"
+
+#include "cad-wakeups.h"
+
+/******************************************************************************
+ * Idle wakeups accounting
+ *
+ * Between calls, callaudiod should only wake up when something actually
+ * happens (client request, sound server or udev event). To check this, the
+ * main context's poll function is wrapped so each blocking poll which
+ * returns while idle is counted as a wakeup. Non-blocking polls (with a zero
+ * timeout) happen while sources are already being dispatched and aren't
+ * wakeups.
+ ******************************************************************************/
+
+static GPollFunc default_poll;
+static gboolean idle;
+static gint64 idle_since;
+static gint64 idle_time;
+static guint64 idle_wakeups;
+
+static gint counting_poll(GPollFD *fds, guint nfds, gint timeout)
+{
+    gint ret = default_poll(fds, nfds, timeout);
+
+    if (idle && timeout != 0 && ret >= 0)
+        idle_wakeups++;
+
+    return ret;
+}
+
+/**
+ * cad_wakeups_init:
+ * @context: (nullable): the #GMainContext to monitor, or %NULL for the
+ *   default one
+ *
+ * Start counting wakeups of @context's main loop. This must be called
+ * before the main loop is run.
+ */
+void cad_wakeups_init(GMainContext *context)
+{
+    if (!context)
+        context = g_main_context_default();
+
+    default_poll = g_main_context_get_poll_func(context);
+    g_main_context_set_poll_func(context, counting_poll);
+}
+
+/**
+ * cad_wakeups_set_idle:
+ * @is_idle: whether callaudiod is now idle
+ *
+ * Only wakeups happening while idle are counted.
+ */
+void cad_wakeups_set_idle(gboolean is_idle)
+{
+    gint64 now = g_get_monotonic_time();
+
+    if (idle == is_idle)
+        return;
+
+    if (idle) {
+        idle_time += now - idle_since;
+        g_debug("%" G_GUINT64_FORMAT " wakeups while idle so far (%.1f per hour)",
+                idle_wakeups, cad_wakeups_get_idle_rate());
+    }
+
+    idle = is_idle;
+    idle_since = now;
+}
+
+/**
+ * cad_wakeups_get_idle_count:
+ *
+ * Returns: the number of wakeups while idle since startup.
+ */
+guint64 cad_wakeups_get_idle_count(void)
+{
+    return idle_wakeups;
+}
+
+/**
+ * cad_wakeups_get_idle_rate:
+ *
+ * Returns: the average number of wakeups per hour spent idle.
+ */
+gdouble cad_wakeups_get_idle_rate(void)
+{
+    gint64 total = idle_time;
+
+    if (idle)
+        total += g_get_monotonic_time() - idle_since;
+
+    if (total <= 0)
+        return 0.0;
+
+    return idle_wakeups * (3600.0 * G_USEC_PER_SEC) / total;
+}
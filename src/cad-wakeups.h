@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void cad_wakeups_init(GMainContext *context);
+void cad_wakeups_set_idle(gboolean is_idle);
+guint64 cad_wakeups_get_idle_count(void);
+gdouble cad_wakeups_get_idle_rate(void);
+
+G_END_DECLS
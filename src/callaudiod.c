@@ -8,8 +8,13 @@
 #define G_LOG_DOMAIN "callaudiod"
 
 #include "callaudiod.h"
+#include "cad-backend.h"
 #include "cad-manager.h"
 #include "cad-pulse.h"
+#include "cad-snapshot.h"
+#include "cad-trace.h"
+#include "cad-ucm.h"
+#include "cad-wakeups.h"
 #include "config.h"
 
 #include <glib.h>
@@ -17,6 +22,11 @@
 
 static GMainLoop *main_loop = NULL;
 
+static gint64 start_time;
+static gboolean got_reply;
+static guint idle_timeout;
+static guint idle_timeout_id;
+
 static gboolean quit_cb(gpointer user_data)
 {
     g_info("Caught signal, shutting down...");
@@ -29,6 +39,76 @@ static gboolean quit_cb(gpointer user_data)
     return FALSE;
 }
 
+/******************************************************************************
+ * Exit on idle
+ *
+ * When an idle timeout is set, the daemon exits once it has been left in
+ * default mode, with no bluetooth audio routing and no client requests, for
+ * that long. It will be re-activated by D-Bus on the next request.
+ ******************************************************************************/
+
+static gboolean audio_is_idle(void)
+{
+    return cad_backend_get_audio_mode() != CALL_AUDIO_MODE_CALL &&
+           cad_backend_get_audio_mode() != CALL_AUDIO_MODE_VOIP &&
+           cad_backend_get_bt_audio_state() != CALL_AUDIO_BT_ENABLED;
+}
+
+static gboolean idle_timeout_cb(gpointer user_data)
+{
+    idle_timeout_id = 0;
+
+    /*
+     * Leaving call mode or disabling bluetooth audio will re-arm the timer
+     * through a property change, no need to do it here.
+     */
+    if (!audio_is_idle()) {
+        g_debug("Idle timeout reached, but audio is in use");
+        return G_SOURCE_REMOVE;
+    }
+
+    g_message("Idle for %us, shutting down...", idle_timeout);
+    g_main_loop_quit(main_loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void reset_idle_timeout(void)
+{
+    if (idle_timeout == 0)
+        return;
+
+    if (idle_timeout_id)
+        g_source_remove(idle_timeout_id);
+    idle_timeout_id = g_timeout_add_seconds(idle_timeout, idle_timeout_cb, NULL);
+}
+
+static void activity_cb(CadManager *manager, gpointer user_data)
+{
+    reset_idle_timeout();
+}
+
+/*
+ * Measure activation latency up to the first reply, as this is what a client
+ * activating the daemon actually waits for.
+ */
+static void replied_cb(CadManager *manager, gpointer user_data)
+{
+    if (got_reply)
+        return;
+
+    got_reply = TRUE;
+    g_message("First reply sent %.1f ms after startup",
+              (g_get_monotonic_time() - start_time) / 1000.0);
+}
+
+static void state_changed_cb(GObject *object, GParamSpec *pspec,
+                             gpointer user_data)
+{
+    cad_wakeups_set_idle(audio_is_idle());
+    reset_idle_timeout();
+}
+
 
 static void bus_acquired_cb(GDBusConnection *connection, const gchar *name,
                             gpointer user_data)
@@ -66,14 +146,101 @@ static void name_lost_cb(GDBusConnection *connection, const gchar *name,
 
 int main(int argc, char **argv)
 {
+    g_autoptr(GOptionContext) opt_context = NULL;
+    g_autoptr(GError) err = NULL;
+    g_autofree gchar *trace_path = NULL;
+    g_autofree gchar *ucm_card = NULL;
+    gint idle_timeout_arg = 0;
+    gboolean suspend_unused = FALSE;
+    gboolean echo_cancel = FALSE;
+    gint sidetone = 0;
+    gboolean meter = FALSE;
+    gboolean watchdog = FALSE;
+    gboolean watchdog_reapply = FALSE;
+    gboolean pipewire = FALSE;
+    CadManager *manager;
+
+    const GOptionEntry options [] = {
+        {"trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_path,
+         "Record PulseAudio events to FILE", "FILE"},
+        {"idle-timeout", 'i', 0, G_OPTION_ARG_INT, &idle_timeout_arg,
+         "Exit after SECONDS of inactivity in default mode", "SECONDS"},
+        {"ucm-card", 'u', 0, G_OPTION_ARG_STRING, &ucm_card,
+         "Route through ALSA UCM on CARD while PulseAudio isn't available", "CARD"},
+        {"suspend-unused", 's', 0, G_OPTION_ARG_NONE, &suspend_unused,
+         "Suspend sinks and sources unused by calls while in call mode", NULL},
+        {"echo-cancel", 'e', 0, G_OPTION_ARG_NONE, &echo_cancel,
+         "Use echo cancellation and noise suppression on VoIP speakerphone calls", NULL},
+        {"sidetone", 'S', 0, G_OPTION_ARG_INT, &sidetone,
+         "Enable sidetone on earpiece and headset calls at LEVEL percent", "LEVEL"},
+        {"meter", 'l', 0, G_OPTION_ARG_NONE, &meter,
+         "Publish microphone and output levels during calls", NULL},
+        {"watchdog", 'w', 0, G_OPTION_ARG_NONE, &watchdog,
+         "Check the call route for problems during calls", NULL},
+        {"watchdog-reapply", 0, 0, G_OPTION_ARG_NONE, &watchdog_reapply,
+         "Reapply the call route when the watchdog detects a problem", NULL},
+#if HAVE_PIPEWIRE
+        {"pipewire", 'P', 0, G_OPTION_ARG_NONE, &pipewire,
+         "Use the experimental native PipeWire backend instead of PulseAudio", NULL},
+#endif
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+    };
+
+    start_time = g_get_monotonic_time();
+
+    opt_context = g_option_context_new("- Call audio routing daemon");
+    g_option_context_add_main_entries(opt_context, options, NULL);
+    if (!g_option_context_parse(opt_context, &argc, &argv, &err)) {
+        g_warning("%s", err->message);
+        return 1;
+    }
+
+    if (trace_path && !cad_trace_open(trace_path, &err)) {
+        g_warning("%s", err->message);
+        return 1;
+    }
+
+    if (idle_timeout_arg > 0)
+        idle_timeout = (guint)idle_timeout_arg;
+
+    if (ucm_card && !cad_ucm_init(ucm_card, &err)) {
+        g_warning("%s", err->message);
+        g_clear_error(&err);
+    }
+
     g_unix_signal_add(SIGTERM, quit_cb, NULL);
     g_unix_signal_add(SIGINT, quit_cb, NULL);
 
     main_loop = g_main_loop_new(NULL, FALSE);
+    cad_wakeups_init(NULL);
 
     g_message("**** Callaudiod 0.1.4 Start ****");
-    // Initialize the PulseAudio backend
-    cad_pulse_get_default();
+    // Initialize the audio backend
+    cad_backend_init(pipewire);
+    if (!cad_backend_is_pipewire()) {
+        cad_pulse_set_suspend_unused(suspend_unused);
+        cad_pulse_set_echo_cancel(echo_cancel);
+        cad_pulse_set_sidetone(sidetone > 0 ? (guint)sidetone : 0);
+        cad_pulse_set_meter(meter);
+        cad_pulse_set_watchdog(watchdog || watchdog_reapply, watchdog_reapply);
+    } else if (suspend_unused || echo_cancel || sidetone > 0 || meter ||
+               watchdog || watchdog_reapply) {
+        g_warning("The PipeWire backend doesn't support suspend-unused, "
+                  "echo-cancel, sidetone, meter and watchdog, ignoring");
+    }
+
+    /*
+     * PA introspection is asynchronous: publish the last known state right
+     * away so clients activating us don't have to wait for it.
+     */
+    manager = cad_manager_get_default();
+    cad_snapshot_restore(manager);
+    g_signal_connect(manager, "activity", G_CALLBACK(activity_cb), NULL);
+    g_signal_connect(manager, "replied", G_CALLBACK(replied_cb), NULL);
+    g_signal_connect(manager, "notify", G_CALLBACK(state_changed_cb), NULL);
+    cad_wakeups_set_idle(audio_is_idle());
+    reset_idle_timeout();
+
     g_bus_own_name(CALLAUDIO_DBUS_TYPE, CALLAUDIO_DBUS_NAME,
                    G_BUS_NAME_OWNER_FLAGS_NONE,
                    bus_acquired_cb, name_acquired_cb, name_lost_cb,
@@ -82,5 +249,13 @@ int main(int argc, char **argv)
     g_main_loop_run(main_loop);
     g_main_loop_unref(main_loop);
 
+    g_message("%" G_GUINT64_FORMAT " wakeups while idle (%.1f per hour)",
+              cad_wakeups_get_idle_count(), cad_wakeups_get_idle_rate());
+
+    if (!cad_snapshot_save(manager, &err))
+        g_warning("Unable to save state: %s", err->message);
+    cad_ucm_destroy();
+    cad_trace_close();
+
     return 0;
 }
@@ -8,6 +8,15 @@
 #include "cad-manager.h"
 #include <string.h>
 
+static gboolean bt_scan_timeout_cb(gpointer data)
+{
+    CadManager *manager = data;
+
+    manager->bt_scan_id = 0;
+
+    return scan_bt_devices(manager);
+}
+
 static void udev_event_cb(GUdevClient *client, gchar *action, GUdevDevice *device, gpointer data)
 {   
     CadManager *manager = data;
@@ -22,8 +31,14 @@ static void udev_event_cb(GUdevClient *client, gchar *action, GUdevDevice *devic
     } else {
         g_message("Bluetooth device change, unknown action %s", action);
     }
-    /* We wait for a few seconds to give time to PA to populate the card */
-    g_timeout_add_seconds(5, G_SOURCE_FUNC(scan_bt_devices), manager);
+    /*
+     * We wait for a few seconds to give time to PA to populate the card.
+     * A single device usually triggers a burst of uevents, only keep one
+     * pending scan and restart its timer on each event.
+     */
+    if (manager->bt_scan_id)
+        g_source_remove(manager->bt_scan_id);
+    manager->bt_scan_id = g_timeout_add_seconds(5, bt_scan_timeout_cb, manager);
     return;
 }
 
@@ -39,6 +54,11 @@ void udev_init (CadManager *manager)
 
 void udev_destroy (CadManager *manager)
 {
+    if (manager->bt_scan_id) {
+        g_source_remove(manager->bt_scan_id);
+        manager->bt_scan_id = 0;
+    }
+
     if (manager->udev) {
         g_object_unref(manager->udev);
         manager->udev = NULL;
@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "alloc-counter.h"
+
+#include <stdlib.h>
+
+/*
+ * Count heap allocations made by the test program and the libraries it uses,
+ * by wrapping glibc's allocator: the functions defined here take precedence
+ * over the ones from libc. free() and the aligned allocation functions still
+ * go straight to glibc, which owns all the memory anyway.
+ *
+ * Sanitizers provide their own allocator, and valgrind's replaces glibc's
+ * (still counted, as it also replaces the __libc_* entry points): the counter
+ * is only disabled in the former case.
+ */
+#if defined(__has_feature)
+# if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer) || \
+     __has_feature(thread_sanitizer)
+#  define ALLOC_COUNTER_DISABLED
+# endif
+#endif
+#if !defined(__GLIBC__) || defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+# define ALLOC_COUNTER_DISABLED
+#endif
+
+#ifndef ALLOC_COUNTER_DISABLED
+
+static guint64 allocations;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    /* Only count new blocks, not resizes */
+    if (!ptr)
+        __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+
+    return __libc_realloc(ptr, size);
+}
+
+gboolean alloc_counter_is_available(void)
+{
+    return TRUE;
+}
+
+/**
+ * alloc_counter_get:
+ *
+ * Returns: the number of blocks allocated by the process so far, in all
+ * threads.
+ */
+guint64 alloc_counter_get(void)
+{
+    return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+#else /* ALLOC_COUNTER_DISABLED */
+
+gboolean alloc_counter_is_available(void)
+{
+    return FALSE;
+}
+
+guint64 alloc_counter_get(void)
+{
+    return 0;
+}
+
+#endif /* ALLOC_COUNTER_DISABLED */
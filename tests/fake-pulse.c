@@ -0,0 +1,2265 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "fake-pulse"
+
+#include "fake-pulse.h"
+
+#include <pulse/glib-mainloop.h>
+
+#include <string.h>
+
+/*
+ * A stand-in for libpulse and libpulse-mainloop-glib, linked into the tests
+ * instead of the real libraries. It emulates a PulseAudio server serving
+ * scripted cards through the GLib main loop, with the ordering guarantees
+ * callaudiod relies on: requests are answered in order after a configurable
+ * latency, subscription events come right after the reply to the request
+ * which triggered them, and pending requests are dropped without calling
+ * back when the connection is lost.
+ * Only what callaudiod uses is implemented; the default main context is
+ * always used.
+ */
+
+static const gchar * const internal_properties[] = {
+    PA_PROP_DEVICE_BUS_PATH, "platform-sound",
+    PA_PROP_DEVICE_FORM_FACTOR, "internal",
+    "alsa.card_name", "sun50i-a64-audio",
+    PA_PROP_DEVICE_CLASS, "sound",
+    NULL
+};
+
+static const FakePulsePort internal_ports[] = {
+    { "[Out] Headphones", PA_DIRECTION_OUTPUT, 300, PA_PORT_AVAILABLE_NO },
+    { "[Out] Speaker", PA_DIRECTION_OUTPUT, 200, PA_PORT_AVAILABLE_UNKNOWN },
+    { "[Out] Earpiece", PA_DIRECTION_OUTPUT, 100, PA_PORT_AVAILABLE_UNKNOWN },
+    { "[In] Mic", PA_DIRECTION_INPUT, 100, PA_PORT_AVAILABLE_UNKNOWN },
+    { "[In] Headset", PA_DIRECTION_INPUT, 200, PA_PORT_AVAILABLE_NO },
+    { NULL }
+};
+
+static const gchar * const pinephone_profiles[] = {
+    "HiFi", "Voice Call", "Voice Call BT", "off", NULL
+};
+
+const FakePulseCard fake_pulse_pinephone = {
+    .name = "alsa_card.platform-sound",
+    .driver = "module-alsa-card.c",
+    .properties = internal_properties,
+    .profiles = pinephone_profiles,
+    .ports = internal_ports,
+    .rate = 48000,
+};
+
+static const gchar * const librem5_profiles[] = { "HiFi", "off", NULL };
+
+/* Calls are routed by switching ports, there's no voice profile */
+const FakePulseCard fake_pulse_librem5 = {
+    .name = "alsa_card.platform-sound",
+    .driver = "module-alsa-card.c",
+    .properties = internal_properties,
+    .profiles = librem5_profiles,
+    .ports = internal_ports,
+    .rate = 48000,
+};
+
+static const gchar * const bt_properties[] = {
+    PA_PROP_DEVICE_BUS, "bluetooth",
+    PA_PROP_DEVICE_FORM_FACTOR, "headset",
+    PA_PROP_DEVICE_CLASS, "sound",
+    NULL
+};
+
+static const gchar * const bt_profiles[] = {
+    "a2dp_sink", "handsfree_head_unit", "off", NULL
+};
+
+static const FakePulsePort bt_ports[] = {
+    { "headset-output", PA_DIRECTION_OUTPUT, 0, PA_PORT_AVAILABLE_UNKNOWN },
+    { "headset-input", PA_DIRECTION_INPUT, 0, PA_PORT_AVAILABLE_UNKNOWN },
+    { NULL }
+};
+
+const FakePulseCard fake_pulse_bt_headset = {
+    .name = "bluez_card.00_11_22_33_44_55",
+    .driver = "module-bluez5-device.c",
+    .properties = bt_properties,
+    .profiles = bt_profiles,
+    .ports = bt_ports,
+    .rate = 16000,
+};
+
+/******************************************************************************
+ * Server model
+ ******************************************************************************/
+
+typedef struct {
+    gchar *name;
+    pa_direction_t direction;
+    guint32 priority;
+    pa_port_available_t available;
+} ServerPort;
+
+typedef struct {
+    guint32 index;
+    gchar *name;
+    gchar *driver;
+    pa_proplist *proplist;
+    guint32 rate;
+    GPtrArray *profiles;
+    guint active_profile;
+    GPtrArray *ports;
+} ServerCard;
+
+typedef struct {
+    guint32 index;
+    gboolean is_sink;
+    gchar *name;
+    ServerCard *card;
+    pa_proplist *proplist;
+    guint32 monitor;
+    guint32 monitor_of_sink;
+    GPtrArray *ports;       /* borrowed from the card */
+    ServerPort *active_port;
+    gboolean mute;
+    gboolean suspended;
+} ServerDevice;
+
+typedef struct {
+    guint32 index;
+    gchar *name;
+    gchar *argument;
+} ServerModule;
+
+typedef struct _Request Request;
+typedef void (*RequestFunc)(Request *request);
+
+/* A pending request, subscription event or stream state change */
+struct _Request {
+    RequestFunc func;
+    pa_context *context;
+    pa_stream *stream;
+    pa_operation *operation;
+    gint64 due;
+    GCallback cb;
+    gpointer userdata;
+    gboolean list;
+    gboolean sink;
+    guint32 index;
+    gchar *name;
+    gchar *argument;
+    gint value;
+};
+
+struct pa_proplist {
+    GPtrArray *keys;
+    GPtrArray *values;
+};
+
+struct pa_context {
+    gint ref;
+    pa_context_state_t state;
+    int error;
+    gboolean nofail;
+    gboolean linked;
+    gboolean connect_queued;
+    pa_context_notify_cb_t state_cb;
+    gpointer state_userdata;
+    pa_context_subscribe_cb_t subscribe_cb;
+    gpointer subscribe_userdata;
+    pa_subscription_mask_t mask;
+};
+
+struct pa_operation {
+    gint ref;
+};
+
+struct pa_stream {
+    gint ref;
+    pa_context *context;
+    pa_stream_state_t state;
+    gboolean linked;
+    gchar *device_name;
+    guint32 device;
+    pa_stream_notify_cb_t state_cb;
+    gpointer state_userdata;
+    pa_stream_request_cb_t read_cb;
+    gpointer read_userdata;
+};
+
+struct pa_glib_mainloop {
+    pa_mainloop_api api;
+};
+
+static struct {
+    GPtrArray *cards;
+    GPtrArray *devices;
+    GPtrArray *modules;
+    guint32 next_card;
+    guint32 next_device;
+    guint32 next_module;
+    gchar *server_name;
+    gchar *default_sink;
+    gchar *default_source;
+    guint latency;
+    gboolean stopped;
+    GQueue requests;
+    GQueue events;          /* generated while handling a request */
+    gboolean handling;
+    guint dispatch_id;
+    GList *contexts;
+    GList *streams;
+    guint served;
+    guint commands;
+    GPtrArray *allowed_criticals;
+} server;
+
+static void server_port_free(ServerPort *port)
+{
+    g_free(port->name);
+    g_free(port);
+}
+
+static void server_card_free(ServerCard *card)
+{
+    g_free(card->name);
+    g_free(card->driver);
+    pa_proplist_free(card->proplist);
+    g_ptr_array_unref(card->profiles);
+    g_ptr_array_unref(card->ports);
+    g_free(card);
+}
+
+static void server_device_free(ServerDevice *device)
+{
+    g_free(device->name);
+    pa_proplist_free(device->proplist);
+    g_ptr_array_unref(device->ports);
+    g_free(device);
+}
+
+static void server_module_free(ServerModule *module)
+{
+    g_free(module->name);
+    g_free(module->argument);
+    g_free(module);
+}
+
+static void server_init(void)
+{
+    if (server.cards)
+        return;
+
+    server.cards = g_ptr_array_new_with_free_func((GDestroyNotify)server_card_free);
+    server.devices = g_ptr_array_new_with_free_func((GDestroyNotify)server_device_free);
+    server.modules = g_ptr_array_new_with_free_func((GDestroyNotify)server_module_free);
+    server.allowed_criticals = g_ptr_array_new_with_free_func(g_free);
+    server.server_name = g_strdup("pulseaudio");
+}
+
+static ServerCard *find_card(guint32 index)
+{
+    guint i;
+
+    for (i = 0; i < server.cards->len; i++) {
+        ServerCard *card = g_ptr_array_index(server.cards, i);
+
+        if (card->index == index)
+            return card;
+    }
+
+    return NULL;
+}
+
+static ServerDevice *find_device(gboolean is_sink, guint32 index)
+{
+    guint i;
+
+    for (i = 0; i < server.devices->len; i++) {
+        ServerDevice *device = g_ptr_array_index(server.devices, i);
+
+        if (device->is_sink == is_sink && device->index == index)
+            return device;
+    }
+
+    return NULL;
+}
+
+static ServerDevice *find_device_by_name(gboolean is_sink, const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < server.devices->len; i++) {
+        ServerDevice *device = g_ptr_array_index(server.devices, i);
+
+        if (device->is_sink == is_sink && g_strcmp0(device->name, name) == 0)
+            return device;
+    }
+
+    return NULL;
+}
+
+/* The card's sink, or its source if @is_sink is FALSE (monitors excluded) */
+static ServerDevice *find_card_device(guint32 card, gboolean is_sink)
+{
+    guint i;
+
+    for (i = 0; i < server.devices->len; i++) {
+        ServerDevice *device = g_ptr_array_index(server.devices, i);
+
+        if (device->card->index == card && device->is_sink == is_sink &&
+            device->monitor_of_sink == PA_INVALID_INDEX)
+            return device;
+    }
+
+    return NULL;
+}
+
+static ServerModule *find_module(guint32 index)
+{
+    guint i;
+
+    for (i = 0; i < server.modules->len; i++) {
+        ServerModule *module = g_ptr_array_index(server.modules, i);
+
+        if (module->index == index)
+            return module;
+    }
+
+    return NULL;
+}
+
+/******************************************************************************
+ * Requests dispatching
+ *
+ * Requests and events are queued in a single FIFO, and dispatched from the
+ * main loop once their due time (queuing time plus the configured latency) is
+ * reached. Events posted while handling a request are moved in front of the
+ * queue once the request has been answered, so they arrive right after the
+ * reply, before the answers to later requests.
+ ******************************************************************************/
+
+static void schedule_dispatch(void);
+
+static Request *request_new(RequestFunc func, pa_context *c, GCallback cb, gpointer userdata)
+{
+    Request *request = g_new0(Request, 1);
+
+    request->func = func;
+    request->context = c;
+    request->cb = cb;
+    request->userdata = userdata;
+    request->due = g_get_monotonic_time() + server.latency * G_TIME_SPAN_MILLISECOND;
+
+    return request;
+}
+
+static void request_free(Request *request)
+{
+    if (request->operation)
+        pa_operation_unref(request->operation);
+    g_free(request->name);
+    g_free(request->argument);
+    g_free(request);
+}
+
+/* Requests can only be made while connected */
+static Request *context_request(pa_context *c, RequestFunc func, GCallback cb, gpointer userdata)
+{
+    if (c->state != PA_CONTEXT_READY) {
+        c->error = PA_ERR_BADSTATE;
+        return NULL;
+    }
+
+    return request_new(func, c, cb, userdata);
+}
+
+static pa_operation *queue_request(Request *request)
+{
+    pa_operation *o = g_new0(pa_operation, 1);
+
+    /* One reference for the request, one for the caller */
+    o->ref = 2;
+    request->operation = o;
+    g_queue_push_tail(&server.requests, request);
+    schedule_dispatch();
+
+    return o;
+}
+
+static void queue_event(Request *request)
+{
+    if (server.handling) {
+        request->due = 0;
+        g_queue_push_tail(&server.events, request);
+    } else {
+        g_queue_push_tail(&server.requests, request);
+        schedule_dispatch();
+    }
+}
+
+static void drop_queued(GQueue *queue, pa_context *c, pa_stream *s)
+{
+    GList *l = queue->head;
+
+    while (l) {
+        GList *next = l->next;
+        Request *request = l->data;
+
+        if ((c && request->context == c) || (s && request->stream == s)) {
+            g_queue_delete_link(queue, l);
+            request_free(request);
+        }
+        l = next;
+    }
+}
+
+/* Drop the requests of a context or stream, without calling back */
+static void drop_requests(pa_context *c, pa_stream *s)
+{
+    drop_queued(&server.requests, c, s);
+    drop_queued(&server.events, c, s);
+
+    if (g_queue_is_empty(&server.requests) && server.dispatch_id) {
+        g_source_remove(server.dispatch_id);
+        server.dispatch_id = 0;
+    }
+}
+
+static void handle_request(Request *request)
+{
+    pa_context *c = pa_context_ref(request->context);
+
+    if (request->operation)
+        server.served++;
+
+    server.handling = TRUE;
+    request->func(request);
+    server.handling = FALSE;
+
+    while (!g_queue_is_empty(&server.events))
+        g_queue_push_head(&server.requests, g_queue_pop_tail(&server.events));
+
+    request_free(request);
+    pa_context_unref(c);
+}
+
+static gboolean dispatch_cb(gpointer data)
+{
+    Request *request;
+
+    server.dispatch_id = 0;
+
+    while ((request = g_queue_peek_head(&server.requests)) &&
+           request->due <= g_get_monotonic_time()) {
+        g_queue_pop_head(&server.requests);
+        handle_request(request);
+    }
+
+    schedule_dispatch();
+
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_dispatch(void)
+{
+    Request *request = g_queue_peek_head(&server.requests);
+    gint64 delay;
+
+    if (!request || server.handling || server.dispatch_id)
+        return;
+
+    delay = request->due - g_get_monotonic_time();
+    if (delay <= 0)
+        server.dispatch_id = g_idle_add(dispatch_cb, NULL);
+    else
+        server.dispatch_id = g_timeout_add((delay + 999) / 1000, dispatch_cb, NULL);
+}
+
+static void handle_event(Request *request)
+{
+    pa_context *c = request->context;
+
+    if (c->state == PA_CONTEXT_READY && c->subscribe_cb) {
+        c->subscribe_cb(c, (pa_subscription_event_type_t)request->value,
+                        request->index, c->subscribe_userdata);
+    }
+}
+
+static void post_event(pa_subscription_event_type_t type, guint32 index)
+{
+    pa_subscription_mask_t mask = 1 << (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK);
+    GList *l;
+
+    for (l = server.contexts; l; l = l->next) {
+        pa_context *c = l->data;
+        Request *request;
+
+        if (c->state != PA_CONTEXT_READY || !(c->mask & mask))
+            continue;
+
+        request = request_new(handle_event, c, NULL, NULL);
+        request->index = index;
+        request->value = type;
+        queue_event(request);
+    }
+}
+
+static void reply_success(Request *request, gboolean success, int error)
+{
+    pa_context_success_cb_t cb = (pa_context_success_cb_t)request->cb;
+
+    if (!success)
+        request->context->error = error;
+    if (cb)
+        cb(request->context, success, request->userdata);
+}
+
+/******************************************************************************
+ * Model changes
+ ******************************************************************************/
+
+static void stream_kill(pa_stream *s);
+
+static ServerPort *best_port(GPtrArray *ports)
+{
+    ServerPort *best = NULL;
+    guint i;
+
+    for (i = 0; i < ports->len; i++) {
+        ServerPort *port = g_ptr_array_index(ports, i);
+
+        if (port->available == PA_PORT_AVAILABLE_NO)
+            continue;
+        if (!best || port->priority > best->priority)
+            best = port;
+    }
+
+    if (!best && ports->len > 0)
+        best = g_ptr_array_index(ports, 0);
+
+    return best;
+}
+
+static ServerDevice *device_add(ServerCard *card, gboolean is_sink, gchar *name,
+                                const gchar *device_class, GPtrArray *ports)
+{
+    ServerDevice *device = g_new0(ServerDevice, 1);
+
+    device->index = server.next_device++;
+    device->is_sink = is_sink;
+    device->name = name;
+    device->card = card;
+    device->monitor = PA_INVALID_INDEX;
+    device->monitor_of_sink = PA_INVALID_INDEX;
+    device->ports = ports;
+    device->active_port = best_port(ports);
+    device->proplist = pa_proplist_new();
+    pa_proplist_sets(device->proplist, PA_PROP_DEVICE_CLASS, device_class);
+    g_ptr_array_add(server.devices, device);
+
+    post_event((is_sink ? PA_SUBSCRIPTION_EVENT_SINK : PA_SUBSCRIPTION_EVENT_SOURCE) |
+               PA_SUBSCRIPTION_EVENT_NEW, device->index);
+
+    return device;
+}
+
+static GPtrArray *card_get_ports(ServerCard *card, pa_direction_t direction)
+{
+    GPtrArray *ports = g_ptr_array_new();
+    guint i;
+
+    for (i = 0; i < card->ports->len; i++) {
+        ServerPort *port = g_ptr_array_index(card->ports, i);
+
+        if (port->direction == direction)
+            g_ptr_array_add(ports, port);
+    }
+
+    return ports;
+}
+
+/*
+ * Create the devices of the card's active profile: a sink and its monitor
+ * if the card has output ports, and a source if it has input ports
+ */
+static void card_add_devices(ServerCard *card)
+{
+    const gchar *profile = g_ptr_array_index(card->profiles, card->active_profile);
+    g_autofree gchar *suffix = NULL;
+    GPtrArray *outputs, *inputs;
+
+    if (strcmp(profile, "off") == 0)
+        return;
+
+    suffix = g_strdelimit(g_strdup_printf("%s.%s", card->name, profile), " ", '_');
+
+    outputs = card_get_ports(card, PA_DIRECTION_OUTPUT);
+    if (outputs->len > 0) {
+        ServerDevice *sink, *monitor;
+
+        sink = device_add(card, TRUE, g_strconcat("fake_output.", suffix, NULL),
+                          "sound", outputs);
+        monitor = device_add(card, FALSE, g_strconcat(sink->name, ".monitor", NULL),
+                             "monitor", g_ptr_array_new());
+        monitor->monitor_of_sink = sink->index;
+        sink->monitor = monitor->index;
+    } else {
+        g_ptr_array_unref(outputs);
+    }
+
+    inputs = card_get_ports(card, PA_DIRECTION_INPUT);
+    if (inputs->len > 0)
+        device_add(card, FALSE, g_strconcat("fake_input.", suffix, NULL), "sound", inputs);
+    else
+        g_ptr_array_unref(inputs);
+}
+
+static void device_remove(ServerDevice *device)
+{
+    GList *l;
+
+    for (l = server.streams; l; l = l->next) {
+        pa_stream *s = l->data;
+
+        if (s->device == device->index && s->state == PA_STREAM_READY)
+            stream_kill(s);
+    }
+
+    post_event((device->is_sink ? PA_SUBSCRIPTION_EVENT_SINK : PA_SUBSCRIPTION_EVENT_SOURCE) |
+               PA_SUBSCRIPTION_EVENT_REMOVE, device->index);
+    g_ptr_array_remove(server.devices, device);
+}
+
+static void card_remove_devices(ServerCard *card)
+{
+    guint i = 0;
+
+    while (i < server.devices->len) {
+        ServerDevice *device = g_ptr_array_index(server.devices, i);
+
+        if (device->card == card)
+            device_remove(device);
+        else
+            i++;
+    }
+}
+
+static void card_set_profile(ServerCard *card, guint profile)
+{
+    if (card->active_profile == profile)
+        return;
+
+    card_remove_devices(card);
+    card->active_profile = profile;
+    card_add_devices(card);
+    post_event(PA_SUBSCRIPTION_EVENT_CARD | PA_SUBSCRIPTION_EVENT_CHANGE, card->index);
+}
+
+static guint32 module_add(const gchar *name, const gchar *argument)
+{
+    ServerModule *module = g_new0(ServerModule, 1);
+
+    module->index = server.next_module++;
+    module->name = g_strdup(name);
+    module->argument = g_strdup(argument);
+    g_ptr_array_add(server.modules, module);
+    post_event(PA_SUBSCRIPTION_EVENT_MODULE | PA_SUBSCRIPTION_EVENT_NEW, module->index);
+
+    return module->index;
+}
+
+/******************************************************************************
+ * Introspection replies
+ ******************************************************************************/
+
+static void reply_card(Request *request, ServerCard *card)
+{
+    pa_card_info_cb_t cb = (pa_card_info_cb_t)request->cb;
+    guint n_profiles = card->profiles->len;
+    guint n_ports = card->ports->len;
+    pa_card_profile_info2 *profiles = g_newa(pa_card_profile_info2, n_profiles);
+    pa_card_profile_info2 **profile_ptrs = g_newa(pa_card_profile_info2 *, n_profiles);
+    pa_card_port_info *ports = g_newa(pa_card_port_info, MAX(n_ports, 1));
+    pa_card_port_info **port_ptrs = g_newa(pa_card_port_info *, MAX(n_ports, 1));
+    pa_card_info info;
+    guint i;
+
+    memset(&info, 0, sizeof(info));
+    memset(profiles, 0, n_profiles * sizeof(*profiles));
+    memset(ports, 0, MAX(n_ports, 1) * sizeof(*ports));
+
+    for (i = 0; i < n_profiles; i++) {
+        profiles[i].name = g_ptr_array_index(card->profiles, i);
+        profiles[i].description = profiles[i].name;
+        profiles[i].priority = n_profiles - i;
+        profiles[i].available = 1;
+        profile_ptrs[i] = &profiles[i];
+    }
+
+    for (i = 0; i < n_ports; i++) {
+        ServerPort *port = g_ptr_array_index(card->ports, i);
+
+        ports[i].name = port->name;
+        ports[i].description = port->name;
+        ports[i].priority = port->priority;
+        ports[i].available = port->available;
+        ports[i].direction = port->direction;
+        port_ptrs[i] = &ports[i];
+    }
+
+    info.index = card->index;
+    info.name = card->name;
+    info.owner_module = PA_INVALID_INDEX;
+    info.driver = card->driver;
+    info.proplist = card->proplist;
+    info.n_profiles = n_profiles;
+    info.profiles2 = profile_ptrs;
+    /* callaudiod compares it with the profiles list items */
+    info.active_profile2 = profile_ptrs[card->active_profile];
+    info.n_ports = n_ports;
+    info.ports = port_ptrs;
+
+    cb(request->context, &info, 0, request->userdata);
+}
+
+static void reply_sink(Request *request, ServerDevice *device)
+{
+    pa_sink_info_cb_t cb = (pa_sink_info_cb_t)request->cb;
+    guint n_ports = device->ports->len;
+    pa_sink_port_info *ports = g_newa(pa_sink_port_info, MAX(n_ports, 1));
+    pa_sink_port_info **port_ptrs = g_newa(pa_sink_port_info *, MAX(n_ports, 1));
+    pa_sink_info info;
+    guint i;
+
+    memset(&info, 0, sizeof(info));
+    memset(ports, 0, MAX(n_ports, 1) * sizeof(*ports));
+
+    for (i = 0; i < n_ports; i++) {
+        ServerPort *port = g_ptr_array_index(device->ports, i);
+
+        ports[i].name = port->name;
+        ports[i].description = port->name;
+        ports[i].priority = port->priority;
+        ports[i].available = port->available;
+        port_ptrs[i] = &ports[i];
+        if (port == device->active_port)
+            info.active_port = &ports[i];
+    }
+
+    info.name = device->name;
+    info.index = device->index;
+    info.description = device->name;
+    info.sample_spec.format = PA_SAMPLE_S16LE;
+    info.sample_spec.rate = device->card->rate;
+    info.sample_spec.channels = 2;
+    info.channel_map.channels = 2;
+    info.owner_module = PA_INVALID_INDEX;
+    pa_cvolume_set(&info.volume, 2, PA_VOLUME_NORM);
+    info.mute = device->mute;
+    info.monitor_source = device->monitor;
+    info.driver = "fake-pulse.c";
+    info.proplist = device->proplist;
+    info.base_volume = PA_VOLUME_NORM;
+    info.state = device->suspended ? PA_SINK_SUSPENDED : PA_SINK_IDLE;
+    info.card = device->card->index;
+    info.n_ports = n_ports;
+    info.ports = port_ptrs;
+
+    cb(request->context, &info, 0, request->userdata);
+}
+
+static void reply_source(Request *request, ServerDevice *device)
+{
+    pa_source_info_cb_t cb = (pa_source_info_cb_t)request->cb;
+    guint n_ports = device->ports->len;
+    pa_source_port_info *ports = g_newa(pa_source_port_info, MAX(n_ports, 1));
+    pa_source_port_info **port_ptrs = g_newa(pa_source_port_info *, MAX(n_ports, 1));
+    pa_source_info info;
+    guint i;
+
+    memset(&info, 0, sizeof(info));
+    memset(ports, 0, MAX(n_ports, 1) * sizeof(*ports));
+
+    for (i = 0; i < n_ports; i++) {
+        ServerPort *port = g_ptr_array_index(device->ports, i);
+
+        ports[i].name = port->name;
+        ports[i].description = port->name;
+        ports[i].priority = port->priority;
+        ports[i].available = port->available;
+        port_ptrs[i] = &ports[i];
+        if (port == device->active_port)
+            info.active_port = &ports[i];
+    }
+
+    info.name = device->name;
+    info.index = device->index;
+    info.description = device->name;
+    info.sample_spec.format = PA_SAMPLE_S16LE;
+    info.sample_spec.rate = device->card->rate;
+    info.sample_spec.channels = 2;
+    info.channel_map.channels = 2;
+    info.owner_module = PA_INVALID_INDEX;
+    pa_cvolume_set(&info.volume, 2, PA_VOLUME_NORM);
+    info.mute = device->mute;
+    info.monitor_of_sink = device->monitor_of_sink;
+    info.driver = "fake-pulse.c";
+    info.proplist = device->proplist;
+    info.base_volume = PA_VOLUME_NORM;
+    info.state = device->suspended ? PA_SOURCE_SUSPENDED : PA_SOURCE_IDLE;
+    info.card = device->card->index;
+    info.n_ports = n_ports;
+    info.ports = port_ptrs;
+
+    cb(request->context, &info, 0, request->userdata);
+}
+
+static void handle_card_info(Request *request)
+{
+    pa_card_info_cb_t cb = (pa_card_info_cb_t)request->cb;
+    pa_context *c = request->context;
+    guint i;
+
+    if (!request->list) {
+        ServerCard *card = find_card(request->index);
+
+        if (!card) {
+            c->error = PA_ERR_NOENTITY;
+            cb(c, NULL, -1, request->userdata);
+            return;
+        }
+        reply_card(request, card);
+    } else {
+        for (i = 0; i < server.cards->len && c->state == PA_CONTEXT_READY; i++)
+            reply_card(request, g_ptr_array_index(server.cards, i));
+    }
+
+    if (c->state == PA_CONTEXT_READY)
+        cb(c, NULL, 1, request->userdata);
+}
+
+static void end_device_list(Request *request, int eol)
+{
+    if (request->sink)
+        ((pa_sink_info_cb_t)request->cb)(request->context, NULL, eol, request->userdata);
+    else
+        ((pa_source_info_cb_t)request->cb)(request->context, NULL, eol, request->userdata);
+}
+
+static void handle_device_info(Request *request)
+{
+    pa_context *c = request->context;
+    guint i;
+
+    if (!request->list) {
+        ServerDevice *device;
+
+        if (request->name)
+            device = find_device_by_name(request->sink, request->name);
+        else
+            device = find_device(request->sink, request->index);
+
+        if (!device) {
+            c->error = PA_ERR_NOENTITY;
+            end_device_list(request, -1);
+            return;
+        }
+        if (request->sink)
+            reply_sink(request, device);
+        else
+            reply_source(request, device);
+    } else {
+        for (i = 0; i < server.devices->len && c->state == PA_CONTEXT_READY; i++) {
+            ServerDevice *device = g_ptr_array_index(server.devices, i);
+
+            if (device->is_sink && request->sink)
+                reply_sink(request, device);
+            else if (!device->is_sink && !request->sink)
+                reply_source(request, device);
+        }
+    }
+
+    if (c->state == PA_CONTEXT_READY)
+        end_device_list(request, 1);
+}
+
+static void handle_module_info(Request *request)
+{
+    pa_module_info_cb_t cb = (pa_module_info_cb_t)request->cb;
+    pa_context *c = request->context;
+    guint i;
+
+    for (i = 0; i < server.modules->len && c->state == PA_CONTEXT_READY; i++) {
+        ServerModule *module = g_ptr_array_index(server.modules, i);
+        pa_module_info info;
+
+        memset(&info, 0, sizeof(info));
+        info.index = module->index;
+        info.name = module->name;
+        info.argument = module->argument;
+        info.n_used = PA_INVALID_INDEX;
+        cb(c, &info, 0, request->userdata);
+    }
+
+    if (c->state == PA_CONTEXT_READY)
+        cb(c, NULL, 1, request->userdata);
+}
+
+static void handle_server_info(Request *request)
+{
+    pa_server_info_cb_t cb = (pa_server_info_cb_t)request->cb;
+    pa_server_info info;
+
+    memset(&info, 0, sizeof(info));
+    info.user_name = "user";
+    info.host_name = "localhost";
+    info.server_version = "16.1";
+    info.server_name = server.server_name;
+    info.sample_spec.format = PA_SAMPLE_S16LE;
+    info.sample_spec.rate = 48000;
+    info.sample_spec.channels = 2;
+    info.channel_map.channels = 2;
+    info.default_sink_name = server.default_sink;
+    info.default_source_name = server.default_source;
+
+    cb(request->context, &info, request->userdata);
+}
+
+/* Streams other than callaudiod's own meters aren't modelled */
+static void handle_sink_input_info(Request *request)
+{
+    ((pa_sink_input_info_cb_t)request->cb)(request->context, NULL, 1, request->userdata);
+}
+
+static void handle_source_output_info(Request *request)
+{
+    ((pa_source_output_info_cb_t)request->cb)(request->context, NULL, 1, request->userdata);
+}
+
+/******************************************************************************
+ * Commands
+ ******************************************************************************/
+
+static void handle_subscribe(Request *request)
+{
+    request->context->mask = (pa_subscription_mask_t)request->value;
+    reply_success(request, TRUE, PA_OK);
+}
+
+static void handle_set_card_profile(Request *request)
+{
+    ServerCard *card = find_card(request->index);
+    guint i;
+
+    server.commands++;
+
+    if (card) {
+        for (i = 0; i < card->profiles->len; i++) {
+            if (strcmp(g_ptr_array_index(card->profiles, i), request->name) == 0) {
+                card_set_profile(card, i);
+                reply_success(request, TRUE, PA_OK);
+                return;
+            }
+        }
+    }
+
+    reply_success(request, FALSE, PA_ERR_NOENTITY);
+}
+
+static void handle_set_port(Request *request)
+{
+    ServerDevice *device = find_device(request->sink, request->index);
+    guint i;
+
+    server.commands++;
+
+    if (device) {
+        for (i = 0; i < device->ports->len; i++) {
+            ServerPort *port = g_ptr_array_index(device->ports, i);
+
+            if (strcmp(port->name, request->name) != 0)
+                continue;
+
+            if (device->active_port != port) {
+                device->active_port = port;
+                post_event((device->is_sink ? PA_SUBSCRIPTION_EVENT_SINK :
+                                              PA_SUBSCRIPTION_EVENT_SOURCE) |
+                           PA_SUBSCRIPTION_EVENT_CHANGE, device->index);
+            }
+            reply_success(request, TRUE, PA_OK);
+            return;
+        }
+    }
+
+    reply_success(request, FALSE, PA_ERR_NOENTITY);
+}
+
+static void handle_set_mute(Request *request)
+{
+    ServerDevice *device = find_device(request->sink, request->index);
+
+    server.commands++;
+
+    if (!device) {
+        reply_success(request, FALSE, PA_ERR_NOENTITY);
+        return;
+    }
+
+    if (device->mute != !!request->value) {
+        device->mute = !!request->value;
+        post_event((device->is_sink ? PA_SUBSCRIPTION_EVENT_SINK : PA_SUBSCRIPTION_EVENT_SOURCE) |
+                   PA_SUBSCRIPTION_EVENT_CHANGE, device->index);
+    }
+    reply_success(request, TRUE, PA_OK);
+}
+
+static void handle_suspend(Request *request)
+{
+    ServerDevice *device = find_device(request->sink, request->index);
+
+    server.commands++;
+
+    if (!device) {
+        reply_success(request, FALSE, PA_ERR_NOENTITY);
+        return;
+    }
+
+    if (device->suspended != !!request->value) {
+        device->suspended = !!request->value;
+        post_event((device->is_sink ? PA_SUBSCRIPTION_EVENT_SINK : PA_SUBSCRIPTION_EVENT_SOURCE) |
+                   PA_SUBSCRIPTION_EVENT_CHANGE, device->index);
+    }
+    reply_success(request, TRUE, PA_OK);
+}
+
+static void handle_set_default(Request *request)
+{
+    gchar **name = request->sink ? &server.default_sink : &server.default_source;
+
+    server.commands++;
+
+    if (!find_device_by_name(request->sink, request->name)) {
+        reply_success(request, FALSE, PA_ERR_NOENTITY);
+        return;
+    }
+
+    if (g_strcmp0(*name, request->name) != 0) {
+        g_free(*name);
+        *name = g_strdup(request->name);
+        post_event(PA_SUBSCRIPTION_EVENT_SERVER | PA_SUBSCRIPTION_EVENT_CHANGE,
+                   PA_INVALID_INDEX);
+    }
+    reply_success(request, TRUE, PA_OK);
+}
+
+static void handle_load_module(Request *request)
+{
+    pa_context_index_cb_t cb = (pa_context_index_cb_t)request->cb;
+    guint32 index = module_add(request->name, request->argument);
+
+    server.commands++;
+
+    if (cb)
+        cb(request->context, index, request->userdata);
+}
+
+static void handle_unload_module(Request *request)
+{
+    ServerModule *module = find_module(request->index);
+
+    server.commands++;
+
+    if (!module) {
+        reply_success(request, FALSE, PA_ERR_NOENTITY);
+        return;
+    }
+
+    g_ptr_array_remove(server.modules, module);
+    post_event(PA_SUBSCRIPTION_EVENT_MODULE | PA_SUBSCRIPTION_EVENT_REMOVE, request->index);
+    reply_success(request, TRUE, PA_OK);
+}
+
+static void handle_sink_input_volume(Request *request)
+{
+    server.commands++;
+
+    reply_success(request, FALSE, PA_ERR_NOENTITY);
+}
+
+/******************************************************************************
+ * Context
+ ******************************************************************************/
+
+static void stream_set_state(pa_stream *s, pa_stream_state_t state);
+
+static void context_unlink(pa_context *c)
+{
+    GList *streams, *l;
+
+    if (!c->linked)
+        return;
+
+    c->linked = FALSE;
+    server.contexts = g_list_remove(server.contexts, c);
+    drop_requests(c, NULL);
+
+    streams = g_list_copy(server.streams);
+    for (l = streams; l; l = l->next)
+        pa_stream_ref(l->data);
+    for (l = streams; l; l = l->next) {
+        pa_stream *s = l->data;
+
+        if (s->context == c) {
+            stream_set_state(s, c->state == PA_CONTEXT_FAILED ? PA_STREAM_FAILED :
+                                                                PA_STREAM_TERMINATED);
+        }
+        pa_stream_unref(s);
+    }
+    g_list_free(streams);
+}
+
+/* As in libpulse, the callback is called before pending requests are dropped */
+static void context_set_state(pa_context *c, pa_context_state_t state)
+{
+    if (c->state == state)
+        return;
+
+    pa_context_ref(c);
+    c->state = state;
+    if (c->state_cb)
+        c->state_cb(c, c->state_userdata);
+    if (state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED)
+        context_unlink(c);
+    pa_context_unref(c);
+}
+
+static void handle_connect(Request *request)
+{
+    pa_context *c = request->context;
+
+    c->connect_queued = FALSE;
+
+    if (!server.stopped) {
+        context_set_state(c, PA_CONTEXT_READY);
+    } else if (!c->nofail) {
+        c->error = PA_ERR_CONNECTIONREFUSED;
+        context_set_state(c, PA_CONTEXT_FAILED);
+    }
+    /* Otherwise, keep waiting for the server to start */
+}
+
+static void queue_connect(pa_context *c)
+{
+    Request *request = request_new(handle_connect, c, NULL, NULL);
+
+    c->connect_queued = TRUE;
+    g_queue_push_tail(&server.requests, request);
+    schedule_dispatch();
+}
+
+/* Drop all the connections, as if the server crashed */
+static void kill_clients(void)
+{
+    GList *contexts, *l;
+
+    contexts = g_list_copy(server.contexts);
+    for (l = contexts; l; l = l->next)
+        pa_context_ref(l->data);
+    for (l = contexts; l; l = l->next) {
+        pa_context *c = l->data;
+
+        if (c->state == PA_CONTEXT_READY) {
+            c->error = PA_ERR_CONNECTIONTERMINATED;
+            context_set_state(c, PA_CONTEXT_FAILED);
+        }
+        pa_context_unref(c);
+    }
+    g_list_free(contexts);
+}
+
+pa_context *pa_context_new(pa_mainloop_api *mainloop, const char *name)
+{
+    pa_context *c;
+
+    g_return_val_if_fail(mainloop, NULL);
+
+    server_init();
+
+    c = g_new0(pa_context, 1);
+    c->ref = 1;
+    c->state = PA_CONTEXT_UNCONNECTED;
+
+    return c;
+}
+
+pa_context *pa_context_new_with_proplist(pa_mainloop_api *mainloop, const char *name,
+                                         const pa_proplist *proplist)
+{
+    return pa_context_new(mainloop, name);
+}
+
+pa_context *pa_context_ref(pa_context *c)
+{
+    c->ref++;
+
+    return c;
+}
+
+void pa_context_unref(pa_context *c)
+{
+    if (--c->ref > 0)
+        return;
+
+    context_unlink(c);
+    g_free(c);
+}
+
+void pa_context_set_state_callback(pa_context *c, pa_context_notify_cb_t cb, void *userdata)
+{
+    c->state_cb = cb;
+    c->state_userdata = userdata;
+}
+
+void pa_context_set_subscribe_callback(pa_context *c, pa_context_subscribe_cb_t cb,
+                                       void *userdata)
+{
+    c->subscribe_cb = cb;
+    c->subscribe_userdata = userdata;
+}
+
+int pa_context_errno(const pa_context *c)
+{
+    return c ? c->error : PA_ERR_INVALID;
+}
+
+pa_context_state_t pa_context_get_state(const pa_context *c)
+{
+    return c->state;
+}
+
+int pa_context_connect(pa_context *c, const char *server_name, pa_context_flags_t flags,
+                       const pa_spawn_api *api)
+{
+    if (c->state != PA_CONTEXT_UNCONNECTED) {
+        c->error = PA_ERR_BADSTATE;
+        return -PA_ERR_BADSTATE;
+    }
+
+    c->nofail = (flags & PA_CONTEXT_NOFAIL) != 0;
+    c->linked = TRUE;
+    server.contexts = g_list_append(server.contexts, c);
+
+    context_set_state(c, PA_CONTEXT_CONNECTING);
+    if (c->state == PA_CONTEXT_CONNECTING && (!server.stopped || !c->nofail))
+        queue_connect(c);
+
+    return 0;
+}
+
+void pa_context_disconnect(pa_context *c)
+{
+    if (PA_CONTEXT_IS_GOOD(c->state))
+        context_set_state(c, PA_CONTEXT_TERMINATED);
+}
+
+pa_operation *pa_context_subscribe(pa_context *c, pa_subscription_mask_t m,
+                                   pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_subscribe, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->value = m;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_server_info(pa_context *c, pa_server_info_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_server_info, G_CALLBACK(cb), userdata);
+
+    return request ? queue_request(request) : NULL;
+}
+
+pa_operation *pa_context_get_card_info_by_index(pa_context *c, uint32_t idx,
+                                                pa_card_info_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_card_info, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_card_info_list(pa_context *c, pa_card_info_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_card_info, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->list = TRUE;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_sink_info_by_index(pa_context *c, uint32_t idx,
+                                                pa_sink_info_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_device_info, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->sink = TRUE;
+    request->index = idx;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_sink_info_list(pa_context *c, pa_sink_info_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_device_info, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->sink = TRUE;
+    request->list = TRUE;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_source_info_by_index(pa_context *c, uint32_t idx,
+                                                  pa_source_info_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_device_info, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_source_info_by_name(pa_context *c, const char *name,
+                                                 pa_source_info_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_device_info, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->name = g_strdup(name);
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_source_info_list(pa_context *c, pa_source_info_cb_t cb,
+                                              void *userdata)
+{
+    Request *request = context_request(c, handle_device_info, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->list = TRUE;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_get_module_info_list(pa_context *c, pa_module_info_cb_t cb,
+                                              void *userdata)
+{
+    Request *request = context_request(c, handle_module_info, G_CALLBACK(cb), userdata);
+
+    return request ? queue_request(request) : NULL;
+}
+
+pa_operation *pa_context_get_sink_input_info_list(pa_context *c, pa_sink_input_info_cb_t cb,
+                                                  void *userdata)
+{
+    Request *request = context_request(c, handle_sink_input_info, G_CALLBACK(cb), userdata);
+
+    return request ? queue_request(request) : NULL;
+}
+
+pa_operation *pa_context_get_source_output_info_list(pa_context *c,
+                                                     pa_source_output_info_cb_t cb,
+                                                     void *userdata)
+{
+    Request *request = context_request(c, handle_source_output_info, G_CALLBACK(cb), userdata);
+
+    return request ? queue_request(request) : NULL;
+}
+
+pa_operation *pa_context_set_card_profile_by_index(pa_context *c, uint32_t idx,
+                                                   const char *profile,
+                                                   pa_context_success_cb_t cb,
+                                                   void *userdata)
+{
+    Request *request = context_request(c, handle_set_card_profile, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+    request->name = g_strdup(profile);
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_set_sink_port_by_index(pa_context *c, uint32_t idx, const char *port,
+                                                pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_set_port, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->sink = TRUE;
+    request->index = idx;
+    request->name = g_strdup(port);
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_set_source_port_by_index(pa_context *c, uint32_t idx,
+                                                  const char *port,
+                                                  pa_context_success_cb_t cb,
+                                                  void *userdata)
+{
+    Request *request = context_request(c, handle_set_port, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+    request->name = g_strdup(port);
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_set_source_mute_by_index(pa_context *c, uint32_t idx, int mute,
+                                                  pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_set_mute, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+    request->value = mute;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_suspend_sink_by_index(pa_context *c, uint32_t idx, int suspend,
+                                               pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_suspend, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->sink = TRUE;
+    request->index = idx;
+    request->value = suspend;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_suspend_source_by_index(pa_context *c, uint32_t idx, int suspend,
+                                                 pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_suspend, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+    request->value = suspend;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_set_default_sink(pa_context *c, const char *name,
+                                          pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_set_default, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->sink = TRUE;
+    request->name = g_strdup(name);
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_set_default_source(pa_context *c, const char *name,
+                                            pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_set_default, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->name = g_strdup(name);
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_load_module(pa_context *c, const char *name, const char *argument,
+                                     pa_context_index_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_load_module, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->name = g_strdup(name);
+    request->argument = g_strdup(argument);
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_unload_module(pa_context *c, uint32_t idx,
+                                       pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_unload_module, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+
+    return queue_request(request);
+}
+
+pa_operation *pa_context_set_sink_input_volume(pa_context *c, uint32_t idx,
+                                               const pa_cvolume *volume,
+                                               pa_context_success_cb_t cb, void *userdata)
+{
+    Request *request = context_request(c, handle_sink_input_volume, G_CALLBACK(cb), userdata);
+
+    if (!request)
+        return NULL;
+
+    request->index = idx;
+
+    return queue_request(request);
+}
+
+void pa_operation_unref(pa_operation *o)
+{
+    if (--o->ref == 0)
+        g_free(o);
+}
+
+/******************************************************************************
+ * Streams
+ *
+ * Streams connect to a device and stay there until it goes away; they never
+ * carry any data.
+ ******************************************************************************/
+
+static void stream_unlink(pa_stream *s)
+{
+    if (!s->linked)
+        return;
+
+    s->linked = FALSE;
+    s->device = PA_INVALID_INDEX;
+    server.streams = g_list_remove(server.streams, s);
+    drop_requests(NULL, s);
+}
+
+static void stream_set_state(pa_stream *s, pa_stream_state_t state)
+{
+    if (s->state == state)
+        return;
+
+    pa_stream_ref(s);
+    s->state = state;
+    if (s->state_cb)
+        s->state_cb(s, s->state_userdata);
+    if (state == PA_STREAM_FAILED || state == PA_STREAM_TERMINATED)
+        stream_unlink(s);
+    pa_stream_unref(s);
+}
+
+static void handle_stream_state(Request *request)
+{
+    stream_set_state(request->stream, (pa_stream_state_t)request->value);
+}
+
+/* The device went away, fail the stream after the current reply */
+static void stream_kill(pa_stream *s)
+{
+    Request *request = request_new(handle_stream_state, s->context, NULL, NULL);
+
+    s->device = PA_INVALID_INDEX;
+    request->stream = s;
+    request->value = PA_STREAM_FAILED;
+    queue_event(request);
+}
+
+static ServerDevice *resolve_source(const gchar *name)
+{
+    ServerDevice *sink;
+
+    if (!name || strcmp(name, "@DEFAULT_SOURCE@") == 0)
+        return find_device_by_name(FALSE, server.default_source);
+
+    if (strcmp(name, "@DEFAULT_MONITOR@") != 0)
+        return find_device_by_name(FALSE, name);
+
+    sink = find_device_by_name(TRUE, server.default_sink);
+
+    return sink ? find_device(FALSE, sink->monitor) : NULL;
+}
+
+static void handle_stream_connect(Request *request)
+{
+    pa_stream *s = request->stream;
+    ServerDevice *device = resolve_source(s->device_name);
+
+    if (!device) {
+        s->context->error = PA_ERR_NOENTITY;
+        stream_set_state(s, PA_STREAM_FAILED);
+        return;
+    }
+
+    s->device = device->index;
+    stream_set_state(s, PA_STREAM_READY);
+}
+
+pa_stream *pa_stream_new(pa_context *c, const char *name, const pa_sample_spec *ss,
+                         const pa_channel_map *map)
+{
+    pa_stream *s;
+
+    if (c->state != PA_CONTEXT_READY) {
+        c->error = PA_ERR_BADSTATE;
+        return NULL;
+    }
+
+    s = g_new0(pa_stream, 1);
+    s->ref = 1;
+    s->context = pa_context_ref(c);
+    s->state = PA_STREAM_UNCONNECTED;
+    s->device = PA_INVALID_INDEX;
+
+    return s;
+}
+
+pa_stream *pa_stream_ref(pa_stream *s)
+{
+    s->ref++;
+
+    return s;
+}
+
+void pa_stream_unref(pa_stream *s)
+{
+    if (--s->ref > 0)
+        return;
+
+    stream_unlink(s);
+    pa_context_unref(s->context);
+    g_free(s->device_name);
+    g_free(s);
+}
+
+int pa_stream_connect_record(pa_stream *s, const char *dev, const pa_buffer_attr *attr,
+                             pa_stream_flags_t flags)
+{
+    Request *request;
+
+    if (s->state != PA_STREAM_UNCONNECTED || s->context->state != PA_CONTEXT_READY) {
+        s->context->error = PA_ERR_BADSTATE;
+        return -PA_ERR_BADSTATE;
+    }
+
+    s->device_name = g_strdup(dev);
+    s->linked = TRUE;
+    server.streams = g_list_append(server.streams, s);
+
+    request = request_new(handle_stream_connect, s->context, NULL, NULL);
+    request->stream = s;
+    g_queue_push_tail(&server.requests, request);
+    schedule_dispatch();
+
+    stream_set_state(s, PA_STREAM_CREATING);
+
+    return 0;
+}
+
+int pa_stream_disconnect(pa_stream *s)
+{
+    if (!PA_STREAM_IS_GOOD(s->state)) {
+        s->context->error = PA_ERR_BADSTATE;
+        return -PA_ERR_BADSTATE;
+    }
+
+    stream_set_state(s, PA_STREAM_TERMINATED);
+
+    return 0;
+}
+
+pa_stream_state_t pa_stream_get_state(const pa_stream *s)
+{
+    return s->state;
+}
+
+pa_context *pa_stream_get_context(const pa_stream *s)
+{
+    return s->context;
+}
+
+void pa_stream_set_state_callback(pa_stream *s, pa_stream_notify_cb_t cb, void *userdata)
+{
+    s->state_cb = cb;
+    s->state_userdata = userdata;
+}
+
+void pa_stream_set_read_callback(pa_stream *s, pa_stream_request_cb_t cb, void *userdata)
+{
+    s->read_cb = cb;
+    s->read_userdata = userdata;
+}
+
+size_t pa_stream_readable_size(const pa_stream *s)
+{
+    return 0;
+}
+
+int pa_stream_peek(pa_stream *s, const void **data, size_t *nbytes)
+{
+    *data = NULL;
+    *nbytes = 0;
+
+    return 0;
+}
+
+int pa_stream_drop(pa_stream *s)
+{
+    return 0;
+}
+
+/******************************************************************************
+ * Utilities
+ ******************************************************************************/
+
+pa_proplist *pa_proplist_new(void)
+{
+    pa_proplist *p = g_new0(pa_proplist, 1);
+
+    p->keys = g_ptr_array_new_with_free_func(g_free);
+    p->values = g_ptr_array_new_with_free_func(g_free);
+
+    return p;
+}
+
+void pa_proplist_free(pa_proplist *p)
+{
+    g_ptr_array_unref(p->keys);
+    g_ptr_array_unref(p->values);
+    g_free(p);
+}
+
+int pa_proplist_sets(pa_proplist *p, const char *key, const char *value)
+{
+    guint i;
+
+    for (i = 0; i < p->keys->len; i++) {
+        if (strcmp(g_ptr_array_index(p->keys, i), key) == 0) {
+            g_free(p->values->pdata[i]);
+            p->values->pdata[i] = g_strdup(value);
+            return 0;
+        }
+    }
+
+    g_ptr_array_add(p->keys, g_strdup(key));
+    g_ptr_array_add(p->values, g_strdup(value));
+
+    return 0;
+}
+
+const char *pa_proplist_gets(const pa_proplist *p, const char *key)
+{
+    guint i;
+
+    for (i = 0; i < p->keys->len; i++) {
+        if (strcmp(g_ptr_array_index(p->keys, i), key) == 0)
+            return g_ptr_array_index(p->values, i);
+    }
+
+    return NULL;
+}
+
+/* The state holds the index of the next key, plus one */
+const char *pa_proplist_iterate(const pa_proplist *p, void **state)
+{
+    guint i = GPOINTER_TO_UINT(*state);
+
+    if (i >= p->keys->len)
+        return NULL;
+
+    *state = GUINT_TO_POINTER(i + 1);
+
+    return g_ptr_array_index(p->keys, i);
+}
+
+pa_cvolume *pa_cvolume_set(pa_cvolume *a, unsigned channels, pa_volume_t v)
+{
+    unsigned i;
+
+    a->channels = (uint8_t)MIN(channels, PA_CHANNELS_MAX);
+    for (i = 0; i < a->channels; i++)
+        a->values[i] = v;
+
+    return a;
+}
+
+int pa_cvolume_equal(const pa_cvolume *a, const pa_cvolume *b)
+{
+    unsigned i;
+
+    if (a->channels != b->channels)
+        return 0;
+
+    for (i = 0; i < a->channels; i++) {
+        if (a->values[i] != b->values[i])
+            return 0;
+    }
+
+    return 1;
+}
+
+/* Linear rather than cubic, volumes are only compared with each other */
+pa_volume_t pa_sw_volume_from_linear(double v)
+{
+    if (v <= 0.0)
+        return PA_VOLUME_MUTED;
+
+    return (pa_volume_t)(v * PA_VOLUME_NORM);
+}
+
+const char *pa_strerror(int error)
+{
+    switch (ABS(error)) {
+    case PA_OK:
+        return "OK";
+    case PA_ERR_INVALID:
+        return "Invalid argument";
+    case PA_ERR_CONNECTIONREFUSED:
+        return "Connection refused";
+    case PA_ERR_NOENTITY:
+        return "No such entity";
+    case PA_ERR_CONNECTIONTERMINATED:
+        return "Connection terminated";
+    case PA_ERR_BADSTATE:
+        return "Bad state";
+    default:
+        return "Unknown error code";
+    }
+}
+
+pa_glib_mainloop *pa_glib_mainloop_new(GMainContext *c)
+{
+    return g_new0(pa_glib_mainloop, 1);
+}
+
+void pa_glib_mainloop_free(pa_glib_mainloop *g)
+{
+    g_free(g);
+}
+
+pa_mainloop_api *pa_glib_mainloop_get_api(pa_glib_mainloop *g)
+{
+    return &g->api;
+}
+
+/******************************************************************************
+ * Test interface
+ ******************************************************************************/
+
+/**
+ * fake_pulse_reset:
+ *
+ * Bring the server back to its initial state: no card, no module, running,
+ * without latency. Clients are expected to be gone already.
+ */
+void fake_pulse_reset(void)
+{
+    Request *request;
+
+    server_init();
+
+    while ((request = g_queue_pop_head(&server.requests)))
+        request_free(request);
+    while ((request = g_queue_pop_head(&server.events)))
+        request_free(request);
+    if (server.dispatch_id) {
+        g_source_remove(server.dispatch_id);
+        server.dispatch_id = 0;
+    }
+
+    g_ptr_array_set_size(server.devices, 0);
+    g_ptr_array_set_size(server.cards, 0);
+    g_ptr_array_set_size(server.modules, 0);
+    g_ptr_array_set_size(server.allowed_criticals, 0);
+    server.next_card = server.next_device = server.next_module = 0;
+    g_clear_pointer(&server.default_sink, g_free);
+    g_clear_pointer(&server.default_source, g_free);
+    fake_pulse_set_server_name("pulseaudio");
+    server.latency = 0;
+    server.stopped = FALSE;
+    server.served = 0;
+    server.commands = 0;
+}
+
+/**
+ * fake_pulse_set_latency:
+ * @msec: the delay before each request is answered
+ */
+void fake_pulse_set_latency(guint msec)
+{
+    server.latency = msec;
+}
+
+/**
+ * fake_pulse_set_server_name:
+ * @name: the server name, e.g. "PulseAudio (on PipeWire 0.3.65)"
+ */
+void fake_pulse_set_server_name(const gchar *name)
+{
+    server_init();
+
+    g_free(server.server_name);
+    server.server_name = g_strdup(name);
+}
+
+/**
+ * fake_pulse_set_running:
+ * @running: whether the server accepts connections
+ *
+ * Stopping the server drops all connections. Clients connecting with
+ * %PA_CONTEXT_NOFAIL wait for it to start again.
+ */
+void fake_pulse_set_running(gboolean running)
+{
+    GList *l;
+
+    server_init();
+
+    server.stopped = !running;
+    if (!running) {
+        kill_clients();
+        return;
+    }
+
+    for (l = server.contexts; l; l = l->next) {
+        pa_context *c = l->data;
+
+        if (c->state == PA_CONTEXT_CONNECTING && !c->connect_queued)
+            queue_connect(c);
+    }
+}
+
+/**
+ * fake_pulse_disconnect:
+ *
+ * Drop all connections, as if the server had crashed and been restarted.
+ */
+void fake_pulse_disconnect(void)
+{
+    kill_clients();
+}
+
+/**
+ * fake_pulse_add_card:
+ * @card: the card to plug
+ *
+ * Returns: the card's index
+ */
+guint32 fake_pulse_add_card(const FakePulseCard *spec)
+{
+    ServerCard *card = g_new0(ServerCard, 1);
+    guint i;
+
+    server_init();
+
+    card->index = server.next_card++;
+    card->name = g_strdup(spec->name);
+    card->driver = g_strdup(spec->driver);
+    card->rate = spec->rate;
+    card->proplist = pa_proplist_new();
+    for (i = 0; spec->properties[i]; i += 2)
+        pa_proplist_sets(card->proplist, spec->properties[i], spec->properties[i + 1]);
+    card->profiles = g_ptr_array_new_with_free_func(g_free);
+    for (i = 0; spec->profiles[i]; i++)
+        g_ptr_array_add(card->profiles, g_strdup(spec->profiles[i]));
+    card->ports = g_ptr_array_new_with_free_func((GDestroyNotify)server_port_free);
+    for (i = 0; spec->ports[i].name; i++) {
+        ServerPort *port = g_new0(ServerPort, 1);
+
+        port->name = g_strdup(spec->ports[i].name);
+        port->direction = spec->ports[i].direction;
+        port->priority = spec->ports[i].priority;
+        port->available = spec->ports[i].available;
+        g_ptr_array_add(card->ports, port);
+    }
+    g_ptr_array_add(server.cards, card);
+
+    post_event(PA_SUBSCRIPTION_EVENT_CARD | PA_SUBSCRIPTION_EVENT_NEW, card->index);
+    card_add_devices(card);
+
+    return card->index;
+}
+
+/**
+ * fake_pulse_remove_card:
+ * @index: the card's index
+ *
+ * Unplug a card, along with its devices.
+ */
+void fake_pulse_remove_card(guint32 index)
+{
+    ServerCard *card = find_card(index);
+
+    g_return_if_fail(card != NULL);
+
+    card_remove_devices(card);
+    g_ptr_array_remove(server.cards, card);
+    post_event(PA_SUBSCRIPTION_EVENT_CARD | PA_SUBSCRIPTION_EVENT_REMOVE, index);
+}
+
+/**
+ * fake_pulse_set_port_available:
+ * @card: the card's index
+ * @port: the port name
+ * @available: the new availability
+ *
+ * Plug or unplug a jack. As with module-switch-on-port-available unloaded,
+ * the active ports don't change.
+ */
+void fake_pulse_set_port_available(guint32 card, const gchar *port,
+                                   pa_port_available_t available)
+{
+    ServerCard *server_card = find_card(card);
+    guint i;
+
+    g_return_if_fail(server_card != NULL);
+
+    for (i = 0; i < server_card->ports->len; i++) {
+        ServerPort *server_port = g_ptr_array_index(server_card->ports, i);
+
+        if (strcmp(server_port->name, port) != 0 || server_port->available == available)
+            continue;
+
+        server_port->available = available;
+        post_event(PA_SUBSCRIPTION_EVENT_CARD | PA_SUBSCRIPTION_EVENT_CHANGE, card);
+    }
+}
+
+/**
+ * fake_pulse_add_module:
+ * @name: the module name
+ * @argument: (nullable): the module arguments
+ *
+ * Returns: the module's index
+ */
+guint32 fake_pulse_add_module(const gchar *name, const gchar *argument)
+{
+    server_init();
+
+    return module_add(name, argument);
+}
+
+const gchar *fake_pulse_get_active_profile(guint32 card)
+{
+    ServerCard *server_card = find_card(card);
+
+    if (!server_card)
+        return NULL;
+
+    return g_ptr_array_index(server_card->profiles, server_card->active_profile);
+}
+
+const gchar *fake_pulse_get_sink_port(guint32 card)
+{
+    ServerDevice *sink = find_card_device(card, TRUE);
+
+    return sink && sink->active_port ? sink->active_port->name : NULL;
+}
+
+gboolean fake_pulse_get_source_mute(guint32 card)
+{
+    ServerDevice *source = find_card_device(card, FALSE);
+
+    g_return_val_if_fail(source != NULL, FALSE);
+
+    return source->mute;
+}
+
+guint fake_pulse_count_modules(const gchar *name)
+{
+    guint i, count = 0;
+
+    for (i = 0; i < server.modules->len; i++) {
+        ServerModule *module = g_ptr_array_index(server.modules, i);
+
+        if (strcmp(module->name, name) == 0)
+            count++;
+    }
+
+    return count;
+}
+
+/**
+ * fake_pulse_count_clients:
+ *
+ * Returns: the number of connected contexts.
+ */
+guint fake_pulse_count_clients(void)
+{
+    guint count = 0;
+    GList *l;
+
+    for (l = server.contexts; l; l = l->next) {
+        pa_context *c = l->data;
+
+        if (c->state == PA_CONTEXT_READY)
+            count++;
+    }
+
+    return count;
+}
+
+/**
+ * fake_pulse_count_streams:
+ *
+ * Returns: the number of streams connected to a device.
+ */
+guint fake_pulse_count_streams(void)
+{
+    guint count = 0;
+    GList *l;
+
+    for (l = server.streams; l; l = l->next) {
+        pa_stream *s = l->data;
+
+        if (s->state == PA_STREAM_READY)
+            count++;
+    }
+
+    return count;
+}
+
+/**
+ * fake_pulse_get_requests:
+ *
+ * Returns: the number of requests answered since the last reset.
+ */
+guint fake_pulse_get_requests(void)
+{
+    return server.served;
+}
+
+/**
+ * fake_pulse_get_commands:
+ *
+ * Returns: the number of requests changing the server state (profiles,
+ * ports, mute, modules...) answered since the last reset.
+ */
+guint fake_pulse_get_commands(void)
+{
+    return server.commands;
+}
+
+/**
+ * fake_pulse_is_idle:
+ *
+ * Returns: %TRUE if there's no request or event left to process.
+ */
+gboolean fake_pulse_is_idle(void)
+{
+    return g_queue_is_empty(&server.requests);
+}
+
+/******************************************************************************
+ * Test logs
+ *
+ * The tests run with fatal warnings, but callaudiod warns about conditions
+ * the tests trigger on purpose (e.g. a card going away during an operation).
+ * Its warnings are logged without aborting, criticals only if they match a
+ * pattern allowed with fake_pulse_allow_critical(). Messages are only shown
+ * in verbose mode.
+ ******************************************************************************/
+
+static void log_handler(const gchar *domain, GLogLevelFlags level,
+                        const gchar *message, gpointer data)
+{
+    if ((level & (G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG)) &&
+        !g_test_verbose())
+        return;
+
+    g_log_default_handler(domain, level, message, data);
+}
+
+static gboolean fatal_log_handler(const gchar *domain, GLogLevelFlags level,
+                                  const gchar *message, gpointer data)
+{
+    guint i;
+
+    if (!domain || !g_str_has_prefix(domain, "callaudiod"))
+        return TRUE;
+
+    if (level & G_LOG_LEVEL_WARNING)
+        return FALSE;
+
+    for (i = 0; i < server.allowed_criticals->len; i++) {
+        if (g_pattern_match_simple(g_ptr_array_index(server.allowed_criticals, i), message))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * fake_pulse_init_logs:
+ *
+ * Set up logging for tests running callaudiod against the fake server. Must
+ * be called after g_test_init().
+ */
+void fake_pulse_init_logs(void)
+{
+    server_init();
+
+    g_log_set_default_handler(log_handler, NULL);
+    g_test_log_set_fatal_handler(fatal_log_handler, NULL);
+}
+
+/**
+ * fake_pulse_allow_critical:
+ * @pattern: a glob-style pattern
+ *
+ * Don't abort on callaudiod criticals matching @pattern, until the next
+ * fake_pulse_reset().
+ */
+void fake_pulse_allow_critical(const gchar *pattern)
+{
+    g_ptr_array_add(server.allowed_criticals, g_strdup(pattern));
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <pulse/pulseaudio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * FakePulsePort:
+ * @name: the port name, %NULL to end a list of ports
+ * @direction: whether the port belongs to the card's sink or source
+ * @priority: the port priority
+ * @available: the port availability (e.g. whether a jack is plugged)
+ */
+typedef struct _FakePulsePort {
+    const gchar *name;
+    pa_direction_t direction;
+    guint32 priority;
+    pa_port_available_t available;
+} FakePulsePort;
+
+/**
+ * FakePulseCard:
+ * @name: the card name
+ * @driver: the PulseAudio module handling the card
+ * @properties: %NULL-terminated list of property names and values
+ * @profiles: %NULL-terminated list of profiles, the first one is active
+ * @ports: the card ports, ended by a port without name
+ * @rate: the sample rate of the card's sink and source
+ *
+ * A scripted sound card. Each profile but "off" gets a sink (with its monitor
+ * source) if the card has output ports, and a source if it has input ports;
+ * switching profiles re-creates them, as PulseAudio does.
+ */
+typedef struct _FakePulseCard {
+    const gchar *name;
+    const gchar *driver;
+    const gchar * const *properties;
+    const gchar * const *profiles;
+    const FakePulsePort *ports;
+    guint32 rate;
+} FakePulseCard;
+
+extern const FakePulseCard fake_pulse_pinephone;
+extern const FakePulseCard fake_pulse_librem5;
+extern const FakePulseCard fake_pulse_bt_headset;
+
+void fake_pulse_reset(void);
+void fake_pulse_set_latency(guint msec);
+void fake_pulse_set_server_name(const gchar *name);
+void fake_pulse_set_running(gboolean running);
+void fake_pulse_disconnect(void);
+
+guint32 fake_pulse_add_card(const FakePulseCard *card);
+void fake_pulse_remove_card(guint32 index);
+void fake_pulse_set_port_available(guint32 card, const gchar *port,
+                                   pa_port_available_t available);
+guint32 fake_pulse_add_module(const gchar *name, const gchar *argument);
+
+const gchar *fake_pulse_get_active_profile(guint32 card);
+const gchar *fake_pulse_get_sink_port(guint32 card);
+gboolean fake_pulse_get_source_mute(guint32 card);
+guint fake_pulse_count_modules(const gchar *name);
+guint fake_pulse_count_clients(void);
+guint fake_pulse_count_streams(void);
+guint fake_pulse_get_requests(void);
+guint fake_pulse_get_commands(void);
+gboolean fake_pulse_is_idle(void);
+
+void fake_pulse_init_logs(void);
+void fake_pulse_allow_critical(const gchar *pattern);
+
+G_END_DECLS
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "pulse-driver.h"
+#include "cad-manager.h"
+#include "cad-pulse.h"
+#include "fake-pulse.h"
+
+/*
+ * Drive the PulseAudio backend against the fake server from fake-pulse.c the
+ * way the D-Bus interface does, waiting for each operation to complete.
+ */
+
+static gint op_result = -1;
+
+static void op_cb(CadOperation *op)
+{
+    op_result = op->success;
+}
+
+/**
+ * pulse_driver_connect:
+ *
+ * Create the backend, and wait for it to find the cards of the fake server.
+ */
+void pulse_driver_connect(void)
+{
+    /* The manager creates the backend while scanning bluetooth devices */
+    cad_manager_get_default();
+    cad_pulse_get_default();
+    pulse_driver_wait_idle();
+}
+
+/**
+ * pulse_driver_wait_idle:
+ *
+ * Process requests until the server and callaudiod are both idle.
+ */
+void pulse_driver_wait_idle(void)
+{
+    do {
+        while (!fake_pulse_is_idle())
+            g_main_context_iteration(NULL, TRUE);
+    } while (g_main_context_iteration(NULL, FALSE));
+}
+
+/**
+ * pulse_driver_op_new:
+ * @type: the operation type
+ *
+ * Returns: a new operation, whose result is returned by
+ * pulse_driver_get_result() once complete.
+ */
+CadOperation *pulse_driver_op_new(CadOperationType type)
+{
+    CadOperation *op = g_new0(CadOperation, 1);
+
+    op->type = type;
+    op->callback = op_cb;
+    op_result = -1;
+
+    return op;
+}
+
+/**
+ * pulse_driver_get_result:
+ *
+ * Returns: the result of the last operation, -1 if it is still pending.
+ */
+gint pulse_driver_get_result(void)
+{
+    return op_result;
+}
+
+/**
+ * pulse_driver_wait_op:
+ *
+ * Wait for the pending operation, which must release the state.
+ *
+ * Returns: whether the operation succeeded.
+ */
+gboolean pulse_driver_wait_op(void)
+{
+    pulse_driver_wait_idle();
+
+    g_assert_cmpint(op_result, !=, -1);
+    g_assert_cmpuint(cad_manager_get_default()->commit_hold, ==, 0);
+
+    return op_result;
+}
+
+gboolean pulse_driver_select_mode(CallAudioMode mode)
+{
+    cad_pulse_select_mode(mode, pulse_driver_op_new(CAD_OPERATION_SELECT_MODE));
+
+    return pulse_driver_wait_op();
+}
+
+gboolean pulse_driver_enable_speaker(gboolean enable)
+{
+    cad_pulse_enable_speaker(enable, pulse_driver_op_new(CAD_OPERATION_ENABLE_SPEAKER));
+
+    return pulse_driver_wait_op();
+}
+
+gboolean pulse_driver_mute_mic(gboolean mute)
+{
+    cad_pulse_mute_mic(mute, pulse_driver_op_new(CAD_OPERATION_MUTE_MIC));
+
+    return pulse_driver_wait_op();
+}
+
+gboolean pulse_driver_prepare_call(gboolean prepare)
+{
+    cad_pulse_prepare_call(prepare, pulse_driver_op_new(CAD_OPERATION_PREPARE_CALL));
+
+    return pulse_driver_wait_op();
+}
+
+gboolean pulse_driver_enable_bt_audio(gboolean enable)
+{
+    cad_pulse_enable_bt_audio(enable, pulse_driver_op_new(CAD_OPERATION_SWITCH_BT_AUDIO));
+
+    return pulse_driver_wait_op();
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "libcallaudio.h"
+#include "cad-operation.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void pulse_driver_connect(void);
+void pulse_driver_wait_idle(void);
+
+CadOperation *pulse_driver_op_new(CadOperationType type);
+gint pulse_driver_get_result(void);
+gboolean pulse_driver_wait_op(void);
+
+gboolean pulse_driver_select_mode(CallAudioMode mode);
+gboolean pulse_driver_enable_speaker(gboolean enable);
+gboolean pulse_driver_mute_mic(gboolean mute);
+gboolean pulse_driver_prepare_call(gboolean prepare);
+gboolean pulse_driver_enable_bt_audio(gboolean enable);
+
+G_END_DECLS
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "alloc-counter.h"
+#include "config.h"
+#include "fake-pulse.h"
+#include "trace-replay.h"
+
+#include <glib/gstdio.h>
+
+#include <stdio.h>
+
+/*
+ * Replay a trace recorded with "callaudiod --trace" against the fake
+ * PulseAudio server, and report the time and allocations it took along with
+ * the routing decisions made.
+ */
+int main(int argc, char **argv)
+{
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *runtime_dir = NULL;
+    g_autofree gchar *data_dir = NULL;
+    TraceReplayStats stats;
+    gdouble speed = 0;
+    gboolean verbose = FALSE;
+    gboolean ret;
+    guint i;
+
+    const GOptionEntry options[] = {
+        {"speed", 's', 0, G_OPTION_ARG_DOUBLE, &speed,
+         "Replay SPEED times faster than recorded (default: as fast as possible)", "SPEED"},
+        {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+         "Print the route chosen after each operation", NULL},
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+    };
+
+    context = g_option_context_new("TRACE - replay a callaudiod trace");
+    g_option_context_add_main_entries(context, options, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+
+    if (argc != 2) {
+        g_autofree gchar *help = g_option_context_get_help(context, TRUE, NULL);
+
+        g_printerr("%s", help);
+        return 1;
+    }
+
+    fake_pulse_init_logs();
+
+    /* Don't overwrite the state saved by the real callaudiod */
+    runtime_dir = g_dir_make_tmp("callaudiod-replay-XXXXXX", &error);
+    if (!runtime_dir) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    g_setenv("XDG_RUNTIME_DIR", runtime_dir, TRUE);
+
+    ret = trace_replay_run(argv[1], speed, &stats, &error);
+
+    data_dir = g_build_filename(runtime_dir, APP_DATA_NAME, NULL);
+    g_rmdir(data_dir);
+    g_rmdir(runtime_dir);
+
+    if (!ret) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+
+    if (verbose) {
+        for (i = 0; i < stats.routes->len; i++)
+            printf("%s\n", (gchar *)g_ptr_array_index(stats.routes, i));
+    }
+
+    printf("Replayed %u operations and %u card events in %.3f s, using %.3f s of CPU time\n",
+           stats.operations, stats.events, stats.elapsed, stats.cpu_time);
+    printf("%u requests, %u of them routing commands\n", stats.requests, stats.commands);
+    if (alloc_counter_is_available())
+        printf("%" G_GUINT64_FORMAT " allocations\n", stats.allocations);
+    printf("%u operations with a different outcome than recorded\n", stats.mismatches);
+
+    trace_replay_stats_clear(&stats);
+
+    return 0;
+}
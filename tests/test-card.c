@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cad-card.h"
+
+#include <glib.h>
+
+static void test_card_internal(void)
+{
+    /* PinePhone-style card, with all properties set */
+    g_assert_true(cad_card_is_internal("platform-sound", "internal",
+                                       "PinePhone", "sound"));
+    /* Properties aren't mandatory */
+    g_assert_true(cad_card_is_internal(NULL, NULL, NULL, NULL));
+
+    /* USB and bluetooth cards */
+    g_assert_false(cad_card_is_internal("pci-0000:00:14.0-usb-0:1:1.0", NULL,
+                                        "USB Audio", "sound"));
+    g_assert_false(cad_card_is_internal(NULL, "headset", NULL, "sound"));
+
+    /* Modems exposing an audio card */
+    g_assert_false(cad_card_is_internal("platform-sound", "internal",
+                                        "Modem", "sound"));
+    g_assert_false(cad_card_is_internal("platform-modem", NULL, NULL, "modem"));
+}
+
+static void test_card_call_ports(void)
+{
+    /* PinePhone ports */
+    g_assert_true(cad_card_port_is_speaker("[Out] Speaker"));
+    g_assert_true(cad_card_port_is_earpiece("[Out] Earpiece"));
+    g_assert_false(cad_card_port_is_speaker("[Out] Earpiece"));
+    g_assert_false(cad_card_port_is_earpiece("[Out] Speaker"));
+
+    /* Some UCM configs name the earpiece after the handset */
+    g_assert_true(cad_card_port_is_earpiece("[Out] Handset"));
+
+    g_assert_false(cad_card_port_is_speaker("[Out] Headphones"));
+    g_assert_false(cad_card_port_is_earpiece("[Out] Headphones"));
+    g_assert_false(cad_card_port_is_speaker("[In] Mic"));
+    g_assert_false(cad_card_port_is_earpiece(""));
+}
+
+static void test_card_voice_profile(void)
+{
+    g_assert_true(cad_card_profile_is_voice("Voice Call"));
+    /* Also matches, callers pick the first voice profile of the card */
+    g_assert_true(cad_card_profile_is_voice("Voice Call BT"));
+    g_assert_false(cad_card_profile_is_voice("HiFi"));
+    g_assert_false(cad_card_profile_is_voice("off"));
+    g_assert_false(cad_card_profile_is_voice(""));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/card/internal", test_card_internal);
+    g_test_add_func("/card/call-ports", test_card_call_ports);
+    g_test_add_func("/card/voice-profile", test_card_voice_profile);
+
+    return g_test_run();
+}
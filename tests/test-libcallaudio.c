@@ -0,0 +1,407 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "callaudiod.h"
+#include "callaudio-dbus.h"
+#include "libcallaudio.h"
+
+#include <gio/gio.h>
+
+#define N_THREADS 4
+#define N_ITERATIONS 2000
+#define N_INIT_ITERATIONS 300
+#define CALL_INTERVAL 50
+
+/*
+ * A minimal callaudiod on a private session bus, publishing a new state
+ * every millisecond from its own thread. Every field is derived from the
+ * generation number so clients can tell whether they got a torn state: the
+ * speaker and mic states are always equal, and so are the audio mode and
+ * Bluetooth state.
+ */
+typedef struct {
+    GDBusConnection *connection;
+    CallAudioDbusCallAudio *skeleton;
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread;
+    guint64 generation;
+} FakeDaemon;
+
+/*
+ * The main context libcallaudio dispatches its notifications in, iterated by
+ * a dedicated thread like in an application with a GLib main loop.
+ */
+typedef struct {
+    GMainContext *context;
+    GMainLoop *loop;
+    GThread *thread;
+} Dispatcher;
+
+static GTestDBus *bus;
+static FakeDaemon fake_daemon;
+static Dispatcher dispatcher;
+static gint listener_calls;
+
+static void check_state(const CallAudioState *state)
+{
+    g_assert_cmpuint(state->mic_state, ==, state->speaker_state);
+    g_assert_cmpuint(state->bt_audio_state, ==, state->mode);
+}
+
+static GVariant *build_state(guint64 generation)
+{
+    GVariantBuilder builder;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add(&builder, "{sv}", "AudioMode",
+                          g_variant_new_uint32(generation % 3));
+    g_variant_builder_add(&builder, "{sv}", "SpeakerState",
+                          g_variant_new_uint32(generation % 2));
+    g_variant_builder_add(&builder, "{sv}", "MicState",
+                          g_variant_new_uint32(generation % 2));
+    g_variant_builder_add(&builder, "{sv}", "BtAudioState",
+                          g_variant_new_uint32(generation % 3));
+    g_variant_builder_add(&builder, "{sv}", "Generation",
+                          g_variant_new_uint64(generation));
+
+    return g_variant_builder_end(&builder);
+}
+
+static gboolean publish_cb(gpointer data)
+{
+    FakeDaemon *self = data;
+
+    call_audio_dbus_call_audio_emit_state_changed(self->skeleton,
+                                                  build_state(++self->generation));
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean handle_select_mode(CallAudioDbusCallAudio *skeleton,
+                                   GDBusMethodInvocation  *invocation,
+                                   guint                   mode,
+                                   gpointer                data)
+{
+    call_audio_dbus_call_audio_complete_select_mode(skeleton, invocation, TRUE);
+
+    return TRUE;
+}
+
+static gpointer run_loop(gpointer data)
+{
+    GMainLoop *loop = data;
+    GMainContext *context = g_main_loop_get_context(loop);
+
+    g_main_context_push_thread_default(context);
+    g_main_loop_run(loop);
+    g_main_context_pop_thread_default(context);
+
+    return NULL;
+}
+
+static void fake_daemon_start(FakeDaemon *self)
+{
+    g_autoptr(GVariant) ret = NULL;
+    g_autoptr(GError) error = NULL;
+    GSource *source;
+
+    self->context = g_main_context_new();
+    self->loop = g_main_loop_new(self->context, FALSE);
+
+    self->connection = g_dbus_connection_new_for_address_sync(
+                            g_test_dbus_get_bus_address(bus),
+                            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                            G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                            NULL, NULL, &error);
+    g_assert_no_error(error);
+
+    /* Method calls are dispatched in the context the object is exported from */
+    g_main_context_push_thread_default(self->context);
+    self->skeleton = call_audio_dbus_call_audio_skeleton_new();
+    g_signal_connect(self->skeleton, "handle-select-mode",
+                     G_CALLBACK(handle_select_mode), NULL);
+    g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(self->skeleton),
+                                     self->connection, CALLAUDIO_DBUS_PATH,
+                                     &error);
+    g_main_context_pop_thread_default(self->context);
+    g_assert_no_error(error);
+
+    ret = g_dbus_connection_call_sync(self->connection, "org.freedesktop.DBus",
+                                      "/org/freedesktop/DBus",
+                                      "org.freedesktop.DBus", "RequestName",
+                                      g_variant_new("(su)", CALLAUDIO_DBUS_NAME, 0),
+                                      G_VARIANT_TYPE("(u)"),
+                                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+    g_assert_no_error(error);
+
+    source = g_timeout_source_new(1);
+    g_source_set_callback(source, publish_cb, self, NULL);
+    g_source_attach(source, self->context);
+    g_source_unref(source);
+
+    self->thread = g_thread_new("fake-callaudiod", run_loop, self->loop);
+}
+
+static void fake_daemon_stop(FakeDaemon *self)
+{
+    g_main_loop_quit(self->loop);
+    g_thread_join(self->thread);
+
+    g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(self->skeleton));
+    g_clear_object(&self->skeleton);
+    g_dbus_connection_close_sync(self->connection, NULL, NULL);
+    g_clear_object(&self->connection);
+    g_clear_pointer(&self->loop, g_main_loop_unref);
+    g_clear_pointer(&self->context, g_main_context_unref);
+}
+
+static void dispatcher_start(Dispatcher *self)
+{
+    self->context = g_main_context_new();
+    self->loop = g_main_loop_new(self->context, FALSE);
+    self->thread = g_thread_new("dispatcher", run_loop, self->loop);
+}
+
+static void dispatcher_stop(Dispatcher *self)
+{
+    g_main_loop_quit(self->loop);
+    g_thread_join(self->thread);
+
+    /* Release the notifications still queued, and the proxies they hold */
+    while (g_main_context_iteration(self->context, FALSE));
+
+    g_clear_pointer(&self->loop, g_main_loop_unref);
+    g_clear_pointer(&self->context, g_main_context_unref);
+}
+
+/*
+ * Listeners may be called once more after being removed from another thread,
+ * so their data must outlive them: use a static counter.
+ */
+static void listener_cb(const CallAudioState *old_state,
+                        const CallAudioState *new_state,
+                        gpointer              data)
+{
+    check_state(old_state);
+    check_state(new_state);
+    g_atomic_int_inc((gint *)data);
+}
+
+typedef struct {
+    guint id;
+    guint other_id;
+    gint other_calls;
+    gint calls;
+} RemovingListener;
+
+static void removing_listener_cb(const CallAudioState *old_state,
+                                 const CallAudioState *new_state,
+                                 gpointer              data)
+{
+    RemovingListener *listener = data;
+
+    call_audio_remove_state_listener(listener->other_id);
+    g_atomic_int_inc(&listener->calls);
+}
+
+/* Runs in the dispatching context, so no notification can come in between */
+static gboolean add_listeners_cb(gpointer data)
+{
+    RemovingListener *listener = data;
+
+    listener->id = call_audio_add_state_listener(removing_listener_cb, listener);
+    listener->other_id = call_audio_add_state_listener(listener_cb,
+                                                       &listener->other_calls);
+    g_atomic_int_inc(&listener->calls);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void use_library(guint iteration)
+{
+    g_autoptr(GError) error = NULL;
+    CallAudioState state;
+    guint id;
+
+    if (call_audio_get_state(&state, NULL))
+        check_state(&state);
+
+    /* Individual getters aren't consistent with each other, only in range */
+    g_assert_cmpuint(call_audio_get_audio_mode(), <=, CALL_AUDIO_MODE_UNKNOWN);
+    g_assert_cmpuint(call_audio_get_speaker_state(), <=, CALL_AUDIO_SPEAKER_UNKNOWN);
+    g_assert_cmpuint(call_audio_get_mic_state(), <=, CALL_AUDIO_MIC_UNKNOWN);
+    g_assert_cmpuint(call_audio_get_bt_audio_state(), <=, CALL_AUDIO_BT_UNKNOWN);
+
+    id = call_audio_add_state_listener(listener_cb, &listener_calls);
+    if (id != 0)
+        call_audio_remove_state_listener(id);
+
+    /* Goes through get_proxy(), which must keep the proxy alive meanwhile */
+    if (iteration % CALL_INTERVAL == 0 && call_audio_is_inited())
+        call_audio_select_mode(CALL_AUDIO_MODE_CALL, &error);
+}
+
+static gpointer getters_thread(gpointer data)
+{
+    g_autoptr(GError) error = NULL;
+    guint i;
+
+    for (i = 0; i < N_ITERATIONS; i++) {
+        g_assert_true(call_audio_init(&error));
+        g_assert_no_error(error);
+        use_library(i);
+        call_audio_deinit();
+    }
+
+    return NULL;
+}
+
+static gpointer init_deinit_thread(gpointer data)
+{
+    g_autoptr(GError) error = NULL;
+    guint i;
+
+    for (i = 0; i < N_INIT_ITERATIONS; i++) {
+        g_assert_true(call_audio_init_with_context(dispatcher.context, &error));
+        g_assert_no_error(error);
+        use_library(i);
+        call_audio_deinit();
+
+        /* Also race with the library being torn down */
+        use_library(i);
+    }
+
+    return NULL;
+}
+
+static void run_threads(GThreadFunc func)
+{
+    GThread *threads[N_THREADS];
+    guint i;
+
+    for (i = 0; i < N_THREADS; i++)
+        threads[i] = g_thread_new("client", func, NULL);
+    for (i = 0; i < N_THREADS; i++)
+        g_thread_join(threads[i]);
+}
+
+static void wait_listener_calls(gint *calls)
+{
+    gint64 end = g_get_monotonic_time() + 5 * G_USEC_PER_SEC;
+
+    while (g_atomic_int_get(calls) == 0 && g_get_monotonic_time() < end)
+        g_usleep(1000);
+}
+
+/*
+ * Getters, listeners and method calls from several threads while the state
+ * is being updated, the library staying initialized throughout.
+ */
+static void test_concurrent_getters(void)
+{
+    g_autoptr(GError) error = NULL;
+    gint calls = 0;
+    guint id;
+
+    dispatcher_start(&dispatcher);
+
+    g_assert_true(call_audio_init_with_context(dispatcher.context, &error));
+    g_assert_no_error(error);
+    id = call_audio_add_state_listener(listener_cb, &calls);
+    g_assert_cmpuint(id, !=, 0);
+
+    run_threads(getters_thread);
+
+    wait_listener_calls(&calls);
+    g_assert_cmpint(g_atomic_int_get(&calls), >, 0);
+
+    call_audio_remove_state_listener(id);
+    call_audio_deinit();
+    g_assert_false(call_audio_is_inited());
+
+    dispatcher_stop(&dispatcher);
+}
+
+/*
+ * The same, with the library being initialized and freed concurrently: the
+ * proxy is created and destroyed many times, possibly while other threads
+ * are reading the state or calling methods.
+ */
+static void test_concurrent_init_deinit(void)
+{
+    dispatcher_start(&dispatcher);
+
+    run_threads(init_deinit_thread);
+    g_assert_false(call_audio_is_inited());
+
+    dispatcher_stop(&dispatcher);
+}
+
+/*
+ * A listener removed from the dispatching context, here by another listener
+ * notified of the same change, must not be called anymore.
+ */
+static void test_remove_from_listener(void)
+{
+    g_autoptr(GError) error = NULL;
+    RemovingListener remover = { 0 };
+
+    dispatcher_start(&dispatcher);
+
+    g_assert_true(call_audio_init_with_context(dispatcher.context, &error));
+    g_assert_no_error(error);
+
+    g_main_context_invoke(dispatcher.context, add_listeners_cb, &remover);
+
+    /* The first call is the registration itself */
+    while (g_atomic_int_get(&remover.calls) < 4)
+        g_usleep(1000);
+    g_assert_cmpuint(remover.id, !=, 0);
+    g_assert_cmpuint(remover.other_id, !=, 0);
+    g_assert_cmpint(g_atomic_int_get(&remover.other_calls), ==, 0);
+
+    call_audio_remove_state_listener(remover.id);
+    call_audio_deinit();
+
+    dispatcher_stop(&dispatcher);
+}
+
+int main(int argc, char **argv)
+{
+    g_autoptr(GDBusConnection) connection = NULL;
+    g_autofree gchar *dbus_daemon = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    dbus_daemon = g_find_program_in_path("dbus-daemon");
+    if (!dbus_daemon) {
+        g_printerr("dbus-daemon not found, skipping\n");
+        return 77;
+    }
+
+    bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(bus);
+    fake_daemon_start(&fake_daemon);
+
+    g_test_add_func("/libcallaudio/concurrent/getters", test_concurrent_getters);
+    g_test_add_func("/libcallaudio/concurrent/init-deinit", test_concurrent_init_deinit);
+    g_test_add_func("/libcallaudio/remove-from-listener", test_remove_from_listener);
+
+    ret = g_test_run();
+
+    fake_daemon_stop(&fake_daemon);
+
+    /* libcallaudio's connection may outlive the bus, don't exit with it */
+    connection = g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+    if (connection)
+        g_dbus_connection_set_exit_on_close(connection, FALSE);
+    g_test_dbus_stop(bus);
+    g_clear_object(&bus);
+
+    return ret;
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cad-manager.h"
+#include "cad-pulse.h"
+#include "cad-trace.h"
+#include "cad-wakeups.h"
+#include "config.h"
+#include "fake-pulse.h"
+#include "pulse-driver.h"
+#include "trace-replay.h"
+
+#include <glib/gstdio.h>
+
+#include <unistd.h>
+
+/*
+ * Run the PulseAudio backend against the fake server from fake-pulse.c,
+ * checking the routing decisions made on the devices callaudiod supports.
+ * The benchmark runs more iterations in performance mode ("-m perf").
+ */
+#define BENCHMARK_SWITCHES 200
+#define IDLE_PERIOD        500 /* ms */
+
+typedef struct {
+    guint32 card;
+} Fixture;
+
+static void fixture_setup(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_reset();
+    fake_pulse_add_module("module-switch-on-port-available", NULL);
+    fixture->card = fake_pulse_add_card(data);
+    pulse_driver_connect();
+}
+
+static void fixture_setup_pipewire(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_reset();
+    fake_pulse_set_server_name("PulseAudio (on PipeWire 0.3.65)");
+    fake_pulse_add_module("module-switch-on-port-available", NULL);
+    fixture->card = fake_pulse_add_card(data);
+    pulse_driver_connect();
+}
+
+/* No suitable card, callaudiod waits for one */
+static void fixture_setup_empty(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_reset();
+    fixture->card = PA_INVALID_INDEX;
+    pulse_driver_connect();
+}
+
+static void fixture_teardown(Fixture *fixture, gconstpointer data)
+{
+    g_object_unref(cad_pulse_get_default());
+    pulse_driver_wait_idle();
+    fake_pulse_reset();
+}
+
+static void test_pulse_init(Fixture *fixture, gconstpointer data)
+{
+    g_assert_cmpuint(fake_pulse_count_clients(), ==, 1);
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_DEFAULT);
+    g_assert_cmpint(cad_pulse_get_speaker_state(), ==, CALL_AUDIO_SPEAKER_OFF);
+    g_assert_cmpint(cad_pulse_get_mic_state(), ==, CALL_AUDIO_MIC_ON);
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "HiFi");
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Speaker");
+    /* It would switch ports behind our back */
+    g_assert_cmpuint(fake_pulse_count_modules("module-switch-on-port-available"), ==, 0);
+}
+
+static void test_pulse_pipewire(Fixture *fixture, gconstpointer data)
+{
+    /* The session manager handles routing policy */
+    g_assert_cmpuint(fake_pulse_count_modules("module-switch-on-port-available"), ==, 1);
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_DEFAULT);
+}
+
+static void test_pulse_voice_profile(Fixture *fixture, gconstpointer data)
+{
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_CALL);
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "Voice Call");
+    /* The sink is re-created by the profile switch, it mustn't use the speaker */
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Earpiece");
+
+    g_assert_true(pulse_driver_mute_mic(TRUE));
+    g_assert_cmpint(cad_pulse_get_mic_state(), ==, CALL_AUDIO_MIC_OFF);
+    g_assert_true(fake_pulse_get_source_mute(fixture->card));
+
+    /* Ending the call unmutes the mic */
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_DEFAULT));
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_DEFAULT);
+    g_assert_cmpint(cad_pulse_get_mic_state(), ==, CALL_AUDIO_MIC_ON);
+    g_assert_false(fake_pulse_get_source_mute(fixture->card));
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "HiFi");
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Speaker");
+
+    /* VoIP keeps the default profile, with the earpiece */
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_VOIP));
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_VOIP);
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "HiFi");
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Earpiece");
+}
+
+static void test_pulse_no_voice_profile(Fixture *fixture, gconstpointer data)
+{
+    /* The mode is guessed from the active port */
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_DEFAULT);
+
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_CALL);
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "HiFi");
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Earpiece");
+
+    g_assert_true(pulse_driver_enable_speaker(TRUE));
+    g_assert_cmpint(cad_pulse_get_speaker_state(), ==, CALL_AUDIO_SPEAKER_ON);
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Speaker");
+
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_DEFAULT));
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_DEFAULT);
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Speaker");
+}
+
+static void test_pulse_headphones(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_set_port_available(fixture->card, "[Out] Headphones", PA_PORT_AVAILABLE_YES);
+    pulse_driver_wait_idle();
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Headphones");
+
+    fake_pulse_set_port_available(fixture->card, "[Out] Headphones", PA_PORT_AVAILABLE_NO);
+    pulse_driver_wait_idle();
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Speaker");
+}
+
+static void test_pulse_prepared_call(Fixture *fixture, gconstpointer data)
+{
+    guint unprepared, prepared;
+
+    unprepared = fake_pulse_get_requests();
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    unprepared = fake_pulse_get_requests() - unprepared;
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_DEFAULT));
+
+    g_assert_true(pulse_driver_prepare_call(TRUE));
+    /* Ringing doesn't change the route */
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "HiFi");
+
+    prepared = fake_pulse_get_requests();
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    prepared = fake_pulse_get_requests() - prepared;
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "Voice Call");
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Earpiece");
+
+    g_test_message("Answering a call takes %u requests, %u when prepared",
+                   unprepared, prepared);
+    g_assert_cmpuint(prepared, <, unprepared);
+}
+
+static void test_pulse_bt(Fixture *fixture, gconstpointer data)
+{
+    guint32 headset;
+
+    headset = fake_pulse_add_card(&fake_pulse_bt_headset);
+    pulse_driver_wait_idle();
+    g_assert_cmpint(cad_pulse_get_bt_audio_state(), ==, CALL_AUDIO_BT_AVAILABLE);
+
+    g_assert_true(pulse_driver_enable_bt_audio(TRUE));
+    g_assert_cmpstr(fake_pulse_get_active_profile(headset), ==, "handsfree_head_unit");
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "Voice Call BT");
+    g_assert_cmpuint(fake_pulse_count_modules("module-loopback"), ==, 2);
+    /* The headset runs at 16 kHz, the internal card at 48 kHz */
+    g_assert_true(cad_pulse_is_resampling());
+
+    g_assert_true(pulse_driver_enable_bt_audio(FALSE));
+    g_assert_cmpuint(fake_pulse_count_modules("module-loopback"), ==, 0);
+    g_assert_false(cad_pulse_is_resampling());
+
+    fake_pulse_remove_card(headset);
+    pulse_driver_wait_idle();
+}
+
+static void test_pulse_card_removed(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_allow_critical("PA returned an error while querying card info");
+
+    cad_pulse_select_mode(CALL_AUDIO_MODE_CALL, pulse_driver_op_new(CAD_OPERATION_SELECT_MODE));
+    fake_pulse_remove_card(fixture->card);
+
+    g_assert_false(pulse_driver_wait_op());
+}
+
+static void test_pulse_disconnect(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_allow_critical("Error in PulseAudio context: *");
+
+    cad_pulse_select_mode(CALL_AUDIO_MODE_CALL, pulse_driver_op_new(CAD_OPERATION_SELECT_MODE));
+    fake_pulse_disconnect();
+    /* Pending requests are dropped, the operation fails right away */
+    g_assert_cmpint(pulse_driver_get_result(), ==, FALSE);
+    g_assert_cmpuint(cad_manager_get_default()->commit_hold, ==, 0);
+
+    /* The backend reconnects and finds the card again */
+    pulse_driver_wait_idle();
+    g_assert_cmpuint(fake_pulse_count_clients(), ==, 1);
+    g_assert_cmpint(cad_pulse_get_audio_mode(), ==, CALL_AUDIO_MODE_DEFAULT);
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "Voice Call");
+}
+
+static void test_pulse_latency(Fixture *fixture, gconstpointer data)
+{
+    gint64 start;
+
+    fake_pulse_set_latency(20);
+
+    /* Querying the card, then switching profiles: two round trips */
+    start = g_get_monotonic_time();
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    g_assert_cmpint(g_get_monotonic_time() - start, >=, 40 * G_TIME_SPAN_MILLISECOND);
+    g_assert_cmpstr(fake_pulse_get_sink_port(fixture->card), ==, "[Out] Earpiece");
+}
+
+static void test_pulse_benchmark(Fixture *fixture, gconstpointer data)
+{
+    guint switches = g_test_perf() ? 10 * BENCHMARK_SWITCHES : BENCHMARK_SWITCHES;
+    guint requests = fake_pulse_get_requests();
+    gdouble elapsed;
+    guint i;
+
+    g_test_timer_start();
+    for (i = 0; i < switches; i++)
+        g_assert_true(pulse_driver_select_mode(i % 2 ? CALL_AUDIO_MODE_DEFAULT : CALL_AUDIO_MODE_CALL));
+    elapsed = g_test_timer_elapsed();
+    requests = fake_pulse_get_requests() - requests;
+
+    g_test_message("%u mode switches in %.3f s: %.0f switches/s, %.1f requests per switch",
+                   switches, elapsed, switches / elapsed, (gdouble)requests / switches);
+    g_test_minimized_result(elapsed / switches, "%.1f us per mode switch",
+                            elapsed / switches * G_USEC_PER_SEC);
+}
+
+static gboolean idle_period_cb(gpointer data)
+{
+    gboolean *done = data;
+
+    *done = TRUE;
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Stay idle for IDLE_PERIOD, and return the wakeups but the one ending it */
+static guint64 count_idle_wakeups(void)
+{
+    gboolean done = FALSE;
+    guint64 count;
+
+    pulse_driver_wait_idle();
+    cad_wakeups_set_idle(TRUE);
+    count = cad_wakeups_get_idle_count();
+    g_timeout_add(IDLE_PERIOD, idle_period_cb, &done);
+    while (!done)
+        g_main_context_iteration(NULL, TRUE);
+    cad_wakeups_set_idle(FALSE);
+
+    return cad_wakeups_get_idle_count() - count - 1;
+}
+
+static void test_pulse_wakeups_idle(Fixture *fixture, gconstpointer data)
+{
+    g_assert_cmpuint(count_idle_wakeups(), ==, 0);
+}
+
+/* New cards are notified by the server, they mustn't be polled for */
+static void test_pulse_wakeups_card_wait(Fixture *fixture, gconstpointer data)
+{
+    g_assert_cmpuint(count_idle_wakeups(), ==, 0);
+
+    fixture->card = fake_pulse_add_card(&fake_pulse_pinephone);
+    pulse_driver_wait_idle();
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "Voice Call");
+}
+
+/* While the server is down, the connection waits for it instead of retrying */
+static void test_pulse_wakeups_reconnect(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_allow_critical("Error in PulseAudio context: *");
+
+    fake_pulse_set_running(FALSE);
+    g_assert_cmpuint(count_idle_wakeups(), ==, 0);
+    g_assert_cmpuint(fake_pulse_count_clients(), ==, 0);
+
+    fake_pulse_set_running(TRUE);
+    pulse_driver_wait_idle();
+    g_assert_cmpuint(fake_pulse_count_clients(), ==, 1);
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    g_assert_cmpstr(fake_pulse_get_active_profile(fixture->card), ==, "Voice Call");
+}
+
+/* A burst of bluetooth uevents triggers a single scan, after a delay */
+static void test_pulse_wakeups_udev(Fixture *fixture, gconstpointer data)
+{
+    CadManager *manager = cad_manager_get_default();
+    g_autoptr(GUdevDevice) device = NULL;
+    guint64 count;
+    guint requests, i;
+
+    device = g_udev_client_query_by_subsystem_and_name(manager->udev, "mem", "null");
+    if (!device) {
+        g_test_skip("No device to send uevents for");
+        return;
+    }
+
+    requests = fake_pulse_get_requests();
+    cad_wakeups_set_idle(TRUE);
+    count = cad_wakeups_get_idle_count();
+    for (i = 0; i < 3; i++)
+        g_signal_emit_by_name(manager->udev, "uevent", "add", device);
+    while (manager->bt_scan_id)
+        g_main_context_iteration(NULL, TRUE);
+    pulse_driver_wait_idle();
+    cad_wakeups_set_idle(FALSE);
+
+    /* Woken up by the debounce timer only, to list the cards once */
+    g_assert_cmpuint(cad_wakeups_get_idle_count(), ==, count + 1);
+    g_assert_cmpuint(fake_pulse_get_requests(), ==, requests + 1);
+    g_assert_cmpuint(count_idle_wakeups(), ==, 0);
+}
+
+static void test_pulse_reconnect_dispose(Fixture *fixture, gconstpointer data)
+{
+    fake_pulse_allow_critical("Error in PulseAudio context: *");
+
+    /* The reconnection is pending, it mustn't outlive the backend */
+    fake_pulse_disconnect();
+    g_object_unref(cad_pulse_get_default());
+    pulse_driver_wait_idle();
+    g_assert_cmpuint(fake_pulse_count_clients(), ==, 0);
+}
+
+/* Record a session, then check replaying it leads to the same decisions */
+static void test_pulse_replay(void)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *path = NULL;
+    g_autofree gchar *profile = NULL;
+    g_autofree gchar *port = NULL;
+    TraceReplayStats stats;
+    guint32 card, headset;
+    gint fd;
+
+    fd = g_file_open_tmp("callaudiod-replay-XXXXXX", &path, &error);
+    g_assert_no_error(error);
+    close(fd);
+
+    fake_pulse_reset();
+    fake_pulse_add_module("module-switch-on-port-available", NULL);
+    card = fake_pulse_add_card(&fake_pulse_pinephone);
+    g_assert_true(cad_trace_open(path, &error));
+    g_assert_no_error(error);
+    pulse_driver_connect();
+
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+    fake_pulse_set_port_available(card, "[Out] Headphones", PA_PORT_AVAILABLE_YES);
+    pulse_driver_wait_idle();
+    g_assert_true(pulse_driver_enable_speaker(TRUE));
+    fake_pulse_set_port_available(card, "[Out] Headphones", PA_PORT_AVAILABLE_NO);
+    pulse_driver_wait_idle();
+    headset = fake_pulse_add_card(&fake_pulse_bt_headset);
+    pulse_driver_wait_idle();
+    g_assert_true(pulse_driver_enable_bt_audio(TRUE));
+    g_assert_true(pulse_driver_enable_bt_audio(FALSE));
+    fake_pulse_remove_card(headset);
+    pulse_driver_wait_idle();
+    g_assert_true(pulse_driver_mute_mic(TRUE));
+    g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_VOIP));
+
+    cad_trace_close();
+    profile = g_strdup(fake_pulse_get_active_profile(card));
+    port = g_strdup(fake_pulse_get_sink_port(card));
+    g_object_unref(cad_pulse_get_default());
+    pulse_driver_wait_idle();
+
+    g_assert_true(trace_replay_run(path, 0, &stats, &error));
+    g_assert_no_error(error);
+    g_test_message("Replayed %u operations in %.3f s (%.3f s CPU), %u requests, %"
+                   G_GUINT64_FORMAT " allocations", stats.operations, stats.elapsed,
+                   stats.cpu_time, stats.requests, stats.allocations);
+    g_assert_cmpuint(stats.operations, ==, 6);
+    g_assert_cmpuint(stats.routes->len, ==, 6);
+    g_assert_cmpuint(stats.mismatches, ==, 0);
+    /* Headphones plugged and unplugged, headset added and removed */
+    g_assert_cmpuint(stats.events, >=, 4);
+    /* The internal card is plugged first on both sides */
+    g_assert_cmpstr(fake_pulse_get_active_profile(card), ==, profile);
+    g_assert_cmpstr(fake_pulse_get_sink_port(card), ==, port);
+    trace_replay_stats_clear(&stats);
+
+    /* With the recorded timing, slowed down */
+    g_assert_true(trace_replay_run(path, 0.5, &stats, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(stats.operations, ==, 6);
+    trace_replay_stats_clear(&stats);
+
+    fake_pulse_reset();
+    g_unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    g_autofree gchar *runtime_dir = NULL;
+    g_autofree gchar *data_dir = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    fake_pulse_init_logs();
+    cad_wakeups_init(NULL);
+
+    /* Keep snapshots away from the user's runtime directory */
+    runtime_dir = g_dir_make_tmp("callaudiod-pulse-XXXXXX", NULL);
+    g_assert_nonnull(runtime_dir);
+    g_setenv("XDG_RUNTIME_DIR", runtime_dir, TRUE);
+
+    g_test_add("/pulse/init", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_init, fixture_teardown);
+    g_test_add("/pulse/pipewire", Fixture, &fake_pulse_pinephone,
+               fixture_setup_pipewire, test_pulse_pipewire, fixture_teardown);
+    g_test_add("/pulse/voice-profile", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_voice_profile, fixture_teardown);
+    g_test_add("/pulse/no-voice-profile", Fixture, &fake_pulse_librem5,
+               fixture_setup, test_pulse_no_voice_profile, fixture_teardown);
+    g_test_add("/pulse/headphones", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_headphones, fixture_teardown);
+    g_test_add("/pulse/prepared-call", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_prepared_call, fixture_teardown);
+    g_test_add("/pulse/bluetooth", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_bt, fixture_teardown);
+    g_test_add("/pulse/card-removed", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_card_removed, fixture_teardown);
+    g_test_add("/pulse/disconnect", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_disconnect, fixture_teardown);
+    g_test_add("/pulse/latency", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_latency, fixture_teardown);
+    g_test_add("/pulse/benchmark", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_benchmark, fixture_teardown);
+    g_test_add("/pulse/reconnect-dispose", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_reconnect_dispose, fixture_teardown);
+    g_test_add("/pulse/wakeups/idle", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_wakeups_idle, fixture_teardown);
+    g_test_add("/pulse/wakeups/card-wait", Fixture, NULL,
+               fixture_setup_empty, test_pulse_wakeups_card_wait, fixture_teardown);
+    g_test_add("/pulse/wakeups/reconnect", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_wakeups_reconnect, fixture_teardown);
+    g_test_add("/pulse/wakeups/udev", Fixture, &fake_pulse_pinephone,
+               fixture_setup, test_pulse_wakeups_udev, fixture_teardown);
+    g_test_add_func("/pulse/replay", test_pulse_replay);
+
+    ret = g_test_run();
+
+    data_dir = g_build_filename(runtime_dir, APP_DATA_NAME, NULL);
+    g_rmdir(data_dir);
+    g_rmdir(runtime_dir);
+
+    return ret;
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "alloc-counter.h"
+#include "cad-card.h"
+#include "cad-pulse.h"
+#include "cad-snapshot.h"
+#include "cad-trace.h"
+#include "config.h"
+#include "fake-pulse.h"
+#include "pulse-driver.h"
+
+#include <glib/gstdio.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+/*
+ * Soak tests: repeat the operations callaudiod performs on every route change
+ * and check memory usage stays bounded, reporting the number of allocations
+ * made by each iteration. The number of iterations can be raised through
+ * CAD_SOAK_ITERATIONS for long runs; leaks are reported with details when
+ * running with "meson test --setup=valgrind".
+ */
+#define DEFAULT_ITERATIONS 20000
+#define WARMUP_ITERATIONS  1000
+#define MAX_RSS_GROWTH     (4 * 1024 * 1024)
+
+static guint iterations = DEFAULT_ITERATIONS;
+
+static gsize get_rss(void)
+{
+    g_autofree gchar *statm = NULL;
+    gulong size, resident;
+
+    if (!g_file_get_contents("/proc/self/statm", &statm, NULL, NULL) ||
+        sscanf(statm, "%lu %lu", &size, &resident) != 2)
+        return 0;
+
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Run @func for the configured number of iterations, and fail if the
+ * resident memory grew by more than MAX_RSS_GROWTH after the warmup.
+ */
+static void soak(void (*func)(guint iteration))
+{
+    gsize start = 0, end;
+    guint64 allocations = 0;
+    guint i;
+
+    for (i = 0; i < iterations; i++) {
+        if (i == WARMUP_ITERATIONS) {
+            start = get_rss();
+            allocations = alloc_counter_get();
+        }
+        func(i);
+    }
+    end = get_rss();
+    allocations = alloc_counter_get() - allocations;
+
+    g_test_message("RSS after warmup: %" G_GSIZE_FORMAT " kB, at the end: %"
+                   G_GSIZE_FORMAT " kB", start / 1024, end / 1024);
+    if (alloc_counter_is_available())
+        g_test_message("%.1f allocations per iteration",
+                       (gdouble)allocations / (iterations - WARMUP_ITERATIONS));
+    else
+        g_test_message("Allocation count unavailable with this build");
+
+    /* RSS isn't meaningful under valgrind, which reports leaks by itself */
+    if (start == 0 || g_getenv("CAD_SOAK_SKIP_RSS"))
+        return;
+
+    g_assert_cmpuint(end, <=, start + MAX_RSS_GROWTH);
+}
+
+static void card_iteration(guint iteration)
+{
+    g_assert_true(cad_card_is_internal("platform-sound", "internal", NULL, NULL));
+    g_assert_true(cad_card_port_is_speaker("[Out] Speaker"));
+    g_assert_true(cad_card_port_is_earpiece("[Out] Earpiece"));
+    g_assert_false(cad_card_port_is_earpiece("[Out] Headphones"));
+    g_assert_false(cad_card_profile_is_voice("HiFi"));
+    g_assert_true(cad_card_profile_is_voice("Voice Call"));
+}
+
+static void test_soak_card(void)
+{
+    soak(card_iteration);
+}
+
+/*
+ * Suspend and resume devices as on every call, alternating with bluetooth
+ * headsets coming and going.
+ */
+static void suspended_iteration(guint iteration)
+{
+    g_autoptr(GHashTable) sinks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_autoptr(GHashTable) sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_autoptr(GHashTable) restored_sinks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_autoptr(GHashTable) restored_sources = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_autoptr(GError) error = NULL;
+
+    g_hash_table_add(sinks, g_strdup("alsa_output.hdmi-stereo"));
+    if (iteration % 2)
+        g_hash_table_add(sinks, g_strdup_printf("bluez_sink.%08x.a2dp_sink", iteration));
+    g_hash_table_add(sources, g_strdup("alsa_input.usb-mic"));
+
+    g_assert_true(cad_snapshot_save_suspended(sinks, sources, &error));
+    g_assert_no_error(error);
+    cad_snapshot_restore_suspended(restored_sinks, restored_sources);
+    g_assert_cmpuint(g_hash_table_size(restored_sinks), ==, g_hash_table_size(sinks));
+    g_assert_cmpuint(g_hash_table_size(restored_sources), ==, 1);
+
+    /* Call ended, everything resumed */
+    g_hash_table_remove_all(sinks);
+    g_hash_table_remove_all(sources);
+    g_assert_true(cad_snapshot_save_suspended(sinks, sources, &error));
+    g_assert_no_error(error);
+}
+
+static void test_soak_suspended(void)
+{
+    soak(suspended_iteration);
+}
+
+static gboolean count_record(const CadTraceRecord *record, GVariant *payload,
+                             gpointer user_data)
+{
+    guint *count = user_data;
+
+    (*count)++;
+
+    return TRUE;
+}
+
+/* Record and read back a short trace, as done when capturing field sessions */
+static void trace_iteration(guint iteration)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *path = NULL;
+    pa_sink_port_info speaker = { .name = "[Out] Speaker", .priority = 100 };
+    pa_sink_port_info *ports[] = { &speaker };
+    pa_sink_info sink = { 0 };
+    guint count = 0;
+    gint fd;
+
+    fd = g_file_open_tmp("callaudiod-soak-XXXXXX", &path, &error);
+    g_assert_no_error(error);
+    close(fd);
+
+    sink.index = iteration;
+    sink.name = "alsa_output.platform-sound.HiFi__hw_0__sink";
+    sink.n_ports = G_N_ELEMENTS(ports);
+    sink.ports = ports;
+    sink.active_port = &speaker;
+
+    g_assert_true(cad_trace_open(path, &error));
+    cad_trace_subscription(iteration, PA_SUBSCRIPTION_EVENT_SINK);
+    cad_trace_sink_info(&sink);
+    cad_trace_operation(0, iteration % 3, TRUE);
+    cad_trace_close();
+
+    g_assert_true(cad_trace_read(path, count_record, &count, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(count, ==, 3);
+
+    g_unlink(path);
+}
+
+static void ignore_log(const gchar *domain, GLogLevelFlags level,
+                       const gchar *message, gpointer user_data)
+{
+}
+
+static void test_soak_trace(void)
+{
+    /* Don't flood the test log with a message for each trace */
+    guint handler = g_log_set_handler("callaudiod-trace", G_LOG_LEVEL_MESSAGE,
+                                      ignore_log, NULL);
+
+    soak(trace_iteration);
+
+    g_log_remove_handler("callaudiod-trace", handler);
+}
+
+/*
+ * Route changes as performed by the PulseAudio backend against the fake
+ * server, one operation per iteration: calls with the speaker and mic
+ * toggled, headphones and bluetooth headsets plugged and unplugged, and the
+ * server restarting.
+ */
+static guint32 soak_card;
+static guint32 soak_headset;
+
+static void pulse_iteration(guint iteration)
+{
+    switch (iteration % 16) {
+    case 0:
+        g_assert_true(pulse_driver_prepare_call(TRUE));
+        break;
+    case 1:
+        g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_CALL));
+        break;
+    case 2:
+        g_assert_true(pulse_driver_enable_speaker(TRUE));
+        break;
+    case 3:
+        g_assert_true(pulse_driver_mute_mic(TRUE));
+        break;
+    case 4:
+        g_assert_true(pulse_driver_mute_mic(FALSE));
+        break;
+    case 5:
+        g_assert_true(pulse_driver_enable_speaker(FALSE));
+        break;
+    case 6:
+        fake_pulse_set_port_available(soak_card, "[Out] Headphones", PA_PORT_AVAILABLE_YES);
+        pulse_driver_wait_idle();
+        break;
+    case 7:
+        fake_pulse_set_port_available(soak_card, "[Out] Headphones", PA_PORT_AVAILABLE_NO);
+        pulse_driver_wait_idle();
+        break;
+    case 8:
+        g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_DEFAULT));
+        break;
+    case 9:
+        /* A new headset each time, as the card name is kept by callaudiod */
+        soak_headset = fake_pulse_add_card(&fake_pulse_bt_headset);
+        pulse_driver_wait_idle();
+        break;
+    case 10:
+        /* Only check the operations complete, bluetooth state is tested in test-pulse */
+        pulse_driver_enable_bt_audio(TRUE);
+        break;
+    case 11:
+        pulse_driver_enable_bt_audio(FALSE);
+        break;
+    case 12:
+        fake_pulse_remove_card(soak_headset);
+        pulse_driver_wait_idle();
+        break;
+    case 13:
+        g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_VOIP));
+        break;
+    case 14:
+        g_assert_true(pulse_driver_select_mode(CALL_AUDIO_MODE_DEFAULT));
+        break;
+    case 15:
+        fake_pulse_disconnect();
+        pulse_driver_wait_idle();
+        g_assert_cmpuint(fake_pulse_count_clients(), ==, 1);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void test_soak_pulse(void)
+{
+    fake_pulse_reset();
+    fake_pulse_allow_critical("Error in PulseAudio context: *");
+    soak_card = fake_pulse_add_card(&fake_pulse_pinephone);
+    pulse_driver_connect();
+
+    soak(pulse_iteration);
+
+    g_object_unref(cad_pulse_get_default());
+    pulse_driver_wait_idle();
+    fake_pulse_reset();
+}
+
+int main(int argc, char **argv)
+{
+    g_autofree gchar *runtime_dir = NULL;
+    g_autofree gchar *data_dir = NULL;
+    const gchar *env;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    fake_pulse_init_logs();
+
+    env = g_getenv("CAD_SOAK_ITERATIONS");
+    if (env)
+        iterations = MAX(g_ascii_strtoull(env, NULL, 10), WARMUP_ITERATIONS + 1);
+
+    /* Keep snapshots away from the user's runtime directory */
+    runtime_dir = g_dir_make_tmp("callaudiod-soak-XXXXXX", NULL);
+    g_assert_nonnull(runtime_dir);
+    g_setenv("XDG_RUNTIME_DIR", runtime_dir, TRUE);
+
+    g_test_add_func("/soak/card", test_soak_card);
+    g_test_add_func("/soak/suspended", test_soak_suspended);
+    g_test_add_func("/soak/trace", test_soak_trace);
+    g_test_add_func("/soak/pulse", test_soak_pulse);
+
+    ret = g_test_run();
+
+    data_dir = g_build_filename(runtime_dir, APP_DATA_NAME, NULL);
+    g_rmdir(data_dir);
+    g_rmdir(runtime_dir);
+
+    return ret;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cad-state-page.h"
+#include "libcallaudio.h"
+
+#include <glib.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define N_READERS 4
+#define N_UPDATES 200000
+
+/*
+ * Every published field is derived from the generation number, so readers
+ * can tell whether they got a torn state.
+ */
+static void publish(guint64 generation)
+{
+    cad_state_page_publish(generation, (gint64)generation * 1000,
+                           generation % 3, generation % 2,
+                           (generation / 2) % 2, generation % 3);
+}
+
+static void check_data(const CadStatePageData *data)
+{
+    g_assert_cmpint(data->timestamp, ==, (gint64)data->generation * 1000);
+    g_assert_cmpuint(data->audio_mode, ==, data->generation % 3);
+    g_assert_cmpuint(data->speaker_state, ==, data->generation % 2);
+    g_assert_cmpuint(data->mic_state, ==, (data->generation / 2) % 2);
+    g_assert_cmpuint(data->bt_audio_state, ==, data->generation % 3);
+}
+
+/* Map the page read-only, the way libcallaudio does */
+static const CadStatePage *map_page(void)
+{
+    void *mem;
+
+    mem = mmap(NULL, sizeof(CadStatePage), PROT_READ, MAP_SHARED,
+               cad_state_page_get_fd(), 0);
+    g_assert_true(mem != MAP_FAILED);
+
+    return mem;
+}
+
+static void test_state_page_initial(void)
+{
+    g_autoptr(GError) error = NULL;
+    const CadStatePage *page;
+    CadStatePageData data;
+
+    g_assert_true(cad_state_page_init(&error));
+    g_assert_no_error(error);
+    page = map_page();
+
+    g_assert_cmpuint(page->magic, ==, CAD_STATE_PAGE_MAGIC);
+    g_assert_cmpuint(page->version, ==, CAD_STATE_PAGE_VERSION);
+
+    cad_state_page_read(page, &data);
+    g_assert_cmpuint(data.generation, ==, 0);
+    g_assert_cmpuint(data.audio_mode, ==, CALL_AUDIO_MODE_UNKNOWN);
+    g_assert_cmpuint(data.speaker_state, ==, CALL_AUDIO_SPEAKER_UNKNOWN);
+    g_assert_cmpuint(data.mic_state, ==, CALL_AUDIO_MIC_UNKNOWN);
+    g_assert_cmpuint(data.bt_audio_state, ==, CALL_AUDIO_BT_UNKNOWN);
+
+    publish(42);
+    cad_state_page_read(page, &data);
+    g_assert_cmpuint(data.generation, ==, 42);
+    check_data(&data);
+
+    munmap((void *)page, sizeof(CadStatePage));
+    cad_state_page_destroy();
+    g_assert_cmpint(cad_state_page_get_fd(), <, 0);
+}
+
+typedef struct {
+    const CadStatePage *page;
+    gint *done;
+    guint64 reads;
+} ReaderData;
+
+static gpointer reader_thread(gpointer user_data)
+{
+    ReaderData *reader = user_data;
+    CadStatePageData data;
+    guint64 last = 0;
+
+    while (!g_atomic_int_get(reader->done)) {
+        cad_state_page_read(reader->page, &data);
+        check_data(&data);
+        /* The state never goes back in time */
+        g_assert_cmpuint(data.generation, >=, last);
+        last = data.generation;
+        reader->reads++;
+    }
+
+    return NULL;
+}
+
+static void test_state_page_concurrent(void)
+{
+    g_autoptr(GError) error = NULL;
+    ReaderData readers[N_READERS];
+    GThread *threads[N_READERS];
+    const CadStatePage *page;
+    guint64 reads = 0;
+    gint64 start, elapsed;
+    gint done = 0;
+    guint64 i;
+
+    g_assert_true(cad_state_page_init(&error));
+    g_assert_no_error(error);
+    page = map_page();
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < N_READERS; i++) {
+        readers[i].page = page;
+        readers[i].done = &done;
+        readers[i].reads = 0;
+        threads[i] = g_thread_new("reader", reader_thread, &readers[i]);
+    }
+
+    for (i = 1; i <= N_UPDATES; i++)
+        publish(i);
+
+    g_atomic_int_set(&done, 1);
+    for (i = 0; i < N_READERS; i++) {
+        g_thread_join(threads[i]);
+        reads += readers[i].reads;
+    }
+    elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    g_test_message("%" G_GUINT64_FORMAT " reads by %d threads during %d updates, "
+                   "%.1f Mreads/s", reads, N_READERS, N_UPDATES,
+                   (gdouble)reads / elapsed);
+
+    munmap((void *)page, sizeof(CadStatePage));
+    cad_state_page_destroy();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/state-page/initial", test_state_page_initial);
+    g_test_add_func("/state-page/concurrent", test_state_page_concurrent);
+
+    return g_test_run();
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cad-trace.h"
+
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include <unistd.h>
+
+typedef struct {
+    GArray *records;
+    GPtrArray *payloads;
+} TraceData;
+
+static gboolean collect_record(const CadTraceRecord *record, GVariant *payload,
+                               gpointer user_data)
+{
+    TraceData *trace = user_data;
+
+    g_array_append_val(trace->records, *record);
+    g_ptr_array_add(trace->payloads, g_variant_ref(payload));
+
+    return TRUE;
+}
+
+static void trace_data_init(TraceData *trace)
+{
+    trace->records = g_array_new(FALSE, FALSE, sizeof(CadTraceRecord));
+    trace->payloads = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+}
+
+static void trace_data_clear(TraceData *trace)
+{
+    g_array_unref(trace->records);
+    g_ptr_array_unref(trace->payloads);
+}
+
+static gchar *record_trace(void)
+{
+    g_autoptr(GError) error = NULL;
+    pa_card_profile_info2 hifi = { .name = "HiFi", .available = 1 };
+    pa_card_profile_info2 voice = { .name = "Voice Call", .available = 1 };
+    pa_card_profile_info2 *profiles[] = { &hifi, &voice };
+    pa_card_port_info speaker = { .name = "[Out] Speaker",
+                                  .available = PA_PORT_AVAILABLE_UNKNOWN };
+    pa_card_port_info *card_ports[] = { &speaker };
+    pa_sink_port_info sink_speaker = { .name = "[Out] Speaker", .priority = 100,
+                                       .available = PA_PORT_AVAILABLE_UNKNOWN };
+    pa_sink_port_info *sink_ports[] = { &sink_speaker };
+    pa_card_info card = { 0 };
+    pa_sink_info sink = { 0 };
+    gchar *path;
+    gint fd;
+
+    fd = g_file_open_tmp("callaudiod-trace-XXXXXX", &path, &error);
+    g_assert_no_error(error);
+    close(fd);
+
+    card.index = 3;
+    card.name = "alsa_card.platform-sound";
+    card.proplist = pa_proplist_new();
+    pa_proplist_sets(card.proplist, PA_PROP_DEVICE_FORM_FACTOR, "internal");
+    card.n_profiles = G_N_ELEMENTS(profiles);
+    card.profiles2 = profiles;
+    card.active_profile2 = &hifi;
+    card.n_ports = G_N_ELEMENTS(card_ports);
+    card.ports = card_ports;
+
+    sink.index = 7;
+    sink.card = 3;
+    sink.sample_spec.rate = 48000;
+    sink.sample_spec.channels = 2;
+    sink.latency = 20000;
+    sink.n_ports = G_N_ELEMENTS(sink_ports);
+    sink.ports = sink_ports;
+    sink.active_port = &sink_speaker;
+
+    g_assert_true(cad_trace_open(path, &error));
+    g_assert_no_error(error);
+
+    cad_trace_subscription(3, PA_SUBSCRIPTION_EVENT_CARD | PA_SUBSCRIPTION_EVENT_CHANGE);
+    cad_trace_card_info(&card);
+    cad_trace_sink_info(&sink);
+    cad_trace_operation(0, 1, TRUE);
+    cad_trace_close();
+
+    pa_proplist_free(card.proplist);
+
+    return path;
+}
+
+static void test_trace_round_trip(void)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *path = record_trace();
+    g_autoptr(GVariantIter) ports = NULL;
+    const CadTraceRecord *record;
+    const gchar *name, *active;
+    guint32 port_priority, port_available;
+    guint32 rate;
+    TraceData trace;
+    guint i;
+
+    trace_data_init(&trace);
+    g_assert_true(cad_trace_read(path, collect_record, &trace, &error));
+    g_assert_no_error(error);
+    g_assert_cmpuint(trace.records->len, ==, 4);
+
+    for (i = 1; i < trace.records->len; i++) {
+        const CadTraceRecord *prev = &g_array_index(trace.records, CadTraceRecord, i - 1);
+
+        record = &g_array_index(trace.records, CadTraceRecord, i);
+        g_assert_cmpuint(record->timestamp, >=, prev->timestamp);
+    }
+
+    record = &g_array_index(trace.records, CadTraceRecord, 0);
+    g_assert_cmpuint(record->event, ==, CAD_TRACE_EVENT_SUBSCRIPTION);
+    g_assert_cmpuint(record->index, ==, 3);
+
+    record = &g_array_index(trace.records, CadTraceRecord, 1);
+    g_assert_cmpuint(record->event, ==, CAD_TRACE_EVENT_CARD_INFO);
+    g_variant_get(g_ptr_array_index(trace.payloads, 1), "(&s&s&s@a{ss}@a(su)@a(su))",
+                  &name, NULL, &active, NULL, NULL, NULL);
+    g_assert_cmpstr(name, ==, "alsa_card.platform-sound");
+    g_assert_cmpstr(active, ==, "HiFi");
+
+    record = &g_array_index(trace.records, CadTraceRecord, 2);
+    g_assert_cmpuint(record->event, ==, CAD_TRACE_EVENT_SINK_INFO);
+    g_assert_cmpuint(record->index, ==, 7);
+    g_variant_get(g_ptr_array_index(trace.payloads, 2), "(&su&sa(suu)uybtt@a{ss})",
+                  NULL, NULL, &active, &ports, &rate, NULL, NULL, NULL, NULL, NULL);
+    g_assert_cmpstr(active, ==, "[Out] Speaker");
+    g_assert_cmpuint(rate, ==, 48000);
+    g_assert_true(g_variant_iter_next(ports, "(&suu)", &name,
+                                      &port_priority, &port_available));
+    g_assert_cmpstr(name, ==, "[Out] Speaker");
+    g_assert_cmpuint(port_priority, ==, 100);
+
+    record = &g_array_index(trace.records, CadTraceRecord, 3);
+    g_assert_cmpuint(record->event, ==, CAD_TRACE_EVENT_OPERATION_SUCCEEDED);
+
+    trace_data_clear(&trace);
+    g_unlink(path);
+}
+
+static void test_trace_truncated(void)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *path = record_trace();
+    g_autofree gchar *contents = NULL;
+    TraceData trace;
+    gsize length;
+
+    /* Cut the last record short, as if callaudiod crashed while writing it */
+    g_assert_true(g_file_get_contents(path, &contents, &length, &error));
+    g_assert_true(g_file_set_contents(path, contents, length - 2, &error));
+    g_assert_no_error(error);
+
+    trace_data_init(&trace);
+    g_assert_false(cad_trace_read(path, collect_record, &trace, &error));
+    g_assert_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT);
+    g_assert_cmpuint(trace.records->len, ==, 3);
+
+    trace_data_clear(&trace);
+    g_unlink(path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/trace/round-trip", test_trace_round_trip);
+    g_test_add_func("/trace/truncated", test_trace_truncated);
+
+    return g_test_run();
+}
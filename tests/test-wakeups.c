@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "cad-wakeups.h"
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define EVENT_DELAY (500 * G_TIME_SPAN_MILLISECOND)
+
+static GMainContext *context;
+
+static gboolean fd_cb(gint fd, GIOCondition condition, gpointer user_data)
+{
+    gboolean *received = user_data;
+    gchar byte;
+
+    g_assert_cmpint(read(fd, &byte, 1), ==, 1);
+    *received = TRUE;
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gpointer send_event(gpointer user_data)
+{
+    gint fd = GPOINTER_TO_INT(user_data);
+
+    g_usleep(EVENT_DELAY);
+    g_assert_cmpint(write(fd, "x", 1), ==, 1);
+
+    return NULL;
+}
+
+/*
+ * A fake backend connection, which only gets an event after EVENT_DELAY:
+ * the only wakeup while idle must be the one caused by that event.
+ */
+static void test_wakeups_idle_backend(void)
+{
+    g_autoptr(GSource) source = NULL;
+    gboolean received = FALSE;
+    GThread *thread;
+    guint64 count = cad_wakeups_get_idle_count();
+    gint fds[2];
+
+    g_assert_true(g_unix_open_pipe(fds, FD_CLOEXEC, NULL));
+
+    source = g_unix_fd_source_new(fds[0], G_IO_IN);
+    g_source_set_callback(source, G_SOURCE_FUNC(fd_cb), &received, NULL);
+    g_source_attach(source, context);
+
+    cad_wakeups_set_idle(TRUE);
+    thread = g_thread_new("backend", send_event, GINT_TO_POINTER(fds[1]));
+    while (!received)
+        g_main_context_iteration(context, TRUE);
+    g_thread_join(thread);
+
+    g_assert_cmpuint(cad_wakeups_get_idle_count(), ==, count + 1);
+    g_assert_cmpfloat(cad_wakeups_get_idle_rate(), >, 0.0);
+
+    g_source_destroy(source);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+    guint *fired = user_data;
+
+    (*fired)++;
+
+    return *fired < 3 ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static void run_timer(void)
+{
+    g_autoptr(GSource) source = g_timeout_source_new(20);
+    guint fired = 0;
+
+    g_source_set_callback(source, timeout_cb, &fired, NULL);
+    g_source_attach(source, context);
+    while (fired < 3)
+        g_main_context_iteration(context, TRUE);
+}
+
+/* Periodic timers are what we want to catch while idle, but not in calls */
+static void test_wakeups_timer(void)
+{
+    guint64 count;
+
+    cad_wakeups_set_idle(TRUE);
+    count = cad_wakeups_get_idle_count();
+    run_timer();
+    g_assert_cmpuint(cad_wakeups_get_idle_count(), >=, count + 3);
+
+    cad_wakeups_set_idle(FALSE);
+    count = cad_wakeups_get_idle_count();
+    run_timer();
+    g_assert_cmpuint(cad_wakeups_get_idle_count(), ==, count);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    context = g_main_context_new();
+    cad_wakeups_init(context);
+
+    g_test_add_func("/wakeups/idle-backend", test_wakeups_idle_backend);
+    g_test_add_func("/wakeups/timer", test_wakeups_timer);
+
+    ret = g_test_run();
+
+    g_main_context_unref(context);
+
+    return ret;
+}
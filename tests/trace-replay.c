@@ -0,0 +1,632 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "trace-replay.h"
+#include "alloc-counter.h"
+#include "cad-pulse.h"
+#include "cad-trace.h"
+#include "fake-pulse.h"
+#include "pulse-driver.h"
+
+#include <gio/gio.h>
+
+#include <string.h>
+#include <time.h>
+
+/*
+ * Replay a trace recorded with "callaudiod --trace" against the fake server
+ * from fake-pulse.c. The cards, ports and modules found in the trace are
+ * recreated on the fake server, then the card events and routing operations
+ * are replayed in order, so callaudiod goes through changed_cb() and its info
+ * callbacks as it did when the trace was recorded. Replies come from the
+ * fake server's model of the cards rather than from the trace, which lets
+ * the routing decisions made during the replay be compared with the
+ * recorded ones.
+ */
+
+#define DEFAULT_RATE 48000
+
+typedef struct {
+    guint32 index;          /* on the fake server, PA_INVALID_INDEX if unplugged */
+    gboolean initial;       /* present when the trace started */
+    gboolean has_rate;
+    FakePulseCard spec;
+    GPtrArray *strings;     /* owns the strings used by @spec */
+    GPtrArray *properties;
+    GPtrArray *profiles;
+    GArray *ports;
+} ReplayCard;
+
+typedef struct {
+    GArray *records;
+    GPtrArray *payloads;
+    GHashTable *cards;      /* trace index to ReplayCard */
+    GPtrArray *card_list;   /* in order of appearance */
+    GPtrArray *modules;     /* names and arguments, loaded at startup */
+    guint32 main_card;
+    GArray *expected;       /* outcomes of the recorded operations */
+    GArray *results;        /* outcomes of the replayed operations */
+    gdouble speed;
+    gint64 start;
+    guint64 first_timestamp;
+    TraceReplayStats *stats;
+} Replay;
+
+/* Operations call back without user data */
+static Replay *current;
+
+static const gchar *card_strdup(ReplayCard *card, const gchar *str)
+{
+    gchar *copy = g_strdup(str);
+
+    g_ptr_array_add(card->strings, copy);
+
+    return copy;
+}
+
+/* Ports never seen on a sink or source: guess from the usual names */
+static pa_direction_t guess_direction(const gchar *port)
+{
+    if (strstr(port, "[In]") || strstr(port, "input") || strstr(port, "Mic"))
+        return PA_DIRECTION_INPUT;
+
+    return PA_DIRECTION_OUTPUT;
+}
+
+static ReplayCard *replay_card_new(GVariant *payload)
+{
+    ReplayCard *card = g_new0(ReplayCard, 1);
+    g_autoptr(GVariantIter) properties = NULL;
+    g_autoptr(GVariantIter) profiles = NULL;
+    g_autoptr(GVariantIter) ports = NULL;
+    const gchar *name, *driver, *active, *value;
+    guint32 available;
+
+    card->index = PA_INVALID_INDEX;
+    card->strings = g_ptr_array_new_with_free_func(g_free);
+    card->properties = g_ptr_array_new();
+    card->profiles = g_ptr_array_new();
+    /* Zero-terminated: the list of ports ends with a port without name */
+    card->ports = g_array_new(TRUE, TRUE, sizeof(FakePulsePort));
+
+    g_variant_get(payload, "(&s&s&sa{ss}a(su)a(su))", &name, &driver, &active,
+                  &properties, &profiles, &ports);
+
+    card->spec.name = card_strdup(card, name);
+    card->spec.driver = card_strdup(card, driver);
+    card->spec.rate = DEFAULT_RATE;
+
+    while (g_variant_iter_next(properties, "{&s&s}", &name, &value)) {
+        g_ptr_array_add(card->properties, (gpointer)card_strdup(card, name));
+        g_ptr_array_add(card->properties, (gpointer)card_strdup(card, value));
+    }
+    g_ptr_array_add(card->properties, NULL);
+
+    /* The fake server activates the first profile */
+    if (*active)
+        g_ptr_array_add(card->profiles, (gpointer)card_strdup(card, active));
+    while (g_variant_iter_next(profiles, "(&su)", &name, &available)) {
+        if (strcmp(name, active) != 0)
+            g_ptr_array_add(card->profiles, (gpointer)card_strdup(card, name));
+    }
+    if (card->profiles->len == 0)
+        g_ptr_array_add(card->profiles, (gpointer)card_strdup(card, "off"));
+    g_ptr_array_add(card->profiles, NULL);
+
+    while (g_variant_iter_next(ports, "(&su)", &name, &available)) {
+        FakePulsePort port = { 0 };
+
+        port.name = card_strdup(card, name);
+        port.direction = guess_direction(name);
+        port.available = available;
+        g_array_append_val(card->ports, port);
+    }
+
+    card->spec.properties = (const gchar * const *)card->properties->pdata;
+    card->spec.profiles = (const gchar * const *)card->profiles->pdata;
+    card->spec.ports = (const FakePulsePort *)card->ports->data;
+
+    return card;
+}
+
+static void replay_card_free(ReplayCard *card)
+{
+    g_ptr_array_unref(card->properties);
+    g_ptr_array_unref(card->profiles);
+    g_array_unref(card->ports);
+    g_ptr_array_unref(card->strings);
+    g_free(card);
+}
+
+static FakePulsePort *replay_card_find_port(ReplayCard *card, const gchar *name)
+{
+    guint i;
+
+    for (i = 0; i < card->ports->len; i++) {
+        FakePulsePort *port = &g_array_index(card->ports, FakePulsePort, i);
+
+        if (strcmp(port->name, name) == 0)
+            return port;
+    }
+
+    return NULL;
+}
+
+/* Complete the card ports with the direction and priority found on a device */
+static void replay_add_device(Replay *replay, GVariant *payload, gboolean is_sink)
+{
+    g_autoptr(GVariantIter) ports = NULL;
+    ReplayCard *card;
+    FakePulsePort *port;
+    const gchar *name;
+    guint32 index, rate, priority, available;
+    guint32 monitor_of_sink = PA_INVALID_INDEX;
+
+    if (is_sink) {
+        g_variant_get(payload, "(&su&sa(suu)uybtt@a{ss})", NULL, &index, NULL,
+                      &ports, &rate, NULL, NULL, NULL, NULL, NULL);
+    } else {
+        g_variant_get(payload, "(&su&sa(suu)uybtt@a{ss}u)", NULL, &index, NULL,
+                      &ports, &rate, NULL, NULL, NULL, NULL, NULL, &monitor_of_sink);
+    }
+
+    card = g_hash_table_lookup(replay->cards, GUINT_TO_POINTER(index));
+    if (!card || monitor_of_sink != PA_INVALID_INDEX)
+        return;
+
+    if (!card->has_rate) {
+        card->spec.rate = rate;
+        card->has_rate = TRUE;
+    }
+
+    while (g_variant_iter_next(ports, "(&suu)", &name, &priority, &available)) {
+        port = replay_card_find_port(card, name);
+        if (!port)
+            continue;
+
+        port->direction = is_sink ? PA_DIRECTION_OUTPUT : PA_DIRECTION_INPUT;
+        port->priority = priority;
+    }
+}
+
+static guint32 get_subscription_type(Replay *replay, guint i)
+{
+    guint32 type;
+
+    g_variant_get(g_ptr_array_index(replay->payloads, i), "(u)", &type);
+
+    return type;
+}
+
+/* Card events and operations are replayed, everything else is a consequence */
+static gboolean is_input(Replay *replay, guint i)
+{
+    const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+
+    if (record->event == CAD_TRACE_EVENT_OPERATION_STARTED)
+        return TRUE;
+
+    return record->event == CAD_TRACE_EVENT_SUBSCRIPTION &&
+           (get_subscription_type(replay, i) & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) ==
+           PA_SUBSCRIPTION_EVENT_CARD;
+}
+
+/*
+ * Find the cards, their ports and the modules loaded at startup. Cards which
+ * show up with a "new" event are only plugged when the event is replayed.
+ */
+static void replay_prepare(Replay *replay)
+{
+    g_autoptr(GHashTable) added = g_hash_table_new(NULL, NULL);
+    g_autoptr(GHashTable) modules = g_hash_table_new(NULL, NULL);
+    gboolean started = FALSE;
+    guint32 type;
+    guint i;
+
+    for (i = 0; i < replay->records->len; i++) {
+        const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+        GVariant *payload = g_ptr_array_index(replay->payloads, i);
+        gpointer key = GUINT_TO_POINTER(record->index);
+        ReplayCard *card;
+        const gchar *name, *argument;
+
+        switch (record->event) {
+        case CAD_TRACE_EVENT_SUBSCRIPTION:
+            type = get_subscription_type(replay, i);
+            if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_CARD &&
+                (type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW &&
+                !g_hash_table_contains(replay->cards, key))
+                g_hash_table_add(added, key);
+            break;
+        case CAD_TRACE_EVENT_CARD_INFO:
+            if (g_hash_table_contains(replay->cards, key))
+                break;
+            card = replay_card_new(payload);
+            card->initial = !g_hash_table_contains(added, key);
+            g_hash_table_insert(replay->cards, key, card);
+            g_ptr_array_add(replay->card_list, card);
+            break;
+        case CAD_TRACE_EVENT_MODULE_INFO:
+            if (started || g_hash_table_contains(modules, key))
+                break;
+            g_hash_table_add(modules, key);
+            g_variant_get(payload, "(&s&s)", &name, &argument);
+            g_ptr_array_add(replay->modules, g_strdup(name));
+            g_ptr_array_add(replay->modules, g_strdup(argument));
+            break;
+        case CAD_TRACE_EVENT_OPERATION_STARTED:
+            started = TRUE;
+            break;
+        default:
+            break;
+        }
+    }
+
+    for (i = 0; i < replay->records->len; i++) {
+        const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+
+        if (record->event == CAD_TRACE_EVENT_SINK_INFO ||
+            record->event == CAD_TRACE_EVENT_SOURCE_INFO)
+            replay_add_device(replay, g_ptr_array_index(replay->payloads, i),
+                              record->event == CAD_TRACE_EVENT_SINK_INFO);
+    }
+
+    for (i = 0; i < replay->records->len; i++) {
+        if (is_input(replay, i)) {
+            replay->first_timestamp = g_array_index(replay->records, CadTraceRecord, i).timestamp;
+            break;
+        }
+    }
+}
+
+static void replay_plug_card(Replay *replay, ReplayCard *card)
+{
+    card->index = fake_pulse_add_card(&card->spec);
+
+    if (replay->main_card == PA_INVALID_INDEX &&
+        !g_str_has_prefix(card->spec.driver, "module-bluez"))
+        replay->main_card = card->index;
+}
+
+static void replay_set_port_available(ReplayCard *card, const gchar *name,
+                                      guint32 available, gboolean *changed)
+{
+    FakePulsePort *port = replay_card_find_port(card, name);
+
+    if (!port || port->available == (pa_port_available_t)available)
+        return;
+
+    port->available = available;
+    fake_pulse_set_port_available(card->index, name, available);
+    *changed = TRUE;
+}
+
+/*
+ * A jack was plugged or unplugged: the new availability of the ports is
+ * found in the replies to the queries made by callaudiod after the event.
+ */
+static gboolean replay_card_changed(Replay *replay, ReplayCard *card, guint32 trace_index,
+                                    guint i)
+{
+    gboolean changed = FALSE;
+    const gchar *name;
+    guint32 index, priority, available;
+
+    for (i = i + 1; i < replay->records->len && !is_input(replay, i); i++) {
+        const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+        GVariant *payload = g_ptr_array_index(replay->payloads, i);
+        g_autoptr(GVariantIter) ports = NULL;
+
+        if (record->event == CAD_TRACE_EVENT_CARD_INFO && record->index == trace_index) {
+            g_variant_get_child(payload, 5, "a(su)", &ports);
+            while (g_variant_iter_next(ports, "(&su)", &name, &available))
+                replay_set_port_available(card, name, available, &changed);
+        } else if (record->event == CAD_TRACE_EVENT_SINK_INFO ||
+                   record->event == CAD_TRACE_EVENT_SOURCE_INFO) {
+            g_variant_get_child(payload, 1, "u", &index);
+            if (index != trace_index)
+                continue;
+            g_variant_get_child(payload, 3, "a(suu)", &ports);
+            while (g_variant_iter_next(ports, "(&suu)", &name, &priority, &available))
+                replay_set_port_available(card, name, available, &changed);
+        }
+    }
+
+    return changed;
+}
+
+static void replay_card_event(Replay *replay, guint i)
+{
+    const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+    ReplayCard *card = g_hash_table_lookup(replay->cards, GUINT_TO_POINTER(record->index));
+    guint32 type = get_subscription_type(replay, i);
+
+    if (!card)
+        return;
+
+    switch (type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) {
+    case PA_SUBSCRIPTION_EVENT_NEW:
+        if (card->index != PA_INVALID_INDEX)
+            return;
+        replay_plug_card(replay, card);
+        break;
+    case PA_SUBSCRIPTION_EVENT_REMOVE:
+        if (card->index == PA_INVALID_INDEX)
+            return;
+        fake_pulse_remove_card(card->index);
+        if (replay->main_card == card->index)
+            replay->main_card = PA_INVALID_INDEX;
+        card->index = PA_INVALID_INDEX;
+        break;
+    case PA_SUBSCRIPTION_EVENT_CHANGE:
+        /* Most changes are profile switches made by callaudiod itself */
+        if (card->index == PA_INVALID_INDEX ||
+            !replay_card_changed(replay, card, record->index, i))
+            return;
+        break;
+    default:
+        return;
+    }
+
+    replay->stats->events++;
+}
+
+static gchar *describe_route(CadOperation *op)
+{
+    static const gchar * const names[] = {
+        "select-mode", "enable-speaker", "mute-mic", "switch-bt-audio", "prepare-call",
+    };
+    const gchar *name = op->type < G_N_ELEMENTS(names) ? names[op->type] : "unknown";
+    const gchar *port;
+    guint32 card = current->main_card;
+
+    if (card == PA_INVALID_INDEX) {
+        return g_strdup_printf("%s %u %s: no card", name, GPOINTER_TO_UINT(op->value),
+                               op->success ? "succeeded" : "failed");
+    }
+
+    port = fake_pulse_get_sink_port(card);
+
+    return g_strdup_printf("%s %u %s: %s, %s, mic %s", name, GPOINTER_TO_UINT(op->value),
+                           op->success ? "succeeded" : "failed",
+                           fake_pulse_get_active_profile(card), port ? port : "no sink",
+                           fake_pulse_get_source_mute(card) ? "muted" : "on");
+}
+
+static void replay_op_cb(CadOperation *op)
+{
+    gboolean success = op->success;
+
+    g_array_append_val(current->results, success);
+    g_ptr_array_add(current->stats->routes, describe_route(op));
+}
+
+static void replay_operation(Replay *replay, guint i)
+{
+    const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+    CadOperation *op;
+    guint32 value;
+
+    g_variant_get(g_ptr_array_index(replay->payloads, i), "(u)", &value);
+
+    op = g_new0(CadOperation, 1);
+    op->type = record->index;
+    op->value = GUINT_TO_POINTER(value);
+    op->callback = replay_op_cb;
+    replay->stats->operations++;
+
+    switch (op->type) {
+    case CAD_OPERATION_SELECT_MODE:
+        cad_pulse_select_mode(value, op);
+        break;
+    case CAD_OPERATION_ENABLE_SPEAKER:
+        cad_pulse_enable_speaker(value, op);
+        break;
+    case CAD_OPERATION_MUTE_MIC:
+        cad_pulse_mute_mic(value, op);
+        break;
+    case CAD_OPERATION_SWITCH_BT_AUDIO:
+        cad_pulse_enable_bt_audio(value, op);
+        break;
+    case CAD_OPERATION_PREPARE_CALL:
+        cad_pulse_prepare_call(value, op);
+        break;
+    default:
+        g_warning("Skipping unknown operation %u", record->index);
+        replay->stats->operations--;
+        g_free(op);
+        break;
+    }
+}
+
+static gboolean timeout_cb(gpointer data)
+{
+    gboolean *done = data;
+
+    *done = TRUE;
+
+    return G_SOURCE_REMOVE;
+}
+
+/* Keep the recorded timing, scaled by the replay speed */
+static void replay_wait(Replay *replay, guint i)
+{
+    const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+    gboolean done = FALSE;
+    gint64 delay;
+
+    if (replay->speed <= 0)
+        return;
+
+    delay = replay->start + (record->timestamp - replay->first_timestamp) / replay->speed -
+            g_get_monotonic_time();
+    if (delay <= 0)
+        return;
+
+    g_timeout_add((delay + 999) / 1000, timeout_cb, &done);
+    while (!done)
+        g_main_context_iteration(NULL, TRUE);
+}
+
+static gboolean collect_record(const CadTraceRecord *record, GVariant *payload,
+                               gpointer user_data)
+{
+    Replay *replay = user_data;
+
+    g_array_append_val(replay->records, *record);
+    g_ptr_array_add(replay->payloads, g_variant_ref(payload));
+
+    return TRUE;
+}
+
+static gdouble get_cpu_time(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        return 0;
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void replay_run(Replay *replay)
+{
+    TraceReplayStats *stats = replay->stats;
+    guint64 allocations;
+    gdouble cpu_time;
+    guint requests, commands;
+    gboolean success;
+    guint i;
+
+    fake_pulse_reset();
+    for (i = 0; i < replay->modules->len; i += 2) {
+        fake_pulse_add_module(g_ptr_array_index(replay->modules, i),
+                              g_ptr_array_index(replay->modules, i + 1));
+    }
+    for (i = 0; i < replay->card_list->len; i++) {
+        ReplayCard *card = g_ptr_array_index(replay->card_list, i);
+
+        if (card->initial)
+            replay_plug_card(replay, card);
+    }
+    pulse_driver_connect();
+
+    requests = fake_pulse_get_requests();
+    commands = fake_pulse_get_commands();
+    allocations = alloc_counter_get();
+    cpu_time = get_cpu_time();
+    replay->start = g_get_monotonic_time();
+
+    for (i = 0; i < replay->records->len; i++) {
+        const CadTraceRecord *record = &g_array_index(replay->records, CadTraceRecord, i);
+
+        switch (record->event) {
+        case CAD_TRACE_EVENT_SUBSCRIPTION:
+            if (!is_input(replay, i))
+                break;
+            replay_wait(replay, i);
+            replay_card_event(replay, i);
+            break;
+        case CAD_TRACE_EVENT_OPERATION_STARTED:
+            replay_wait(replay, i);
+            replay_operation(replay, i);
+            break;
+        case CAD_TRACE_EVENT_OPERATION_SUCCEEDED:
+        case CAD_TRACE_EVENT_OPERATION_FAILED:
+            success = record->event == CAD_TRACE_EVENT_OPERATION_SUCCEEDED;
+            g_array_append_val(replay->expected, success);
+            break;
+        default:
+            break;
+        }
+
+        /* As fast as possible, but each step is complete before the next one */
+        if (replay->speed <= 0)
+            pulse_driver_wait_idle();
+    }
+    pulse_driver_wait_idle();
+
+    stats->elapsed = (g_get_monotonic_time() - replay->start) / (gdouble)G_USEC_PER_SEC;
+    stats->cpu_time = get_cpu_time() - cpu_time;
+    stats->allocations = alloc_counter_get() - allocations;
+    stats->requests = fake_pulse_get_requests() - requests;
+    stats->commands = fake_pulse_get_commands() - commands;
+
+    for (i = 0; i < MAX(replay->expected->len, replay->results->len); i++) {
+        if (i >= replay->expected->len || i >= replay->results->len ||
+            g_array_index(replay->expected, gboolean, i) !=
+            g_array_index(replay->results, gboolean, i))
+            stats->mismatches++;
+    }
+
+    g_object_unref(cad_pulse_get_default());
+    pulse_driver_wait_idle();
+}
+
+/**
+ * trace_replay_run:
+ * @path: the trace to replay
+ * @speed: how many times faster than recorded to replay the trace, or 0 to
+ *   replay it as fast as possible, waiting for each step to complete
+ * @stats: (out): the replay statistics, to free with trace_replay_stats_clear()
+ * @error: Error information
+ *
+ * Replay @path against the fake server, with a new PulseAudio backend. The
+ * fake server is left in the state reached at the end of the trace.
+ *
+ * Returns: %TRUE if the trace could be replayed, or %FALSE on error.
+ */
+gboolean trace_replay_run(const gchar *path, gdouble speed,
+                          TraceReplayStats *stats, GError **error)
+{
+    Replay replay = { 0 };
+    gboolean ret = FALSE;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->routes = g_ptr_array_new_with_free_func(g_free);
+
+    replay.records = g_array_new(FALSE, FALSE, sizeof(CadTraceRecord));
+    replay.payloads = g_ptr_array_new_with_free_func((GDestroyNotify)g_variant_unref);
+    replay.cards = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)replay_card_free);
+    replay.card_list = g_ptr_array_new();
+    replay.modules = g_ptr_array_new_with_free_func(g_free);
+    replay.main_card = PA_INVALID_INDEX;
+    replay.expected = g_array_new(FALSE, FALSE, sizeof(gboolean));
+    replay.results = g_array_new(FALSE, FALSE, sizeof(gboolean));
+    replay.speed = speed;
+    replay.stats = stats;
+
+    if (!cad_trace_read(path, collect_record, &replay, error))
+        goto out;
+
+    replay_prepare(&replay);
+    if (replay.card_list->len == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                    "No card found in trace '%s'", path);
+        goto out;
+    }
+
+    current = &replay;
+    replay_run(&replay);
+    current = NULL;
+    ret = TRUE;
+
+out:
+    g_array_unref(replay.records);
+    g_ptr_array_unref(replay.payloads);
+    g_ptr_array_unref(replay.card_list);
+    g_hash_table_destroy(replay.cards);
+    g_ptr_array_unref(replay.modules);
+    g_array_unref(replay.expected);
+    g_array_unref(replay.results);
+
+    return ret;
+}
+
+void trace_replay_stats_clear(TraceReplayStats *stats)
+{
+    g_clear_pointer(&stats->routes, g_ptr_array_unref);
+}
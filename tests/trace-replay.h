@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * TraceReplayStats:
+ * @operations: number of routing operations replayed
+ * @mismatches: number of operations whose outcome differs from the recording
+ * @events: number of card events (plugged, unplugged, jacks) replayed
+ * @requests: number of requests sent to the server
+ * @commands: number of requests changing the server state
+ * @allocations: number of heap allocations, 0 if they can't be counted
+ * @cpu_time: CPU time used by the process, in seconds
+ * @elapsed: wall clock time taken by the replay, in seconds
+ * @routes: the route chosen after each operation, as a string
+ */
+typedef struct {
+    guint operations;
+    guint mismatches;
+    guint events;
+    guint requests;
+    guint commands;
+    guint64 allocations;
+    gdouble cpu_time;
+    gdouble elapsed;
+    GPtrArray *routes;
+} TraceReplayStats;
+
+gboolean trace_replay_run(const gchar *path, gdouble speed,
+                          TraceReplayStats *stats, GError **error);
+void trace_replay_stats_clear(TraceReplayStats *stats);
+
+G_END_DECLS
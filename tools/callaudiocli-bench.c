@@ -0,0 +1,280 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "callaudiocli-bench.h"
+#include "libcallaudio.h"
+
+#include <stdio.h>
+
+/*
+ * Each iteration toggles every state once, so that callaudiod always has to
+ * perform an actual routing change
+ */
+typedef enum {
+    BENCH_OP_MODE,
+    BENCH_OP_SPEAKER,
+    BENCH_OP_MIC,
+    BENCH_OP_BT_AUDIO,
+    BENCH_N_OPS
+} BenchOp;
+
+static const gchar *op_names[BENCH_N_OPS] = {
+    "select-mode",
+    "enable-speaker",
+    "mute-mic",
+    "bt-audio",
+};
+
+typedef struct _BenchStats {
+    GArray *samples;
+    guint failures;
+} BenchStats;
+
+/* With --pipelined, each iteration is committed as a single transaction */
+static const gchar *commit_names[] = {
+    "transaction",
+};
+
+typedef struct _BenchCommit {
+    BenchStats *stats;
+    gint64 start;
+    gboolean done;
+} BenchCommit;
+
+static guint op_value(BenchOp op, guint iteration)
+{
+    gboolean on = (iteration % 2) == 0;
+
+    if (op == BENCH_OP_MODE)
+        return on ? CALL_AUDIO_MODE_CALL : CALL_AUDIO_MODE_DEFAULT;
+
+    return on;
+}
+
+static void record(BenchStats *stats, gint64 start, gboolean success)
+{
+    gint64 latency = g_get_monotonic_time() - start;
+
+    g_array_append_val(stats->samples, latency);
+    if (!success)
+        stats->failures++;
+}
+
+static gboolean run_sync(BenchOp op, guint value)
+{
+    g_autoptr(GError) error = NULL;
+
+    switch (op) {
+    case BENCH_OP_MODE:
+        return call_audio_select_mode(value, &error);
+    case BENCH_OP_SPEAKER:
+        return call_audio_enable_speaker(value, &error);
+    case BENCH_OP_MIC:
+        return call_audio_mute_mic(value, &error);
+    case BENCH_OP_BT_AUDIO:
+        return call_audio_bt_audio(value, &error);
+    case BENCH_N_OPS:
+    default:
+        return FALSE;
+    }
+}
+
+static void add_op(CallAudioTransaction *transaction, BenchOp op, guint value)
+{
+    switch (op) {
+    case BENCH_OP_MODE:
+        call_audio_transaction_select_mode(transaction, value);
+        break;
+    case BENCH_OP_SPEAKER:
+        call_audio_transaction_enable_speaker(transaction, value);
+        break;
+    case BENCH_OP_MIC:
+        call_audio_transaction_mute_mic(transaction, value);
+        break;
+    case BENCH_OP_BT_AUDIO:
+        call_audio_transaction_bt_audio(transaction, value);
+        break;
+    case BENCH_N_OPS:
+    default:
+        break;
+    }
+}
+
+static void commit_done(GObject *object, GAsyncResult *result, gpointer data)
+{
+    BenchCommit *commit = data;
+    g_autoptr(GError) error = NULL;
+
+    record(commit->stats, commit->start,
+           call_audio_transaction_commit_finish(result, &error));
+    commit->done = TRUE;
+}
+
+/*
+ * Send all operations of an iteration in one transaction, letting
+ * libcallaudio pipeline those which don't conflict, and wait for it to
+ * complete.
+ */
+static void run_transaction(BenchStats *stats, guint n_ops, guint iteration)
+{
+    CallAudioTransaction *transaction = call_audio_transaction_new();
+    BenchCommit commit = { 0 };
+    guint i;
+
+    for (i = 0; i < n_ops; i++)
+        add_op(transaction, i, op_value(i, iteration));
+
+    commit.stats = stats;
+    commit.start = g_get_monotonic_time();
+    call_audio_transaction_commit_async(transaction, NULL, commit_done, &commit);
+    call_audio_transaction_free(transaction);
+
+    while (!commit.done)
+        g_main_context_iteration(NULL, TRUE);
+}
+
+static gint compare_samples(gconstpointer a, gconstpointer b)
+{
+    gint64 va = *(const gint64 *)a;
+    gint64 vb = *(const gint64 *)b;
+
+    return (va > vb) - (va < vb);
+}
+
+/* Nearest-rank percentile, samples must be sorted */
+static gint64 percentile(GArray *samples, guint percent)
+{
+    guint rank;
+
+    if (samples->len == 0)
+        return 0;
+
+    rank = (samples->len * percent + 99) / 100;
+    if (rank > 0)
+        rank--;
+
+    return g_array_index(samples, gint64, rank);
+}
+
+static void print_results(BenchStats *stats, const gchar **names, guint n_stats,
+                          gint64 elapsed, const gchar *csv_file)
+{
+    FILE *csv = NULL;
+    guint total = 0;
+    guint i;
+
+    if (csv_file) {
+        csv = fopen(csv_file, "w");
+        if (!csv)
+            g_printerr("Unable to open %s, skipping CSV output\n", csv_file);
+        else
+            fprintf(csv, "operation,count,failures,p50_us,p90_us,p99_us,max_us\n");
+    }
+
+    g_print("%-16s %8s %8s %10s %10s %10s %10s\n",
+            "operation", "count", "failed", "p50 (ms)", "p90 (ms)", "p99 (ms)",
+            "max (ms)");
+
+    for (i = 0; i < n_stats; i++) {
+        GArray *samples = stats[i].samples;
+        gint64 p50, p90, p99, max;
+
+        g_array_sort(samples, compare_samples);
+        p50 = percentile(samples, 50);
+        p90 = percentile(samples, 90);
+        p99 = percentile(samples, 99);
+        max = percentile(samples, 100);
+        total += samples->len;
+
+        g_print("%-16s %8u %8u %10.2f %10.2f %10.2f %10.2f\n",
+                names[i], samples->len, stats[i].failures,
+                p50 / 1000.0, p90 / 1000.0, p99 / 1000.0, max / 1000.0);
+        if (csv) {
+            fprintf(csv, "%s,%u,%u,%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT
+                    ",%" G_GINT64_FORMAT ",%" G_GINT64_FORMAT "\n",
+                    names[i], samples->len, stats[i].failures,
+                    p50, p90, p99, max);
+        }
+    }
+
+    g_print("\n%u operations in %.2f s (%.1f ops/s)\n", total,
+            elapsed / (gdouble)G_USEC_PER_SEC,
+            elapsed > 0 ? total * (gdouble)G_USEC_PER_SEC / elapsed : 0.0);
+
+    if (csv)
+        fclose(csv);
+}
+
+/* Put back the routing state as it was before running the benchmark */
+static void restore_state(const CallAudioState *state, gboolean bt_audio)
+{
+    if (state->mode != CALL_AUDIO_MODE_UNKNOWN)
+        run_sync(BENCH_OP_MODE, state->mode);
+    if (state->speaker_state != CALL_AUDIO_SPEAKER_UNKNOWN)
+        run_sync(BENCH_OP_SPEAKER, state->speaker_state == CALL_AUDIO_SPEAKER_ON);
+    if (state->mic_state != CALL_AUDIO_MIC_UNKNOWN)
+        run_sync(BENCH_OP_MIC, state->mic_state == CALL_AUDIO_MIC_OFF);
+    if (bt_audio && state->bt_audio_state != CALL_AUDIO_BT_UNKNOWN)
+        run_sync(BENCH_OP_BT_AUDIO, state->bt_audio_state == CALL_AUDIO_BT_ENABLED);
+}
+
+/*
+ * Repeatedly toggle the routing state and report latency statistics for
+ * each operation. Operations are either performed one after the other using
+ * the synchronous API, or all operations of an iteration are committed as a
+ * transaction, in which case the latency of whole transactions is reported.
+ */
+int cli_bench_run(const CliBenchOptions *options)
+{
+    BenchStats stats[BENCH_N_OPS];
+    CallAudioState initial;
+    guint n_ops = options->bt_audio ? BENCH_N_OPS : BENCH_OP_BT_AUDIO;
+    guint n_stats = options->pipelined ? G_N_ELEMENTS(commit_names) : n_ops;
+    gint64 start, deadline = 0;
+    guint iteration;
+    guint i;
+
+    if (!call_audio_get_state(&initial, NULL)) {
+        g_printerr("Unable to get the current state\n");
+        return 1;
+    }
+
+    for (i = 0; i < n_stats; i++) {
+        stats[i].samples = g_array_new(FALSE, FALSE, sizeof(gint64));
+        stats[i].failures = 0;
+    }
+
+    start = g_get_monotonic_time();
+    if (options->duration > 0)
+        deadline = start + options->duration * G_USEC_PER_SEC;
+
+    for (iteration = 0; ; iteration++) {
+        if (deadline > 0 ? g_get_monotonic_time() >= deadline
+                         : iteration >= options->iterations)
+            break;
+
+        if (options->pipelined) {
+            run_transaction(&stats[0], n_ops, iteration);
+            continue;
+        }
+
+        for (i = 0; i < n_ops; i++) {
+            gint64 op_start = g_get_monotonic_time();
+
+            record(&stats[i], op_start, run_sync(i, op_value(i, iteration)));
+        }
+    }
+
+    print_results(stats, options->pipelined ? commit_names : op_names, n_stats,
+                  g_get_monotonic_time() - start, options->csv_file);
+
+    restore_state(&initial, options->bt_audio);
+
+    for (i = 0; i < n_stats; i++)
+        g_array_unref(stats[i].samples);
+
+    return 0;
+}
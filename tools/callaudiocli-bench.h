@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+typedef struct _CliBenchOptions {
+    guint iterations;
+    guint duration;
+    gboolean pipelined;
+    gboolean bt_audio;
+    const gchar *csv_file;
+} CliBenchOptions;
+
+int cli_bench_run(const CliBenchOptions *options);
@@ -5,10 +5,214 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+#include "callaudiocli-bench.h"
 #include "libcallaudio.h"
 #include "libcallaudio-enums.h"
 
 #include <glib.h>
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void print_status(void)
+{
+    g_autofree gchar *string_audio = g_enum_to_string(CALL_TYPE_AUDIO_MODE,
+                                                      call_audio_get_audio_mode());
+    g_autofree gchar *string_speaker = g_enum_to_string(CALL_TYPE_AUDIO_SPEAKER_STATE,
+                                                        call_audio_get_speaker_state());
+    g_autofree gchar *string_mic = g_enum_to_string(CALL_TYPE_AUDIO_MIC_STATE,
+                                                    call_audio_get_mic_state());
+    g_autofree gchar *string_bt = g_enum_to_string(CALL_TYPE_AUDIO_BLUETOOTH_STATE,
+                                                   call_audio_get_bt_audio_state());
+
+    g_print("Selected mode: %s\n"
+            "Speaker enabled: %s\n"
+            "Mic muted: %s\n"
+            "Bluetooth audio: %s\n",
+            string_audio, string_speaker, string_mic, string_bt);
+}
+
+static void print_change(const gchar *name, GType type, guint old_value, guint new_value)
+{
+    g_autoptr(GDateTime) now = NULL;
+    g_autofree gchar *timestamp = NULL;
+    g_autofree gchar *string_old = NULL;
+    g_autofree gchar *string_new = NULL;
+
+    if (old_value == new_value)
+        return;
+
+    now = g_date_time_new_now_local();
+    timestamp = g_date_time_format(now, "%H:%M:%S.%f");
+    string_old = g_enum_to_string(type, old_value);
+    string_new = g_enum_to_string(type, new_value);
+
+    g_print("[%s] %s: %s -> %s\n", timestamp, name, string_old, string_new);
+}
+
+static void monitor_cb(const CallAudioState *old_state,
+                       const CallAudioState *new_state,
+                       gpointer              data)
+{
+    print_change("mode", CALL_TYPE_AUDIO_MODE,
+                 old_state->mode, new_state->mode);
+    print_change("speaker", CALL_TYPE_AUDIO_SPEAKER_STATE,
+                 old_state->speaker_state, new_state->speaker_state);
+    print_change("mic", CALL_TYPE_AUDIO_MIC_STATE,
+                 old_state->mic_state, new_state->mic_state);
+    print_change("bt-audio", CALL_TYPE_AUDIO_BLUETOOTH_STATE,
+                 old_state->bt_audio_state, new_state->bt_audio_state);
+}
+
+static gboolean monitor_quit_cb(gpointer data)
+{
+    g_main_loop_quit(data);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Print every state change published by callaudiod until interrupted
+ */
+static int run_monitor(void)
+{
+    g_autoptr(GMainLoop) loop = g_main_loop_new(NULL, FALSE);
+    guint id;
+
+    print_status();
+
+    id = call_audio_add_state_listener(monitor_cb, NULL);
+    if (id == 0) {
+        g_printerr("Unable to monitor state changes\n");
+        return 1;
+    }
+
+    g_unix_signal_add(SIGINT, monitor_quit_cb, loop);
+    g_unix_signal_add(SIGTERM, monitor_quit_cb, loop);
+    g_main_loop_run(loop);
+
+    call_audio_remove_state_listener(id);
+
+    return 0;
+}
+
+static gboolean parse_bool(const gchar *arg, gboolean *value)
+{
+    if (g_strcmp0(arg, "1") == 0 || g_strcmp0(arg, "on") == 0) {
+        *value = TRUE;
+        return TRUE;
+    } else if (g_strcmp0(arg, "0") == 0 || g_strcmp0(arg, "off") == 0) {
+        *value = FALSE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Execute a single batch command, returning FALSE on error
+ */
+static gboolean run_command(gchar **argv, GError **error)
+{
+    const gchar *cmd = argv[0];
+    const gchar *arg = argv[1];
+    gboolean value;
+
+    if (g_strcmp0(cmd, "status") == 0) {
+        print_status();
+        return TRUE;
+    }
+
+    if (!arg || argv[2]) {
+        g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                    "'%s' expects exactly one argument", cmd);
+        return FALSE;
+    }
+
+    if (g_strcmp0(cmd, "sleep") == 0) {
+        g_usleep(strtoul(arg, NULL, 10) * 1000);
+        return TRUE;
+    }
+
+    if (g_strcmp0(cmd, "mode") == 0) {
+        if (g_strcmp0(arg, "call") == 0 || g_strcmp0(arg, "1") == 0)
+            return call_audio_select_mode(CALL_AUDIO_MODE_CALL, error);
+        if (g_strcmp0(arg, "voip") == 0 || g_strcmp0(arg, "2") == 0)
+            return call_audio_select_mode(CALL_AUDIO_MODE_VOIP, error);
+        if (g_strcmp0(arg, "default") == 0 || g_strcmp0(arg, "0") == 0)
+            return call_audio_select_mode(CALL_AUDIO_MODE_DEFAULT, error);
+    } else if (parse_bool(arg, &value)) {
+        if (g_strcmp0(cmd, "speaker") == 0)
+            return call_audio_enable_speaker(value, error);
+        if (g_strcmp0(cmd, "mute") == 0)
+            return call_audio_mute_mic(value, error);
+        if (g_strcmp0(cmd, "bt") == 0)
+            return call_audio_bt_audio(value, error);
+    }
+
+    g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+                "Invalid command '%s %s'", cmd, arg);
+    return FALSE;
+}
+
+/*
+ * Run a script of commands, one per line, from a file or stdin ("-").
+ * Empty lines and lines starting with '#' are ignored. Execution continues
+ * after a failing command, but the exit status then reports the failure.
+ *
+ * Supported commands:
+ *   mode default|call|voip
+ *   speaker on|off
+ *   mute on|off
+ *   bt on|off
+ *   status
+ *   sleep MILLISECONDS
+ */
+static int run_batch(const gchar *path)
+{
+    g_autoptr(GIOChannel) channel = NULL;
+    g_autoptr(GError) err = NULL;
+    gchar *line = NULL;
+    guint lineno = 0;
+    int ret = 0;
+
+    if (g_strcmp0(path, "-") == 0)
+        channel = g_io_channel_unix_new(STDIN_FILENO);
+    else
+        channel = g_io_channel_new_file(path, "r", &err);
+
+    if (!channel) {
+        g_printerr("Unable to open %s: %s\n", path, err->message);
+        return 1;
+    }
+
+    while (g_io_channel_read_line(channel, &line, NULL, NULL, &err) == G_IO_STATUS_NORMAL) {
+        g_auto(GStrv) argv = NULL;
+        g_autoptr(GError) cmd_err = NULL;
+
+        lineno++;
+        g_strstrip(line);
+        if (line[0] == '\0' || line[0] == '#') {
+            g_free(line);
+            continue;
+        }
+
+        if (!g_shell_parse_argv(line, NULL, &argv, &cmd_err) ||
+            !run_command(argv, &cmd_err)) {
+            g_printerr("%s:%u: %s\n", path, lineno,
+                       cmd_err ? cmd_err->message : "Operation failed");
+            ret = 1;
+        }
+        g_free(line);
+    }
+
+    if (err) {
+        g_printerr("Unable to read %s: %s\n", path, err->message);
+        ret = 1;
+    }
+
+    return ret;
+}
 
 int main (int argc, char *argv[0])
 {
@@ -17,13 +221,35 @@ int main (int argc, char *argv[0])
     int mode = -1;
     int speaker = -1;
     int mic = -1;
+    int bt = -1;
     gboolean status = FALSE;
+    gboolean monitor = FALSE;
+    g_autofree gchar *batch = NULL;
+    gboolean bench = FALSE;
+    CliBenchOptions bench_options = {
+        .iterations = 100,
+    };
 
     const GOptionEntry options [] = {
         {"select-mode", 'm', 0, G_OPTION_ARG_INT, &mode, "Select mode", NULL},
         {"enable-speaker", 's', 0, G_OPTION_ARG_INT, &speaker, "Enable speaker", NULL},
         {"mute-mic", 'u', 0, G_OPTION_ARG_INT, &mic, "Mute microphone", NULL},
+        {"bt-audio", 'B', 0, G_OPTION_ARG_INT, &bt, "Enable bluetooth audio", NULL},
         {"status", 'S', 0, G_OPTION_ARG_NONE, &status, "Print status", NULL},
+        {"monitor", 'M', 0, G_OPTION_ARG_NONE, &monitor, "Monitor state changes", NULL},
+        {"batch", 0, 0, G_OPTION_ARG_FILENAME, &batch,
+         "Run commands from a file, or stdin if FILE is -", "FILE"},
+        {"bench", 'b', 0, G_OPTION_ARG_NONE, &bench, "Benchmark routing changes", NULL},
+        {"iterations", 'n', 0, G_OPTION_ARG_INT, &bench_options.iterations,
+         "Number of benchmark iterations (default: 100)", "N"},
+        {"duration", 'd', 0, G_OPTION_ARG_INT, &bench_options.duration,
+         "Run the benchmark for a given duration instead", "SECONDS"},
+        {"pipelined", 'p', 0, G_OPTION_ARG_NONE, &bench_options.pipelined,
+         "Commit each benchmark iteration as a single transaction", NULL},
+        {"bench-bt", 0, 0, G_OPTION_ARG_NONE, &bench_options.bt_audio,
+         "Include Bluetooth audio in the benchmark", NULL},
+        {"csv", 0, 0, G_OPTION_ARG_FILENAME, &bench_options.csv_file,
+         "Write benchmark results to a CSV file", "FILE"},
         { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
     };
 
@@ -39,11 +265,26 @@ int main (int argc, char *argv[0])
         return 1;
     }
 
+    if (bench) {
+        int ret = cli_bench_run(&bench_options);
+
+        call_audio_deinit();
+        return ret;
+    }
+
+    if (batch) {
+        int ret = run_batch(batch);
+
+        call_audio_deinit();
+        return ret;
+    }
+
     /* If there's nothing else to be done, print the current status */
-    if (mode == -1 && speaker == -1 && mic == -1)
+    if (mode == -1 && speaker == -1 && mic == -1 && bt == -1 && !monitor)
         status = TRUE;
 
-    if (mode == CALL_AUDIO_MODE_DEFAULT || mode == CALL_AUDIO_MODE_CALL) {
+    if (mode == CALL_AUDIO_MODE_DEFAULT || mode == CALL_AUDIO_MODE_CALL ||
+        mode == CALL_AUDIO_MODE_VOIP) {
         if (!call_audio_select_mode(mode, &err)) {
             return 1;
         }
@@ -61,20 +302,22 @@ int main (int argc, char *argv[0])
         }
     }
 
-    if (status) {
-        CallAudioMode audio_mode = call_audio_get_audio_mode();
-        CallAudioSpeakerState speaker_state = call_audio_get_speaker_state();
-        CallAudioMicState mic_state = call_audio_get_mic_state();
-        const char *string_audio = g_enum_to_string(CALL_TYPE_AUDIO_MODE, audio_mode);
-        const char *string_speaker = g_enum_to_string(CALL_TYPE_AUDIO_SPEAKER_STATE, speaker_state);
-        const char *string_mic = g_enum_to_string(CALL_TYPE_AUDIO_MIC_STATE, mic_state);
+    if (bt == 0 || bt == 1) {
+        if (!call_audio_bt_audio((gboolean)bt, &err)) {
+            return 1;
+        }
+    }
 
-        g_print("Selected mode: %s\n"
-                "Speaker enabled: %s\n"
-                "Mic muted: %s\n",
-                string_audio, string_speaker, string_mic);
+    if (monitor) {
+        int ret = run_monitor();
+
+        call_audio_deinit();
+        return ret;
     }
 
+    if (status)
+        print_status();
+
     call_audio_deinit ();
     return 0;
 }